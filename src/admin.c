@@ -46,8 +46,10 @@
 
 static int command_fallback(client_t *client, source_t *source, int response);
 static int command_metadata(client_t *client, source_t *source, int response);
+static int command_metadata_batch (client_t *client, int response);
 static int command_shoutcast_metadata(client_t *client, source_t *source);
 static int command_show_listeners(client_t *client, source_t *source, int response);
+static int command_show_listeners_json(client_t *client, source_t *source, int response);
 static int command_move_clients(client_t *client, source_t *source, int response);
 static int command_stats(client_t *client, const char *filename);
 static int command_stats_mount (client_t *client, source_t *source, int response);
@@ -57,8 +59,11 @@ static int command_manageauth(client_t *client, source_t *source, int response);
 static int command_buildm3u(client_t *client, const char *mount);
 static int command_show_image (client_t *client, const char* mount);
 static int command_kill_source(client_t *client, source_t *source, int response);
+static int command_flush_auth_cache (client_t *client, source_t *source, int response);
 static int command_updatemetadata(client_t *client, source_t *source, int response);
 static int command_admin_function (client_t *client, int response);
+static int command_stats_json (client_t *client, int response);
+static int command_metrics (client_t *client, int response);
 static int command_list_log (client_t *client, int response);
 static int command_manage_relay (client_t *client, int response);
 #ifdef MY_ALLOC
@@ -84,8 +89,11 @@ struct admin_command
 static struct admin_command admin_general[] =
 {
     { "managerelays",       RAW,    { command_manage_relay } },
+    { "metadata.batch",     RAW,    { command_metadata_batch } },
     { "listmounts",         RAW,    { command_list_mounts } },
     { "function",           RAW,    { command_admin_function } },
+    { "stats.json",         RAW,    { command_stats_json } },
+    { "metrics",            RAW,    { command_metrics } },
 #ifdef MY_ALLOC
     { "alloc",              RAW,    { command_alloc } },
 #endif
@@ -108,12 +116,14 @@ static struct admin_command admin_mount[] =
     { "fallback",           RAW,    { command_fallback } },
     { "metadata",           RAW,    { command_metadata } },
     { "listclients",        RAW,    { command_show_listeners } },
+    { "listclients.json",   RAW,    { command_show_listeners_json } },
     { "updatemetadata",     RAW,    { command_updatemetadata } },
     { "killclient",         RAW,    { command_kill_client } },
     { "moveclients",        RAW,    { command_move_clients } },
     { "killsource",         RAW,    { command_kill_source } },
     { "stats",              RAW,    { command_stats_mount } },
     { "manageauth",         RAW,    { command_manageauth } },
+    { "flushauthcache",     RAW,    { command_flush_auth_cache } },
     { "admin.cgi",          RAW,    { command_shoutcast_metadata } },
     { "resetstats",         XSLT,   { command_reset_stats } },
     { "metadata.xsl",       XSLT,   { command_metadata } },
@@ -281,13 +291,38 @@ struct _client_functions admin_mount_ops =
 };
 
 
+/* re-entry point for general admin requests moved onto the admin worker */
+static int admin_general_client (client_t *client)
+{
+    char *uri = (void*)client->aux_data;
+    int ret;
+
+    client->aux_data = (int64_t)NULL;
+    ret = admin_handle_general_request (client, uri);
+    free (uri);
+    return ret;
+}
+
+struct _client_functions admin_general_ops =
+{
+    admin_general_client,
+    admin_client_destroy
+};
+
+
 int admin_mount_request (client_t *client)
 {
     source_t *source;
     const char *mount = client->mount;
     char *uri = (void*)client->aux_data;
 
-    struct admin_command *cmd = find_admin_command (admin_mount, uri);
+    struct admin_command *cmd;
+
+    /* json status needs no source access, the mount param just filters */
+    if (strcmp (uri, "stats.json") == 0)
+        return command_stats_json (client, RAW);
+
+    cmd = find_admin_command (admin_mount, uri);
 
     if (cmd == NULL)
         return command_stats (client, uri);
@@ -320,6 +355,11 @@ int admin_mount_request (client_t *client)
             return fserve_list_clients (client, mount, cmd->response, 1);
         if (strncmp (cmd->request, "killclient", 10) == 0)
             return fserve_kill_client (client, mount, cmd->response);
+        if (strcmp (cmd->request, "flushauthcache") == 0)
+        {   /* no source needed, the auth hangs off the mount config */
+            free (uri);
+            return command_flush_auth_cache (client, NULL, cmd->response);
+        }
         WARN1("Admin command on non-existent source %s", mount);
         free (uri);
         return client_send_400 (client, "Source does not exist");
@@ -445,6 +485,15 @@ int admin_handle_request (client_t *client, const char *uri)
         return admin_mount_request (client);
     }
 
+    /* keep general admin handling off the streaming workers so a slow consumer
+     * or a heavy listing cannot add jitter to audio pacing. Mount commands
+     * keep their affinity with the source worker as before */
+    if (worker_admin && client->worker != worker_admin)
+    {
+        client->aux_data = (int64_t)strdup (uri);
+        client->ops = &admin_general_ops;
+        return client_change_worker (client, worker_admin);
+    }
     return admin_handle_general_request (client, uri);
 }
 
@@ -764,6 +813,195 @@ static int command_show_listeners (client_t *client, source_t *source, int respo
 }
 
 
+/* how many listener records to emit per lock hold on the json path */
+#define LISTCLIENTS_BATCH 256
+
+struct lc_buf
+{
+    refbuf_t *head, *tail;
+    unsigned int total;
+};
+
+static void lc_add (struct lc_buf *b, const char *data, unsigned int len)
+{
+    while (len)
+    {
+        unsigned int space;
+
+        if (b->tail == NULL || b->tail->len == 8192)
+        {
+            refbuf_t *r = refbuf_new (8192);
+            r->len = 0;
+            r->flags |= WRITE_BLOCK_GENERIC;
+            if (b->tail)
+                b->tail->next = r;
+            else
+                b->head = r;
+            b->tail = r;
+        }
+        space = 8192 - b->tail->len;
+        if (space > len)
+            space = len;
+        memcpy (b->tail->data + b->tail->len, data, space);
+        b->tail->len += space;
+        b->total += space;
+        data += space;
+        len -= space;
+    }
+}
+
+static void lc_add_escaped (struct lc_buf *b, const char *s)
+{
+    const char *p = s;
+    char tmp [8];
+
+    while (*p)
+    {
+        const char *q = p;
+        while (*q && *q != '"' && *q != '\\' && (unsigned char)*q >= 0x20)
+            q++;
+        if (q > p)
+            lc_add (b, p, q - p);
+        if (*q == '\0')
+            break;
+        if (*q == '"')
+            lc_add (b, "\\\"", 2);
+        else if (*q == '\\')
+            lc_add (b, "\\\\", 2);
+        else
+        {
+            snprintf (tmp, sizeof tmp, "\\u%04x", (unsigned char)*q);
+            lc_add (b, tmp, 6);
+        }
+        p = q + 1;
+    }
+}
+
+
+/* json counterpart of stats_listener_to_xml, same details per listener */
+static void listener_to_json (client_t *listener, struct lc_buf *b, int first)
+{
+    const char *header;
+    uint64_t lag = 0;
+    char buf [64];
+    int r;
+
+    r = snprintf (buf, sizeof buf, "%s{\"id\":%" PRIu64 ",\"ip\":\"", first ? "" : ",",
+            listener->connection.id);
+    lc_add (b, buf, r);
+    lc_add_escaped (b, listener->connection.ip);
+    lc_add (b, "\"", 1);
+
+    header = httpp_getvar (listener->parser, "user-agent");
+    if (header && util_valid_utf8 (header))
+    {
+        lc_add (b, ",\"agent\":\"", 10);
+        lc_add_escaped (b, header);
+        lc_add (b, "\"", 1);
+    }
+    header = httpp_getvar (listener->parser, "referer");
+    if (header && util_valid_utf8 (header))
+    {
+        lc_add (b, ",\"referer\":\"", 12);
+        lc_add_escaped (b, header);
+        lc_add (b, "\"", 1);
+    }
+    if ((listener->flags & (CLIENT_ACTIVE|CLIENT_IN_FSERVE)) == CLIENT_ACTIVE)
+    {
+        source_t *source = listener->shared_data;
+        lag = source->client->queue_pos - listener->queue_pos;
+    }
+    r = snprintf (buf, sizeof buf, ",\"lag\":%" PRIu64, lag);
+    lc_add (b, buf, r);
+    if (listener->worker)
+    {
+        r = snprintf (buf, sizeof buf, ",\"connected\":%lu",
+                (unsigned long)(listener->worker->current_time.tv_sec - listener->connection.con_time));
+        lc_add (b, buf, r);
+    }
+    if (listener->username && util_valid_utf8 (listener->username))
+    {
+        lc_add (b, ",\"username\":\"", 13);
+        lc_add_escaped (b, listener->username);
+        lc_add (b, "\"", 1);
+    }
+    lc_add (b, "}", 1);
+}
+
+
+/* next listener node above the given connection id, clients tree is keyed on
+ * it so a batched walk can resume after the source lock was dropped */
+static avl_node *listener_node_after (source_t *source, uint64_t id)
+{
+    avl_node *node = source->clients->root->right, *found = NULL;
+
+    while (node)
+    {
+        client_t *listener = (client_t *)node->key;
+        if (listener->connection.id > id)
+        {
+            found = node;
+            node = node->left;
+        }
+        else
+            node = node->right;
+    }
+    return found;
+}
+
+
+/* json listing of the listeners on a source, written straight into refbufs in
+ * batches with the source lock dropped between them, so a very large listener
+ * count neither builds a DOM nor stalls the mount for the whole walk. The
+ * source cannot be reaped mid-request as its client shares this worker.
+ */
+static int command_show_listeners_json (client_t *client, source_t *source, int response)
+{
+    struct lc_buf b = { NULL, NULL, 0 };
+    uint64_t last_id = 0;
+    char buf [64];
+    int r, first = 1;
+
+    lc_add (&b, "{\"mount\":\"", 10);
+    lc_add_escaped (&b, source->mount);
+    r = snprintf (buf, sizeof buf, "\",\"listeners\":%lu,\"records\":[", source->listeners);
+    lc_add (&b, buf, r);
+    for (;;)
+    {
+        avl_node *node = listener_node_after (source, last_id);
+        int batch;
+
+        for (batch = 0; node && batch < LISTCLIENTS_BATCH; batch++)
+        {
+            client_t *listener = (client_t *)node->key;
+            listener_to_json (listener, &b, first);
+            first = 0;
+            last_id = listener->connection.id;
+            node = avl_get_next (node);
+        }
+        thread_rwlock_unlock (&source->lock);
+        if (node == NULL)
+            break;
+        thread_rwlock_rlock (&source->lock);
+    }
+    lc_add (&b, "]}", 2);
+
+    client_set_queue (client, NULL);
+    client->refbuf = refbuf_new (256);
+    r = snprintf (client->refbuf->data, 256,
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: application/json\r\n"
+            "Content-Length: %u\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Access-Control-Allow-Origin: *\r\n\r\n", b.total);
+    client->refbuf->len = r;
+    client->refbuf->flags |= WRITE_BLOCK_GENERIC;
+    client->refbuf->next = b.head;
+    client->respcode = 200;
+    return fserve_setup_client (client);
+}
+
+
 static int command_show_image (client_t *client, const char *mount)
 {
     source_t *source;
@@ -999,7 +1237,7 @@ static int command_fallback (client_t *client, source_t *source, int response)
         if (COMMAND_REQUIRE(client, "fallback", fallback) < 0)
             return client_send_400 (client, "missing arg, fallback");
 
-        xmlFree (mountinfo->fallback_mount);
+        config_retire_xmlstr (mountinfo->fallback_mount);
         mountinfo->fallback_mount = (char *)xmlCharStrdup (fallback);
         snprintf (buffer, sizeof (buffer), "Fallback for \"%s\" configured", mountinfo->mountname);
         config_release_config ();
@@ -1010,6 +1248,37 @@ static int command_fallback (client_t *client, source_t *source, int response)
 }
 
 
+/* drop any cached auth decisions on the mount, eg after the backend has
+ * revoked sessions before their TTL is up. The mount does not need a
+ * running source for this.
+ */
+static int command_flush_auth_cache (client_t *client, source_t *source, int response)
+{
+    char *mount = strdup (source ? source->mount : client->mount);
+    mount_proxy *mountinfo;
+    ice_config_t *config;
+    char buffer [200];
+    int count = -1;
+
+    if (source)
+        thread_rwlock_unlock (&source->lock);
+    config = config_get_config();
+    mountinfo = config_find_mount (config, mount);
+    if (mountinfo && mountinfo->auth)
+        count = auth_cache_flush (mountinfo->auth);
+    config_release_config ();
+    if (count < 0)
+    {
+        free (mount);
+        return client_send_400 (client, "no auth details available");
+    }
+    INFO2 ("Admin request: flushed %d cached auth decisions on %s", count, mount);
+    snprintf (buffer, sizeof (buffer), "Flushed %d cached auth decisions on \"%s\"", count, mount);
+    free (mount);
+    return html_success (client, buffer);
+}
+
+
 static int command_metadata (client_t *client, source_t *source, int response)
 {
     const char *song, *title, *artist, *artwork, *charset, *url, *intro;
@@ -1095,6 +1364,75 @@ static int command_metadata (client_t *client, source_t *source, int response)
 }
 
 
+/* batched form of the metadata update. The required updates parameter holds
+ * one entry per line (%0A separated), each "mount title...", the first space
+ * splitting the two. The whole batch runs in one pass under a single tree
+ * lock, so a playout pushing titles to hundreds of mounts in the same second
+ * costs one request and one lock cycle instead of one of each per mount.
+ */
+static int command_metadata_batch (client_t *client, int response)
+{
+    const char *updates, *charset;
+    char *list, *line;
+    int applied = 0, seen = 0;
+    xmlDocPtr doc;
+    xmlNodePtr node;
+    char detail [60];
+
+    if (COMMAND_REQUIRE (client, "updates", updates) < 0)
+        return client_send_400 (client, "missing updates parameter");
+    COMMAND_OPTIONAL (client, "charset", charset);
+
+    doc = xmlNewDoc (XMLSTR("1.0"));
+    node = xmlNewDocNode (doc, NULL, XMLSTR("iceresponse"), NULL);
+    xmlDocSetRootElement (doc, node);
+
+    list = strdup (updates);
+    avl_tree_rlock (global.source_tree);
+    for (line = list; line && *line; )
+    {
+        char *eol = strchr (line, '\n'), *title;
+        source_t *source;
+
+        if (eol)
+            *eol++ = '\0';
+        title = strchr (line, ' ');
+        do
+        {
+            if (title == NULL)
+                break;
+            *title++ = '\0';
+            if (line [0] == '\0' || title [0] == '\0')
+                break;
+            seen++;
+            source = source_find_mount_raw (line);
+            if (source == NULL)
+                break;
+            thread_rwlock_wlock (&source->lock);
+            if (source_available (source) && source->format && source->format->set_tag)
+            {
+                format_plugin_t *plugin = source->format;
+
+                plugin->set_tag (plugin, "title", title, charset);
+                /* update done, let it be pushed into the stream */
+                plugin->set_tag (plugin, NULL, NULL, charset);
+                INFO2 ("Metadata title on %s changed to \"%s\"", source->mount, title);
+                applied++;
+            }
+            thread_rwlock_unlock (&source->lock);
+        } while (0);
+        line = eol;
+    }
+    avl_tree_unlock (global.source_tree);
+    free (list);
+
+    snprintf (detail, sizeof detail, "Metadata updated on %d of %d mounts", applied, seen);
+    xmlNewChild (node, NULL, XMLSTR("message"), XMLSTR(detail));
+    xmlNewChild (node, NULL, XMLSTR("return"), XMLSTR("1"));
+    return admin_send_response (doc, client, response, "response.xsl");
+}
+
+
 static int command_shoutcast_metadata (client_t *client, source_t *source)
 {
     const char *action;
@@ -1180,6 +1518,22 @@ static int command_stats (client_t *client, const char *filename)
 }
 
 
+/* direct json form of the stats dump, skipping the xml doc and transform */
+static int command_stats_json (client_t *client, int response)
+{
+    const char *show_mount = httpp_get_query_param (client->parser, "mount");
+
+    return stats_send_json (client, STATS_ALL, show_mount);
+}
+
+
+/* prometheus exposition of the stats trees, for direct scraping */
+static int command_metrics (client_t *client, int response)
+{
+    return stats_send_prometheus (client);
+}
+
+
 static int command_list_log (client_t *client, int response)
 {
     refbuf_t *content;
@@ -1247,15 +1601,38 @@ int command_list_mounts(client_t *client, int response)
     {
         redirector_update (client);
 
-        snprintf (client->refbuf->data, PER_CLIENT_REFBUF_SIZE,
-                "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n");
-        client->refbuf->len = strlen (client->refbuf->data);
-        client->respcode = 200;
-
         if (strcmp (httpp_getvar (client->parser, HTTPP_VAR_URI), "/admin/streams") == 0)
-            client->refbuf->next = stats_get_streams (1);
+        {
+            const char *have = httpp_get_query_param (client->parser, "streams_gen");
+            refbuf_t *delta = NULL;
+            uint64_t gen;
+
+            if (have)
+                delta = stats_get_streams_delta ((uint64_t)strtoull (have, NULL, 10), &gen);
+            if (delta)
+            {
+                snprintf (client->refbuf->data, PER_CLIENT_REFBUF_SIZE,
+                        "HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                        "X-Streamlist-Gen: %" PRIu64 "\r\nX-Streamlist-Delta: 1\r\n\r\n", gen);
+                client->refbuf->next = delta;
+            }
+            else
+            {
+                gen = stats_streamlist_gen ();
+                snprintf (client->refbuf->data, PER_CLIENT_REFBUF_SIZE,
+                        "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n"
+                        "X-Streamlist-Gen: %" PRIu64 "\r\n\r\n", gen);
+                client->refbuf->next = stats_get_streams (1);
+            }
+        }
         else
+        {
+            snprintf (client->refbuf->data, PER_CLIENT_REFBUF_SIZE,
+                    "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n");
             client->refbuf->next = stats_get_streams (0);
+        }
+        client->refbuf->len = strlen (client->refbuf->data);
+        client->respcode = 200;
         return fserve_setup_client (client);
     }
     else
@@ -1293,6 +1670,7 @@ static int command_alloc(client_t *client)
     xmlDocPtr doc = xmlNewDoc (XMLSTR("1.0"));
     xmlNodePtr rootnode = xmlNewDocNode(doc, NULL, XMLSTR("icestats"), NULL);
     avl_node *node;
+    ssize_t total = 0, sites = 0;
     char value[25];
 
     xmlDocSetRootElement(doc, rootnode);
@@ -1307,15 +1685,24 @@ static int command_alloc(client_t *client)
         alloc_node *an = node->key;
         xmlNodePtr bnode = xmlNewChild (rootnode, NULL, XMLSTR("block"), NULL);
         xmlSetProp (bnode, XMLSTR("name"), XMLSTR(an->name));
-        snprintf (value, sizeof value, "%d", an->count);
+        snprintf (value, sizeof value, "%zd", an->count);
         xmlNewChild (bnode, NULL, XMLSTR("count"), XMLSTR(value));
-        snprintf (value, sizeof value, "%d", an->allocated);
+        snprintf (value, sizeof value, "%zd", an->allocated);
         xmlNewChild (bnode, NULL, XMLSTR("allocated"), XMLSTR(value));
+        snprintf (value, sizeof value, "%zd", an->peak);
+        xmlNewChild (bnode, NULL, XMLSTR("peak"), XMLSTR(value));
+        total += an->allocated;
+        sites++;
 
         node = avl_get_next (node);
     }
     avl_tree_unlock (global.alloc_tree);
 
+    snprintf (value, sizeof value, "%zd", total);
+    xmlNewChild (rootnode, NULL, XMLSTR("total_allocated"), XMLSTR(value));
+    snprintf (value, sizeof value, "%zd", sites);
+    xmlNewChild (rootnode, NULL, XMLSTR("alloc_sites"), XMLSTR(value));
+
     return admin_send_response (doc, client, RAW, "stats.xsl");
 }
 #endif
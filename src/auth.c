@@ -26,6 +26,7 @@
 #include <malloc.h>
 #endif
 
+#include "timing/timing.h"
 #include "auth.h"
 #include "auth_htpasswd.h"
 #include "auth_cmd.h"
@@ -37,6 +38,8 @@
 #include "httpp/httpp.h"
 #include "fserve.h"
 #include "admin.h"
+#include "util.h"
+#include "hls.h"
 #include "global.h"
 
 #include "logging.h"
@@ -44,7 +47,7 @@
 
 struct _auth_thread_t
 {
-    thread_type *thread;
+    int busy;       /* slot has work queued or running on the pool */
     void *data;
     unsigned int id;
     struct auth_tag *auth;
@@ -55,10 +58,12 @@ static rwlock_t auth_lock;
 int allow_auth;
 
 static void *auth_run_thread (void *arg);
+static void auth_new_listener (auth_client *auth_user);
 static int  auth_postprocess_listener (auth_client *auth_user);
 static void auth_postprocess_source (auth_client *auth_user);
 static int  wait_for_auth (client_t *client);
 static void auth_client_free (auth_client *auth_user);
+static int  auth_cache_entry_free (void *key);
 
 
 struct _client_functions auth_release_ops =
@@ -131,21 +136,71 @@ static auth_client *auth_client_setup (const char *mount, client_t *client)
 }
 
 
+static unsigned int auth_queue_shard (const char *mount)
+{
+    unsigned int hash = 5381;
+    while (*mount)
+        hash = hash * 33 + *mount++;
+    return hash % AUTH_QUEUE_SHARDS;
+}
+
+
+/* take the next pending entry, scanning the shards round-robin from the
+ * rotor position so no one shard monopolises the handlers. Expects the
+ * auth lock to be held. listener_only restricts the take to listener adds
+ * for the backends that batch those up.
+ */
+static auth_client *auth_queue_take (auth_t *auth, int *rotor, int listener_only)
+{
+    int i;
+
+    for (i = 0; i < AUTH_QUEUE_SHARDS; i++)
+    {
+        int s = (*rotor + i) % AUTH_QUEUE_SHARDS;
+        auth_queue_t *q = &auth->queue [s];
+        auth_client *auth_user = q->head;
+
+        if (auth_user == NULL)
+            continue;
+        if (listener_only && auth_user->process != auth_new_listener)
+            continue;
+        q->head = auth_user->next;
+        if (q->head == NULL)
+            q->tailp = &q->head;
+        q->count--;
+        q->served++;
+        if (auth_user->queued_ms)
+            q->wait_ms += timing_cached_time() - auth_user->queued_ms;
+        auth->pending_count--;
+        auth_user->next = NULL;
+        *rotor = (s + 1) % AUTH_QUEUE_SHARDS;
+        return auth_user;
+    }
+    return NULL;
+}
+
+
 static void queue_auth_client (auth_client *auth_user, mount_proxy *mountinfo)
 {
     auth_t *auth;
+    auth_queue_t *q;
     client_t *failed = NULL;
     auth_client **old_tail;
 
     if (auth_user == NULL || mountinfo == NULL)
         return;
     auth = mountinfo->auth;
+    q = &auth->queue [auth_queue_shard (auth_user->mount)];
     thread_mutex_lock (&auth->lock);
     auth_user->next = NULL;
     auth_user->auth = auth;
-    old_tail = auth->tailp;
-    *auth->tailp = auth_user;
-    auth->tailp = &auth_user->next;
+    auth_user->queued_ms = timing_cached_time();
+    old_tail = q->tailp;
+    *q->tailp = auth_user;
+    q->tailp = &auth_user->next;
+    q->count++;
+    if (q->count > q->peak)
+        q->peak = q->count;
     auth->pending_count++;
     if (auth->refcount > auth->handlers)
         DEBUG0 ("max authentication handlers allocated");
@@ -154,26 +209,28 @@ static void queue_auth_client (auth_client *auth_user, mount_proxy *mountinfo)
         int i;
         for (i=0; i<auth->handlers; i++)
         {
-            if (auth->handles [i].thread == NULL)
+            if (auth->handles [i].busy == 0)
             {
-                DEBUG1 ("starting auth thread %d", i);
+                DEBUG1 ("starting auth handler %d", i);
                 auth->refcount++;
-                auth->handles [i].thread = thread_create ("auth thread", auth_run_thread, &auth->handles [i], THREAD_DETACHED);
-                if (auth->handles [i].thread == NULL)
+                auth->handles [i].busy = 1;
+                if (thread_pool_run (THREAD_POOL_HIGH, auth_run_thread, &auth->handles [i]) < 0)
                 {
-                    auth->tailp = old_tail;
+                    auth->handles [i].busy = 0;
+                    q->tailp = old_tail;
                     *old_tail = NULL;
+                    q->count--;
                     auth->pending_count--;
                     auth->refcount--;
                     failed = auth_user->client;
                     auth_user->client = NULL;
-                    ERROR0 ("failed to start auth thread, system limit probably reached");
+                    ERROR0 ("failed to queue auth handler, system limit probably reached");
                 }
                 break;
             }
         }
     }
-    DEBUG2 ("auth on %s has %d pending", auth->mount, auth->pending_count);
+    DEBUG3 ("auth on %s has %d pending, %d in shard", auth->mount, auth->pending_count, q->count);
     thread_mutex_unlock (&auth->lock);
     if (failed)
     {
@@ -188,6 +245,8 @@ static void queue_auth_client (auth_client *auth_user, mount_proxy *mountinfo)
  */
 void auth_release (auth_t *authenticator)
 {
+    int i;
+
     if (authenticator == NULL) return;
     authenticator->refcount--;
     DEBUG2 ("...refcount on auth_t %s is now %d", authenticator->mount, authenticator->refcount);
@@ -197,6 +256,19 @@ void auth_release (auth_t *authenticator)
         return;
     }
 
+    for (i = 0; i < AUTH_QUEUE_SHARDS; i++)
+    {
+        auth_queue_t *q = &authenticator->queue [i];
+        if (q->served)
+        {
+            char line [256];
+            snprintf (line, sizeof line, "queue shard %d on %s: served %" PRIu64
+                    ", peak depth %d, avg wait %" PRIu64 "ms",
+                    i, authenticator->mount, q->served, q->peak, q->wait_ms / q->served);
+            INFO1 ("%s", line);
+        }
+    }
+
     /* cleanup auth threads attached to this auth */
     authenticator->flags &= ~AUTH_RUNNING;
     while (authenticator->handlers)
@@ -208,6 +280,8 @@ void auth_release (auth_t *authenticator)
     }
     free (authenticator->handles);
 
+    if (authenticator->cache)
+        avl_tree_free (authenticator->cache, auth_cache_entry_free);
     if (authenticator->release)
         authenticator->release (authenticator);
     xmlFree (authenticator->type);
@@ -220,6 +294,157 @@ void auth_release (auth_t *authenticator)
 }
 
 
+/* Cache of recent backend decisions, keyed on mount and a hash of the
+ * credentials presented. Only clean accepts are stored, a reject may be down
+ * to a backend outage and anything carrying per-client extras (intro content,
+ * redirects, time limits) needs the backend on each request. Entries are
+ * guarded by the auth lock like the pending queue.
+ */
+#define AUTH_CACHE_LIMIT        4000
+
+typedef struct
+{
+    char *mount;
+    uint64_t hash;
+    time_t expires;
+} auth_cache_entry;
+
+
+static uint64_t auth_cache_hash (const char *user, const char *pass)
+{
+    uint64_t hash = util_hash64 (user, strlen (user), 0x9e3779b97f4a7c15ULL);
+
+    return util_hash64 (pass, strlen (pass), hash);
+}
+
+
+static int auth_cache_compare (void *arg, void *a, void *b)
+{
+    auth_cache_entry *x = a, *y = b;
+    int ret = strcmp (x->mount, y->mount);
+
+    if (ret == 0)
+        ret = (x->hash > y->hash) - (x->hash < y->hash);
+    return ret;
+}
+
+
+static int auth_cache_entry_free (void *key)
+{
+    auth_cache_entry *entry = key;
+    free (entry->mount);
+    free (entry);
+    return 1;
+}
+
+
+/* check for a still valid cached accept for these details, returns 1 if the
+ * listener can skip the backend request.
+ */
+static int auth_cache_lookup (auth_t *auth, const char *mount, client_t *client)
+{
+    auth_cache_entry look;
+    void *result;
+    int ret = 0;
+
+    if (auth->cache == NULL || client->username == NULL || client->password == NULL)
+        return 0;
+    look.mount = (char *)mount;
+    look.hash = auth_cache_hash (client->username, client->password);
+    thread_mutex_lock (&auth->lock);
+    if (avl_get_by_key (auth->cache, &look, &result) == 0)
+    {
+        auth_cache_entry *entry = result;
+        if (entry->expires >= time (NULL))
+            ret = 1;
+        else
+        {
+            avl_delete (auth->cache, entry, auth_cache_entry_free);
+            auth->cache_count--;
+        }
+    }
+    thread_mutex_unlock (&auth->lock);
+    return ret;
+}
+
+
+/* store the outcome of a backend listener add if it is safe to replay */
+static void auth_cache_store (auth_client *auth_user)
+{
+    auth_t *auth = auth_user->auth;
+    client_t *client = auth_user->client;
+    auth_cache_entry *entry;
+    void *result;
+    time_t now;
+
+    if (auth == NULL || auth->cache == NULL || client == NULL)
+        return;
+    if ((client->flags & CLIENT_AUTHENTICATED) == 0)
+        return;
+    if (client->username == NULL || client->password == NULL)
+        return;
+    if ((client->flags & (CLIENT_HAS_INTRO_CONTENT|CLIENT_HIJACKER|CLIENT_IS_SLAVE)) ||
+            client->connection.discon.time)
+        return;
+    now = time (NULL);
+    entry = calloc (1, sizeof (*entry));
+    entry->mount = strdup (auth_user->mount);
+    entry->hash = auth_cache_hash (client->username, client->password);
+    entry->expires = now + auth->cache_ttl;
+    thread_mutex_lock (&auth->lock);
+    if (avl_get_by_key (auth->cache, entry, &result) == 0)
+    {   /* refresh the existing entry */
+        ((auth_cache_entry *)result)->expires = entry->expires;
+        auth_cache_entry_free (entry);
+    }
+    else
+    {
+        if (auth->cache_count >= AUTH_CACHE_LIMIT)
+        {   /* sweep out anything expired before considering the drop */
+            avl_node *node = avl_get_first (auth->cache);
+            while (node)
+            {
+                auth_cache_entry *old = node->key;
+                node = avl_get_next (node);
+                if (old->expires < now)
+                {
+                    avl_delete (auth->cache, old, auth_cache_entry_free);
+                    auth->cache_count--;
+                }
+            }
+        }
+        if (auth->cache_count < AUTH_CACHE_LIMIT)
+        {
+            avl_insert (auth->cache, entry);
+            auth->cache_count++;
+        }
+        else
+            auth_cache_entry_free (entry);
+    }
+    thread_mutex_unlock (&auth->lock);
+}
+
+
+/* drop all cached decisions on this auth, eg on an admin trigger when the
+ * backend has revoked sessions. Returns the number of entries dropped.
+ */
+int auth_cache_flush (auth_t *auth)
+{
+    avl_node *node;
+    int count = 0;
+
+    if (auth == NULL || auth->cache == NULL)
+        return 0;
+    thread_mutex_lock (&auth->lock);
+    while ((node = avl_get_first (auth->cache)))
+        avl_delete (auth->cache, node->key, auth_cache_entry_free);
+    count = auth->cache_count;
+    auth->cache_count = 0;
+    thread_mutex_unlock (&auth->lock);
+    return count;
+}
+
+
 static void auth_client_free (auth_client *auth_user)
 {
     if (auth_user == NULL)
@@ -267,6 +492,45 @@ static void auth_new_listener (auth_client *auth_user)
 }
 
 
+/* Backends that can run several backend requests at once from a single
+ * handler thread use this to take further pending listener adds off the
+ * queues. Returns NULL if no shard has a listener add at its head. Caller
+ * is expected to finish each one returned with auth_complete_listener.
+ */
+auth_client *auth_queue_next_listener (auth_t *auth)
+{
+    while (1)
+    {
+        auth_client *auth_user = NULL;
+        client_t *client;
+
+        thread_mutex_lock (&auth->lock);
+        auth_user = auth_queue_take (auth, &auth->rotor, 1);
+        thread_mutex_unlock (&auth->lock);
+        if (auth_user == NULL)
+            return NULL;
+        client = auth_user->client;
+        if (allow_auth && client_connected (client))
+            return auth_user;
+        DEBUG1 ("dropping listener #%" PRIu64 " connection", client->connection.id);
+        client->respcode = 400;
+        auth_client_free (auth_user);
+    }
+}
+
+
+/* Completion of a listener add taken via auth_queue_next_listener, mirrors
+ * the processing normally done from the auth thread loop.
+ */
+void auth_complete_listener (auth_client *auth_user)
+{
+    auth_postprocess_listener (auth_user);
+    if (auth_user->queued_ms)
+        stats_hist_record (STATS_HIST_AUTH, timing_get_time() - auth_user->queued_ms);
+    auth_client_free (auth_user);
+}
+
+
 /* wrapper function for auth thread to drop listener connections
  */
 static void auth_remove_listener (auth_client *auth_user)
@@ -321,7 +585,7 @@ static void stream_start_callback (auth_client *auth_user)
         client_t *client = auth_user->client;
         free (client->connection.ip);
         free (client->shared_data); // useragent
-        free (client);
+        client_free (client);
         auth_user->client = NULL;
     }
 }
@@ -341,7 +605,7 @@ static void stream_end_callback (auth_client *auth_user)
         client_t *client = auth_user->client;
         free (client->connection.ip);
         free (client->shared_data); // useragent
-        free (client);
+        client_free (client);
         auth_user->client = NULL;
     }
 }
@@ -352,37 +616,39 @@ static void *auth_run_thread (void *arg)
 {
     auth_thread_t *handler = arg;
     auth_t *auth = handler->auth;
+    int rotor = handler->id % AUTH_QUEUE_SHARDS;    /* spread starting shards over the handlers */
 
     DEBUG2 ("Authentication thread %d started for %s", handler->id, auth->mount);
     thread_rwlock_rlock (&auth_lock);
 
     while (1)
     {
+        auth_client *auth_user;
+
         thread_mutex_lock (&auth->lock);
-        if (auth->head)
+        auth_user = auth_queue_take (auth, &rotor, 0);
+        if (auth_user)
         {
-            auth_client *auth_user = auth->head;
-
             DEBUG2 ("%d client(s) pending on %s", auth->pending_count, auth->mount);
-            auth->head = auth_user->next;
-            if (auth->head == NULL)
-                auth->tailp = &auth->head;
-            auth->pending_count--;
             thread_mutex_unlock (&auth->lock);
-            auth_user->next = NULL;
 
             /* associate per-thread data with auth_user here */
             auth_user->thread_data = handler->data;
             auth_user->handler = handler->id;
 
             if (auth_user->process)
+            {
                 auth_user->process (auth_user);
+                /* covers queue wait plus the backend, the SLO view of auth */
+                if (auth_user->queued_ms)
+                    stats_hist_record (STATS_HIST_AUTH, timing_get_time() - auth_user->queued_ms);
+            }
 
             auth_client_free (auth_user);
 
             continue;
         }
-        handler->thread = NULL;
+        handler->busy = 0;
         break;
     }
     DEBUG1 ("Authenication thread %d shutting down", handler->id);
@@ -483,6 +749,16 @@ static int add_authenticated_listener (const char *mount, mount_proxy *mountinfo
     /* some win32 setups do not do TCP win scaling well, so allow an override */
     if (mountinfo && mountinfo->so_sndbuf > 0)
         sock_set_send_buffer (client->connection.sock, mountinfo->so_sndbuf);
+    if (mountinfo && mountinfo->notsent_lowat > 0)
+        sock_set_notsent_lowat (client->connection.sock, mountinfo->notsent_lowat);
+#ifdef HAVE_MSG_ZEROCOPY
+    if (mountinfo && mountinfo->so_zerocopy && not_ssl_connection (&client->connection) &&
+            sock_enable_zerocopy (client->connection.sock) == 0)
+    {
+        client->flags |= CLIENT_ZEROCOPY;
+        DEBUG1 ("zerocopy enabled on listener socket for %s", mount);
+    }
+#endif
 
     /* check whether we are processing a streamlist request for slaves */
     if (strcmp (mount, "/admin/streams") == 0)
@@ -512,6 +788,9 @@ static int add_authenticated_listener (const char *mount, mount_proxy *mountinfo
         return stats_transform_xslt (client, mount);
     }
 
+    if (util_check_valid_extension (mount) == M3U8_CONTENT)
+        return hls_client_request (mount, client);
+
     ret = source_add_listener (mount, mountinfo, client);
 
     if (ret == -2)
@@ -541,6 +820,7 @@ static int auth_postprocess_listener (auth_client *auth_user)
     if (client == NULL)
         return 0;
 
+    auth_cache_store (auth_user);
     if ((client->flags & CLIENT_AUTHENTICATED) == 0)
     {
         /* auth failed so do we place the listener elsewhere */
@@ -684,7 +964,14 @@ int auth_add_listener (const char *mount, client_t *client)
                 }
                 if (auth->authenticate)
                 {
-                    auth_client *auth_user = auth_client_setup (mount, client);
+                    auth_client *auth_user;
+
+                    if (auth_cache_lookup (auth, mount, client))
+                    {
+                        DEBUG1 ("cached accept for listener #%" PRIu64, client->connection.id);
+                        break;  /* drop through as already authenticated */
+                    }
+                    auth_user = auth_client_setup (mount, client);
                     auth_user->process = auth_new_listener;
                     client->flags &= ~CLIENT_ACTIVE;
                     DEBUG1 ("adding client #%" PRIu64 " for authentication", client->connection.id);
@@ -790,10 +1077,17 @@ static int get_authenticator (auth_t *auth, config_options_t *options)
             auth->rejected_mount = (char*)xmlStrdup (XMLSTR(options->value));
         else if (strcmp(options->name, "handlers") == 0)
             auth->handlers = atoi (options->value);
+        else if (strcmp(options->name, "cache_ttl") == 0)
+            auth->cache_ttl = atoi (options->value);
         options = options->next;
     }
     if (auth->handlers < 1) auth->handlers = 3;
     if (auth->handlers > 100) auth->handlers = 100;
+    if (auth->cache_ttl > 0)
+    {
+        auth->cache = avl_tree_new (auth_cache_compare, NULL);
+        INFO1 ("caching auth decisions for up to %d seconds", auth->cache_ttl);
+    }
     return 0;
 }
 
@@ -845,7 +1139,8 @@ int auth_get_authenticator (xmlNodePtr node, void *x)
     }
     else
     {
-        auth->tailp = &auth->head;
+        for (i=0; i<AUTH_QUEUE_SHARDS; i++)
+            auth->queue[i].tailp = &auth->queue[i].head;
         thread_mutex_create (&auth->lock);
 
         /* allocate N threads */
@@ -910,7 +1205,7 @@ void auth_stream_start (mount_proxy *mountinfo, source_t *source)
 
         // use a blank client copy to avoid a race as slower callbacks could occur
         // after a short lived source.
-        auth_user->client = calloc (1, sizeof (client_t));
+        auth_user->client = client_create ();
         auth_user->client->connection.ip = strdup (client->connection.ip);
         if (agent)
             auth_user->client->shared_data = strdup (agent);
@@ -934,7 +1229,7 @@ void auth_stream_end (mount_proxy *mountinfo, source_t *source)
         auth_client *auth_user = auth_client_setup (mount, NULL);
 
         // use a blank client copy to avoid a race
-        auth_user->client = calloc (1, sizeof (client_t));
+        auth_user->client = client_create ();
         auth_user->client->connection.ip = strdup (client->connection.ip);
         if (agent)
             auth_user->client->shared_data = strdup (agent);
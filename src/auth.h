@@ -22,6 +22,7 @@ typedef struct _auth_thread_t auth_thread_t;
 #include <libxml/xmlmemory.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
+#include "avl/avl.h"
 #include "client.h"
 #include "thread/thread.h"
 
@@ -41,6 +42,7 @@ typedef struct auth_client_tag
     char        *hostname;
     int         port;
     int         handler;
+    uint64_t    queued_ms;
     client_t    *client;
     struct auth_tag *auth;
     void        *thread_data;
@@ -49,6 +51,22 @@ typedef struct auth_client_tag
 } auth_client;
 
 
+/* pending clients are split over a few queues keyed on a hash of the
+ * mount, so a backlog building up on one mount does not hold up joins
+ * for other mounts served by the same auth (wildcard/default mounts).
+ */
+#define AUTH_QUEUE_SHARDS       4
+
+typedef struct
+{
+    auth_client *head, **tailp;
+    int count;
+    int peak;
+    uint64_t served;
+    uint64_t wait_ms;       /* cumulative queue wait of served entries */
+} auth_queue_t;
+
+
 typedef struct auth_tag
 {
     char *mount;
@@ -91,9 +109,15 @@ typedef struct auth_tag
     /* runtime allocated array of thread handlers for this auth */
     auth_thread_t *handles;
 
-    /* per-auth queue for clients */
-    auth_client *head, **tailp;
+    /* per-auth queues for clients, sharded by mount */
+    auth_queue_t queue [AUTH_QUEUE_SHARDS];
     int pending_count;
+    int rotor;      /* next shard for the batching backends to drain */
+
+    /* TTL cache of recent backend decisions, NULL unless cache_ttl is set */
+    avl_tree *cache;
+    int cache_ttl;
+    int cache_count;
 
     void *state;
     char *type;
@@ -129,6 +153,12 @@ int auth_stream_authenticate (client_t *client, const char *mount, struct _mount
 
 void auth_check_http (client_t *client);
 
+/* for backends able to run several queued listener adds concurrently */
+auth_client *auth_queue_next_listener (auth_t *auth);
+void auth_complete_listener (auth_client *auth_user);
+
+int  auth_cache_flush (struct auth_tag *auth);
+
 #endif
 
 
@@ -11,7 +11,7 @@
  *                      and others (see AUTHORS for details).
  */
 
-/** 
+/**
  * Client authentication via command functions
  *
  * The stated program is started and via it's stdin it is passed
@@ -20,6 +20,14 @@
  * password\n
  * a return code of 0 indicates a valid user, authentication failure if
  * otherwise
+ *
+ * With the "pooled" option set, each auth handler thread keeps one helper
+ * process alive instead of forking per listener, so the number of helpers
+ * follows the handlers setting. The helper is started with "pooled" as its
+ * first argument and is expected to loop, reading requests and writing
+ * responses on its stdin/stdout. Each request and response is prefixed
+ * with its byte count as a decimal number terminated by a newline; the
+ * payloads are the same header blocks as the fork-per-request mode uses.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -50,6 +58,7 @@
 #include "cfgfile.h"
 #include "httpp/httpp.h"
 #include "global.h"
+#include "sighandler.h"
 
 #include "logging.h"
 #define CATMODULE "auth_cmd"
@@ -57,6 +66,7 @@
 typedef struct {
     char *listener_add;
     char *listener_remove;
+    int pooled;
 } auth_cmd;
 
 
@@ -64,6 +74,10 @@ typedef struct
 {
     char *location;
     char errormsg [100];
+    /* long-lived helper for the pooled mode, 0/-1 when not running */
+    pid_t helper_pid;
+    int helper_in;      /* read responses from here */
+    int helper_out;     /* write requests to here */
 } auth_thread_data;
 
 
@@ -264,6 +278,292 @@ static void get_response (int fd, auth_client *auth_user, pid_t pid)
 }
 
 
+static int build_request (auth_client *auth_user, char *str, unsigned int len)
+{
+    client_t *client = auth_user->client;
+    const char *qargs;
+    char *referer, *agent;
+    int written;
+
+    qargs = httpp_getvar (client->parser, HTTPP_VAR_QUERYARGS);
+    agent = (char*)httpp_getvar (client->parser, "user-agent");
+    if (agent)
+        agent = util_url_escape (agent);
+    referer = (char*)httpp_getvar (client->parser, "referer");
+    if (referer)
+        referer = util_url_escape (referer);
+    written = snprintf (str, len,
+            "Mountpoint: %s%s\n"
+            "User: %s\n"
+            "Pass: %s\n"
+            "IP: %s\n"
+            "Agent: %s\n"
+            "Referer: %s\n\n",
+            auth_user->mount, qargs ? qargs : "",
+            client->username ? client->username : "",
+            client->password ? client->password : "",
+            client->connection.ip,
+            agent ? agent : "",
+            referer ? referer : "");
+    free (agent);
+    free (referer);
+    return written;
+}
+
+
+/* common rejection handling once the response headers have been parsed */
+static auth_result cmd_failure (auth_client *auth_user)
+{
+    client_t *client = auth_user->client;
+    auth_cmd *cmd = auth_user->auth->state;
+    auth_thread_data *atd = auth_user->thread_data;
+
+    if (atd->errormsg[0])
+    {
+        INFO3 ("listener %s (%s) returned \"%s\"", client->connection.ip, cmd->listener_add, atd->errormsg);
+        if (atoi (atd->errormsg) == 403)
+        {
+            auth_user->client = NULL;
+            client_send_403 (client, atd->errormsg+4);
+            return AUTH_FAILED;
+        }
+    }
+    if (atd->location)
+    {
+        client_send_302 (client, atd->location);
+        auth_user->client = NULL;
+        free (atd->location);
+        atd->location = NULL;
+    }
+    return AUTH_FAILED;
+}
+
+
+static void helper_stop (auth_thread_data *atd)
+{
+    int wstatus = 0;
+
+    if (atd->helper_pid <= 0)
+        return;
+    close (atd->helper_out);
+    close (atd->helper_in);
+    kill (atd->helper_pid, SIGTERM);
+    if (waitpid (atd->helper_pid, &wstatus, 0) < 0)
+        WARN2 ("waitpid on helper %ld, %s", (long)atd->helper_pid, strerror (errno));
+    DEBUG1 ("stopped pooled helper, pid %ld", (long)atd->helper_pid);
+    atd->helper_pid = 0;
+}
+
+
+static int helper_start (auth_t *auth, auth_thread_data *atd)
+{
+    auth_cmd *cmd = auth->state;
+    int infd[2], outfd[2];
+    pid_t pid;
+
+    if (pipe (infd) < 0 || pipe (outfd) < 0)
+    {
+        ERROR1 ("pipe failed code %d", errno);
+        return -1;
+    }
+    pid = fork();
+    switch (pid)
+    {
+        case 0: /* child */
+            dup2 (outfd[0], 0);
+            if (outfd[0] != 0)
+                close (outfd[0]);
+            dup2 (infd[1], 1);
+            if (infd[1] != 1)
+                close (infd[1]);
+            close (outfd[1]);
+            close (infd[0]);
+#ifdef _XOPEN_SOURCE
+            if (auth->flags & AUTH_CLEAN_ENV)
+                unsetenv ("LD_PRELOAD");
+#endif
+            sighandler_child_reset ();
+            execl (cmd->listener_add, cmd->listener_add, "pooled", NULL);
+            exit (-1);
+        case -1:
+            ERROR1 ("Failed to create helper process for %s", cmd->listener_add);
+            close (outfd[0]);
+            close (outfd[1]);
+            close (infd[0]);
+            close (infd[1]);
+            return -1;
+        default:
+            close (outfd[0]);
+            close (infd[1]);
+            atd->helper_pid = pid;
+            atd->helper_in = infd[0];
+            atd->helper_out = outfd[1];
+            INFO2 ("started pooled helper %s, pid %ld", cmd->listener_add, (long)pid);
+            break;
+    }
+    return 0;
+}
+
+
+/* read exactly len bytes from the helper, killing it off on timeout */
+static int helper_read (auth_thread_data *atd, void *buf, unsigned int len, const char *mount)
+{
+    char *p = buf;
+
+    while (len)
+    {
+        int ret;
+#if HAVE_POLL
+        struct pollfd response;
+        response.fd = atd->helper_in;
+        response.events = POLLIN;
+        response.revents = 0;
+        ret = poll (&response, 1, 1000);
+        if (ret == 0)
+        {
+            kill (atd->helper_pid, SIGTERM);
+            WARN1 ("command timeout triggered for %s", mount);
+            return -1;
+        }
+        if (ret < 0)
+            continue;
+#endif
+        ret = read (atd->helper_in, p, len);
+        if (ret <= 0)
+        {
+            if (ret < 0 && sock_recoverable (sock_error()))
+                continue;
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+
+static int get_pooled_response (auth_thread_data *atd, auth_client *auth_user)
+{
+    client_t *client = auth_user->client;
+    refbuf_t *r = client->refbuf;
+    char lenbuf [12], *blankline, *p;
+    unsigned int i, len, hlen;
+
+    for (i = 0; i < sizeof (lenbuf)-1; i++)
+    {
+        if (helper_read (atd, lenbuf+i, 1, auth_user->mount) < 0)
+            return -1;
+        if (lenbuf [i] == '\n')
+            break;
+    }
+    lenbuf [i] = '\0';
+    len = (unsigned int)atoi (lenbuf);
+    if (i == 0 || i == sizeof (lenbuf)-1 || len == 0 || len > 1000000)
+    {
+        WARN1 ("bad response length from helper for %s", auth_user->mount);
+        return -1;
+    }
+    hlen = len > 4095 ? 4095 : len;
+    memset (r->data, 0, 4096);
+    if (helper_read (atd, r->data, hlen, auth_user->mount) < 0)
+        return -1;
+    len -= hlen;
+    blankline = strstr (r->data, "\n\n");
+    if (blankline == NULL)
+        return -1;
+    p = r->data;
+    do {
+        char *nl = strchr (p, '\n');
+        *nl = '\0';
+        process_header (p, auth_user);
+        p = nl+1;
+    } while (*p != '\n');
+    if (client->flags & CLIENT_HAS_INTRO_CONTENT)
+    {
+        refbuf_t *tail = r;
+        r->len = hlen - (blankline + 2 - r->data);
+        if (r->len)
+            memmove (r->data, blankline+2, r->len);
+        client->refbuf = refbuf_new (4096);
+        client->refbuf->next = r;
+        r->next = NULL;
+        while (len)
+        {
+            unsigned int block = 4096 - tail->len;
+            if (block == 0)
+            {
+                tail->next = refbuf_new (4096);
+                tail = tail->next;
+                tail->len = 0;
+                tail->next = NULL;
+                block = 4096;
+            }
+            if (block > len)
+                block = len;
+            if (helper_read (atd, tail->data + tail->len, block, auth_user->mount) < 0)
+                return -1;
+            tail->len += block;
+            len -= block;
+        }
+        if (r->len == 0 && r->next == NULL)
+        {
+            client->refbuf->next = NULL;
+            refbuf_release (r);
+            client->flags &= ~CLIENT_HAS_INTRO_CONTENT;
+        }
+    }
+    else
+    {
+        char drain [1024];
+        while (len)
+        {
+            unsigned int block = len > sizeof (drain) ? sizeof (drain) : len;
+            if (helper_read (atd, drain, block, auth_user->mount) < 0)
+                return -1;
+            len -= block;
+        }
+    }
+    return 0;
+}
+
+
+static auth_result auth_cmd_client_pooled (auth_client *auth_user)
+{
+    client_t *client = auth_user->client;
+    auth_t *auth = auth_user->auth;
+    auth_cmd *cmd = auth->state;
+    auth_thread_data *atd = auth_user->thread_data;
+    char str [512], frame [528];
+    int len, flen, attempts;
+
+    len = build_request (auth_user, str, sizeof (str));
+    for (attempts = 2; attempts; attempts--)
+    {
+        if (atd->helper_pid <= 0 && helper_start (auth, atd) < 0)
+            return AUTH_FAILED;
+        flen = snprintf (frame, sizeof (frame), "%d\n%s", len, str);
+        if (write (atd->helper_out, frame, flen) == flen)
+            break;
+        /* the helper has probably died, retry with a fresh one */
+        helper_stop (atd);
+    }
+    if (attempts == 0)
+    {
+        ERROR1 ("unable to pass request to helper \"%s\"", cmd->listener_add);
+        return AUTH_FAILED;
+    }
+    if (get_pooled_response (atd, auth_user) < 0)
+    {
+        WARN1 ("restarting pooled helper \"%s\"", cmd->listener_add);
+        helper_stop (atd);
+        return AUTH_FAILED;
+    }
+    if (client->flags & CLIENT_AUTHENTICATED)
+        return AUTH_OK;
+    return cmd_failure (auth_user);
+}
+
+
 static auth_result auth_cmd_client (auth_client *auth_user)
 {
     int infd[2], outfd[2];
@@ -273,12 +573,13 @@ static auth_result auth_cmd_client (auth_client *auth_user)
     auth_cmd *cmd = auth->state;
     auth_thread_data *atd = auth_user->thread_data;
     int status, len;
-    const char *qargs;
-    char *referer, *agent, str[512];
+    char str[512];
 
     atd->errormsg[0] = 0;
     if ((auth->flags & AUTH_RUNNING) == 0)
         return AUTH_FAILED;
+    if (cmd->pooled)
+        return auth_cmd_client_pooled (auth_user);
     if (pipe (infd) < 0 || pipe (outfd) < 0)
     {
         ERROR1 ("pipe failed code %d", errno);
@@ -300,6 +601,7 @@ static auth_result auth_cmd_client (auth_client *auth_user)
             if (auth->flags & AUTH_CLEAN_ENV)
                 unsetenv ("LD_PRELOAD");
 #endif
+            sighandler_child_reset ();
             execl (cmd->listener_add, cmd->listener_add, NULL);
             exit (-1);
         case -1:
@@ -308,28 +610,7 @@ static auth_result auth_cmd_client (auth_client *auth_user)
         default: /* parent */
             close (outfd[0]);
             close (infd[1]);
-            qargs = httpp_getvar (client->parser, HTTPP_VAR_QUERYARGS);
-            agent = (char*)httpp_getvar (client->parser, "user-agent");
-            if (agent)
-                agent = util_url_escape (agent);
-            referer = (char*)httpp_getvar (client->parser, "referer");
-            if (referer)
-                referer = util_url_escape (referer);
-            len = snprintf (str, sizeof(str),
-                    "Mountpoint: %s%s\n"
-                    "User: %s\n"
-                    "Pass: %s\n"
-                    "IP: %s\n"
-                    "Agent: %s\n"
-                    "Referer: %s\n\n",
-                    auth_user->mount, qargs ? qargs : "",
-                    client->username ? client->username : "",
-                    client->password ? client->password : "",
-                    client->connection.ip,
-                    agent ? agent : "",
-                    referer ? referer : "");
-            free (agent);
-            free (referer);
+            len = build_request (auth_user, str, sizeof (str));
             write (outfd[1], str, len);
             close (outfd[1]);
             get_response (infd[0], auth_user, pid);
@@ -363,24 +644,7 @@ static auth_result auth_cmd_client (auth_client *auth_user)
                 return AUTH_OK;
             break;
     }
-    if (atd->errormsg[0])
-    {
-        INFO3 ("listener %s (%s) returned \"%s\"", client->connection.ip, cmd->listener_add, atd->errormsg);
-        if (atoi (atd->errormsg) == 403)
-        {
-            auth_user->client = NULL;
-            client_send_403 (client, atd->errormsg+4);
-            return AUTH_FAILED;
-        }
-    }
-    if (atd->location)
-    {
-        client_send_302 (client, atd->location);
-        auth_user->client = NULL;
-        free (atd->location);
-        atd->location = NULL;
-    }
-    return AUTH_FAILED;
+    return cmd_failure (auth_user);
 }
 
 static auth_result auth_cmd_adduser(auth_t *auth, const char *username, const char *password)
@@ -410,6 +674,8 @@ static void *alloc_thread_data (auth_t *auth)
 static void release_thread_data (auth_t *auth, void *thread_data)
 {
     auth_thread_data *atd = thread_data;
+    helper_stop (atd);
+    free (atd->location);
     free (atd);
     DEBUG1 ("...handler destroyed for %s", auth->mount);
 }
@@ -434,6 +700,8 @@ int auth_get_cmd_auth (auth_t *authenticator, config_options_t *options)
             state->listener_add = strdup (options->value);
         if (strcmp (options->name, "listener_remove") == 0)
             state->listener_remove = strdup (options->value);
+        if (strcmp (options->name, "pooled") == 0)
+            state->pooled = atoi (options->value);
         options = options->next;
     }
     if (state->listener_add == NULL)
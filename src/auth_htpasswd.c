@@ -40,26 +40,133 @@
 static auth_result htpasswd_adduser (auth_t *auth, const char *username, const char *password);
 static auth_result htpasswd_deleteuser(auth_t *auth, const char *username);
 static auth_result htpasswd_userlist(auth_t *auth, xmlNodePtr srcnode);
-static int _free_user (void *key);
 
 typedef struct
 {
     char *name;
-    char *pass;
+    char *pass;         /* part of the same allocation as name */
+    unsigned int hash;
 } htpasswd_user;
 
+/* Open addressing table of users, linear probing. Lookups run against the
+ * published table without any locking; a rebuild publishes a replacement
+ * and retires the old table, which is only freed on the rebuild after that.
+ * Rebuilds are at least a check interval apart so any lookup that picked up
+ * the old pointer is long finished by then.
+ */
+typedef struct
+{
+    unsigned int mask;      /* slot count - 1, always a power of two */
+    unsigned int count;
+    htpasswd_user slots [];
+} htpasswd_table;
+
+#define HTPASSWD_MIN_SLOTS      1024
+#define HTPASSWD_CHECK_INTERVAL 10
+
 typedef struct {
     char *filename;
-    rwlock_t file_rwlock;
-    avl_tree *users;
+    rwlock_t file_rwlock;   /* serialises file updates and table rebuilds */
+    htpasswd_table *table;
+    htpasswd_table *retired;
     time_t mtime;
+    time_t next_check;
 } htpasswd_auth_state;
 
+
+static unsigned int username_hash (const char *name)
+{
+    unsigned int hash = 5381;
+
+    while (*name)
+        hash = hash * 33 + (unsigned char)*name++;
+    return hash;
+}
+
+
+static htpasswd_table *table_new (unsigned int slots)
+{
+    htpasswd_table *table = calloc (1, sizeof (htpasswd_table) + sizeof (htpasswd_user) * slots);
+    table->mask = slots - 1;
+    return table;
+}
+
+
+static void table_free (htpasswd_table *table)
+{
+    unsigned int i;
+
+    if (table == NULL)
+        return;
+    for (i = 0; i <= table->mask; i++)
+        free (table->slots [i].name);   /* ->pass is part of same buffer */
+    free (table);
+}
+
+
+static htpasswd_user *table_lookup (htpasswd_table *table, const char *name)
+{
+    unsigned int hash = username_hash (name), idx = hash & table->mask;
+
+    while (table->slots [idx].name)
+    {
+        if (table->slots [idx].hash == hash && strcmp (table->slots [idx].name, name) == 0)
+            return &table->slots [idx];
+        idx = (idx + 1) & table->mask;
+    }
+    return NULL;
+}
+
+
+static void table_insert (htpasswd_table **tablep, char *name, char *pass)
+{
+    htpasswd_table *table = *tablep;
+    unsigned int hash = username_hash (name), idx;
+
+    if ((table->count + 1) * 10 > (table->mask + 1) * 7)
+    {   /* over 70% full, double up */
+        htpasswd_table *larger = table_new ((table->mask + 1) << 1);
+
+        for (idx = 0; idx <= table->mask; idx++)
+        {
+            htpasswd_user *slot = &table->slots [idx];
+            unsigned int j;
+
+            if (slot->name == NULL)
+                continue;
+            j = slot->hash & larger->mask;
+            while (larger->slots [j].name)
+                j = (j + 1) & larger->mask;
+            larger->slots [j] = *slot;
+        }
+        larger->count = table->count;
+        free (table);       /* name buffers moved over */
+        table = *tablep = larger;
+    }
+    idx = hash & table->mask;
+    while (table->slots [idx].name)
+    {
+        if (table->slots [idx].hash == hash && strcmp (table->slots [idx].name, name) == 0)
+        {   /* later entries in the file replace earlier ones */
+            free (table->slots [idx].name);
+            table->slots [idx].name = name;
+            table->slots [idx].pass = pass;
+            return;
+        }
+        idx = (idx + 1) & table->mask;
+    }
+    table->slots [idx].name = name;
+    table->slots [idx].pass = pass;
+    table->slots [idx].hash = hash;
+    table->count++;
+}
+
+
 static void htpasswd_clear(auth_t *self) {
     htpasswd_auth_state *state = self->state;
     free(state->filename);
-    if (state->users)
-        avl_tree_free (state->users, _free_user);
+    table_free (state->table);
+    table_free (state->retired);
     thread_rwlock_destroy(&state->file_rwlock);
     free(state);
 }
@@ -81,47 +188,22 @@ static char *get_hash(const char *data, size_t len)
 }
 
 
-static int compare_users (void *arg, void *a, void *b)
-{
-    htpasswd_user *user1 = (htpasswd_user *)a;
-    htpasswd_user *user2 = (htpasswd_user *)b;
-
-    return strcmp (user1->name, user2->name);
-}
-
-
-static int _free_user (void *key)
-{
-    htpasswd_user *user = (htpasswd_user *)key;
-
-    free (user->name); /* ->pass is part of same buffer */
-    free (user);
-    return 1;
-}
-
-
-static void htpasswd_recheckfile (htpasswd_auth_state *htpasswd)
+/* rebuild the lookup table if the file changed, expects the file rwlock to
+ * be held as writer.
+ */
+static void htpasswd_rebuild (htpasswd_auth_state *htpasswd)
 {
     FILE *passwdfile;
-    avl_tree *new_users;
+    htpasswd_table *table;
     int num = 0;
     struct stat file_stat;
     char *sep;
     char line [MAX_LINE_LEN];
 
-    if (htpasswd->filename == NULL)
-        return;
     if (stat (htpasswd->filename, &file_stat) != 0)
     {
         const char *msg = strerror (errno);
         WARN2 ("failed to check status of %s (%s)", htpasswd->filename, msg ? msg : "unknown");
-
-        /* Create a dummy users tree for things to use later */
-        thread_rwlock_wlock (&htpasswd->file_rwlock);
-        if(!htpasswd->users)
-            htpasswd->users = avl_tree_new(compare_users, NULL);
-        thread_rwlock_unlock (&htpasswd->file_rwlock);
-
         return;
     }
 
@@ -134,18 +216,18 @@ static void htpasswd_recheckfile (htpasswd_auth_state *htpasswd)
     passwdfile = fopen (htpasswd->filename, "rb");
     if (passwdfile == NULL)
     {
-        WARN2("Failed to open authentication database \"%s\": %s", 
+        WARN2("Failed to open authentication database \"%s\": %s",
                 htpasswd->filename, strerror(errno));
         return;
     }
     htpasswd->mtime = file_stat.st_mtime;
 
-    new_users = avl_tree_new (compare_users, NULL);
+    table = table_new (HTPASSWD_MIN_SLOTS);
 
     while (get_line(passwdfile, line, MAX_LINE_LEN))
     {
         int len;
-        htpasswd_user *entry;
+        char *name;
 
         num++;
         if(!line[0] || line[0] == '#')
@@ -157,20 +239,36 @@ static void htpasswd_recheckfile (htpasswd_auth_state *htpasswd)
             WARN2("No separator on line %d (%s)", num, htpasswd->filename);
             continue;
         }
-        entry = calloc (1, sizeof (htpasswd_user));
         len = strlen (line) + 1;
-        entry->name = malloc (len);
+        name = malloc (len);
         *sep = 0;
-        memcpy (entry->name, line, len);
-        entry->pass = entry->name + (sep-line) + 1;
-        avl_insert (new_users, entry);
+        memcpy (name, line, len);
+        table_insert (&table, name, name + (sep-line) + 1);
     }
     fclose (passwdfile);
 
+    /* the previously retired table has had a full check interval to quiesce */
+    table_free (htpasswd->retired);
+    htpasswd->retired = htpasswd->table;
+    __atomic_store_n (&htpasswd->table, table, __ATOMIC_RELEASE);
+    INFO2 ("%u entries now active from %s", table->count, htpasswd->filename);
+}
+
+
+static void htpasswd_recheckfile (htpasswd_auth_state *htpasswd)
+{
+    time_t now = time (NULL);
+
+    if (htpasswd->filename == NULL)
+        return;
+    if (__atomic_load_n (&htpasswd->next_check, __ATOMIC_RELAXED) > now)
+        return;     /* common case, verified recently enough */
     thread_rwlock_wlock (&htpasswd->file_rwlock);
-    if (htpasswd->users)
-        avl_tree_free (htpasswd->users, _free_user);
-    htpasswd->users = new_users;
+    if (htpasswd->next_check <= now)
+    {
+        htpasswd->next_check = now + HTPASSWD_CHECK_INTERVAL;
+        htpasswd_rebuild (htpasswd);
+    }
     thread_rwlock_unlock (&htpasswd->file_rwlock);
 }
 
@@ -180,8 +278,8 @@ static auth_result htpasswd_auth (auth_client *auth_user)
     auth_t *auth = auth_user->auth;
     htpasswd_auth_state *htpasswd = auth->state;
     client_t *client = auth_user->client;
-    htpasswd_user entry;
-    void *result;
+    htpasswd_table *table;
+    htpasswd_user *found;
 
     do {
         const char *val;
@@ -207,28 +305,23 @@ static auth_result htpasswd_auth (auth_client *auth_user)
 
     htpasswd_recheckfile (htpasswd);
 
-    thread_rwlock_rlock (&htpasswd->file_rwlock);
-    entry.name = client->username;
-    if (avl_get_by_key (htpasswd->users, &entry, &result) == 0)
+    table = __atomic_load_n (&htpasswd->table, __ATOMIC_ACQUIRE);
+    found = table ? table_lookup (table, client->username) : NULL;
+    if (found)
     {
-        htpasswd_user *found = result;
-        char *hashed_pw;
+        char *hashed_pw = get_hash (client->password, strlen (client->password));
 
-        hashed_pw = get_hash (client->password, strlen (client->password));
         if (strcmp (found->pass, hashed_pw) == 0)
         {
             free (hashed_pw);
-            thread_rwlock_unlock (&htpasswd->file_rwlock);
             client->flags |= CLIENT_AUTHENTICATED;
             return AUTH_OK;
         }
-        thread_rwlock_unlock (&htpasswd->file_rwlock);
         free (hashed_pw);
         DEBUG0 ("incorrect password for client");
         return AUTH_FAILED;
     }
     DEBUG1 ("no such username: %s", client->username);
-    thread_rwlock_unlock (&htpasswd->file_rwlock);
     return AUTH_FAILED;
 }
 
@@ -273,15 +366,14 @@ static auth_result htpasswd_adduser (auth_t *auth, const char *username, const c
     FILE *passwdfile;
     char *hashed_password = NULL;
     htpasswd_auth_state *state = auth->state;
-    htpasswd_user entry;
-    void *result;
+    htpasswd_table *table;
 
     htpasswd_recheckfile (state);
 
     thread_rwlock_wlock (&state->file_rwlock);
 
-    entry.name = (char*)username;
-    if (avl_get_by_key (state->users, &entry, &result) == 0)
+    table = __atomic_load_n (&state->table, __ATOMIC_ACQUIRE);
+    if (table && table_lookup (table, username))
     {
         thread_rwlock_unlock (&state->file_rwlock);
         return AUTH_USEREXISTS;
@@ -306,6 +398,10 @@ static auth_result htpasswd_adduser (auth_t *auth, const char *username, const c
     fclose(passwdfile);
     thread_rwlock_unlock (&state->file_rwlock);
 
+    /* make the addition visible without waiting out the check throttle */
+    __atomic_store_n (&state->next_check, 0, __ATOMIC_RELAXED);
+    htpasswd_recheckfile (state);
+
     return AUTH_USERADDED;
 }
 
@@ -396,6 +492,9 @@ static auth_result htpasswd_deleteuser(auth_t *auth, const char *username)
     }
     free(tmpfile);
     thread_rwlock_unlock (&state->file_rwlock);
+
+    /* make the removal visible without waiting out the check throttle */
+    __atomic_store_n (&state->next_check, 0, __ATOMIC_RELAXED);
     htpasswd_recheckfile (state);
 
     return AUTH_USERDELETED;
@@ -406,23 +505,23 @@ static auth_result htpasswd_userlist(auth_t *auth, xmlNodePtr srcnode)
 {
     htpasswd_auth_state *state;
     xmlNodePtr newnode;
-    avl_node *node;
+    htpasswd_table *table;
+    unsigned int i;
 
     state = auth->state;
 
     htpasswd_recheckfile (state);
 
-    thread_rwlock_rlock (&state->file_rwlock);
-    node = avl_get_first (state->users);
-    while (node)
+    table = __atomic_load_n (&state->table, __ATOMIC_ACQUIRE);
+    for (i = 0; table && i <= table->mask; i++)
     {
-        htpasswd_user *user = (htpasswd_user *)node->key;
+        htpasswd_user *user = &table->slots [i];
+        if (user->name == NULL)
+            continue;
         newnode = xmlNewChild (srcnode, NULL, XMLSTR("User"), NULL);
         xmlNewChild(newnode, NULL, XMLSTR("username"), XMLSTR(user->name));
         xmlNewChild(newnode, NULL, XMLSTR("password"), XMLSTR(user->pass));
-        node = avl_get_next (node);
     }
-    thread_rwlock_unlock (&state->file_rwlock);
 
     return AUTH_OK;
 }
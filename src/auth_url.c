@@ -95,13 +95,23 @@
 #include "logging.h"
 #define CATMODULE "auth_url"
 
+#define URL_AUTH_INFLIGHT 10    /* backend requests each auth thread can have running at once */
+
 typedef struct
 {
-    int id;
     CURL *curl;
-    char *server_id;
+    auth_client *auth_user;     /* owner of this transfer, NULL when idle */
     char *location;
+    char *userpwd;
     char errormsg [CURL_ERROR_SIZE];
+    char post [8192];
+} url_transfer;
+
+typedef struct
+{
+    CURLM *multi;
+    char *server_id;
+    url_transfer transfers [URL_AUTH_INFLIGHT];
 } auth_thread_data;
 
 typedef struct {
@@ -169,10 +179,10 @@ static int my_getpass(void *client, char *prompt, char *buffer, int buflen)
 
 static size_t handle_returned_header (void *ptr, size_t size, size_t nmemb, void *stream)
 {
-    auth_client *auth_user = stream;
+    url_transfer *trans = stream;
+    auth_client *auth_user = trans->auth_user;
     unsigned bytes = size * nmemb;
     client_t *client = auth_user->client;
-    auth_thread_data *atd = auth_user->thread_data;
     char *header = (char *)ptr, *header_data;
 
     if (bytes <= 1 || client == NULL)
@@ -190,13 +200,13 @@ static size_t handle_returned_header (void *ptr, size_t size, size_t nmemb, void
             if (retcode == 403)
             {
                 char *p = strchr (ptr, ' ') + 1;
-                snprintf (atd->errormsg, sizeof(atd->errormsg), "%s", p);
-                p = strchr (atd->errormsg, '\r');
+                snprintf (trans->errormsg, sizeof(trans->errormsg), "%s", p);
+                p = strchr (trans->errormsg, '\r');
                 if (p) *p='\0';
             }
             else if ((auth->flags & AUTH_SKIP_IF_SLOW) && retcode >= 400 && retcode < 600)
             {
-                snprintf (atd->errormsg, sizeof(atd->errormsg), "auth on %s disabled, response was \'%.200s...\'", auth->mount, header);
+                snprintf (trans->errormsg, sizeof(trans->errormsg), "auth on %s disabled, response was \'%.200s...\'", auth->mount, header);
                 url->stop_req_until = time (NULL) + url->stop_req_duration; /* prevent further attempts for a while */
                 client->flags |= CLIENT_AUTHENTICATED;
                 return bytes;
@@ -241,7 +251,7 @@ static size_t handle_returned_header (void *ptr, size_t size, size_t nmemb, void
 
         if (strncasecmp (header, "icecast-auth-message:", 21) == 0)
         {
-            snprintf (atd->errormsg, sizeof (atd->errormsg), "%.*s", header_datalen, header_data);
+            snprintf (trans->errormsg, sizeof (trans->errormsg), "%.*s", header_datalen, header_data);
             break;
         }
         if (strncasecmp (header, "ice-username:", 13) == 0)
@@ -257,10 +267,10 @@ static size_t handle_returned_header (void *ptr, size_t size, size_t nmemb, void
         }
         if (strncasecmp (header, "Location:", 9) == 0)
         {
-            free (atd->location);
-            atd->location = malloc (header_datalen+1);
-            if (atd->location)
-                snprintf (atd->location, header_datalen+1, "%s", header_data);
+            free (trans->location);
+            trans->location = malloc (header_datalen+1);
+            if (trans->location)
+                snprintf (trans->location, header_datalen+1, "%s", header_data);
             break;
         }
         if (strncasecmp (header, "Mountpoint:", 11) == 0)
@@ -295,7 +305,8 @@ static size_t handle_returned_header (void *ptr, size_t size, size_t nmemb, void
 
 static size_t handle_returned_data (void *ptr, size_t size, size_t nmemb, void *stream)
 {
-    auth_client *auth_user = stream;
+    url_transfer *trans = stream;
+    auth_client *auth_user = trans->auth_user;
     unsigned bytes = size * nmemb;
     client_t *client = auth_user->client;
     refbuf_t *r = client->refbuf;
@@ -343,15 +354,39 @@ static size_t handle_returned_data (void *ptr, size_t size, size_t nmemb, void *
 }
 
 
+/* run a single prepared transfer through the multi handle, so that it can
+ * reuse any backend connections kept alive from earlier requests */
+static CURLcode url_perform (auth_thread_data *atd, url_transfer *trans)
+{
+    CURLcode res = CURLE_FAILED_INIT;
+    CURLMsg *msg;
+    int active, remaining;
+
+    curl_multi_add_handle (atd->multi, trans->curl);
+    do
+    {
+        curl_multi_perform (atd->multi, &active);
+        if (active)
+            curl_multi_wait (atd->multi, NULL, 0, 1000, NULL);
+    } while (active);
+    while ((msg = curl_multi_info_read (atd->multi, &remaining)))
+        if (msg->msg == CURLMSG_DONE && msg->easy_handle == trans->curl)
+            res = msg->data.result;
+    curl_multi_remove_handle (atd->multi, trans->curl);
+    return res;
+}
+
+
 static auth_result url_remove_listener (auth_client *auth_user)
 {
     client_t *client = auth_user->client;
     auth_url *url = auth_user->auth->state;
     auth_thread_data *atd = auth_user->thread_data;
+    url_transfer *trans = &atd->transfers[0];
     time_t now = time(NULL), duration = now - client->connection.con_time;
     char *username, *password, *mount, *server, *ipaddr, *user_agent;
     const char *qargs, *tmp;
-    char *userpwd = NULL, post [4096];
+    char post [4096];
 
     if (url->removeurl == NULL || client == NULL)
         return AUTH_OK;
@@ -384,7 +419,8 @@ static auth_result url_remove_listener (auth_client *auth_user)
     mount = util_url_escape (post);
     ipaddr = util_url_escape (client->connection.ip);
 
-    snprintf (post, sizeof (post),
+    trans->auth_user = auth_user;
+    snprintf (trans->post, sizeof (trans->post),
             "action=listener_remove&server=%s&port=%d&client=%" PRIu64 "&mount=%s"
             "&user=%s&pass=%s&ip=%s&duration=%lu&agent=%s&sent=%" PRIu64,
             server, auth_user->port, client->connection.id, mount, username,
@@ -399,78 +435,59 @@ static auth_result url_remove_listener (auth_client *auth_user)
     if (strchr (url->removeurl, '@') == NULL)
     {
         if (url->userpwd)
-            curl_easy_setopt (atd->curl, CURLOPT_USERPWD, url->userpwd);
+            curl_easy_setopt (trans->curl, CURLOPT_USERPWD, url->userpwd);
         else
         {
             /* auth'd requests may not have a user/pass, but may use query args */
             if (client->username && client->password)
             {
                 int len = strlen (client->username) + strlen (client->password) + 2;
-                userpwd = malloc (len);
-                snprintf (userpwd, len, "%s:%s", client->username, client->password);
-                curl_easy_setopt (atd->curl, CURLOPT_USERPWD, userpwd);
+                trans->userpwd = malloc (len);
+                snprintf (trans->userpwd, len, "%s:%s", client->username, client->password);
+                curl_easy_setopt (trans->curl, CURLOPT_USERPWD, trans->userpwd);
             }
             else
-                curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
+                curl_easy_setopt (trans->curl, CURLOPT_USERPWD, "");
         }
     }
     else
     {
         /* url has user/pass but libcurl may need to clear any existing settings */
-        curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
+        curl_easy_setopt (trans->curl, CURLOPT_USERPWD, "");
     }
-    curl_easy_setopt (atd->curl, CURLOPT_URL, url->removeurl);
-    curl_easy_setopt (atd->curl, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEHEADER, auth_user);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEDATA, auth_user);
+    curl_easy_setopt (trans->curl, CURLOPT_URL, url->removeurl);
 
     DEBUG2 ("...handler %d (%s) sending request", auth_user->handler, auth_user->mount);
-    if (curl_easy_perform (atd->curl))
+    if (url_perform (atd, trans))
     {
-        WARN3 ("auth to server %s (%s) failed with \"%s\"", url->removeurl, auth_user->mount, atd->errormsg);
+        WARN3 ("auth to server %s (%s) failed with \"%s\"", url->removeurl, auth_user->mount, trans->errormsg);
         url->stop_req_until = time (NULL) + url->stop_req_duration; /* prevent further attempts for a while */
     }
     else
         DEBUG2 ("...handler %d (%s) request complete", auth_user->handler, auth_user->mount);
 
-    free (userpwd);
+    free (trans->userpwd);
+    trans->userpwd = NULL;
+    trans->auth_user = NULL;
 
     return AUTH_OK;
 }
 
 
-static auth_result url_add_listener (auth_client *auth_user)
+/* fill out the details of a listener_add request on the given transfer, the
+ * caller attaches it to the multi handle. returns -1 if it cannot be sent.
+ */
+static int url_prepare_add (url_transfer *trans)
 {
+    auth_client *auth_user = trans->auth_user;
     client_t *client = auth_user->client;
     auth_t *auth = auth_user->auth;
     auth_url *url = auth->state;
-    auth_thread_data *atd = auth_user->thread_data;
 
-    int res = 0, ret = AUTH_FAILED, poffset = 0;
+    int poffset = 0;
     struct build_intro_contents *x;
-    char *userpwd = NULL, post [8192];
-
-    if (url->addurl == NULL || client == NULL)
-        return AUTH_OK;
+    char *post = trans->post;
 
-    if (url->stop_req_until)
-    {
-        time_t now = time(NULL);
-        if (url->stop_req_until <= now)
-        {
-            INFO1 ("restarting url after timeout on %s", auth_user->mount);
-            url->stop_req_until = 0;
-        }
-        else
-        {
-            if (auth->flags & AUTH_SKIP_IF_SLOW)
-            {
-                client->flags |= CLIENT_AUTHENTICATED;
-                return AUTH_OK;
-            }
-            return AUTH_FAILED;
-        }
-    }
     do
     {
         ice_config_t *config = config_get_config ();
@@ -496,7 +513,7 @@ static auth_result url_add_listener (auth_client *auth_user)
 
         /* get the full uri (with query params if available) */
         tmp = httpp_getvar (client->parser, HTTPP_VAR_QUERYARGS);
-        snprintf (post, sizeof post, "%s%s", auth_user->mount, tmp ? tmp : "");
+        snprintf (post, sizeof (trans->post), "%s%s", auth_user->mount, tmp ? tmp : "");
         mount = util_url_escape (post);
         ipaddr = util_url_escape (client->connection.ip);
         tmp = httpp_getvar (client->parser, "referer");
@@ -506,7 +523,7 @@ static auth_result url_add_listener (auth_client *auth_user)
         if (current_listeners == NULL)
             current_listeners = strdup("");
 
-        poffset = snprintf (post, sizeof (post),
+        poffset = snprintf (post, sizeof (trans->post),
                 "action=listener_add&server=%s&port=%d&client=%" PRIu64 "&mount=%s"
                 "&user=%s&pass=%s&ip=%s&agent=%s&referer=%s&listeners=%s",
                 server, port, client->connection.id, mount, username,
@@ -519,16 +536,16 @@ static auth_result url_add_listener (auth_client *auth_user)
         free (username);
         free (password);
         free (ipaddr);
-        if (poffset < 0 || poffset >= sizeof (post))
+        if (poffset < 0 || poffset >= sizeof (trans->post))
         {
             WARN2 ("client from %s (on %s), rejected with headers problem", &client->connection.ip[0], auth_user->mount);
-            return AUTH_FAILED;
+            return -1;
         }
     } while (0);
 
     if (url->header_chk_list)
     {
-        int c = url->header_chk_count, remaining = sizeof(post) - poffset;
+        int c = url->header_chk_count, remaining = sizeof(trans->post) - poffset;
         char *cur_header = url->header_chk_list;
         const char *prefix = (url->header_chk_prefix && isalnum (url->header_chk_prefix[0])) ? url->header_chk_prefix : "ClientHeader-";
 
@@ -544,7 +561,7 @@ static auth_result url_add_listener (auth_client *auth_user)
                 if (r < 0 || r > remaining)
                 {
                     WARN2 ("client from %s (on %s), rejected with too much in headers", &client->connection.ip[0], auth_user->mount);
-                    return AUTH_FAILED;
+                    return -1;
                 }
                 poffset += r;
                 remaining -= r;
@@ -556,33 +573,30 @@ static auth_result url_add_listener (auth_client *auth_user)
     if (strchr (url->addurl, '@') == NULL)
     {
         if (url->userpwd)
-            curl_easy_setopt (atd->curl, CURLOPT_USERPWD, url->userpwd);
+            curl_easy_setopt (trans->curl, CURLOPT_USERPWD, url->userpwd);
         else
         {
             /* auth'd requests may not have a user/pass, but may use query args */
             if (client->username && client->password)
             {
                 int len = strlen (client->username) + strlen (client->password) + 2;
-                userpwd = malloc (len);
-                snprintf (userpwd, len, "%s:%s", client->username, client->password);
-                curl_easy_setopt (atd->curl, CURLOPT_USERPWD, userpwd);
+                trans->userpwd = malloc (len);
+                snprintf (trans->userpwd, len, "%s:%s", client->username, client->password);
+                curl_easy_setopt (trans->curl, CURLOPT_USERPWD, trans->userpwd);
             }
             else
-                curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
+                curl_easy_setopt (trans->curl, CURLOPT_USERPWD, "");
         }
     }
     else
     {
         /* url has user/pass but libcurl may need to clear any existing settings */
-        curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
+        curl_easy_setopt (trans->curl, CURLOPT_USERPWD, "");
     }
-    curl_easy_setopt (atd->curl, CURLOPT_URL, url->addurl);
-    curl_easy_setopt (atd->curl, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEHEADER, auth_user);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEDATA, auth_user);
-    atd->errormsg[0] = '\0';
-    free (atd->location);
-    atd->location = NULL;
+    curl_easy_setopt (trans->curl, CURLOPT_URL, url->addurl);
+    trans->errormsg[0] = '\0';
+    free (trans->location);
+    trans->location = NULL;
     /* setup in case intro data is returned */
     x = (void *)client->refbuf->data;
     x->type = 0;
@@ -591,10 +605,26 @@ static auth_result url_add_listener (auth_client *auth_user)
     x->tailp = &x->head;
 
     DEBUG2 ("handler %d (%s) sending request", auth_user->handler, auth_user->mount);
-    res = curl_easy_perform (atd->curl);
+    return 0;
+}
+
+
+/* process the outcome of a finished listener_add transfer, the easy handle
+ * is expected to of been removed from the multi handle already.
+ */
+static auth_result url_complete_add (url_transfer *trans, CURLcode res)
+{
+    auth_client *auth_user = trans->auth_user;
+    client_t *client = auth_user->client;
+    auth_t *auth = auth_user->auth;
+    auth_url *url = auth->state;
+    int ret = AUTH_FAILED;
+    struct build_intro_contents *x = (void *)client->refbuf->data;
+
     DEBUG2 ("handler %d (%s) request finished", auth_user->handler, auth_user->mount);
 
-    free (userpwd);
+    free (trans->userpwd);
+    trans->userpwd = NULL;
 
     if (client->flags & CLIENT_AUTHENTICATED)
     {
@@ -611,7 +641,7 @@ static auth_result url_add_listener (auth_client *auth_user)
     if (res)
     {
         url->stop_req_until = time (NULL) + url->stop_req_duration; /* prevent further attempts for a while */
-        WARN3 ("auth to server %s (%s) failed with %s", url->addurl, auth_user->mount, atd->errormsg);
+        WARN3 ("auth to server %s (%s) failed with %s", url->addurl, auth_user->mount, trans->errormsg);
         INFO1 ("will not auth new listeners for %d seconds", url->stop_req_duration);
         if (auth->flags & AUTH_SKIP_IF_SLOW)
         {
@@ -629,22 +659,133 @@ static auth_result url_add_listener (auth_client *auth_user)
     }
     if (x->type)
         mpeg_cleanup (&x->sync);
-    if (atd->location)
+    if (trans->location)
     {
-        client_send_302 (client, atd->location);
+        client_send_302 (client, trans->location);
         auth_user->client = NULL;
-        free (atd->location);
-        atd->location = NULL;
+        free (trans->location);
+        trans->location = NULL;
     }
-    else if (atd->errormsg[0])
+    else if (trans->errormsg[0])
     {
-        INFO3 ("listener %s (%s) returned \"%s\"", client->connection.ip, url->addurl, atd->errormsg);
-        if (atoi (atd->errormsg) == 403)
+        INFO3 ("listener %s (%s) returned \"%s\"", client->connection.ip, url->addurl, trans->errormsg);
+        if (atoi (trans->errormsg) == 403)
         {
             auth_user->client = NULL;
-            client_send_403 (client, atd->errormsg+4);
+            client_send_403 (client, trans->errormsg+4);
         }
     }
+    trans->auth_user = NULL;
+    return ret;
+}
+
+
+/* The auth thread cannot do much while a backend request is outstanding, so
+ * as well as the transfer for the client passed in, pull further pending
+ * listener adds off the queue and run them on the multi handle in parallel.
+ * A storm of reconnecting listeners then clears at a rate limited by the
+ * backend and not by round trips times the queue length.
+ */
+static auth_result url_add_listener (auth_client *auth_user)
+{
+    client_t *client = auth_user->client;
+    auth_t *auth = auth_user->auth;
+    auth_url *url = auth->state;
+    auth_thread_data *atd = auth_user->thread_data;
+    auth_result ret = AUTH_FAILED;
+    url_transfer *trans = &atd->transfers[0];
+    int running;
+
+    if (url->addurl == NULL || client == NULL)
+        return AUTH_OK;
+
+    if (url->stop_req_until)
+    {
+        time_t now = time(NULL);
+        if (url->stop_req_until <= now)
+        {
+            INFO1 ("restarting url after timeout on %s", auth_user->mount);
+            url->stop_req_until = 0;
+        }
+        else
+        {
+            if (auth->flags & AUTH_SKIP_IF_SLOW)
+            {
+                client->flags |= CLIENT_AUTHENTICATED;
+                return AUTH_OK;
+            }
+            return AUTH_FAILED;
+        }
+    }
+    trans->auth_user = auth_user;
+    if (url_prepare_add (trans) < 0)
+    {
+        trans->auth_user = NULL;
+        return AUTH_FAILED;
+    }
+    curl_multi_add_handle (atd->multi, trans->curl);
+    running = 1;
+    while (running)
+    {
+        CURLMsg *msg;
+        int active, remaining, i;
+
+        /* top up with any further pending listeners, they share the wait below */
+        while (running < URL_AUTH_INFLIGHT && url->stop_req_until == 0)
+        {
+            auth_client *next = auth_queue_next_listener (auth);
+            url_transfer *t = NULL;
+
+            if (next == NULL)
+                break;
+            for (i = 0; i < URL_AUTH_INFLIGHT; i++)
+                if (atd->transfers[i].auth_user == NULL)
+                {
+                    t = &atd->transfers[i];
+                    break;
+                }
+            next->thread_data = atd;
+            next->handler = auth_user->handler;
+            t->auth_user = next;
+            if (url_prepare_add (t) < 0)
+            {
+                t->auth_user = NULL;
+                auth_complete_listener (next);  /* rejected, still unauthenticated */
+                continue;
+            }
+            curl_multi_add_handle (atd->multi, t->curl);
+            running++;
+        }
+        curl_multi_perform (atd->multi, &active);
+        while ((msg = curl_multi_info_read (atd->multi, &remaining)))
+        {
+            CURLcode res;
+            url_transfer *t = NULL;
+            auth_client *done_user;
+
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            for (i = 0; i < URL_AUTH_INFLIGHT; i++)
+                if (atd->transfers[i].curl == msg->easy_handle)
+                {
+                    t = &atd->transfers[i];
+                    break;
+                }
+            res = msg->data.result;
+            curl_multi_remove_handle (atd->multi, t->curl);
+            done_user = t->auth_user;
+            if (done_user == auth_user)
+                ret = url_complete_add (t, res);
+            else
+            {
+                url_complete_add (t, res);
+                auth_complete_listener (done_user);
+            }
+            running--;
+        }
+        if (running)
+            curl_multi_wait (atd->multi, NULL, 0, 1000, NULL);
+    }
     return ret;
 }
 
@@ -658,7 +799,7 @@ static void url_stream_start (auth_client *auth_user)
     client_t *client = auth_user->client;
     auth_url *url = auth_user->auth->state;
     auth_thread_data *atd = auth_user->thread_data;
-    char post [4096];
+    url_transfer *trans = &atd->transfers[0];
 
     server = util_url_escape (auth_user->hostname);
     mount = util_url_escape (auth_user->mount);
@@ -672,7 +813,8 @@ static void url_stream_start (auth_client *auth_user)
     if (ipaddr == NULL) ipaddr = strdup("");
     if (agent == NULL) agent = strdup("");
 
-    snprintf (post, sizeof (post),
+    trans->auth_user = auth_user;
+    snprintf (trans->post, sizeof (trans->post),
             "action=mount_add&mount=%.200s&server=%s&port=%d&ip=%s&agent=%.200s", mount, server,
             auth_user->port, ipaddr, agent);
     free (ipaddr);
@@ -683,21 +825,19 @@ static void url_stream_start (auth_client *auth_user)
     if (strchr (url->stream_start, '@') == NULL)
     {
         if (url->userpwd)
-            curl_easy_setopt (atd->curl, CURLOPT_USERPWD, url->userpwd);
+            curl_easy_setopt (trans->curl, CURLOPT_USERPWD, url->userpwd);
         else
-            curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
+            curl_easy_setopt (trans->curl, CURLOPT_USERPWD, "");
     }
     else
-        curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
-    curl_easy_setopt (atd->curl, CURLOPT_URL, url->stream_start);
-    curl_easy_setopt (atd->curl, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEHEADER, auth_user);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEDATA, auth_user);
+        curl_easy_setopt (trans->curl, CURLOPT_USERPWD, "");
+    curl_easy_setopt (trans->curl, CURLOPT_URL, url->stream_start);
 
     DEBUG2 ("handler %d (%s) sending request", auth_user->handler, auth_user->mount);
-    if (curl_easy_perform (atd->curl))
-        WARN3 ("auth to server %s (%s) failed with %s", url->stream_start, auth_user->mount, atd->errormsg);
+    if (url_perform (atd, trans))
+        WARN3 ("auth to server %s (%s) failed with %s", url->stream_start, auth_user->mount, trans->errormsg);
     DEBUG2 ("handler %d (%s) request finished", auth_user->handler, auth_user->mount);
+    trans->auth_user = NULL;
 }
 
 
@@ -707,7 +847,7 @@ static void url_stream_end (auth_client *auth_user)
     client_t *client = auth_user->client;
     auth_url *url = auth_user->auth->state;
     auth_thread_data *atd = auth_user->thread_data;
-    char post [4096];
+    url_transfer *trans = &atd->transfers[0];
 
     server = util_url_escape (auth_user->hostname);
     mount = util_url_escape (auth_user->mount);
@@ -721,7 +861,8 @@ static void url_stream_end (auth_client *auth_user)
     if (ipaddr == NULL) ipaddr = strdup("");
     if (agent == NULL) agent = strdup("");
 
-    snprintf (post, sizeof (post),
+    trans->auth_user = auth_user;
+    snprintf (trans->post, sizeof (trans->post),
             "action=mount_remove&mount=%s&server=%.200s&port=%d&ip=%s&agent=%.200s", mount, server,
             auth_user->port, ipaddr, agent);
     free (ipaddr);
@@ -732,21 +873,19 @@ static void url_stream_end (auth_client *auth_user)
     if (strchr (url->stream_end, '@') == NULL)
     {
         if (url->userpwd)
-            curl_easy_setopt (atd->curl, CURLOPT_USERPWD, url->userpwd);
+            curl_easy_setopt (trans->curl, CURLOPT_USERPWD, url->userpwd);
         else
-            curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
+            curl_easy_setopt (trans->curl, CURLOPT_USERPWD, "");
     }
     else
-        curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
-    curl_easy_setopt (atd->curl, CURLOPT_URL, url->stream_end);
-    curl_easy_setopt (atd->curl, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEHEADER, auth_user);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEDATA, auth_user);
+        curl_easy_setopt (trans->curl, CURLOPT_USERPWD, "");
+    curl_easy_setopt (trans->curl, CURLOPT_URL, url->stream_end);
 
     DEBUG2 ("handler %d (%s) sending request", auth_user->handler, auth_user->mount);
-    if (curl_easy_perform (atd->curl))
-        WARN3 ("auth to server %s (%s) failed with %s", url->stream_end, auth_user->mount, atd->errormsg);
+    if (url_perform (atd, trans))
+        WARN3 ("auth to server %s (%s) failed with %s", url->stream_end, auth_user->mount, trans->errormsg);
     DEBUG2 ("handler %d (%s) request finished", auth_user->handler, auth_user->mount);
+    trans->auth_user = NULL;
 }
 
 
@@ -755,22 +894,20 @@ static void url_stream_auth (auth_client *auth_user)
     client_t *client = auth_user->client;
     auth_url *url = auth_user->auth->state;
     auth_thread_data *atd = auth_user->thread_data;
+    url_transfer *trans = &atd->transfers[0];
     char *mount, *host, *user, *pass, *ipaddr, *admin="";
-    char post [4096];
 
+    trans->auth_user = auth_user;
     if (strchr (url->stream_auth, '@') == NULL)
     {
         if (url->userpwd)
-            curl_easy_setopt (atd->curl, CURLOPT_USERPWD, url->userpwd);
+            curl_easy_setopt (trans->curl, CURLOPT_USERPWD, url->userpwd);
         else
-            curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
+            curl_easy_setopt (trans->curl, CURLOPT_USERPWD, "");
     }
     else
-        curl_easy_setopt (atd->curl, CURLOPT_USERPWD, "");
-    curl_easy_setopt (atd->curl, CURLOPT_URL, url->stream_auth);
-    curl_easy_setopt (atd->curl, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEHEADER, auth_user);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEDATA, auth_user);
+        curl_easy_setopt (trans->curl, CURLOPT_USERPWD, "");
+    curl_easy_setopt (trans->curl, CURLOPT_URL, url->stream_auth);
     if (strcmp (auth_user->mount, httpp_getvar (client->parser, HTTPP_VAR_URI)) != 0)
         admin = "&admin=1";
     mount = util_url_escape (auth_user->mount);
@@ -779,7 +916,7 @@ static void url_stream_auth (auth_client *auth_user)
     pass = util_url_escape (client->password);
     ipaddr = util_url_escape (client->connection.ip);
 
-    snprintf (post, sizeof (post),
+    snprintf (trans->post, sizeof (trans->post),
             "action=stream_auth&mount=%s&ip=%s&server=%s&port=%d&user=%s&pass=%s%s",
             mount, ipaddr, host, auth_user->port, user, pass, admin);
     free (ipaddr);
@@ -789,8 +926,9 @@ static void url_stream_auth (auth_client *auth_user)
     free (host);
 
     client->flags &= ~CLIENT_AUTHENTICATED;
-    if (curl_easy_perform (atd->curl))
-        WARN3 ("auth to server %s (%s) failed with %s", url->stream_auth, auth_user->mount, atd->errormsg);
+    if (url_perform (atd, trans))
+        WARN3 ("auth to server %s (%s) failed with %s", url->stream_auth, auth_user->mount, trans->errormsg);
+    trans->auth_user = NULL;
 }
 
 
@@ -815,24 +953,37 @@ static void *alloc_thread_data (auth_t *auth)
     auth_thread_data *atd = calloc (1, sizeof (auth_thread_data));
     ice_config_t *config = config_get_config_unlocked();
     auth_url *url = auth->state;
+    int i;
     atd->server_id = strdup (config->server_id);
 
-    atd->curl = curl_easy_init ();
-    curl_easy_setopt (atd->curl, CURLOPT_USERAGENT, atd->server_id);
-    curl_easy_setopt (atd->curl, CURLOPT_HEADERFUNCTION, handle_returned_header);
-    curl_easy_setopt (atd->curl, CURLOPT_WRITEFUNCTION, handle_returned_data);
-    curl_easy_setopt (atd->curl, CURLOPT_NOSIGNAL, 1L);
-    curl_easy_setopt (atd->curl, CURLOPT_TIMEOUT, (long)url->timeout);
+    /* the multi handle keeps a pool of connections to the backend alive
+     * between requests, so bursts do not re-handshake on each one */
+    atd->multi = curl_multi_init ();
+    curl_multi_setopt (atd->multi, CURLMOPT_MAXCONNECTS, (long)URL_AUTH_INFLIGHT);
+    for (i = 0; i < URL_AUTH_INFLIGHT; i++)
+    {
+        url_transfer *trans = &atd->transfers[i];
+
+        trans->curl = curl_easy_init ();
+        curl_easy_setopt (trans->curl, CURLOPT_USERAGENT, atd->server_id);
+        curl_easy_setopt (trans->curl, CURLOPT_HEADERFUNCTION, handle_returned_header);
+        curl_easy_setopt (trans->curl, CURLOPT_WRITEFUNCTION, handle_returned_data);
+        curl_easy_setopt (trans->curl, CURLOPT_WRITEHEADER, trans);
+        curl_easy_setopt (trans->curl, CURLOPT_WRITEDATA, trans);
+        curl_easy_setopt (trans->curl, CURLOPT_POSTFIELDS, &trans->post[0]);
+        curl_easy_setopt (trans->curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt (trans->curl, CURLOPT_TIMEOUT, (long)url->timeout);
 #ifdef CURLOPT_PASSWDFUNCTION
-    curl_easy_setopt (atd->curl, CURLOPT_PASSWDFUNCTION, my_getpass);
+        curl_easy_setopt (trans->curl, CURLOPT_PASSWDFUNCTION, my_getpass);
 #endif
-    curl_easy_setopt (atd->curl, CURLOPT_ERRORBUFFER, &atd->errormsg[0]);
-    curl_easy_setopt (atd->curl, CURLOPT_FOLLOWLOCATION, 1);
+        curl_easy_setopt (trans->curl, CURLOPT_ERRORBUFFER, &trans->errormsg[0]);
+        curl_easy_setopt (trans->curl, CURLOPT_FOLLOWLOCATION, 1);
 #ifdef CURLOPT_POSTREDIR
-    curl_easy_setopt (atd->curl, CURLOPT_POSTREDIR, CURL_REDIR_POST_ALL);
+        curl_easy_setopt (trans->curl, CURLOPT_POSTREDIR, CURL_REDIR_POST_ALL);
 #endif
-    if (auth->flags & AUTH_SKIP_IF_SLOW)
-        curl_easy_setopt (atd->curl, CURLOPT_SSL_VERIFYPEER, 0L);
+        if (auth->flags & AUTH_SKIP_IF_SLOW)
+            curl_easy_setopt (trans->curl, CURLOPT_SSL_VERIFYPEER, 0L);
+    }
     INFO0 ("...handler data initialized");
     return atd;
 }
@@ -841,7 +992,14 @@ static void *alloc_thread_data (auth_t *auth)
 static void release_thread_data (auth_t *auth, void *thread_data)
 {
     auth_thread_data *atd = thread_data;
-    curl_easy_cleanup (atd->curl);
+    int i;
+    for (i = 0; i < URL_AUTH_INFLIGHT; i++)
+    {
+        curl_easy_cleanup (atd->transfers[i].curl);
+        free (atd->transfers[i].location);
+        free (atd->transfers[i].userpwd);
+    }
+    curl_multi_cleanup (atd->multi);
     free (atd->server_id);
     free (atd);
     DEBUG1 ("...handler destroyed for %s", auth->mount);
@@ -1193,3 +1193,351 @@ void avl_node_unlock(avl_node *node)
     thread_rwlock_unlock(&node->rwlock);
 }
 #endif
+
+
+#ifdef AVL_RMAP
+
+/* read-mostly map. The tree is never modified in place; writers clone the
+ * search path, rebalance the private copies and publish the new root with a
+ * single atomic store, so readers can walk the structure with no lock at
+ * all. Nodes dropped from the published tree go onto a limbo list and are
+ * only freed once the reader epoch they could be visible to has drained.
+ */
+
+static int rmap_height (avl_rnode *n)
+{
+    return n ? n->height : 0;
+}
+
+static void rmap_setheight (avl_rnode *n)
+{
+    int l = rmap_height (n->left), r = rmap_height (n->right);
+    n->height = (l > r ? l : r) + 1;
+}
+
+static avl_rnode *rmap_node_new (void *key)
+{
+    avl_rnode *n = calloc (1, sizeof (*n));
+
+    n->key = key;
+    n->height = 1;
+    return n;
+}
+
+/* drop a node from the published tree. left/right stay intact for readers
+ * still walking the old snapshot, reclamation happens in rmap_gc
+ */
+static void rmap_retire (avl_rmap *map, avl_rnode *n, avl_free_key_fun_type free_fun)
+{
+    n->free_fun = free_fun;
+    n->rnext = map->limbo [map->epoch & 1];
+    map->limbo [map->epoch & 1] = n;
+}
+
+/* private copy of a node for the writer to work on, the original is retired */
+static avl_rnode *rmap_clone (avl_rmap *map, avl_rnode *n, avl_free_key_fun_type free_fun)
+{
+    avl_rnode *copy = rmap_node_new (n->key);
+
+    copy->left = n->left;
+    copy->right = n->right;
+    copy->height = n->height;
+    rmap_retire (map, n, free_fun);
+    return copy;
+}
+
+/* rotations take a private node, the pivot child is cloned as it may still
+ * be shared with the published tree
+ */
+static avl_rnode *rmap_rot_right (avl_rmap *map, avl_rnode *n)
+{
+    avl_rnode *l = rmap_clone (map, n->left, NULL);
+
+    n->left = l->right;
+    l->right = n;
+    rmap_setheight (n);
+    rmap_setheight (l);
+    return l;
+}
+
+static avl_rnode *rmap_rot_left (avl_rmap *map, avl_rnode *n)
+{
+    avl_rnode *r = rmap_clone (map, n->right, NULL);
+
+    n->right = r->left;
+    r->left = n;
+    rmap_setheight (n);
+    rmap_setheight (r);
+    return r;
+}
+
+static avl_rnode *rmap_rebalance (avl_rmap *map, avl_rnode *n)
+{
+    int bf;
+
+    rmap_setheight (n);
+    bf = rmap_height (n->left) - rmap_height (n->right);
+    if (bf > 1)
+    {
+        if (rmap_height (n->left->left) < rmap_height (n->left->right))
+            n->left = rmap_rot_left (map, rmap_clone (map, n->left, NULL));
+        return rmap_rot_right (map, n);
+    }
+    if (bf < -1)
+    {
+        if (rmap_height (n->right->right) < rmap_height (n->right->left))
+            n->right = rmap_rot_right (map, rmap_clone (map, n->right, NULL));
+        return rmap_rot_left (map, n);
+    }
+    return n;
+}
+
+static avl_rnode *rmap_cow_insert (avl_rmap *map, avl_rnode *n, void *key)
+{
+    avl_rnode *copy;
+
+    if (n == NULL)
+        return rmap_node_new (key);
+    copy = rmap_clone (map, n, NULL);
+    if (map->compare_fun (map->compare_arg, key, n->key) < 0)
+        copy->left = rmap_cow_insert (map, copy->left, key);
+    else
+        copy->right = rmap_cow_insert (map, copy->right, key);
+    return rmap_rebalance (map, copy);
+}
+
+static avl_rnode *rmap_cow_delmin (avl_rmap *map, avl_rnode *n, void **minkey)
+{
+    avl_rnode *copy;
+
+    if (n->left == NULL)
+    {
+        *minkey = n->key;       /* key moves up to the victim's clone */
+        rmap_retire (map, n, NULL);
+        return n->right;
+    }
+    copy = rmap_clone (map, n, NULL);
+    copy->left = rmap_cow_delmin (map, copy->left, minkey);
+    return rmap_rebalance (map, copy);
+}
+
+static avl_rnode *rmap_cow_delete (avl_rmap *map, avl_rnode *n, void *key, avl_free_key_fun_type free_fun)
+{
+    avl_rnode *copy;
+    int c = map->compare_fun (map->compare_arg, key, n->key);
+
+    if (c == 0)
+    {
+        if (n->left == NULL || n->right == NULL)
+        {
+            avl_rnode *child = n->left ? n->left : n->right;
+            rmap_retire (map, n, free_fun);
+            return child;
+        }
+        /* two children, the successor key takes the victim's place. The
+         * retired victim keeps its key until the grace period passes */
+        copy = rmap_clone (map, n, free_fun);
+        copy->right = rmap_cow_delmin (map, copy->right, &copy->key);
+        return rmap_rebalance (map, copy);
+    }
+    copy = rmap_clone (map, n, NULL);
+    if (c < 0)
+        copy->left = rmap_cow_delete (map, copy->left, key, free_fun);
+    else
+        copy->right = rmap_cow_delete (map, copy->right, key, free_fun);
+    return rmap_rebalance (map, copy);
+}
+
+static void rmap_limbo_release (avl_rnode *list)
+{
+    while (list)
+    {
+        avl_rnode *next = list->rnext;
+        if (list->free_fun)
+            list->free_fun (list->key);
+        free (list);
+        list = next;
+    }
+}
+
+/* runs under the write lock after a publish. The previous epoch's limbo can
+ * go once no reader is pinned on it; new retirees then reuse that slot under
+ * the bumped epoch
+ */
+static void rmap_gc (avl_rmap *map)
+{
+    unsigned int e = map->epoch;
+    int prev = (e + 1) & 1;
+
+    if (__atomic_load_n (&map->readers [prev], __ATOMIC_SEQ_CST))
+        return;     /* still drained by a later write */
+    rmap_limbo_release (map->limbo [prev]);
+    map->limbo [prev] = NULL;
+    __atomic_store_n (&map->epoch, e + 1, __ATOMIC_SEQ_CST);
+}
+
+avl_rmap *avl_rmap_new (avl_key_compare_fun_type compare_fun, void *compare_arg)
+{
+    avl_rmap *map = calloc (1, sizeof (*map));
+
+    if (map == NULL)
+        return NULL;
+    map->compare_fun = compare_fun;
+    map->compare_arg = compare_arg;
+    thread_mutex_create (&map->wlock);
+    return map;
+}
+
+int avl_rmap_pin (avl_rmap *map)
+{
+    int slot = __atomic_load_n (&map->epoch, __ATOMIC_SEQ_CST) & 1;
+
+    __atomic_add_fetch (&map->readers [slot], 1, __ATOMIC_SEQ_CST);
+    return slot;
+}
+
+void avl_rmap_unpin (avl_rmap *map, int slot)
+{
+    __atomic_sub_fetch (&map->readers [slot], 1, __ATOMIC_SEQ_CST);
+}
+
+int avl_rmap_get (avl_rmap *map, void *key, void **value_address)
+{
+    avl_rnode *n = __atomic_load_n (&map->root, __ATOMIC_ACQUIRE);
+
+    while (n)
+    {
+        int c = map->compare_fun (map->compare_arg, key, n->key);
+        if (c == 0)
+        {
+            if (value_address)
+                *value_address = n->key;
+            return 0;
+        }
+        n = c < 0 ? n->left : n->right;
+    }
+    return -1;
+}
+
+static int rmap_iter_node (avl_rnode *n, avl_iter_fun_type iter_fun, void *iter_arg)
+{
+    int result;
+
+    if (n == NULL)
+        return 0;
+    result = rmap_iter_node (n->left, iter_fun, iter_arg);
+    if (result == 0)
+        result = iter_fun (n->key, iter_arg);
+    if (result == 0)
+        result = rmap_iter_node (n->right, iter_fun, iter_arg);
+    return result;
+}
+
+int avl_rmap_iterate (avl_rmap *map, avl_iter_fun_type iter_fun, void *iter_arg)
+{
+    int slot = avl_rmap_pin (map), result;
+    avl_rnode *root = __atomic_load_n (&map->root, __ATOMIC_ACQUIRE);
+
+    result = rmap_iter_node (root, iter_fun, iter_arg);
+    avl_rmap_unpin (map, slot);
+    return result;
+}
+
+int avl_rmap_insert (avl_rmap *map, void *key)
+{
+    avl_rnode *root;
+
+    thread_mutex_lock (&map->wlock);
+    if (avl_rmap_get (map, key, NULL) == 0)
+    {
+        thread_mutex_unlock (&map->wlock);
+        return -1;
+    }
+    root = rmap_cow_insert (map, map->root, key);
+    __atomic_store_n (&map->root, root, __ATOMIC_SEQ_CST);
+    map->length++;
+    rmap_gc (map);
+    thread_mutex_unlock (&map->wlock);
+    return 0;
+}
+
+int avl_rmap_delete (avl_rmap *map, void *key, avl_free_key_fun_type free_fun)
+{
+    avl_rnode *root;
+
+    thread_mutex_lock (&map->wlock);
+    if (avl_rmap_get (map, key, NULL) < 0)
+    {
+        thread_mutex_unlock (&map->wlock);
+        return -1;
+    }
+    root = rmap_cow_delete (map, map->root, key, free_fun);
+    __atomic_store_n (&map->root, root, __ATOMIC_SEQ_CST);
+    map->length--;
+    rmap_gc (map);
+    thread_mutex_unlock (&map->wlock);
+    return 0;
+}
+
+static avl_rnode *rmap_cow_replace (avl_rmap *map, avl_rnode *n, void *key, avl_free_key_fun_type free_fun)
+{
+    avl_rnode *copy;
+    int c = map->compare_fun (map->compare_arg, key, n->key);
+
+    if (c == 0)
+    {
+        copy = rmap_clone (map, n, free_fun);
+        copy->key = key;
+        return copy;
+    }
+    copy = rmap_clone (map, n, NULL);
+    if (c < 0)
+        copy->left = rmap_cow_replace (map, copy->left, key, free_fun);
+    else
+        copy->right = rmap_cow_replace (map, copy->right, key, free_fun);
+    return copy;    /* same shape as before, no rebalance needed */
+}
+
+/* swap in a key comparing equal to the one present, so readers never see the
+ * entry go missing the way a delete then insert would allow. The displaced
+ * key gets free_fun applied after the grace period
+ */
+int avl_rmap_replace (avl_rmap *map, void *key, avl_free_key_fun_type free_fun)
+{
+    avl_rnode *root;
+
+    thread_mutex_lock (&map->wlock);
+    if (avl_rmap_get (map, key, NULL) < 0)
+    {
+        thread_mutex_unlock (&map->wlock);
+        return -1;
+    }
+    root = rmap_cow_replace (map, map->root, key, free_fun);
+    __atomic_store_n (&map->root, root, __ATOMIC_SEQ_CST);
+    rmap_gc (map);
+    thread_mutex_unlock (&map->wlock);
+    return 0;
+}
+
+static void rmap_tree_free (avl_rnode *n, avl_free_key_fun_type free_fun)
+{
+    if (n == NULL)
+        return;
+    rmap_tree_free (n->left, free_fun);
+    rmap_tree_free (n->right, free_fun);
+    if (free_fun)
+        free_fun (n->key);
+    free (n);
+}
+
+/* caller ensures no further readers or writers by this point */
+void avl_rmap_free (avl_rmap *map, avl_free_key_fun_type free_fun)
+{
+    rmap_tree_free (map->root, free_fun);
+    rmap_limbo_release (map->limbo [0]);
+    rmap_limbo_release (map->limbo [1]);
+    thread_mutex_destroy (&map->wlock);
+    free (map);
+}
+
+#endif /* AVL_RMAP */
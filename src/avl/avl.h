@@ -193,6 +193,49 @@ int avl_get_item_by_key_least (
   void **        value_address
   );
 
+#if !defined(NO_THREAD) && defined(__GNUC__)
+/* read-mostly map, same comparator interface as the avl tree. Lookups and
+ * iteration run without locks against an atomically published copy-on-write
+ * tree; writers serialise internally and replaced nodes are reclaimed in
+ * epochs once every reader pinned on them has moved on. Callers wanting to
+ * use a looked-up key beyond the call wrap it in avl_rmap_pin/unpin, the
+ * equivalent of the read lock held over an avl_get_by_key result.
+ */
+#define AVL_RMAP 1
+
+typedef struct avl_rnode_tag
+{
+    void *key;
+    struct avl_rnode_tag *left;
+    struct avl_rnode_tag *right;
+    struct avl_rnode_tag *rnext;    /* limbo chain once retired */
+    int height;
+    avl_free_key_fun_type free_fun; /* applied to key after the grace period */
+} avl_rnode;
+
+typedef struct _avl_rmap
+{
+    avl_rnode * volatile root;
+    avl_key_compare_fun_type compare_fun;
+    void *compare_arg;
+    unsigned int length;
+    mutex_t wlock;                  /* serialises writers */
+    volatile unsigned int epoch;
+    volatile int readers [2];
+    avl_rnode *limbo [2];
+} avl_rmap;
+
+avl_rmap *avl_rmap_new (avl_key_compare_fun_type compare_fun, void *compare_arg);
+int  avl_rmap_insert (avl_rmap *map, void *key);
+int  avl_rmap_delete (avl_rmap *map, void *key, avl_free_key_fun_type free_fun);
+int  avl_rmap_replace (avl_rmap *map, void *key, avl_free_key_fun_type free_fun);
+int  avl_rmap_get (avl_rmap *map, void *key, void **value_address);
+int  avl_rmap_iterate (avl_rmap *map, avl_iter_fun_type iter_fun, void *iter_arg);
+int  avl_rmap_pin (avl_rmap *map);
+void avl_rmap_unpin (avl_rmap *map, int slot);
+void avl_rmap_free (avl_rmap *map, avl_free_key_fun_type free_fun);
+#endif
+
 /* optional locking stuff */
 void avl_tree_rlock_c(avl_tree *tree, int line, const char *file);
 void avl_tree_wlock_c(avl_tree *tree, int line, const char *file);
@@ -81,8 +81,36 @@
 static ice_config_t _current_configuration;
 static ice_config_locks _locks;
 
+/* The active config is published as a refcounted snapshot swapped atomically
+ * on reload, so a reader pays one atomic incref and a reload never stalls
+ * anyone on the request path. The config write lock only serialises writers.
+ * Replaced snapshots are retired and only cleared once no reader holds them;
+ * a retired snapshot must additionally sit idle across a further reload
+ * before it is freed, which covers a reader stalled between loading the
+ * active pointer and taking its reference.
+ *
+ * Acquired snapshots are remembered per thread so the existing paired
+ * get/release calling convention carries over unchanged.
+ */
+typedef struct retired_config
+{
+    struct retired_config *next;
+    ice_config_t *config;
+    char *xmlstr;           /* a lone replaced string rather than a snapshot */
+    int seen_idle;
+} retired_config_t;
+
+static ice_config_t *_active_config = &_current_configuration;
+static retired_config_t *retired_configs;   /* guarded by the config write lock */
+
+#define CONFIG_HELD_DEPTH   8
+static __thread ice_config_t *held_configs [CONFIG_HELD_DEPTH];
+static __thread int held_depth;
+
 static void _set_defaults(ice_config_t *c);
 static int  _parse_root (xmlNodePtr node, ice_config_t *config);
+static void config_mount_index_build (ice_config_t *config);
+static void config_alias_index_build (ice_config_t *config);
 
 static void create_locks(void) {
     thread_rwlock_create(&_locks.config_lock);
@@ -302,9 +330,26 @@ void config_initialize(void) {
 }
 
 void config_shutdown(void) {
-    config_get_config();
-    config_clear(&_current_configuration);
-    config_release_config();
+    thread_rwlock_wlock(&(_locks.config_lock));
+    config_clear(_active_config);
+    if (_active_config != &_current_configuration)
+        free (_active_config);
+    _active_config = &_current_configuration;
+    while (retired_configs)     /* single threaded by now, drop the lot */
+    {
+        retired_config_t *node = retired_configs;
+        retired_configs = node->next;
+        if (node->config)
+        {
+            config_clear (node->config);
+            if (node->config != &_current_configuration)
+                free (node->config);
+        }
+        if (node->xmlstr)
+            xmlFree (node->xmlstr);
+        free (node);
+    }
+    thread_rwlock_unlock(&(_locks.config_lock));
     release_locks();
 }
 
@@ -374,6 +419,7 @@ static void config_clear_mount (mount_proxy *mount)
     if (mount->type)        xmlFree (mount->type);
     if (mount->subtype)     xmlFree (mount->subtype);
     if (mount->charset)     xmlFree (mount->charset);
+    if (mount->ts_drop_pids) xmlFree (mount->ts_drop_pids);
     if (mount->cluster_password) xmlFree (mount->cluster_password);
     if (mount->redirect)            xmlFree (mount->redirect);
 
@@ -450,6 +496,7 @@ void config_clear(ice_config_t *c)
     if (c->key_file) xmlFree(c->key_file);
     if (c->cipher_list) xmlFree(c->cipher_list);
     if (c->pidfile) xmlFree(c->pidfile);
+    if (c->handover_socket) xmlFree(c->handover_socket);
     if (c->banfile) xmlFree(c->banfile);
     if (c->allowfile) xmlFree (c->allowfile);
     if (c->agentfile) xmlFree (c->agentfile);
@@ -486,6 +533,7 @@ void config_clear(ice_config_t *c)
     while (c->redirect_hosts)
         c->redirect_hosts = config_clear_redirect (c->redirect_hosts);
 
+    free (c->mount_index);
     avl_tree_free (c->mounts_tree, config_clear_mount_from_tree);
     while (c->mounts)
     {
@@ -493,6 +541,7 @@ void config_clear(ice_config_t *c)
         c->mounts = to_go->next;
         config_clear_mount (to_go);
     }
+    free (c->alias_index);
     alias = c->aliases;
     while(alias) {
         nextalias = alias->next;
@@ -576,34 +625,125 @@ ice_config_locks *config_locks(void)
     return &_locks;
 }
 
+
+static void config_retire_scan (void)
+{
+    retired_config_t *node, **trail = &retired_configs;
+
+    while ((node = *trail))
+    {
+        if (node->config == NULL || __atomic_load_n (&node->config->snapshot_refs, __ATOMIC_ACQUIRE) == 0)
+        {
+            if (node->seen_idle)
+            {
+                *trail = node->next;
+                if (node->config)
+                {
+                    config_clear (node->config);
+                    if (node->config != &_current_configuration)
+                        free (node->config);
+                }
+                if (node->xmlstr)
+                    xmlFree (node->xmlstr);
+                free (node);
+                continue;
+            }
+            node->seen_idle = 1;
+        }
+        trail = &node->next;
+    }
+}
+
+
+static void config_retire (ice_config_t *config, char *xmlstr)
+{
+    retired_config_t *node = calloc (1, sizeof (*node));
+
+    node->config = config;
+    node->xmlstr = xmlstr;
+    node->next = retired_configs;
+    retired_configs = node;
+}
+
+
+/* queue a replaced xml string from the active config for freeing once
+ * readers have moved on. The config write lock is expected to be held
+ */
+void config_retire_xmlstr (char *str)
+{
+    if (str)
+        config_retire (NULL, str);
+}
+
+
 void config_release_config(void)
 {
-    thread_rwlock_unlock(&(_locks.config_lock));
+    if (held_depth > 0)
+    {
+        ice_config_t *config = held_configs [--held_depth];
+
+        if (config)
+            __atomic_sub_fetch (&config->snapshot_refs, 1, __ATOMIC_RELEASE);
+        else
+            thread_rwlock_unlock (&(_locks.config_lock));    /* writer grab */
+    }
 }
 
 ice_config_t *config_get_config(void)
 {
-    thread_rwlock_rlock(&(_locks.config_lock));
-    return &_current_configuration;
+    for (;;)
+    {
+        ice_config_t *config = __atomic_load_n (&_active_config, __ATOMIC_ACQUIRE);
+
+        __atomic_add_fetch (&config->snapshot_refs, 1, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n (&_active_config, __ATOMIC_ACQUIRE) == config)
+        {
+            if (held_depth >= CONFIG_HELD_DEPTH)
+            {
+                /* an unrecorded hold cannot be paired up on release, the
+                 * accounting would free a snapshot still in use */
+                ERROR1 ("config held more than %d deep, nesting bug", CONFIG_HELD_DEPTH);
+                abort ();
+            }
+            held_configs [held_depth++] = config;
+            return config;
+        }
+        /* swapped from under us, let the new snapshot settle and retry */
+        __atomic_sub_fetch (&config->snapshot_refs, 1, __ATOMIC_RELEASE);
+    }
 }
 
 ice_config_t *config_grab_config(void)
 {
     thread_rwlock_wlock(&(_locks.config_lock));
-    return &_current_configuration;
+    if (held_depth >= CONFIG_HELD_DEPTH)
+    {
+        ERROR1 ("config held more than %d deep, nesting bug", CONFIG_HELD_DEPTH);
+        abort ();
+    }
+    held_configs [held_depth++] = NULL;     /* writer marker */
+    return _active_config;
 }
 
-/* MUST be called with the lock held! */
-void config_set_config (ice_config_t *new_config, ice_config_t *old_config)
+/* MUST be called with the config write lock held (config_grab_config). The
+ * new settings go out as a fresh snapshot, the one being replaced is retired
+ * until the last reader holding it lets go
+ */
+void config_set_config (ice_config_t *new_config)
 {
-    if (old_config)
-        memcpy (old_config, &_current_configuration, sizeof(ice_config_t));
-    memcpy(&_current_configuration, new_config, sizeof(ice_config_t));
+    ice_config_t *snapshot = malloc (sizeof (ice_config_t));
+    ice_config_t *old = _active_config;
+
+    memcpy (snapshot, new_config, sizeof(ice_config_t));
+    snapshot->snapshot_refs = 0;
+    config_retire_scan ();
+    __atomic_store_n (&_active_config, snapshot, __ATOMIC_RELEASE);
+    config_retire (old, NULL);
 }
 
 ice_config_t *config_get_config_unlocked(void)
 {
-    return &_current_configuration;
+    return _active_config;
 }
 
 
@@ -627,6 +767,8 @@ static void _set_defaults(ice_config_t *configuration)
     configuration->source_limit = CONFIG_DEFAULT_SOURCE_LIMIT;
     configuration->queue_size_limit = CONFIG_DEFAULT_QUEUE_SIZE_LIMIT;
     configuration->workers_count = 1;
+    configuration->accept_threads = 1;
+    configuration->ssl_session_cache = 8192;
     configuration->client_timeout = CONFIG_DEFAULT_CLIENT_TIMEOUT;
     configuration->header_timeout = CONFIG_DEFAULT_HEADER_TIMEOUT;
     configuration->source_timeout = CONFIG_DEFAULT_SOURCE_TIMEOUT;
@@ -782,6 +924,8 @@ static int _parse_accesslog (xmlNodePtr node, void *arg)
         return 2;
     if (type && strcmp (type, "CLF-ESC") == 0)
         log->type = LOG_ACCESS_CLF_ESC;
+    if (type && strcmp (type, "binary") == 0)
+        log->type = LOG_ACCESS_BIN;
     xmlFree (type);
     return 0;
 }
@@ -979,6 +1123,7 @@ static int _parse_paths (xmlNodePtr node, void *arg)
         { "x-forwarded-for",parse_xforward, &config->xforward },
         { "mime-types",     config_get_str, &config->mimetypes_fn },
         { "pidfile",        config_get_str, &config->pidfile },
+        { "handover-socket", config_get_str, &config->handover_socket },
         { "banfile",        config_get_str, &config->banfile },
         { "ban-file",       config_get_str, &config->banfile },
         { "deny-ip",        config_get_str, &config->banfile },
@@ -1072,6 +1217,12 @@ static int _parse_mount (xmlNodePtr node, void *arg)
         { "mp3-metadata-interval",
                                 config_get_int,     &mount->mp3_meta_interval },
         { "ogg-passthrough",    config_get_bool,    &mount->ogg_passthrough },
+        { "raw-passthrough",    config_get_bool,    &mount->raw_passthrough },
+        { "hls",                config_get_bool,    &mount->hls },
+        { "hls-segment-length", config_get_int,     &mount->hls_segment_length },
+        { "hls-segment-count",  config_get_int,     &mount->hls_segment_count },
+        { "audio-meter",        config_get_bool,    &mount->audio_meter },
+        { "ts-drop-pids",       config_get_str,     &mount->ts_drop_pids },
         { "admin_comments_only",config_get_bool,    &mount->admin_comments_only },
         { "allow-url-ogg-metadata",
                                 config_get_bool,    &mount->url_ogg_meta },
@@ -1079,6 +1230,10 @@ static int _parse_mount (xmlNodePtr node, void *arg)
         { "ban-client",         config_get_int,     &mount->ban_client },
         { "intro-skip-replay",  config_get_int,     &mount->intro_skip_replay },
         { "so-sndbuf",          config_get_int,     &mount->so_sndbuf },
+        { "so-zerocopy",        config_get_bool,    &mount->so_zerocopy },
+        { "notsent-lowat",      config_get_int,     &mount->notsent_lowat },
+        { "pace-sends",         config_get_bool,    &mount->pace_sends },
+        { "worker-affinity",    config_get_int,     &mount->worker_affinity },
         { "hidden",             config_get_bool,    &mount->hidden },
         { "authentication",     auth_get_authenticator, &mount->auth },
         { "on-connect",         config_get_str,     &mount->on_connect },
@@ -1118,6 +1273,8 @@ static int _parse_mount (xmlNodePtr node, void *arg)
     mount->access_log.log_ip = 1;
     mount->fallback_override = 1;
     mount->max_send_size = 0;
+    mount->hls_segment_length = 4;
+    mount->hls_segment_count = 5;
     mount->preroll_log.logid = -1;
     mount->preroll_log.display = 50;
     mount->preroll_log.archive = -1;
@@ -1157,6 +1314,21 @@ static int _parse_mount (xmlNodePtr node, void *arg)
 
     if (config_mount_template (mount->mountname))
     {
+        const char *name = mount->mountname;
+
+        /* classify the pattern once, backslash forces the generic path as
+         * it may escape what looks like a metacharacter */
+        mount->pattern_lit = strcspn (name, "*?[$\\");
+        if (name [mount->pattern_lit] == '*' && name [mount->pattern_lit+1] == '\0')
+            mount->pattern_kind = MOUNT_PAT_PREFIX;
+        else if (mount->pattern_lit == 0 && name[0] == '*' &&
+                strcspn (name+1, "*?[$\\") == strlen (name+1))
+        {
+            mount->pattern_kind = MOUNT_PAT_SUFFIX;
+            mount->pattern_lit = strlen (name+1);
+        }
+        else
+            mount->pattern_kind = MOUNT_PAT_GENERIC;
         // may need some priority order imposed at some point
         mount->next = config->mounts;
         config->mounts = mount;
@@ -1213,7 +1385,7 @@ static int _parse_relay (xmlNodePtr node, void *arg)
     ice_config_t *config = arg;
     relay_server *relay = calloc(1, sizeof(relay_server));
     relay_server_host *host = calloc (1, sizeof (relay_server_host));
-    int on_demand = config->on_demand, icy_metadata = 1, running = 1;
+    int on_demand = config->on_demand, icy_metadata = 1, running = 1, hot_standby = 0;
 
     struct cfg_tag icecast_tags[] =
     {
@@ -1227,6 +1399,7 @@ static int _parse_relay (xmlNodePtr node, void *arg)
         { "timeout",                    config_get_int,     &host->timeout },
         { "local-mount",                config_get_str,     &relay->localmount },
         { "on-demand",                  config_get_bool,    &on_demand },
+        { "hot-standby",                config_get_bool,    &hot_standby },
         { "run-on",                     config_get_int,     &relay->run_on },
         { "retry-delay",                config_get_int,     &relay->interval },
         { "relay-icy-metadata",         config_get_bool,    &icy_metadata },
@@ -1252,6 +1425,7 @@ static int _parse_relay (xmlNodePtr node, void *arg)
             return -1;
 
         if (on_demand)      relay->flags |= RELAY_ON_DEMAND;
+        if (hot_standby)    relay->flags |= RELAY_HOT_STANDBY;
         if (icy_metadata)   relay->flags |= RELAY_ICY_META;
         if (running)        relay->flags |= RELAY_RUNNING;
 
@@ -1326,7 +1500,13 @@ static int _parse_limits (xmlNodePtr node, void *arg)
         { "queue-size",     config_get_qsizing, &config->queue_size_limit },
         { "min-queue-size", config_get_qsizing, &config->min_queue_size },
         { "burst-size",     config_get_qsizing, &config->burst_size },
+        { "fserve-cache-size", config_get_qsizing, &config->fserve_cache_limit },
+        { "stream-memory-limit", config_get_bitrate, &config->stream_mem_limit },
         { "workers",        config_get_int,     &config->workers_count },
+        { "io-uring",       config_get_bool,    &config->workers_uring },
+        { "hugepages",      config_get_bool,    &config->hugepages },
+        { "accept-threads", config_get_int,     &config->accept_threads },
+        { "ssl-session-cache", config_get_int,  &config->ssl_session_cache },
         { "client-timeout", config_get_int,     &config->client_timeout },
         { "header-timeout", config_get_int,     &config->header_timeout },
         { "source-timeout", config_get_int,     &config->source_timeout },
@@ -1337,6 +1517,9 @@ static int _parse_limits (xmlNodePtr node, void *arg)
         return -1;
     if (config->workers_count < 1)   config->workers_count = 1;
     if (config->workers_count > 400) config->workers_count = 400;
+    if (config->accept_threads < 1)  config->accept_threads = 1;
+    if (config->accept_threads > 16) config->accept_threads = 16;
+    if (config->ssl_session_cache < 0) config->ssl_session_cache = 0;
     return 0;
 }
 
@@ -1501,38 +1684,157 @@ static int _parse_root (xmlNodePtr node, ice_config_t *config)
     }
     if (config->master_update_interval < 2)
         config->master_update_interval = 60;
+    config_mount_index_build (config);
+    config_alias_index_build (config);
     return 0;
 }
 
 
+static unsigned int config_mount_hash (const char *mount)
+{
+    unsigned int hash = 5381;
+
+    while (*mount)
+        hash = ((hash << 5) + hash) ^ (unsigned char)*mount++;
+    return hash;
+}
+
+
+/* exact mount lookups are a single probe of this hash, built once the full
+ * set of mounts is known. djb2 on the name, linear probe on collision
+ */
+static void config_mount_index_build (ice_config_t *config)
+{
+    unsigned int size = 16, mask;
+    avl_node *node;
+
+    while (size < config->mounts_tree->length * 2)
+        size <<= 1;
+    config->mount_index = calloc (size, sizeof (mount_proxy *));
+    config->mount_index_size = size;
+    mask = size - 1;
+    for (node = avl_get_first (config->mounts_tree); node; node = avl_get_next (node))
+    {
+        mount_proxy *mount = (mount_proxy *)node->key;
+        unsigned int idx = config_mount_hash (mount->mountname) & mask;
+
+        while (config->mount_index [idx])
+            idx = (idx + 1) & mask;
+        config->mount_index [idx] = mount;
+    }
+}
+
+
+/* same single-probe treatment for the aliases, which installs carrying
+ * hundreds of legacy URLs otherwise walk on every connect. Entries sharing a
+ * uri keep their list order along the probe sequence, so the port and
+ * bind-address qualifiers still resolve first match wins
+ */
+static void config_alias_index_build (ice_config_t *config)
+{
+    unsigned int count = 0, size = 16, mask;
+    aliases *alias;
+
+    for (alias = config->aliases; alias; alias = alias->next)
+        count++;
+    if (count == 0)
+        return;
+    while (size < count * 2)
+        size <<= 1;
+    config->alias_index = calloc (size, sizeof (aliases *));
+    config->alias_index_size = size;
+    mask = size - 1;
+    for (alias = config->aliases; alias; alias = alias->next)
+    {
+        unsigned int idx = config_mount_hash (alias->source) & mask;
+
+        while (config->alias_index [idx])
+            idx = (idx + 1) & mask;
+        config->alias_index [idx] = alias;
+    }
+}
+
+
+/* return the first alias matching the request uri and originating socket,
+ * a single hash probe rather than a walk of the full list */
+aliases *config_find_alias (ice_config_t *config, const char *uri, int port, const char *bind)
+{
+    if (config->alias_index_size)
+    {
+        unsigned int mask = config->alias_index_size - 1;
+        unsigned int idx = config_mount_hash (uri) & mask;
+
+        while (config->alias_index [idx])
+        {
+            aliases *alias = config->alias_index [idx];
+
+            if (strcmp (uri, alias->source) == 0 &&
+                    (alias->port == -1 || alias->port == port) &&
+                    (alias->bind_address == NULL ||
+                     (bind != NULL && strcmp (alias->bind_address, bind) == 0)))
+                return alias;
+            idx = (idx + 1) & mask;
+        }
+    }
+    return NULL;
+}
+
+
 /* return the mount details that match the supplied mountpoint */
 mount_proxy *config_find_mount (ice_config_t *config, const char *mount)
 {
+    mount_proxy *mountinfo = NULL, *template;
+    size_t mlen;
+
     if (mount == NULL)
     {
         WARN0 ("no mount name provided");
         return NULL;
     }
-    void *result;
-    mount_proxy findit, *mountinfo = NULL;
-    findit.mountname = (char *)mount;
-
-    int missing = avl_get_by_key (config->mounts_tree, &findit, &result);
-    if (missing)
+    if (config->mount_index_size)
     {
-        mount_proxy *to_return = NULL;
-        mountinfo = config->mounts;
-        while (mountinfo)
+        unsigned int mask = config->mount_index_size - 1;
+        unsigned int idx = config_mount_hash (mount) & mask;
+
+        while (config->mount_index [idx])
         {
-            if (fnmatch (mountinfo->mountname, mount, 0) == 0)
-                to_return = mountinfo;
-            mountinfo = mountinfo->next;
+            if (strcmp (config->mount_index [idx]->mountname, mount) == 0)
+                return config->mount_index [idx];
+            idx = (idx + 1) & mask;
         }
-        if (mountinfo == NULL)
-            mountinfo = to_return;
     }
     else
-        mountinfo = result;
+    {   /* index not built yet, eg during parsing */
+        void *result;
+        mount_proxy findit;
+        findit.mountname = (char *)mount;
+
+        if (avl_get_by_key (config->mounts_tree, &findit, &result) == 0)
+            return result;
+    }
+    /* no exact entry, try the templates. last match wins as before */
+    mlen = strlen (mount);
+    for (template = config->mounts; template; template = template->next)
+    {
+        switch (template->pattern_kind)
+        {
+            case MOUNT_PAT_PREFIX:
+                if (strncmp (mount, template->mountname, template->pattern_lit) == 0)
+                    mountinfo = template;
+                break;
+            case MOUNT_PAT_SUFFIX:
+                if (mlen >= template->pattern_lit &&
+                        strcmp (mount + (mlen - template->pattern_lit), template->mountname + 1) == 0)
+                    mountinfo = template;
+                break;
+            default:
+                if (template->pattern_lit && strncmp (mount, template->mountname, template->pattern_lit) != 0)
+                    break;      /* leading literal cannot match, skip the fnmatch */
+                if (fnmatch (template->mountname, mount, 0) == 0)
+                    mountinfo = template;
+                break;
+        }
+    }
     return mountinfo;
 }
 
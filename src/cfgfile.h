@@ -37,6 +37,8 @@ typedef struct _redirect_host
     time_t next_update;
     char *server;
     int port;
+    long listeners;     /* listener count last reported by the slave */
+    long kbps_free;     /* bandwidth headroom reported, -1 when unknown */
 } redirect_host;
 
 
@@ -56,6 +58,7 @@ typedef struct access_log
 
 #define LOG_ACCESS_CLF                  0
 #define LOG_ACCESS_CLF_ESC              1
+#define LOG_ACCESS_BIN                  2
 
 typedef struct error_log
 {
@@ -94,9 +97,18 @@ typedef struct _config_options {
     struct _config_options *next;
 } config_options_t;
 
+/* pattern classification of a template mountname, set at parse time so the
+ * per-lookup walk avoids fnmatch for the common anchored forms */
+#define MOUNT_PAT_PREFIX    1   /* "literal*" */
+#define MOUNT_PAT_SUFFIX    2   /* "*literal" */
+#define MOUNT_PAT_GENERIC   3   /* anything else, full fnmatch */
+
 typedef struct _mount_proxy {
     char *mountname; /* The mountpoint this proxy is used for */
 
+    int pattern_kind;           /* MOUNT_PAT_*, templates only */
+    unsigned int pattern_lit;   /* literal span length used by the fast paths */
+
     char *username; /* Username and password for this mountpoint. If unset, */
     char *password; /* falls back to global source password */
 
@@ -122,6 +134,10 @@ typedef struct _mount_proxy {
     int no_mount; /* Do we permit direct requests of this mountpoint? (or only
                      indirect, through fallbacks) */
     int so_sndbuf;      /* TCP send buffer size for new clients */
+    int so_zerocopy;    /* use MSG_ZEROCOPY sends for listeners on this mount */
+    int notsent_lowat;  /* cap on kernel unsent bytes per listener socket */
+    int pace_sends;     /* spread listener sends against an absolute byte deadline */
+    int worker_affinity;    /* co-locate listeners with the source while under this count */
     uint32_t burst_size;
     uint32_t min_queue_size;     /* minimum length of queue */
     uint32_t queue_size_limit;
@@ -134,6 +150,12 @@ typedef struct _mount_proxy {
     int filter_theora; /* prevent theora pages getting queued */
     int url_ogg_meta; /* enable to allow updates via url requests for ogg */
     int ogg_passthrough; /* enable to prevent the ogg stream being rebuilt */
+    int raw_passthrough; /* queue the source data without any codec parsing */
+    int hls; /* enable the in-memory hls segmenter on mpeg framed mounts */
+    int hls_segment_length; /* target segment length in seconds */
+    int hls_segment_count; /* segments listed in the playlist */
+    int audio_meter; /* enable the no-decode audio level meter on mpeg framed mounts */
+    char *ts_drop_pids; /* TS PIDs to drop at ingest, comma separated */
     int admin_comments_only; /* enable to only show comments set from the admin page */
     int skip_accesslog;         /* skip logging client to access log */
     int intro_skip_replay;      /* duration to cache IPs, for intro playing */
@@ -206,6 +228,7 @@ struct _listener_t
 #define RELAY_FROM_MASTER               (1<<4)
 #define RELAY_SLAVE                     (1<<5)
 #define RELAY_IN_LIST                   (1<<6)
+#define RELAY_HOT_STANDBY               (1<<7)
 
 typedef struct _relay_server_host
 {
@@ -216,6 +239,7 @@ typedef struct _relay_server_host
     int port;
     int timeout;
     int skip;
+    int fails;      /* recent connect failures, orders startup attempts */
 } relay_server_host;
 
 
@@ -232,6 +256,14 @@ typedef struct _relay_server
     relay_server_host *hosts, *in_use;
     char *username;
     char *password;
+
+    /* hot standby state, a second established upstream kept drained so a
+     * master failure is a swap instead of a reconnect */
+    struct connection_tag *standby_con;
+    struct http_parser_tag *standby_parser;
+    relay_server_host *standby_host;
+    int standby_opening;
+    time_t standby_retry;
 } relay_server;
 
 
@@ -246,6 +278,8 @@ typedef struct
 
 typedef struct ice_config_tag
 {
+    int snapshot_refs;      /* readers holding this published snapshot */
+
     char *config_filename;
 
     char *gitversion;
@@ -256,7 +290,13 @@ typedef struct ice_config_tag
     int source_limit;
     unsigned int queue_size_limit;
     int min_queue_size;
+    uint32_t fserve_cache_limit;    /* byte budget for the file handle cache, 0 for no limit */
+    int64_t stream_mem_limit;       /* byte budget over all stream queues, 0 for no limit */
     int workers_count;
+    int workers_uring;
+    int hugepages;
+    int accept_threads;
+    int ssl_session_cache;
     uint32_t burst_size;
     int client_timeout;
     int header_timeout;
@@ -305,11 +345,14 @@ typedef struct ice_config_tag
 
     mount_proxy *mounts;
     avl_tree *mounts_tree;
+    mount_proxy **mount_index;      /* hash over mounts_tree, exact lookups */
+    unsigned int mount_index_size;  /* power of two, 0 when not built */
 
     char *server_id;
     char *base_dir;
     char *log_dir;
     char *pidfile;
+    char *handover_socket;
     char *banfile;
     char *allowfile;
     char *agentfile;
@@ -320,6 +363,8 @@ typedef struct ice_config_tag
     char *webroot_dir;
     char *adminroot_dir;
     struct _aliases *aliases;
+    aliases **alias_index;          /* hash over aliases, probed in list order */
+    unsigned int alias_index_size;  /* power of two, 0 when not built */
     unsigned slaves_count;
 
     struct access_log      access_log;
@@ -347,11 +392,13 @@ void config_shutdown(void);
 int config_parse_file(const char *filename, ice_config_t *configuration);
 int config_initial_parse_file(const char *filename);
 int config_parse_cmdline(int arg, char **argv);
-void config_set_config (ice_config_t *new_config, ice_config_t *old_config);
+void config_set_config (ice_config_t *new_config);
+void config_retire_xmlstr (char *str);
 listener_t *config_clear_listener (listener_t *listener);
 relay_server *config_clear_relay (relay_server *relay);
 void config_clear(ice_config_t *config);
 mount_proxy *config_find_mount (ice_config_t *config, const char *mount);
+aliases *config_find_alias (ice_config_t *config, const char *uri, int port, const char *bind);
 void config_xml_parse_failure (void*x,  xmlErrorPtr error);
 int config_qsizing_conv_a2n (const char *str, uint32_t *p);
 
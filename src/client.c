@@ -23,11 +23,47 @@
 #include <config.h>
 #endif
 
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* for pthread_setaffinity_np */
+#endif
+#include <sched.h>
+#include <pthread.h>
+#include <stdio.h>
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
 
+#include "compat.h"
+
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_KQUEUE
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef HAVE_MSG_ZEROCOPY
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif
+
 #include "thread/thread.h"
 #include "avl/avl.h"
 #include "httpp/httpp.h"
@@ -50,14 +86,115 @@
 #undef CATMODULE
 #define CATMODULE "client"
 
+#ifdef HAVE_IO_URING
+/* completion context for one queued send. Holds its own reference on the
+ * buffer so the data stays valid even if the client goes away first.
+ */
+struct uring_node
+{
+    client_t *client;
+    refbuf_t *refbuf;
+};
+#endif
+
+#ifdef HAVE_MSG_ZEROCOPY
+/* one entry per MSG_ZEROCOPY send the kernel still owns pages from. The
+ * buffer reference stops the refbuf being recycled until the completion
+ * notification covering its sequence number arrives on the error queue.
+ */
+struct zc_node
+{
+    struct zc_node *next;
+    uint32_t seq;
+    refbuf_t *refbuf;
+};
+static void client_zc_drain (client_t *client);
+#endif
+
 int worker_count = 0, worker_min_count;
-worker_t *worker_balance_to_check, *worker_least_used, *worker_incoming = NULL;
+worker_t *worker_least_used, *worker_most_used, *worker_incoming = NULL;
+worker_t *worker_admin = NULL;      /* management traffic, kept off the streaming pool */
+
+#define WORKER_MAX_NODES    8
+static worker_t *worker_least_used_by_node [WORKER_MAX_NODES];
 
 FD_t logger_fd[2];
 
+/* recycled client structures, chained on next_on_worker. Saves a trip to the
+ * allocator per connection which adds up at high accept rates.
+ */
+#define CLIENT_POOL_MAX     4096
+
+static spin_t client_pool_lock;
+static client_t *client_pool;
+static int client_pool_count;
+
 static void logger_commits (int id);
 
 
+void client_pool_init (void)
+{
+    thread_spin_create (&client_pool_lock);
+    thread_spin_register (&client_pool_lock, "client_pool");
+}
+
+
+void client_pool_shutdown (void)
+{
+    client_t *client;
+
+    thread_spin_lock (&client_pool_lock);
+    client = client_pool;
+    client_pool = NULL;
+    client_pool_count = 0;
+    thread_spin_unlock (&client_pool_lock);
+    while (client)
+    {
+        client_t *to_go = client;
+        client = client->next_on_worker;
+        free (to_go);
+    }
+    thread_spin_destroy (&client_pool_lock);
+}
+
+
+client_t *client_create (void)
+{
+    client_t *client;
+
+    thread_spin_lock (&client_pool_lock);
+    client = client_pool;
+    if (client)
+    {
+        client_pool = client->next_on_worker;
+        client_pool_count--;
+        thread_spin_unlock (&client_pool_lock);
+        memset (client, 0, sizeof (*client));
+        return client;
+    }
+    thread_spin_unlock (&client_pool_lock);
+    return calloc (1, sizeof (client_t));
+}
+
+
+void client_free (client_t *client)
+{
+    if (client == NULL)
+        return;
+    thread_spin_lock (&client_pool_lock);
+    if (client_pool_count < CLIENT_POOL_MAX)
+    {
+        client->next_on_worker = client_pool;
+        client_pool = client;
+        client_pool_count++;
+        thread_spin_unlock (&client_pool_lock);
+        return;
+    }
+    thread_spin_unlock (&client_pool_lock);
+    free (client);
+}
+
+
 void client_register (client_t *client)
 {
     if (client)
@@ -94,6 +231,18 @@ void client_destroy(client_t *client)
         WARN0 ("client still on worker thread");
         return;
     }
+#ifdef HAVE_IO_URING
+    if (client->uring_node)
+    {   /* detach, the completion just drops its buffer reference */
+        struct uring_node *node = client->uring_node;
+        client->uring_node = NULL;
+        __atomic_store_n (&node->client, NULL, __ATOMIC_RELEASE);
+    }
+#endif
+#ifdef HAVE_MSG_ZEROCOPY
+    if (client->zc_list)
+        client_zc_drain (client);
+#endif
     /* release the buffer now, as the buffer could be on the source queue
      * and may of disappeared after auth completes */
     if (client->refbuf)
@@ -145,19 +294,25 @@ void client_destroy(client_t *client)
         global_unlock ();
         connection_close (&client->connection);
 
-        free(client);
+        if (client->pending)
+            refbuf_release (client->pending);
+        client->pending = NULL;
+        client_free (client);
         return;
     }
     global_unlock ();
     DEBUG1 ("keepalive detected on %s, placing back onto worker", client->connection.ip);
     if (not_ssl_connection (&client->connection))
         sock_set_cork (client->connection.sock, 1);    // reenable cork for the next go around
-    client->counter = client->schedule_ms = timing_get_time();
+    client->counter = client->schedule_ms = timing_cached_time();
     connection_reset (&client->connection, client->schedule_ms);
 
     client->ops = &http_request_ops;
     client->flags = CLIENT_ACTIVE;
-    client->shared_data = NULL;
+    /* a pipelined request may of arrived with the last one, push it straight
+     * back in as if just read so the reparse can start without waiting */
+    client->shared_data = client->pending;
+    client->pending = NULL;
     client->refbuf = NULL;
     client->pos = 0;
     client->intro_offset = 0;
@@ -214,9 +369,9 @@ int client_send_302(client_t *client, const char *location)
     char body [4096];
 
     client_set_queue (client, NULL);
-    client->refbuf = refbuf_new (PER_CLIENT_REFBUF_SIZE);
     len = snprintf (body, sizeof body, "Moved <a href=\"%s\">here</a>\r\n", location);
-    len = snprintf (client->refbuf->data, PER_CLIENT_REFBUF_SIZE,
+    client->refbuf = refbuf_new (len + strlen (location) + 128);
+    len = snprintf (client->refbuf->data, client->refbuf->alloc_len,
             "HTTP/1.0 302 Temporarily Moved\r\n"
             "Content-Type: text/html\r\n"
             "Content-Length: %d\r\n"
@@ -232,8 +387,8 @@ int client_send_302(client_t *client, const char *location)
 int client_send_400(client_t *client, const char *message)
 {
     client_set_queue (client, NULL);
-    client->refbuf = refbuf_new (PER_CLIENT_REFBUF_SIZE);
-    snprintf (client->refbuf->data, PER_CLIENT_REFBUF_SIZE,
+    client->refbuf = refbuf_new ((message ? strlen (message) : 0) + 128);
+    snprintf (client->refbuf->data, client->refbuf->alloc_len,
             "HTTP/1.0 400 Bad Request\r\n"
             "Content-Type: text/html\r\n\r\n"
             "<b>%s</b>\r\n", message?message:"");
@@ -271,8 +426,8 @@ int client_send_403(client_t *client, const char *reason)
     if (reason == NULL)
         reason = "Forbidden";
     client_set_queue (client, NULL);
-    client->refbuf = refbuf_new (PER_CLIENT_REFBUF_SIZE);
-    snprintf (client->refbuf->data, PER_CLIENT_REFBUF_SIZE,
+    client->refbuf = refbuf_new (strlen (reason) + 128);
+    snprintf (client->refbuf->data, client->refbuf->alloc_len,
             "HTTP/1.0 403 %s\r\n"
             "Content-Type: text/html\r\n\r\n", reason);
     client->respcode = 403;
@@ -313,8 +468,8 @@ int client_send_404 (client_t *client, const char *message)
         if (client->parser->req_type == httpp_req_head || message == NULL)
             message = "Not Available";
         ret = strlen (message);
-        client->refbuf = refbuf_new (PER_CLIENT_REFBUF_SIZE);
-        snprintf (client->refbuf->data, PER_CLIENT_REFBUF_SIZE,
+        client->refbuf = refbuf_new (ret + 192);
+        snprintf (client->refbuf->data, client->refbuf->alloc_len,
                 "HTTP/1.0 404 Not Available\r\n"
                 "%s\r\nContent-Length: %d\r\nContent-Type: text/html\r\n\r\n"
                 "%s", client_keepalive_header (client), ret,
@@ -330,8 +485,8 @@ int client_send_404 (client_t *client, const char *message)
 int client_send_416(client_t *client)
 {
     client_set_queue (client, NULL);
-    client->refbuf = refbuf_new (PER_CLIENT_REFBUF_SIZE);
-    snprintf (client->refbuf->data, PER_CLIENT_REFBUF_SIZE,
+    client->refbuf = refbuf_new (100);
+    snprintf (client->refbuf->data, client->refbuf->alloc_len,
             "HTTP/1.0 416 Request Range Not Satisfiable\r\n\r\n");
     client->respcode = 416;
     client->refbuf->len = strlen (client->refbuf->data);
@@ -342,8 +497,8 @@ int client_send_416(client_t *client)
 int client_send_501(client_t *client)
 {
     client_set_queue (client, NULL);
-    client->refbuf = refbuf_new (PER_CLIENT_REFBUF_SIZE);
-    snprintf (client->refbuf->data, PER_CLIENT_REFBUF_SIZE,
+    client->refbuf = refbuf_new (100);
+    snprintf (client->refbuf->data, client->refbuf->alloc_len,
             "HTTP/1.0 501 Not Implemented\r\n\r\n");
     client->respcode = 501;
     client->refbuf->len = strlen (client->refbuf->data);
@@ -371,13 +526,15 @@ int client_add_cors (client_t *client, char *buf, int remain)
 
 int client_send_options(client_t *client)
 {
+    const char *origin = httpp_getvar (client->parser, "origin");
+
     client_set_queue (client, NULL);
-    client->refbuf = refbuf_new (PER_CLIENT_REFBUF_SIZE);
+    client->refbuf = refbuf_new ((origin ? strlen (origin) : 0) + 384);
     char *ptr = client->refbuf->data;
-    int bytes = snprintf (ptr, PER_CLIENT_REFBUF_SIZE,
+    int bytes = snprintf (ptr, client->refbuf->alloc_len,
             "HTTP/1.1 200 OK\r\n"
             "Connection: Keep-alive\r\n");
-    client_add_cors (client, ptr+bytes, PER_CLIENT_REFBUF_SIZE-bytes);
+    client_add_cors (client, ptr+bytes, client->refbuf->alloc_len - bytes);
     client->respcode = 200;
     client->refbuf->len = strlen (client->refbuf->data);
     return fserve_setup_client (client);
@@ -385,6 +542,109 @@ int client_send_options(client_t *client)
 
 
 /* helper function for sending the data to a client */
+#ifdef HAVE_MSG_ZEROCOPY
+/* pull zerocopy completions off the socket error queue. Each notification
+ * covers a range of send counters, so drop every pinned buffer up to the
+ * high end of the range.
+ */
+static void client_zc_reap (client_t *client)
+{
+    struct zc_node *node;
+
+    if (client->zc_list == NULL)
+        return;
+    while (1)
+    {
+        char control [100];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof control };
+        struct cmsghdr *cm;
+
+        if (recvmsg (client->connection.sock, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) < 0)
+            break;
+        for (cm = CMSG_FIRSTHDR (&msg); cm; cm = CMSG_NXTHDR (&msg, cm))
+        {
+            struct sock_extended_err *serr = (void *)CMSG_DATA (cm);
+
+            if ((cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) &&
+                    (cm->cmsg_level != SOL_IPV6 || cm->cmsg_type != IPV6_RECVERR))
+                continue;
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            while ((node = client->zc_list) && (int32_t)(serr->ee_data - node->seq) >= 0)
+            {
+                client->zc_list = node->next;
+                refbuf_release (node->refbuf);
+                free (node);
+            }
+        }
+    }
+}
+
+
+/* drop all outstanding zerocopy references at teardown. The socket is going
+ * away so the kernel keeps its own page pins for anything still in flight.
+ */
+static void client_zc_drain (client_t *client)
+{
+    struct zc_node *node;
+
+    client_zc_reap (client);
+    while ((node = client->zc_list))
+    {
+        client->zc_list = node->next;
+        refbuf_release (node->refbuf);
+        free (node);
+    }
+    client->flags &= ~CLIENT_ZEROCOPY;
+}
+
+
+/* MSG_ZEROCOPY variant of the plain socket send. Returns -2 when the caller
+ * should use the normal copying path instead, otherwise behaves like
+ * client_send_bytes with the refbuf held until the kernel confirms the pages
+ * are done with.
+ */
+int client_send_zc (client_t *client, refbuf_t *refbuf, const void *buf, unsigned len)
+{
+    struct zc_node *node, **trail;
+    int ret;
+
+    if ((client->flags & CLIENT_ZEROCOPY) == 0 || not_ssl_connection (&client->connection) == 0)
+        return -2;
+    if (len < 4096)
+        return -2;      // the kernel copies small sends anyway, skip the bookkeeping
+    client_zc_reap (client);
+    node = malloc (sizeof (*node));
+    if (node == NULL)
+        return -2;
+    ret = send (client->connection.sock, buf, len, MSG_DONTWAIT|MSG_NOSIGNAL|MSG_ZEROCOPY);
+    if (ret < 0)
+    {
+        free (node);
+        if (errno == ENOBUFS)
+            return -2;  // optmem/pinning limit hit, send this one with a copy
+        if (sock_recoverable (sock_error()))
+            return -1;
+        client->connection.error = 1;
+        return -1;
+    }
+    if (client->zc_seq == 0)
+        DEBUG2 ("zerocopy sends active for %"PRIu64 " on %s", client->connection.id, client->mount);
+    node->next = NULL;
+    node->seq = client->zc_seq++;
+    node->refbuf = refbuf;
+    refbuf_addref (refbuf);
+    for (trail = (struct zc_node **)&client->zc_list; *trail; trail = &(*trail)->next)
+        ;
+    *trail = node;
+    if (client->connection.sent_bytes == 0)
+        connection_first_byte (&client->connection);
+    client->connection.sent_bytes += ret;
+    return ret;
+}
+#endif
+
+
 int client_send_bytes (client_t *client, const void *buf, unsigned len)
 {
     int (*con_send)(struct connection_tag *handle, const void *buf, size_t len) = connection_send;
@@ -463,20 +723,69 @@ int is_worker_incoming (worker_t *w)
     return (w == worker_incoming) ? 1 : 0;
 }
 
+int is_worker_admin (worker_t *w)
+{
+    return (w == worker_admin) ? 1 : 0;
+}
+
 static uint64_t worker_check_time_ms (worker_t *worker)
 {
-    uint64_t tm = timing_get_time();
+    uint64_t tm = timing_refresh_time();
     if (tm - worker->time_ms > 1000 && worker->time_ms)
         WARN2 ("worker %p has been stuck for %" PRIu64 " ms", worker, (tm - worker->time_ms));
     return tm;
 }
 
 
+/* package id of the given cpu, used as a cheap NUMA node approximation */
+static int worker_cpu_node (int cpu)
+{
+    int node = 0;
+#ifdef __linux__
+    char path [80];
+    FILE *f;
+
+    snprintf (path, sizeof path,
+            "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+    f = fopen (path, "r");
+    if (f)
+    {
+        if (fscanf (f, "%d", &node) != 1 || node < 0)
+            node = 0;
+        fclose (f);
+    }
+#endif
+    return node;
+}
+
+
+static void worker_set_affinity (worker_t *worker)
+{
+#ifdef __linux__
+    if (worker->cpu >= 0)
+    {
+        cpu_set_t set;
+
+        CPU_ZERO (&set);
+        CPU_SET (worker->cpu, &set);
+        if (pthread_setaffinity_np (pthread_self(), sizeof set, &set) == 0)
+            INFO3 ("worker %p pinned to cpu %d (node %d)", worker, worker->cpu, worker->node);
+        else
+            WARN2 ("failed to pin worker %p to cpu %d", worker, worker->cpu);
+    }
+#endif
+}
+
+
 static worker_t *find_least_busy_handler (int log)
 {
-    worker_t *min = workers;
-    int min_count = INT_MAX;
+    worker_t *min = workers, *max = workers;
+    int min_count = INT_MAX, max_count = -1;
 
+    int node_count [WORKER_MAX_NODES];
+
+    for (int i = 0; i < WORKER_MAX_NODES; i++)
+        node_count [i] = INT_MAX;
     if (workers && workers->next)
     {
         worker_t *handler = workers;
@@ -484,8 +793,9 @@ static worker_t *find_least_busy_handler (int log)
         while (handler)
         {
             thread_spin_lock (&handler->lock);
-            int cur_count = handler->count + handler->pending_count;
+            int cur_count = handler->count;
             thread_spin_unlock (&handler->lock);
+            cur_count += __atomic_load_n (&handler->pending_count, __ATOMIC_RELAXED);
 
             if (log) DEBUG2 ("handler %p has %d clients", handler, cur_count);
             if (cur_count < min_count)
@@ -493,10 +803,22 @@ static worker_t *find_least_busy_handler (int log)
                 min = handler;
                 min_count = cur_count;
             }
+            if (cur_count > max_count)
+            {
+                max = handler;
+                max_count = cur_count;
+            }
+            int node = handler->node & (WORKER_MAX_NODES-1);
+            if (cur_count < node_count [node])
+            {
+                node_count [node] = cur_count;
+                worker_least_used_by_node [node] = handler;
+            }
             handler = handler->next;
         }
         worker_min_count = min_count;
     }
+    worker_most_used = max;
     return min;
 }
 
@@ -507,14 +829,583 @@ worker_t *worker_selected (void)
 }
 
 
-/* worker mutex should be already locked */
+/* preferred destination when shedding clients. A worker that has asked to
+ * steal from us takes priority over the generally least used one.
+ * workers_lock must be at least read locked.
+ */
+worker_t *worker_preferred (worker_t *from)
+{
+    if (from && from->move_dest && from->move_dest->running)
+        return from->move_dest;
+    return worker_least_used;
+}
+
+
+/* as worker_preferred, but biased toward workers on the same NUMA node so a
+ * source and the bulk of its listeners avoid cross-socket traffic.
+ */
+worker_t *worker_preferred_on_node (worker_t *from)
+{
+    if (from)
+    {
+        worker_t *w = from->move_dest;
+
+        if (w && w->running && w->node == from->node)
+            return w;
+        w = worker_least_used_by_node [from->node & (WORKER_MAX_NODES-1)];
+        if (w && w->running)
+            return w;
+    }
+    return worker_least_used;
+}
+
+
+/* take the client out of whichever wheel slot or parked list it is on */
+static void worker_wheel_unlink (client_t *client)
+{
+    if (client->wheel_prevp)
+    {
+        *client->wheel_prevp = client->wheel_next;
+        if (client->wheel_next)
+            client->wheel_next->wheel_prevp = client->wheel_prevp;
+        client->wheel_next = NULL;
+        client->wheel_prevp = NULL;
+    }
+}
+
+
+/* file the client on the worker scheduling wheel based on its schedule_ms.
+ * inactive clients are parked instead, they are owned by another thread (eg
+ * auth) and are promoted when that thread reactivates them.
+ */
+static void worker_wheel_insert (worker_t *worker, client_t *client)
+{
+    client_t **head;
+
+    if ((client->flags & CLIENT_ACTIVE) == 0)
+        head = &worker->parked;
+    else
+    {
+        uint64_t tick = client->schedule_ms >> WHEEL_SLOT_BITS;
+
+        if (tick <= worker->wheel_tick)
+            head = &worker->wheel_l0 [worker->wheel_tick & (WHEEL_L0_SLOTS-1)];
+        else if (tick - worker->wheel_tick < WHEEL_L0_SLOTS)
+            head = &worker->wheel_l0 [tick & (WHEEL_L0_SLOTS-1)];
+        else
+        {
+            uint64_t l1_tick = tick >> WHEEL_L0_BITS,
+                     l1_base = worker->wheel_tick >> WHEEL_L0_BITS;
+
+            if (l1_tick - l1_base >= WHEEL_L1_SLOTS)  /* too far out, refile on expiry */
+                l1_tick = l1_base + WHEEL_L1_SLOTS - 1;
+            head = &worker->wheel_l1 [l1_tick & (WHEEL_L1_SLOTS-1)];
+        }
+    }
+    client->wheel_next = *head;
+    if (*head)
+        (*head)->wheel_prevp = &client->wheel_next;
+    *head = client;
+    client->wheel_prevp = head;
+}
+
+
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
+
+#define WORKER_EVENTS_BATCH     128
+
+/* (re)attach the wakeup feed to the worker readiness queue. A NULL data
+ * pointer marks it apart from client entries. */
+static int worker_events_attach_pipe (worker_t *worker)
+{
+#ifdef HAVE_EPOLL
+    struct epoll_event ev;
+
+    memset (&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    return epoll_ctl (worker->event_fd, EPOLL_CTL_ADD, worker->wakeup_fd[0], &ev);
+#else
+    struct kevent ev;
+
+    EV_SET (&ev, worker->wakeup_fd[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+    return kevent (worker->event_fd, &ev, 1, NULL, 0, NULL);
+#endif
+}
+
+
+static void worker_events_init (worker_t *worker)
+{
+#ifdef HAVE_EPOLL
+    worker->event_fd = epoll_create1 (EPOLL_CLOEXEC);
+#else
+    worker->event_fd = kqueue ();
+#endif
+    if (worker->event_fd >= 0 && worker_events_attach_pipe (worker) < 0)
+    {
+        sock_close (worker->event_fd);
+        worker->event_fd = -1;
+    }
+    if (worker->event_fd < 0)
+        WARN0 ("unable to create worker readiness queue, reverting to timed scans");
+}
+
+
+/* add or remove the client socket from the worker readiness queue. Must be
+ * done before the client can be picked up by another worker or freed. */
+static void worker_monitor_client (worker_t *worker, client_t *client, int add)
+{
+    sock_t sock = client->connection.sock;
+
+    if (worker == NULL || worker->event_fd < 0 || sock == SOCK_ERROR)
+        return;
+#ifdef HAVE_EPOLL
+    if (add)
+    {
+        struct epoll_event ev;
+
+        memset (&ev, 0, sizeof ev);
+        /* edge triggered, purely as a hint to bring the schedule forward */
+        ev.events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;
+        ev.data.ptr = client;
+        if (epoll_ctl (worker->event_fd, EPOLL_CTL_ADD, sock, &ev) < 0 && errno == EEXIST)
+            epoll_ctl (worker->event_fd, EPOLL_CTL_MOD, sock, &ev);
+    }
+    else
+        epoll_ctl (worker->event_fd, EPOLL_CTL_DEL, sock, NULL);
+#else
+    struct kevent ev[2];
+    unsigned short flags = add ? EV_ADD|EV_CLEAR : EV_DELETE;
+
+    EV_SET (&ev[0], sock, EVFILT_READ, flags, 0, 0, client);
+    EV_SET (&ev[1], sock, EVFILT_WRITE, flags, 0, 0, client);
+    kevent (worker->event_fd, ev, 2, NULL, 0, NULL);
+#endif
+}
+
+
+/* wait for socket activity or the wakeup feed. clients reported ready have
+ * their schedule brought forward so the following scan processes them.
+ * returns >0 if the wakeup feed needs draining.
+ */
+static int worker_wait_for_events (worker_t *worker, int duration)
+{
+    int i, cnt, pipe_woken = 0;
+#ifdef HAVE_EPOLL
+    struct epoll_event evs [WORKER_EVENTS_BATCH];
+
+    cnt = epoll_wait (worker->event_fd, evs, WORKER_EVENTS_BATCH, duration);
+#else
+    struct kevent evs [WORKER_EVENTS_BATCH];
+    struct timespec ts;
+
+    ts.tv_sec = duration / 1000;
+    ts.tv_nsec = (duration % 1000) * 1000000;
+    cnt = kevent (worker->event_fd, NULL, 0, evs, WORKER_EVENTS_BATCH, &ts);
+#endif
+    if (cnt < 0)
+    {
+        if (errno == EINTR)
+            return 0;
+        WARN1 ("worker readiness queue failed (%d), reverting to timed scans", errno);
+        sock_close (worker->event_fd);
+        worker->event_fd = -1;
+        return 1;  /* caller drains the wakeup feed as usual */
+    }
+    for (i = 0; i < cnt; i++)
+    {
+#ifdef HAVE_EPOLL
+        client_t *client = evs[i].data.ptr;
+#else
+        client_t *client = evs[i].udata;
+#endif
+        if (client == NULL)
+        {
+            pipe_woken = 1;
+            continue;
+        }
+        if (client->flags & CLIENT_ACTIVE)
+        {   /* bring the schedule forward so the next pass picks it up */
+            worker_wheel_unlink (client);
+            client->schedule_ms = 0;
+            worker_wheel_insert (worker, client);
+        }
+    }
+    return pipe_woken;
+}
+
+#else
+
+#define worker_monitor_client(w,c,a)    do {} while(0)
+
+#endif
+
+
+#ifdef HAVE_IO_URING
+
+/* batched socket send engine. Each worker can run a small io_uring so that
+ * the sends queued during a pass go to the kernel in one io_uring_enter
+ * instead of a write syscall per client. Disabled unless <io-uring> is set
+ * in the config, and falls back to direct sends if setup fails.
+ */
+#define WORKER_URING_ENTRIES    256
+
+struct worker_uring
+{
+    int fd;
+    unsigned sq_entries, cq_entries;
+    unsigned to_submit, inflight;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+};
+
+static int worker_uring_enabled;
+
+void worker_uring_configure (int enable)
+{
+    worker_uring_enabled = enable;
+}
+
+
+static void worker_uring_init (worker_t *worker)
+{
+    struct io_uring_params p;
+    struct worker_uring *u;
+    int fd;
+
+    worker->uring = NULL;
+    if (worker_uring_enabled == 0)
+        return;
+    memset (&p, 0, sizeof p);
+    fd = (int)syscall (__NR_io_uring_setup, WORKER_URING_ENTRIES, &p);
+    if (fd < 0)
+    {
+        WARN1 ("io_uring unavailable (%s), using direct sends", strerror (errno));
+        return;
+    }
+    u = calloc (1, sizeof (*u));
+    u->fd = fd;
+    u->sq_entries = p.sq_entries;
+    u->cq_entries = p.cq_entries;
+    u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+    u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    u->sqes_sz = p.sq_entries * sizeof (struct io_uring_sqe);
+    u->sq_ring = mmap (NULL, u->sq_ring_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    u->cq_ring = mmap (NULL, u->cq_ring_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap (NULL, u->sqes_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == (void*)MAP_FAILED)
+    {
+        WARN1 ("io_uring ring mapping failed (%s), using direct sends", strerror (errno));
+        if (u->sq_ring != MAP_FAILED)   munmap (u->sq_ring, u->sq_ring_sz);
+        if (u->cq_ring != MAP_FAILED)   munmap (u->cq_ring, u->cq_ring_sz);
+        if (u->sqes != (void*)MAP_FAILED) munmap (u->sqes, u->sqes_sz);
+        close (fd);
+        free (u);
+        return;
+    }
+    u->sq_head  = (unsigned *)((char *)u->sq_ring + p.sq_off.head);
+    u->sq_tail  = (unsigned *)((char *)u->sq_ring + p.sq_off.tail);
+    u->sq_mask  = (unsigned *)((char *)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((char *)u->sq_ring + p.sq_off.array);
+    u->cq_head  = (unsigned *)((char *)u->cq_ring + p.cq_off.head);
+    u->cq_tail  = (unsigned *)((char *)u->cq_ring + p.cq_off.tail);
+    u->cq_mask  = (unsigned *)((char *)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+    worker->uring = u;
+    INFO1 ("io_uring send engine running for worker %p", worker);
+}
+
+
+/* apply finished sends back onto their clients, run at the top of each pass */
+static void worker_uring_reap (worker_t *worker)
+{
+    struct worker_uring *u = worker->uring;
+    unsigned head;
+
+    if (u == NULL)
+        return;
+    head = *u->cq_head;
+    while (head != __atomic_load_n (u->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &u->cqes [head & *u->cq_mask];
+        struct uring_node *node = (struct uring_node *)(uintptr_t)cqe->user_data;
+        client_t *client = __atomic_load_n (&node->client, __ATOMIC_ACQUIRE);
+
+        if (client)
+        {
+            client->uring_node = NULL;
+            if (cqe->res > 0)
+            {
+                client->pos += cqe->res;
+                client->counter += cqe->res;
+                client->queue_pos += cqe->res;
+                if (client->connection.sent_bytes == 0)
+                    connection_first_byte (&client->connection);
+                client->connection.sent_bytes += cqe->res;
+            }
+            else if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EWOULDBLOCK && cqe->res != -EINTR)
+                client->connection.error = 1;
+        }
+        refbuf_release (node->refbuf);
+        free (node);
+        u->inflight--;
+        head++;
+    }
+    __atomic_store_n (u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+/* queue a send of the unwritten part of the refbuf. Returns -2 when the
+ * engine is not running (caller sends directly), otherwise -1 as the result
+ * is applied on completion and the caller backs off as if blocked.
+ */
+int worker_uring_queue (client_t *client, refbuf_t *refbuf)
+{
+    worker_t *worker = client->worker;
+    struct worker_uring *u = worker ? worker->uring : NULL;
+    struct io_uring_sqe *sqe;
+    struct uring_node *node;
+    unsigned tail, idx;
+
+    if (u == NULL)
+        return -2;
+    if (not_ssl_connection (&client->connection) == 0)
+        return -2;      /* TLS framing must go through the SSL writer */
+    if (client->uring_node)
+        return -1;      /* previous send still in flight */
+    if (connection_unreadable (&client->connection))
+        return -1;
+    tail = *u->sq_tail;
+    if (tail - __atomic_load_n (u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries ||
+            u->inflight >= u->cq_entries)
+        return -1;      /* ring full, let the client retry */
+
+    node = malloc (sizeof (*node));
+    node->client = client;
+    node->refbuf = refbuf;
+    refbuf_addref (refbuf);
+
+    idx = tail & *u->sq_mask;
+    sqe = &u->sqes [idx];
+    memset (sqe, 0, sizeof (*sqe));
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = client->connection.sock;
+    sqe->addr = (uintptr_t)(refbuf->data + client->pos);
+    sqe->len = refbuf->len - client->pos;
+    sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)node;
+    u->sq_array [idx] = idx;
+    __atomic_store_n (u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->to_submit++;
+    u->inflight++;
+    client->uring_node = node;
+    return -1;
+}
+
+
+/* hand the queued sends to the kernel in one go, run at the end of a pass */
+static void worker_uring_flush (worker_t *worker)
+{
+    struct worker_uring *u = worker->uring;
+    int ret;
+
+    if (u == NULL || u->to_submit == 0)
+        return;
+    ret = (int)syscall (__NR_io_uring_enter, u->fd, u->to_submit, 0, 0, NULL, 0);
+    if (ret > 0)
+        u->to_submit -= ret;
+    else if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        WARN1 ("io_uring submit failed (%s)", strerror (errno));
+}
+
+
+/* wait out anything still in flight and drop the ring, used at worker exit
+ * before clients are relocated to other workers.
+ */
+static void worker_uring_shutdown (worker_t *worker)
+{
+    struct worker_uring *u = worker->uring;
+
+    if (u == NULL)
+        return;
+    while (u->inflight)
+    {
+        int ret = (int)syscall (__NR_io_uring_enter, u->fd, u->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret > 0)
+            u->to_submit -= ret;
+        else if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            break;
+        worker_uring_reap (worker);
+    }
+    worker->uring = NULL;
+    munmap (u->sq_ring, u->sq_ring_sz);
+    munmap (u->cq_ring, u->cq_ring_sz);
+    munmap (u->sqes, u->sqes_sz);
+    close (u->fd);
+    free (u);
+}
+
+#else
+
+#define worker_uring_init(w)        do {} while(0)
+#define worker_uring_reap(w)        do {} while(0)
+#define worker_uring_flush(w)       do {} while(0)
+#define worker_uring_shutdown(w)    do {} while(0)
+
+#endif
+
+
+/* how far ahead (in level 0 slots) to look for clients with a quick wakeup
+ * flag set. covers the short reschedule window of caught up listeners without
+ * touching the rest of the wheel.
+ */
+#define WHEEL_WAKEUP_SLOTS  16
+
+
+/* advance the wheel up to the current time, returning the chain of due
+ * clients (linked on wheel_next). also picks up near-future clients whose
+ * quick wakeup flag has been raised and parked clients reactivated by other
+ * threads. with the worker stopping, everything filed is swept up.
+ */
+static client_t *worker_wheel_collect (worker_t *worker)
+{
+    client_t *due = NULL, **due_tail = &due, *cl;
+    uint64_t target = (worker->time_ms + 12) >> WHEEL_SLOT_BITS;
+    unsigned i;
+
+    if (worker->running == 0)
+        target = worker->wheel_tick + (WHEEL_L0_SLOTS * WHEEL_L1_SLOTS);
+
+    while (1)
+    {
+        client_t *chain;
+
+        if ((worker->wheel_tick & (WHEEL_L0_SLOTS-1)) == 0)
+        {
+            /* entering the next level 1 window, bring its clients down */
+            unsigned l1 = (worker->wheel_tick >> WHEEL_L0_BITS) & (WHEEL_L1_SLOTS-1);
+
+            chain = worker->wheel_l1 [l1];
+            worker->wheel_l1 [l1] = NULL;
+            while (chain)
+            {
+                cl = chain;
+                chain = chain->wheel_next;
+                cl->wheel_next = NULL;
+                cl->wheel_prevp = NULL;
+                worker_wheel_insert (worker, cl);
+            }
+        }
+        chain = worker->wheel_l0 [worker->wheel_tick & (WHEEL_L0_SLOTS-1)];
+        worker->wheel_l0 [worker->wheel_tick & (WHEEL_L0_SLOTS-1)] = NULL;
+        while (chain)
+        {
+            chain->wheel_prevp = NULL;
+            *due_tail = chain;
+            due_tail = &chain->wheel_next;
+            chain = chain->wheel_next;
+        }
+        if (worker->wheel_tick >= target)
+            break;
+        worker->wheel_tick++;
+    }
+
+    for (i = 1; i <= WHEEL_WAKEUP_SLOTS; i++)
+    {
+        cl = worker->wheel_l0 [(worker->wheel_tick + i) & (WHEEL_L0_SLOTS-1)];
+        while (cl)
+        {
+            client_t *nx = cl->wheel_next;
+            if (cl->wakeup && *cl->wakeup)
+            {
+                worker_wheel_unlink (cl);
+                *due_tail = cl;
+                due_tail = &cl->wheel_next;
+            }
+            cl = nx;
+        }
+    }
+
+    cl = worker->parked;
+    while (cl)
+    {
+        client_t *nx = cl->wheel_next;
+        if (cl->flags & CLIENT_ACTIVE)
+        {
+            worker_wheel_unlink (cl);
+            *due_tail = cl;
+            due_tail = &cl->wheel_next;
+        }
+        cl = nx;
+    }
+    return due;
+}
+
+
+/* earliest deadline filed on the wheel, for deciding how long to sleep */
+static uint64_t worker_wheel_next_due (worker_t *worker)
+{
+    unsigned i;
+
+    for (i = 0; i < WHEEL_L0_SLOTS; i++)
+    {
+        uint64_t tick = worker->wheel_tick + i;
+        if (worker->wheel_l0 [tick & (WHEEL_L0_SLOTS-1)])
+            return tick << WHEEL_SLOT_BITS;
+    }
+    for (i = 1; i < WHEEL_L1_SLOTS; i++)
+    {
+        uint64_t l1 = (worker->wheel_tick >> WHEEL_L0_BITS) + i;
+        if (worker->wheel_l1 [l1 & (WHEEL_L1_SLOTS-1)])
+            return l1 << (WHEEL_L0_BITS + WHEEL_SLOT_BITS);
+    }
+    return worker->time_ms + 60000;
+}
+
+
+/* push a chain of clients (linked on next_on_worker) onto the worker handoff
+ * stack. lock free, any thread may produce, only the worker consumes.
+ */
+static void worker_push_pending (worker_t *worker, client_t *head, client_t *tail, int count)
+{
+    client_t *old = __atomic_load_n (&worker->pending_clients, __ATOMIC_RELAXED);
+    do
+    {
+        tail->next_on_worker = old;
+    } while (__atomic_compare_exchange_n (&worker->pending_clients, &old, head,
+                0, __ATOMIC_RELEASE, __ATOMIC_RELAXED) == 0);
+    __atomic_add_fetch (&worker->pending_count, count, __ATOMIC_RELAXED);
+}
+
+
 static void worker_add_client (worker_t *worker, client_t *client)
 {
-    ++worker->pending_count;
     client->next_on_worker = NULL;
-    *worker->pending_clients_tail = client;
-    worker->pending_clients_tail = &client->next_on_worker;
     client->worker = worker;
+    worker_push_pending (worker, client, client, 1);
+}
+
+
+/* splice a chain of clients (linked via next_on_worker, head through tail)
+ * onto the destination worker with one exchange and a single wakeup. The
+ * clients must already be unlinked from their previous worker's wheel and
+ * have any readiness monitoring removed.
+ */
+int worker_migrate_clients (worker_t *dest_worker, client_t *head, client_t *tail, int count)
+{
+    client_t *client;
+
+    if (head == NULL || count < 1 || dest_worker == NULL || dest_worker->running == 0)
+        return 0;
+    for (client = head; client; client = client->next_on_worker)
+        client->worker = dest_worker;
+    worker_push_pending (dest_worker, head, tail, count);
+    worker_wakeup (dest_worker);
+    return count;
 }
 
 
@@ -522,14 +1413,14 @@ int client_change_worker (client_t *client, worker_t *dest_worker)
 {
     if (dest_worker->running == 0)
         return 0;
-    client->next_on_worker = NULL;
-
-    thread_spin_lock (&dest_worker->lock);
-    worker_add_client (dest_worker, client);
-    thread_spin_unlock (&dest_worker->lock);
-    worker_wakeup (dest_worker);
+#ifdef HAVE_IO_URING
+    if (client->uring_node)
+        return 0;   /* async send in flight, the move can happen later */
+#endif
+    worker_monitor_client (client->worker, client, 0);
 
-    return 1;
+    client->next_on_worker = NULL;
+    return worker_migrate_clients (dest_worker, client, client, 1);
 }
 
 
@@ -540,11 +1431,9 @@ void client_add_worker (client_t *client)
     thread_rwlock_rlock (&workers_lock);
     /* add client to the handler with the least number of clients */
     handler = worker_selected();
-    thread_spin_lock (&handler->lock);
+    worker_add_client (handler, client);
     thread_rwlock_unlock (&workers_lock);
 
-    worker_add_client (handler, client);
-    thread_spin_unlock (&handler->lock);
     worker_wakeup (handler);
 }
 
@@ -554,11 +1443,9 @@ void client_add_incoming (client_t *client)
 
     thread_rwlock_rlock (&workers_lock);
     handler = worker_incoming;
-    thread_spin_lock (&handler->lock);
+    worker_add_client (handler, client);
     thread_rwlock_unlock (&workers_lock);
 
-    worker_add_client (handler, client);
-    thread_spin_unlock (&handler->lock);
     worker_wakeup (handler);
 }
 
@@ -595,35 +1482,73 @@ void worker_control_create (FD_t wakeup_fd[])
 }
 
 
-static client_t **worker_add_pending_clients (worker_t *worker)
+/* worker wakeups prefer an eventfd, one descriptor instead of two and a
+ * single read resets the counter however often the worker was prodded. The
+ * logger keeps the pipe as it relies on a closing write end for shutdown.
+ */
+static void worker_wakeup_create (worker_t *worker)
 {
-    thread_spin_lock (&worker->lock);
-    if (worker->pending_clients)
-    {
-        unsigned count;
-        client_t **p;
-
-        p = worker->last_p;
-        *worker->last_p = worker->pending_clients;
-        worker->last_p = worker->pending_clients_tail;
-        worker->count += worker->pending_count;
-        count = worker->pending_count;
-        worker->pending_clients = NULL;
-        worker->pending_clients_tail = &worker->pending_clients;
-        worker->pending_count = 0;
-        thread_spin_unlock (&worker->lock);
-        DEBUG2 ("Added %d pending clients to %p", count, worker);
-        return p;  /* only these new ones scheduled so process from here */
+#ifdef HAVE_EVENTFD
+    FD_t fd = eventfd (0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (fd >= 0)
+    {
+        worker->wakeup_fd[0] = worker->wakeup_fd[1] = fd;
+        return;
+    }
+    WARN0 ("eventfd failed, falling back to pipe");
+#endif
+    worker_control_create (&worker->wakeup_fd[0]);
+}
+
+
+static void worker_wakeup_close (worker_t *worker)
+{
+    if (worker->wakeup_fd[1] != worker->wakeup_fd[0])
+        sock_close (worker->wakeup_fd[1]);
+    sock_close (worker->wakeup_fd[0]);
+}
+
+
+static void worker_add_pending_clients (worker_t *worker)
+{
+    client_t *list;
+    unsigned count;
+
+    client_t *reversed = NULL;
+
+    list = __atomic_exchange_n (&worker->pending_clients, NULL, __ATOMIC_ACQUIRE);
+    if (list == NULL)
+        return;
+    count = 0;
+    while (list)     /* stack order, reverse to preserve arrival order */
+    {
+        client_t *nx = list->next_on_worker;
+
+        list->next_on_worker = reversed;
+        reversed = list;
+        count++;
+        list = nx;
     }
+    __atomic_sub_fetch (&worker->pending_count, count, __ATOMIC_RELAXED);
+    thread_spin_lock (&worker->lock);
+    worker->count += count;
     thread_spin_unlock (&worker->lock);
-    worker->wakeup_ms = worker->time_ms + 60000;
-    return &worker->clients;
+    while (reversed)
+    {
+        client_t *nx = reversed->next_on_worker;
+
+        reversed->next_on_worker = NULL;
+        worker_monitor_client (worker, reversed, 1);
+        worker_wheel_insert (worker, reversed);
+        reversed = nx;
+    }
+    DEBUG2 ("Added %d pending clients to %p", count, worker);
 }
 
 
 // enter with spin lock enabled, exit without
 //
-static client_t **worker_wait (worker_t *worker)
+static void worker_wait (worker_t *worker)
 {
     int ret, duration = 2;
 
@@ -637,7 +1562,12 @@ static client_t **worker_wait (worker_t *worker)
     }
     thread_spin_unlock (&worker->lock);
 
-    ret = util_timed_wait_for_fd (worker->wakeup_fd[0], duration);
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
+    if (worker->event_fd >= 0)
+        ret = worker_wait_for_events (worker, duration);
+    else
+#endif
+        ret = util_timed_wait_for_fd (worker->wakeup_fd[0], duration);
     if (ret > 0) /* may of been several wakeup attempts */
     {
         char ca[100];
@@ -648,18 +1578,50 @@ static client_t **worker_wait (worker_t *worker)
                 break;
             if (ret < 0 && sock_recoverable (sock_error()))
                 break;
-            sock_close (worker->wakeup_fd[1]);
-            sock_close (worker->wakeup_fd[0]);
-            worker_control_create (&worker->wakeup_fd[0]);
+            worker_wakeup_close (worker);
+            worker_wakeup_create (worker);
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
+            if (worker->event_fd >= 0)
+                worker_events_attach_pipe (worker);
+#endif
+            __atomic_store_n (&worker->wakeup_pending, 0, __ATOMIC_RELEASE);
             worker_wakeup (worker);
             WARN0 ("Had to recreate worker control feed");
         } while (1);
+        /* drop the flag after draining, anything raised during the drain just
+         * leaves a stray byte behind for the next poll rather than being lost */
+        __atomic_store_n (&worker->wakeup_pending, 0, __ATOMIC_RELEASE);
     }
 
-    worker->time_ms = timing_get_time();
+    worker->time_ms = timing_refresh_time();
     worker->current_time.tv_sec = (time_t)(worker->time_ms/1000);
 
-    return worker_add_pending_clients (worker);
+    worker_add_pending_clients (worker);
+}
+
+
+#define WORKER_RECLAIM_BATCH    256
+
+/* run the full teardown (logging, refbuf and auth releases, socket close) for
+ * a bounded batch of the clients dropped during the pass. A 20k listener drop
+ * is spread over several passes instead of stalling the pacing of the rest */
+static void worker_reclaim (worker_t *worker)
+{
+    int limit = worker->running ? WORKER_RECLAIM_BATCH : worker->reclaim_count;
+
+    while (worker->reclaim_count && limit)
+    {
+        client_t *client = worker->reclaim_head;
+
+        if ((worker->reclaim_head = client->wheel_next) == NULL)
+            worker->reclaim_tail = &worker->reclaim_head;
+        worker->reclaim_count--;
+        limit--;
+        client->wheel_next = NULL;
+        client->ops->release (client);
+    }
+    if (worker->reclaim_count && worker->wakeup_ms > worker->time_ms + 5)
+        worker->wakeup_ms = worker->time_ms + 5;    /* back soon for the rest */
 }
 
 
@@ -669,36 +1631,34 @@ static void worker_relocate_clients (worker_t *worker)
         return;
     while (worker->count || worker->pending_count)
     {
-        client_t *client = worker->clients, **prevp = &worker->clients;
+        client_t *client = worker_wheel_collect (worker), *head = NULL, **tail = &head;
+        int moved = 0;
 
         worker->wakeup_ms = worker->time_ms + 150;
         worker->current_time.tv_sec = (time_t)(worker->time_ms/1000);
         while (client)
         {
-            if (client->flags & CLIENT_ACTIVE)
-            {
-                client->worker = workers;
-                prevp = &client->next_on_worker;
-            }
-            else
-            {
-                *prevp = client->next_on_worker;
-                worker_add_client (worker, client);
-                worker->count--;
-            }
-            client = *prevp;
+            client_t *nx = client->wheel_next;
+
+            client->wheel_next = NULL;
+            client->next_on_worker = NULL;
+            *tail = client;
+            tail = &client->next_on_worker;
+            moved++;
+            client = nx;
         }
-        if (worker->clients)
+        /* parked clients stay with us until their owning thread lets go */
+        while ((client = worker->parked) != NULL)
         {
-            thread_spin_lock (&workers->lock);
-            *workers->pending_clients_tail = worker->clients;
-            workers->pending_clients_tail = prevp;
-            workers->pending_count += worker->count;
-            thread_spin_unlock (&workers->lock);
-            worker_wakeup (workers);
-            worker->clients = NULL;
-            worker->last_p = &worker->clients;
-            worker->count = 0;
+            worker_wheel_unlink (client);
+            worker->count--;
+            worker_add_client (worker, client);
+        }
+        if (moved)
+        {
+            client_t *last = (client_t *)((char *)tail - offsetof (client_t, next_on_worker));
+            worker_migrate_clients (workers, head, last, moved);
+            worker->count -= moved;
         }
         thread_spin_lock (&worker->lock);
         worker_wait (worker);
@@ -709,91 +1669,133 @@ void *worker (void *arg)
 {
     worker_t *worker = arg;
     long prev_count = -1;
-    client_t **prevp = &worker->clients;
-    uint64_t c = 0;
+    uint64_t c = 0, steal_check_ms = 0;
 
     thread_rwlock_rlock (&global.workers_rw);
+    worker_set_affinity (worker);
     worker->running = 1;
     worker->wakeup_ms = (int64_t)0;
-    worker->time_ms = timing_get_time();
+    worker->time_ms = timing_refresh_time();
+    worker->wheel_tick = worker->time_ms >> WHEEL_SLOT_BITS;
 
     while (1)
     {
-        client_t *client = *prevp;
-        uint64_t sched_ms = worker->time_ms + 12;
+        worker_uring_reap (worker);
+        client_t *client = worker_wheel_collect (worker);
+        uint64_t sched_ms = worker->time_ms + 12, pass_start = worker->time_ms;
 
         c = 0;
         while (client)
         {
+            client_t *nx = client->wheel_next;
+            int ret = 0, process = 1;
+
             if (client->worker != worker) abort();
-            /* process client details but skip those that are not ready yet */
-            if (client->flags & CLIENT_ACTIVE)
+            client->wheel_next = NULL;
+            if (worker->running)  // force all active clients to run on worker shutdown
             {
-                int ret = 0;
-                client_t *nx = client->next_on_worker;
+                if ((client->flags & CLIENT_ACTIVE) == 0)
+                    process = 0;    // deactivated since being picked up, park it
+                else if (client->schedule_ms > sched_ms &&
+                        (client->wakeup == NULL || *client->wakeup == 0))
+                    process = 0;    // long timer clamped to the wheel span, refile
+                else if (c > 9000 && client->wakeup == NULL)
+                    process = 0;    // pass getting too large, catch up next time
+            }
+            else if ((client->flags & CLIENT_ACTIVE) == 0)
+                process = 0;
 
-                int process = 1;
-                if (worker->running)  // force all active clients to run on worker shutdown
+            if (process)
+            {
+                if ((c & 511) == 0)
                 {
-                    if (client->schedule_ms <= sched_ms)
-                    {
-                        if (c > 9000 && client->wakeup == NULL)
-                            process = 0;
-                    }
-                    else if (client->wakeup == NULL || *client->wakeup == 0)
-                    {
-                        process = 0;
-                    }
+                    // update these periodically to keep in sync
+                    worker->time_ms = worker_check_time_ms (worker);
+                    worker->current_time.tv_sec = (time_t)(worker->time_ms/1000);
                 }
-
-                if (process)
+                c++;
+                errno = 0;
+                ret = client->ops->process (client);
+                if (ret < 0)
                 {
-                    if ((c & 511) == 0)
-                    {
-                        // update these periodically to keep in sync
-                        worker->time_ms = worker_check_time_ms (worker);
-                        worker->current_time.tv_sec = (time_t)(worker->time_ms/1000);
-                    }
-                    c++;
-                    errno = 0;
-                    ret = client->ops->process (client);
-                    if (ret < 0)
-                    {
-                        client->worker = NULL;
-                        if (client->ops->release)
-                            client->ops->release (client);
-                    }
-                    if (ret)
+                    worker_monitor_client (worker, client, 0);
+                    client->worker = NULL;
+                    if (client->ops->release)
                     {
-                        thread_spin_lock (&worker->lock);
-                        worker->count--;
-                        if (nx == NULL) /* is this the last client */
-                            worker->last_p = prevp;
-                        client = *prevp = nx;
-                        thread_spin_unlock (&worker->lock);
-                        continue;
+                        /* teardown is deferred to worker_reclaim, run in
+                         * bounded batches once the pass has completed */
+                        client->wheel_next = NULL;
+                        *worker->reclaim_tail = client;
+                        worker->reclaim_tail = &client->wheel_next;
+                        worker->reclaim_count++;
                     }
                 }
-                if ((client->flags & CLIENT_ACTIVE) && client->schedule_ms < worker->wakeup_ms)
-                    worker->wakeup_ms = client->schedule_ms;
+                if (ret)
+                {
+                    thread_spin_lock (&worker->lock);
+                    worker->count--;
+                    thread_spin_unlock (&worker->lock);
+                    client = nx;
+                    continue;
+                }
             }
-            prevp = &client->next_on_worker;
-            client = *prevp;
+            worker_wheel_insert (worker, client);
+            client = nx;
         }
+        worker->time_ms = worker_check_time_ms (worker);
+        worker->current_time.tv_sec = (time_t)(worker->time_ms/1000);
+        uint64_t pass_ms = worker->time_ms - pass_start;
+        int bucket = 0;
+        while (bucket < 7 && pass_ms >= ((uint64_t)1 << bucket))
+            bucket++;
+        worker->stat_pass_ms_hist [bucket]++;
+        worker->stat_passes++;
+        worker->stat_visits += c;
+        if (pass_ms > worker->stat_max_pass_ms)
+            worker->stat_max_pass_ms = pass_ms;
         if (prev_count != worker->count)
         {
             DEBUG2 ("%p now has %d clients", worker, worker->count);
             prev_count = worker->count;
         }
+        worker->wakeup_ms = worker_wheel_next_due (worker);
+        worker_reclaim (worker);
+        if (worker->running && worker->time_ms >= steal_check_ms &&
+                is_worker_incoming (worker) == 0 && is_worker_admin (worker) == 0 &&
+                thread_rwlock_tryrlock (&workers_lock) == 0)
+        {
+            worker_t *victim = worker_most_used;
+
+            steal_check_ms = worker->time_ms + 1000;
+            if (victim && victim != worker && victim->running)
+            {
+                thread_spin_lock (&victim->lock);
+                long diff = victim->count - (worker->count +
+                        __atomic_load_n (&worker->pending_count, __ATOMIC_RELAXED));
+                if (diff > 200 && victim->move_allocations == 0)
+                {
+                    victim->move_allocations = diff > 1000 ? 500 : (int)(diff >> 1);
+                    victim->move_dest = worker;
+                    thread_spin_unlock (&victim->lock);
+                    DEBUG3 ("%p requesting %d clients from %p", worker, victim->move_allocations, victim);
+                    worker_wakeup (victim);
+                }
+                else
+                    thread_spin_unlock (&victim->lock);
+            }
+            thread_rwlock_unlock (&workers_lock);
+        }
+        worker_uring_flush (worker);
         thread_spin_lock (&worker->lock);
         if (worker->running == 0)
         {
             if (worker->count == 0 && worker->pending_count == 0)
                 break;
         }
-        prevp = worker_wait (worker);
+        worker_wait (worker);
     }
     thread_spin_unlock (&worker->lock);
+    worker_uring_shutdown (worker);
     worker_relocate_clients (worker);
     INFO0 ("shutting down");
     thread_rwlock_unlock (&global.workers_rw);
@@ -801,7 +1803,8 @@ void *worker (void *arg)
 }
 
 
-// We pick a worker (consequetive) and set a max number of clients to move if needed
+// refresh the least/most used markers. Actual moves are initiated by the
+// idle workers themselves raising a steal request on the busiest one.
 void worker_balance_trigger (time_t now)
 {
     thread_rwlock_wlock (&workers_lock);
@@ -810,17 +1813,6 @@ void worker_balance_trigger (time_t now)
         int log_counts = (now & 15) == 0 ? 1 : 0;
 
         worker_least_used = find_least_busy_handler (log_counts);
-        if (worker_balance_to_check)
-        {
-            worker_t *w = worker_balance_to_check;
-            // DEBUG2 ("Worker allocations reset on %p, least is %p", w, worker_least_used);
-            thread_spin_lock (&w->lock);
-            w->move_allocations = 200;
-            worker_balance_to_check = w->next;
-            thread_spin_unlock (&w->lock);
-        }
-        if (worker_balance_to_check == NULL)
-            worker_balance_to_check = workers;
     }
     thread_rwlock_unlock (&workers_lock);
 }
@@ -828,13 +1820,34 @@ void worker_balance_trigger (time_t now)
 
 static void worker_start (void)
 {
+    static int worker_next_cpu = 0;
     worker_t *handler = calloc (1, sizeof(worker_t));
 
-    worker_control_create (&handler->wakeup_fd[0]);
+    handler->cpu = -1;
+#ifdef __linux__
+    long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+    if (ncpus > 0)
+    {
+        handler->cpu = worker_next_cpu++ % (int)ncpus;
+        handler->node = worker_cpu_node (handler->cpu);
+    }
+#endif
+    worker_wakeup_create (handler);
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
+    worker_events_init (handler);
+#endif
+    worker_uring_init (handler);
 
-    handler->pending_clients_tail = &handler->pending_clients;
     thread_spin_create (&handler->lock);
-    handler->last_p = &handler->clients;
+    {
+        static int worker_serial = 0;
+        char lname [20];
+
+        snprintf (lname, sizeof lname, "worker_%d", worker_serial++);
+        thread_spin_register (&handler->lock, lname);
+    }
+    handler->wheel_tick = timing_cached_time() >> WHEEL_SLOT_BITS;
+    handler->reclaim_tail = &handler->reclaim_head;
 
     thread_rwlock_wlock (&workers_lock);
     if (worker_incoming == NULL)
@@ -847,10 +1860,20 @@ static void worker_start (void)
         worker_start();  // single level recursion, just get a special worker thread set up
         return;
     }
+    if (worker_admin == NULL)
+    {
+        worker_admin = handler;
+        handler->move_allocations = 1000000;    // outside the balancing pool, stays fixed
+        handler->thread = thread_create ("worker", worker, handler, THREAD_ATTACHED);
+        thread_rwlock_unlock (&workers_lock);
+        INFO1 ("starting admin worker thread %p", worker_admin);
+        worker_start();  // recurse again for the streaming worker actually requested
+        return;
+    }
     handler->next = workers;
     workers = handler;
     worker_count++;
-    worker_least_used = worker_balance_to_check = workers;
+    worker_least_used = workers;
     thread_rwlock_unlock (&workers_lock);
 
     handler->thread = thread_create ("worker", worker, handler, THREAD_ATTACHED);
@@ -866,13 +1889,27 @@ static void worker_stop (void)
     {
         if (worker_count > 0)
         {
+            worker_t *w;
+
             handler = workers;
             workers = handler->next;
-            worker_least_used = worker_balance_to_check = workers;
+            worker_least_used = worker_most_used = workers;
             if (workers)
                 workers->move_allocations = 1000;
+            for (w = workers; w; w = w->next)
+                if (w->move_dest == handler)
+                    w->move_dest = NULL;
+            for (int i = 0; i < WORKER_MAX_NODES; i++)
+                if (worker_least_used_by_node [i] == handler)
+                    worker_least_used_by_node [i] = NULL;
             worker_count--;
         }
+        else if (worker_admin)
+        {
+            handler = worker_admin;
+            worker_admin = NULL;
+            INFO0 ("stopping admin worker thread");
+        }
         else
         {
             handler = worker_incoming;
@@ -892,12 +1929,15 @@ static void worker_stop (void)
             thread_join (handler->thread);
             thread_spin_destroy (&handler->lock);
 
-            sock_close (handler->wakeup_fd[1]);
-            sock_close (handler->wakeup_fd[0]);
+            worker_wakeup_close (handler);
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
+            if (handler->event_fd >= 0)
+                sock_close (handler->event_fd);
+#endif
             free (handler);
             thread_rwlock_wlock (&workers_lock);
         }
-    } while (workers == NULL && worker_incoming);
+    } while (workers == NULL && (worker_incoming || worker_admin));
     thread_rwlock_unlock (&workers_lock);
 }
 
@@ -917,15 +1957,89 @@ void workers_adjust (int new_count)
 
 void worker_wakeup (worker_t *worker)
 {
+    /* coalesce bursts of state changes into a single pass. The flag stays up
+     * until the worker next drains its control fd, so repeat callers skip the
+     * syscall entirely while a signal is already pending.
+     */
+    if (__atomic_exchange_n (&worker->wakeup_pending, 1, __ATOMIC_ACQ_REL))
+        return;
+#ifdef HAVE_EVENTFD
+    if (worker->wakeup_fd[0] == worker->wakeup_fd[1])
+    {
+        uint64_t inc = 1;
+        if (write (worker->wakeup_fd[1], &inc, sizeof inc) < 0)
+            ; /* counter saturated, a wakeup is pending regardless */
+        return;
+    }
+#endif
     pipe_write (worker->wakeup_fd[1], "W", 1);
 }
 
 
+static void worker_stats_emit (worker_t *worker, const char *tag)
+{
+    char name [48], hist [128];
+    int i, len = 0;
+
+    snprintf (name, sizeof name, "worker_%s_clients", tag);
+    stats_event_args (NULL, name, "%d", worker->count +
+            __atomic_load_n (&worker->pending_count, __ATOMIC_RELAXED));
+
+    snprintf (name, sizeof name, "worker_%s_passes", tag);
+    stats_event_args (NULL, name, "%" PRIu64,
+            __atomic_load_n (&worker->stat_passes, __ATOMIC_RELAXED));
+
+    snprintf (name, sizeof name, "worker_%s_visits", tag);
+    stats_event_args (NULL, name, "%" PRIu64,
+            __atomic_load_n (&worker->stat_visits, __ATOMIC_RELAXED));
+
+    snprintf (name, sizeof name, "worker_%s_max_pass_ms", tag);
+    stats_event_args (NULL, name, "%" PRIu64,
+            __atomic_load_n (&worker->stat_max_pass_ms, __ATOMIC_RELAXED));
+
+    /* log2 bucketed pass durations, 0/1/2-3/4-7/../64+ ms */
+    for (i = 0; i < 8; i++)
+        len += snprintf (hist + len, sizeof hist - len, "%s%" PRIu64,
+                i ? "/" : "",
+                __atomic_load_n (&worker->stat_pass_ms_hist[i], __ATOMIC_RELAXED));
+    snprintf (name, sizeof name, "worker_%s_pass_ms_hist", tag);
+    stats_event_flags (NULL, name, hist, STATS_COUNTERS|STATS_HIDDEN);
+}
+
+
+/* push the per-worker loop counters into the stats engine, run off the
+ * slave main loop alongside the other periodic stats updates.
+ */
+void worker_stats_global (void)
+{
+    worker_t *handler;
+    int id = 0;
+
+    thread_rwlock_rlock (&workers_lock);
+    if (worker_incoming)
+        worker_stats_emit (worker_incoming, "incoming");
+    if (worker_admin)
+        worker_stats_emit (worker_admin, "admin");
+    for (handler = workers; handler; handler = handler->next, id++)
+    {
+        char tag [16];
+        snprintf (tag, sizeof tag, "%d", id);
+        worker_stats_emit (handler, tag);
+    }
+    thread_rwlock_unlock (&workers_lock);
+}
+
+
 static void logger_commits (int id)
 {
     pipe_write (logger_fd[1], "L", 1);
 }
 
+void worker_logger_wake (void)
+{
+    pipe_write (logger_fd[1], "L", 1);
+}
+
 static void *log_commit_thread (void *arg)
 {
     INFO0 ("started");
@@ -938,6 +2052,10 @@ static void *log_commit_thread (void *arg)
             global_lock();
             int loop = (global.running == ICE_RUNNING);
             global_unlock();
+            /* wakeups are only sent on an empty ring so sweep up any lines
+             * queued since the last pipe poke */
+            logging_flush_access ();
+            log_commit_entries ();
             if (loop) continue;
         }
         if (ret > 0)
@@ -947,6 +2065,7 @@ static void *log_commit_thread (void *arg)
             if (ret > 0)
             {
                 // fprintf (stderr, "logger woken with %d\n", ret);
+                logging_flush_access ();
                 log_commit_entries ();
                 continue;
             }
@@ -961,6 +2080,7 @@ static void *log_commit_thread (void *arg)
             ERROR1 ("logger received code %d", err);
             continue;
         }
+        logging_flush_access ();
         log_commit_entries ();
         // fprintf (stderr, "logger closed with zero workers\n");
         break;
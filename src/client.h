@@ -28,18 +28,51 @@ typedef struct _worker_t worker_t;
 #include "compat.h"
 #include "thread/thread.h"
 
+/* timer wheel for client scheduling. level 0 covers the next second or so at
+ * a fine granularity, level 1 the next minute, anything later is clamped to
+ * the last level 1 slot and refiled as it comes back around.
+ */
+#define WHEEL_SLOT_BITS     2                       /* 4ms per level 0 slot */
+#define WHEEL_L0_BITS       8
+#define WHEEL_L0_SLOTS      (1 << WHEEL_L0_BITS)    /* 256 slots, just over 1s */
+#define WHEEL_L1_SLOTS      64                      /* 1.024s each, 65s span */
+
 struct _worker_t
 {
     int running;
     int count, pending_count;
     int move_allocations;
+    struct _worker_t *move_dest;    /* worker that asked to steal from us */
+    int cpu, node;                  /* pinned cpu and its package/node */
     spin_t lock;
+    int wakeup_pending;             /* a signal is already in the control fd */
     FD_t wakeup_fd[2];
-
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
+    FD_t event_fd;
+#endif
+#ifdef HAVE_IO_URING
+    struct worker_uring *uring;     /* batched send engine, NULL if disabled */
+#endif
+
+    /* lock free multi-producer handoff stack, reversed on consumption */
     client_t *pending_clients;
-    client_t **pending_clients_tail,
-             *clients;
-    client_t **last_p;
+
+    /* loop instrumentation, written by the worker thread, read for stats */
+    uint64_t stat_passes;
+    uint64_t stat_visits;               /* process callbacks invoked */
+    uint64_t stat_pass_ms_hist [8];     /* log2 bucketed pass durations */
+    uint64_t stat_max_pass_ms;
+
+    uint64_t wheel_tick;        /* level 0 slot the wheel has advanced to */
+    client_t *wheel_l0 [WHEEL_L0_SLOTS];
+    client_t *wheel_l1 [WHEEL_L1_SLOTS];
+    client_t *parked;           /* inactive clients, waiting on other threads */
+
+    /* dead clients unlinked from the wheel, torn down in bounded batches
+     * between passes so a mass disconnect does not stall send pacing */
+    client_t *reclaim_head, **reclaim_tail;
+    int reclaim_count;
+
     thread_type *thread;
     struct timespec current_time;
     uint64_t time_ms;
@@ -49,6 +82,7 @@ struct _worker_t
 
 
 extern worker_t *workers;
+extern worker_t *worker_admin;
 extern int worker_count;
 extern rwlock_t workers_lock;
 
@@ -71,6 +105,17 @@ struct _client_tag
 
     client_t *next_on_worker;
 
+    /* scheduling wheel (or parked list) linkage on the worker */
+    client_t *wheel_next, **wheel_prevp;
+
+#ifdef HAVE_IO_URING
+    void *uring_node;       /* async send in flight, blocks worker moves */
+#endif
+#ifdef HAVE_MSG_ZEROCOPY
+    void *zc_list;          /* refbufs pinned by in-flight zerocopy sends */
+    uint32_t zc_seq;        /* kernel completion counter for this socket */
+#endif
+
     /* functions to process client */
     struct _client_functions *ops;
 
@@ -98,6 +143,10 @@ struct _client_tag
     /* where in the queue the client is */
     refbuf_t *refbuf;
 
+    /* bytes read past the current request, ie a pipelined follow-up. held
+     * over the response and re-presented for parsing on keepalive reuse */
+    refbuf_t *pending;
+
     /* byte count in queue */
     uint64_t queue_pos;
 
@@ -117,6 +166,9 @@ struct _client_tag
     uint64_t counter;
     uint64_t aux_data;
 
+    /* absolute deadline clock for paced sends, 0 until the first paced pass */
+    uint64_t pace_ms;
+
     /* function to call to release format specific resources */
     void (*free_client_data)(struct _client_tag *client);
 
@@ -125,6 +177,10 @@ struct _client_tag
     unsigned int throttle;
 };
 
+void client_pool_init (void);
+void client_pool_shutdown (void);
+client_t *client_create (void);
+void client_free (client_t *client);
 void client_register (client_t *client);
 void client_destroy(client_t *client);
 int  client_add_cors (client_t *client, char *buf, int remain);
@@ -146,15 +202,28 @@ int  client_connected (client_t *client);
 const char *client_keepalive_header (client_t *client);
 
 int  client_change_worker (client_t *client, worker_t *dest_worker);
+int  worker_migrate_clients (worker_t *dest_worker, client_t *head, client_t *tail, int count);
 void client_add_worker (client_t *client);
 void client_add_incoming (client_t *client);
 worker_t *worker_selected (void);
+worker_t *worker_preferred (worker_t *from);
+worker_t *worker_preferred_on_node (worker_t *from);
 void worker_balance_trigger (time_t now);
 void workers_adjust (int new_count);
 void worker_wakeup (worker_t *worker);
+#ifdef HAVE_IO_URING
+void worker_uring_configure (int enable);
+int  worker_uring_queue (client_t *client, refbuf_t *refbuf);
+#endif
+#ifdef HAVE_MSG_ZEROCOPY
+int  client_send_zc (client_t *client, refbuf_t *refbuf, const void *buf, unsigned len);
+#endif
+void worker_stats_global (void);
 void worker_logger_init (void);
 void worker_logger (int stop);
+void worker_logger_wake (void);
 int  is_worker_incoming (worker_t *w);
+int  is_worker_admin (worker_t *w);
 
 
 /* client flags bitmask */
@@ -172,6 +241,7 @@ int  is_worker_incoming (worker_t *w);
 #define CLIENT_RANGE_END            (1<<11)
 #define CLIENT_KEEPALIVE            (1<<12)
 #define CLIENT_CHUNKED              (1<<13)
+#define CLIENT_ZEROCOPY             (1<<14)
 #define CLIENT_FORMAT_BIT           (1<<16)
 
 #endif  /* __CLIENT_H__ */
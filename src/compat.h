@@ -55,6 +55,52 @@
 #include <alloca.h>
 #endif
 
+/* socket readiness notification backend for the workers. These are implied
+ * by the platform rather than probed for, define NO_WORKER_EVENTS to force
+ * the traditional timed scans.
+ */
+#ifndef NO_WORKER_EVENTS
+#  if defined(__linux__)
+#    define HAVE_EPOLL 1
+#    define HAVE_EVENTFD 1
+#  elif defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || \
+       defined(__DragonFly__) || defined(__APPLE__)
+#    define HAVE_KQUEUE 1
+#  endif
+#endif
+
+/* optional io_uring batched send engine for the workers, needs the kernel
+ * uapi header at build time and a capable kernel at runtime. Define
+ * NO_IO_URING to leave it out entirely.
+ */
+#ifndef NO_IO_URING
+#  if defined(__linux__) && defined(__has_include)
+#    if __has_include(<linux/io_uring.h>)
+#      define HAVE_IO_URING 1
+#    endif
+#  endif
+#endif
+
+/* zero copy file to socket transfers. Linux only for now, the BSD sendfile
+ * signatures differ, define NO_SENDFILE to force the buffered path.
+ */
+#ifndef NO_SENDFILE
+#  if defined(__linux__)
+#    define HAVE_SENDFILE 1
+#  endif
+#endif
+
+/* MSG_ZEROCOPY sends with completion tracking off the socket error queue,
+ * opt-in per mount. Define NO_MSG_ZEROCOPY to force copying sends.
+ */
+#ifndef NO_MSG_ZEROCOPY
+#  if defined(__linux__) && defined(__has_include)
+#    if __has_include(<linux/errqueue.h>)
+#      define HAVE_MSG_ZEROCOPY 1
+#    endif
+#  endif
+#endif
+
 #ifdef HAVE_MALLOC_H
 #include <malloc.h>
 #endif
@@ -26,6 +26,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fnmatch.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
 
 #ifdef _MSC_VER
  #include <winsock2.h>
@@ -106,6 +112,46 @@ static uint64_t _current_id = 0;
 thread_type *conn_tid;
 int sigfd;
 
+/* extra accept threads, each with its own SO_REUSEPORT listen sockets */
+#define MAX_ACCEPT_THREADS 16
+static int accept_threads = 1;
+static int listen_generation;
+static thread_type *accept_tids [MAX_ACCEPT_THREADS];
+
+#ifndef _WIN32
+#include <sys/un.h>
+
+/* listen socket handover. A successor process started with the same config
+ * collects the bound listen sockets over a unix socket with SCM_RIGHTS, so
+ * an upgrade keeps the accept queues and costs no dropped connections.
+ */
+#define HANDOVER_MAX_FDS 64
+
+struct handover_sock
+{
+    sock_t sock;
+    int port;
+    char bind [128];
+};
+
+static sock_t handover_fd = SOCK_ERROR;
+static char handover_path [256];
+static struct handover_sock handover_pool [HANDOVER_MAX_FDS];
+static int handover_pool_count;
+
+static void handover_serve (void);
+#endif
+
+#ifdef HAVE_OPENSSL
+/* TLS handshakes are completed on a separate thread so the crypto cost of a
+ * connect burst never lands on a worker that is pacing live streams.
+ */
+static thread_type *handshake_tid;
+static spin_t handshake_lock;
+static client_t *handshake_queue;
+static int handshake_running;
+#endif
+
 static int ssl_ok;
 #ifdef HAVE_OPENSSL
 #ifndef SSL_OP_NO_COMPRESSION
@@ -119,6 +165,23 @@ static unsigned long ssl_id_function (void);
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
 static void ssl_locking_function (int mode, int n, const char *file, int line);
 #endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+/* rotating session ticket keys. tickets are issued under the current key but
+ * the previous key still decrypts, so a rotation does not force every
+ * outstanding ticket back through a full handshake.
+ */
+#define TICKET_KEY_LIFETIME     3600
+struct ticket_key
+{
+    unsigned char name [16];
+    unsigned char aes [32];
+    unsigned char hmac [32];
+};
+static struct ticket_key ticket_keys [2];   // current, previous
+static time_t ticket_key_expires;
+static spin_t ticket_lock;
+#endif
 #endif
 
 int header_timeout;
@@ -245,6 +308,12 @@ static int compare_banned_ip (void *arg, void *a, void *b)
 void connection_initialize(void)
 {
     thread_spin_create (&_connection_lock);
+#ifdef HAVE_OPENSSL
+    thread_spin_create (&handshake_lock);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    thread_spin_create (&ticket_lock);
+#endif
+#endif
 
     memset (&banned_ip, 0, sizeof (banned_ip));
     memset (&allowed_ip, 0, sizeof (allowed_ip));
@@ -276,8 +345,26 @@ void connection_initialize(void)
 
 void connection_shutdown(void)
 {
+#ifndef _WIN32
+    if (handover_fd != SOCK_ERROR)
+    {
+        sock_close (handover_fd);
+        handover_fd = SOCK_ERROR;
+    }
+    if (handover_path [0])
+    {   /* not handed over to a successor, reclaim the path */
+        unlink (handover_path);
+        handover_path [0] = '\0';
+    }
+#endif
     connection_listen_sockets_close (NULL, 1);
     thread_spin_destroy (&_connection_lock);
+#ifdef HAVE_OPENSSL
+    thread_spin_destroy (&handshake_lock);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    thread_spin_destroy (&ticket_lock);
+#endif
+#endif
 #ifdef HAVE_OPENSSL
     SSL_CTX_free (ssl_ctx);
 #if !defined(WIN32) && OPENSSL_VERSION_NUMBER < 0x10000000
@@ -329,6 +416,92 @@ static void ssl_locking_function (int mode, int n, const char *file, int line)
 #endif
 
 
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+static void ticket_key_generate (struct ticket_key *key)
+{
+    RAND_bytes (key->name, sizeof key->name);
+    RAND_bytes (key->aes,  sizeof key->aes);
+    RAND_bytes (key->hmac, sizeof key->hmac);
+}
+
+
+/* called by openssl when issuing (enc 1) or decrypting (enc 0) a session
+ * ticket. Keys rotate lazily on the hour, tickets under the previous key are
+ * still honoured but get re-issued under the current one.
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int ssl_ticket_key_cb (SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+        EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc)
+#else
+static int ssl_ticket_key_cb (SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+        EVP_CIPHER_CTX *ctx, HMAC_CTX *hctx, int enc)
+#endif
+{
+    struct ticket_key key;
+    time_t now = time (NULL);
+    int renew = 0;
+
+    thread_spin_lock (&ticket_lock);
+    if (now >= ticket_key_expires)
+    {
+        if (ticket_key_expires)
+            ticket_keys[1] = ticket_keys[0];
+        else    /* first use, the zeroed slot must never decrypt a ticket */
+            ticket_key_generate (&ticket_keys[1]);
+        ticket_key_generate (&ticket_keys[0]);
+        ticket_key_expires = now + TICKET_KEY_LIFETIME;
+    }
+    if (enc)
+        key = ticket_keys[0];
+    else
+    {
+        if (memcmp (key_name, ticket_keys[0].name, sizeof key.name) == 0)
+            key = ticket_keys[0];
+        else if (memcmp (key_name, ticket_keys[1].name, sizeof key.name) == 0)
+        {
+            key = ticket_keys[1];
+            renew = 1;
+        }
+        else
+        {
+            thread_spin_unlock (&ticket_lock);
+            return 0;   // unknown key, client does a full handshake
+        }
+    }
+    thread_spin_unlock (&ticket_lock);
+
+    if (enc)
+    {
+        if (RAND_bytes (iv, EVP_MAX_IV_LENGTH) <= 0)
+            return -1;
+        memcpy (key_name, key.name, sizeof key.name);
+        EVP_EncryptInit_ex (ctx, EVP_aes_256_cbc(), NULL, key.aes, iv);
+    }
+    else
+        EVP_DecryptInit_ex (ctx, EVP_aes_256_cbc(), NULL, key.aes, iv);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    {
+        OSSL_PARAM params [3];
+        params[0] = OSSL_PARAM_construct_utf8_string (OSSL_MAC_PARAM_DIGEST, "sha256", 0);
+        params[1] = OSSL_PARAM_construct_octet_string (OSSL_MAC_PARAM_KEY, key.hmac, sizeof key.hmac);
+        params[2] = OSSL_PARAM_construct_end ();
+        EVP_MAC_CTX_set_params (hctx, params);
+    }
+#else
+    HMAC_Init_ex (hctx, key.hmac, sizeof key.hmac, EVP_sha256(), NULL);
+#endif
+    return renew ? 2 : 1;   // 2 asks openssl to re-issue under the current key
+}
+#endif
+
+
 static void get_ssl_certificate (ice_config_t *config)
 {
     ssl_ok = 0;
@@ -348,6 +521,11 @@ static void get_ssl_certificate (ice_config_t *config)
 #endif
         ssl_opts = SSL_CTX_get_options (new_ssl_ctx);
         SSL_CTX_set_options (new_ssl_ctx, ssl_opts|SSL_OP_NO_SSLv2|SSL_OP_NO_SSLv3|SSL_OP_NO_COMPRESSION|SSL_OP_CIPHER_SERVER_PREFERENCE|SSL_OP_ALL);
+#ifdef SSL_OP_ENABLE_KTLS
+        /* offload record framing to the kernel where it can, openssl quietly
+         * keeps doing it in userspace when the kernel or cipher cannot */
+        SSL_CTX_set_options (new_ssl_ctx, SSL_OP_ENABLE_KTLS);
+#endif
 
         // Enable DH and ECDH
         // See: https://john.nachtimwald.com/2014/10/01/enable-dh-and-ecdh-in-openssl-server/
@@ -398,6 +576,23 @@ static void get_ssl_certificate (ice_config_t *config)
         {
             WARN1 ("Invalid cipher list: %s", config->cipher_list);
         }
+        if (config->ssl_session_cache)
+        {
+            SSL_CTX_set_session_id_context (new_ssl_ctx, (const unsigned char *)"icecast", 7);
+            SSL_CTX_set_session_cache_mode (new_ssl_ctx, SSL_SESS_CACHE_SERVER);
+            SSL_CTX_sess_set_cache_size (new_ssl_ctx, config->ssl_session_cache);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+            SSL_CTX_set_tlsext_ticket_key_evp_cb (new_ssl_ctx, ssl_ticket_key_cb);
+#elif OPENSSL_VERSION_NUMBER >= 0x10100000L
+            SSL_CTX_set_tlsext_ticket_key_cb (new_ssl_ctx, ssl_ticket_key_cb);
+#endif
+            INFO1 ("SSL session cache enabled, %d entries", config->ssl_session_cache);
+        }
+        else
+        {
+            SSL_CTX_set_session_cache_mode (new_ssl_ctx, SSL_SESS_CACHE_OFF);
+            SSL_CTX_set_options (new_ssl_ctx, SSL_OP_NO_TICKET);
+        }
         ssl_ok = 1;
         INFO1 ("SSL certificate found at %s", config->cert_file);
         if (strcmp (config->cert_file, config->key_file) != 0)
@@ -481,7 +676,11 @@ int connection_send_ssl (connection_t *con, const void *buf, size_t len)
             DEBUG2("error %d, %s", code, err);
     }
     if (bytes > 0)
+    {
+        if (con->sent_bytes == 0)
+            connection_first_byte (con);
         con->sent_bytes += bytes;
+    }
     return bytes;
 }
 #else
@@ -532,7 +731,11 @@ int connection_send (connection_t *con, const void *buf, size_t len)
             con->error = 1;
     }
     else
+    {
+        if (con->sent_bytes == 0 && bytes > 0)
+            connection_first_byte (con);
         con->sent_bytes += bytes;
+    }
     return bytes;
 }
 
@@ -548,9 +751,21 @@ void connection_bufs_init (struct connection_bufs *v, short start)
 }
 
 
+/* set up with caller provided iovec storage, eg off the stack, to avoid an
+ * alloc/free round trip on short lived sends. released as usual */
+void connection_bufs_init_fixed (struct connection_bufs *v, IOVEC *storage, short max)
+{
+    memset (v, 0, sizeof (struct connection_bufs));
+    v->block = storage;
+    v->max = max;
+    v->fixed = 1;
+}
+
+
 void connection_bufs_release (struct connection_bufs *v)
 {
-    free (v->block);
+    if (v->fixed == 0)
+        free (v->block);
     memset (v, 0, sizeof (struct connection_bufs));
 }
 
@@ -572,7 +787,15 @@ int connection_bufs_append (struct connection_bufs *v, void *buf, unsigned int l
     if (v->count >= v->max)
     {
        int len = v->max + 16;
-       IOVEC *arr = realloc (v->block, (len*sizeof(IOVEC)));
+       IOVEC *arr;
+       if (v->fixed)
+       {
+           arr = malloc (len*sizeof(IOVEC));
+           memcpy (arr, v->block, v->count*sizeof(IOVEC));
+           v->fixed = 0;
+       }
+       else
+           arr = realloc (v->block, (len*sizeof(IOVEC)));
        v->max = len;
        v->block = arr;
     }
@@ -650,7 +873,11 @@ int connection_bufs_send (connection_t *con, struct connection_bufs *vectors, in
         if (offset)
             *p = old_vals;
         if (ret > 0)
+        {
+            if (con->sent_bytes == 0)
+                connection_first_byte (con);
             con->sent_bytes += ret;
+        }
     }
     return ret;
 }
@@ -681,6 +908,12 @@ static void add_banned_ip (cache_file_contents *c, const void *e, time_t now)
     {
         struct node_IP_time *banned;
         const char *ip = e;
+
+        if (iptrie_insert (&c->iptrie, ip, now) == 0)
+        {
+            DEBUG1 ("Adding prefix entry \"%.30s\"", ip);
+            return;
+        }
 #ifdef HAVE_FNMATCH_H
         if (ip [strcspn (ip, "*?[")]) // if wildcard present
         {
@@ -700,6 +933,33 @@ static void add_banned_ip (cache_file_contents *c, const void *e, time_t now)
     }
 }
 
+/* allow list entries are usually IPs or CIDR ranges, anything else drops
+ * through to the generic wildcard/literal handling */
+static void add_allowed_ip (cache_file_contents *c, const void *e, time_t now)
+{
+    const char *ip = e;
+
+    if (iptrie_insert (&c->iptrie, ip, 0) == 0)
+    {
+        DEBUG1 ("Adding prefix entry \"%.30s\"", ip);
+        return;
+    }
+#ifdef HAVE_FNMATCH_H
+    if (ip [strcspn (ip, "*?[")]) // if wildcard present
+    {
+        struct cache_list_node *entry = calloc (1, sizeof (*entry));
+        entry->content = strdup (ip);
+        entry->next = c->extra;
+        c->extra = entry;
+        DEBUG1 ("Adding wildcard entry \"%.30s\"", ip);
+        return;
+    }
+#endif
+    DEBUG1 ("Adding literal entry \"%.30s\"", ip);
+    avl_insert (c->contents, strdup (ip));
+}
+
+
 void connection_add_banned_ip (const char *ip, int duration)
 {
     time_t timeout = 0;
@@ -710,6 +970,7 @@ void connection_add_banned_ip (const char *ip, int duration)
     {
         global_lock();
         add_banned_ip (&banned_ip, ip, timeout);
+        cached_pattern_compile (&banned_ip);
         global_unlock();
     }
     else
@@ -721,16 +982,17 @@ void connection_release_banned_ip (const char *ip)
     if (banned_ip.contents)
     {
         global_lock();
-        avl_delete (banned_ip.contents, (void*)ip, cached_treenode_free);
+        if (iptrie_remove (&banned_ip.iptrie, ip) < 0)
+            avl_delete (banned_ip.contents, (void*)ip, cached_treenode_free);
         global_unlock();
     }
 }
 
 void connection_stats (void)
 {
-    long banned_IPs = 0;
+    long banned_IPs = banned_ip.iptrie.count;
     if (banned_ip.contents)
-        banned_IPs = (long)banned_ip.contents->length;
+        banned_IPs += (long)banned_ip.contents->length;
     stats_event_args (NULL, "banned_IPs", "%ld", banned_IPs);
 }
 
@@ -743,7 +1005,14 @@ time_t cachefile_timecheck = (time_t)0;
 static int search_banned_ip_locked (char *ip)
 {
     int ret = 0;
-    if (banned_ip.extra)
+    if (iptrie_lookup (&banned_ip.iptrie, ip, cachefile_timecheck))
+        return 1;
+    if (banned_ip.matcher)
+    {
+        if (cached_pattern_match (&banned_ip, ip))
+            return 1;
+    }
+    else if (banned_ip.extra)
     {
         struct cache_list_node *entry = banned_ip.extra;
         while (entry)
@@ -932,14 +1201,24 @@ void connection_close_sigfd (void)
 static sock_t wait_for_serversock (void)
 {
 #ifdef HAVE_POLL
-    int i, ret;
-    struct pollfd ufds [global.server_sockets + 1];
+    int i, ret, hslot = -1;
+    struct pollfd ufds [global.server_sockets + 2];
 
     for(i=0; i < global.server_sockets; i++) {
         ufds[i].fd = global.serversock[i];
         ufds[i].events = POLLIN;
         ufds[i].revents = 0;
     }
+#ifndef _WIN32
+    if (handover_fd != SOCK_ERROR)
+    {
+        hslot = i;
+        ufds[i].fd = handover_fd;
+        ufds[i].events = POLLIN;
+        ufds[i].revents = 0;
+        i++;
+    }
+#endif
 #ifdef HAVE_SIGNALFD
     ufds[i].revents = 0;
     if (sigfd >= 0)
@@ -951,7 +1230,7 @@ static sock_t wait_for_serversock (void)
     else
         ret = poll(ufds, i, 4000);
 #else
-    ret = poll(ufds, global.server_sockets, 333);
+    ret = poll(ufds, i, 333);
 #endif
 
     if (ret <= 0)
@@ -983,6 +1262,11 @@ static sock_t wait_for_serversock (void)
                         global.schedule_config_reread = 1;
                         global_unlock();
                         break;
+                    case SIGCHLD:
+                        /* auth and script children are waited on by whoever
+                         * forked them, this covers the persistent helper */
+                        source_scripter_reap ();
+                        break;
                     default:
                         WARN1 ("unexpected signal (%d)", fdsi.ssi_signo);
                 }
@@ -994,6 +1278,10 @@ static sock_t wait_for_serversock (void)
             slave_restart(); // something odd happened
             thread_sleep (250000);
         }
+#endif
+#ifndef _WIN32
+        if (hslot >= 0 && (ufds[hslot].revents & POLLIN))
+            handover_serve ();
 #endif
         for(i=0; i < global.server_sockets; i++) {
             if(ufds[i].revents & POLLIN)
@@ -1056,24 +1344,14 @@ static sock_t wait_for_serversock (void)
 }
 
 
-static client_t *accept_client (void)
+/* build a client from a freshly accepted socket, which arrives already
+ * nonblocking. Returns NULL with the socket closed when the connection is
+ * unwanted or setup fails.
+ */
+static client_t *accept_client (sock_t sock, char *addr, sock_t serversock, listener_t *from_conn)
 {
-    sock_t sock, serversock = wait_for_serversock ();
     listener_t *server_conn = NULL;
-    char addr [200];
 
-    if (serversock == SOCK_ERROR)
-        return NULL;
-
-    sock = sock_accept (serversock, addr, 200);
-    if (sock == SOCK_ERROR)
-    {
-        if (sock_recoverable (sock_error()))
-            return NULL;
-        WARN2 ("accept() failed with error %d: %s", sock_error(), strerror(sock_error()));
-        thread_sleep (500000);
-        return NULL;
-    }
     do
     {
         int i;
@@ -1081,19 +1359,27 @@ static client_t *accept_client (void)
 
         if (accept_ip_address (addr) == 0)
             break;
-        if (sock_set_blocking (sock, 0) || (sock_set_cork (sock, 1) < 0 && sock_set_nodelay (sock)))
+        if (sock_set_cork (sock, 1) < 0 && sock_set_nodelay (sock))
         {
             WARN0 ("failed to set tcp options on client connection, dropping");
             break;
         }
         global_lock ();
-        for (i=0; i < global.server_sockets; i++)
+        if (from_conn)
         {
-            if (global.serversock[i] == serversock)
+            server_conn = from_conn;
+            server_conn->refcount++;
+        }
+        else
+        {
+            for (i=0; i < global.server_sockets; i++)
             {
-                server_conn = global.server_conn[i];
-                server_conn->refcount++;
-                break;
+                if (global.serversock[i] == serversock)
+                {
+                    server_conn = global.server_conn[i];
+                    server_conn->refcount++;
+                    break;
+                }
             }
         }
         global_unlock ();
@@ -1104,22 +1390,14 @@ static client_t *accept_client (void)
 
             if (ssl_ok && server_conn->ssl)
                 not_using_ssl = 0;
-            if (not_using_ssl)
-            {
-                if (sock_set_blocking (sock, 0) || (sock_set_cork (sock, 1) < 0 && sock_set_nodelay (sock)))
-                {
-                    WARN1 ("failed to set tcp options on incoming client connection %s, dropping", addr);
-                    break;
-                }
-            }
-            client = calloc (1, sizeof (client_t));
+            client = client_create ();
             if (client == NULL || connection_init (&client->connection, sock, addr) < 0)
             {
-                free (client);
+                client_free (client);
                 break;
             }
 
-            client->shared_data = r = refbuf_new (PER_CLIENT_REFBUF_SIZE);
+            client->shared_data = r = refbuf_new (PER_CLIENT_REQBUF_SIZE);
             r->len = 0; // for building up the request coming in
 
             global_lock ();
@@ -1151,6 +1429,44 @@ static client_t *accept_client (void)
 }
 
 
+/* forward declared, defined below with the other queueing helpers */
+static void connection_queue_client (client_t *client);
+
+#define ACCEPT_BATCH 64
+
+/* drain a ready listener in one pass. accept4 hands the sockets back already
+ * nonblocking so a connect burst is absorbed a batch at a time instead of one
+ * accept/fcntl round trip per client with a poll wakeup in between.
+ */
+static int accept_clients (sock_t serversock, listener_t *from_conn)
+{
+    int accepted = 0;
+    char addr [200];
+
+    if (serversock == SOCK_ERROR)
+        return 0;
+
+    while (accepted < ACCEPT_BATCH)
+    {
+        client_t *client;
+        sock_t sock = sock_accept_nb (serversock, addr, sizeof addr);
+        if (sock == SOCK_ERROR)
+        {
+            if (sock_recoverable (sock_error()))
+                break;
+            WARN2 ("accept() failed with error %d: %s", sock_error(), strerror(sock_error()));
+            thread_sleep (500000);
+            break;
+        }
+        accepted++;
+        client = accept_client (sock, addr, serversock, from_conn);
+        if (client)
+            connection_queue_client (client);
+    }
+    return accepted;
+}
+
+
 /* shoutcast source clients are handled specially because the protocol is limited. It is
  * essentially a password followed by a series of headers, each on a separate line.  In here
  * we get the password and build a http request like a native source client would do
@@ -1166,7 +1482,7 @@ static int shoutcast_source_client (client_t *client)
         if (client->shared_data)  /* need to get password first */
         {
             refbuf_t *refbuf = client->shared_data;
-            int remaining = PER_CLIENT_REFBUF_SIZE - 2 - refbuf->len, ret, len;
+            int remaining = refbuf->alloc_len - 2 - refbuf->len, ret, len;
             char *buf = refbuf->data + refbuf->len;
             char *esc_header;
             refbuf_t *r, *resp;
@@ -1229,6 +1545,11 @@ static int shoutcast_source_client (client_t *client)
             refbuf_release (r);
             client->ops = &http_request_ops;
             client->pos = 0;
+            /* encoders commonly send their headers in the same packet as the
+             * password, so the rebuilt request is often complete already;
+             * carry straight on with the parse rather than waiting for
+             * another scheduling round, reconnect storms settle a pass each */
+            return client->ops->process (client);
         }
         client->schedule_ms = client->worker->time_ms + 100;
         return 0;
@@ -1264,7 +1585,7 @@ int setup_source_client_callback (client_t *client)
            if (strcasecmp (expect, "100-continue") == 0)
            {
                DEBUG0 ("client expects 100 continue");
-               snprintf (buf->data, PER_CLIENT_REFBUF_SIZE, "HTTP/1.1 100 Continue\r\n\r\n");
+               snprintf (buf->data, buf->alloc_len, "HTTP/1.1 100 Continue\r\n\r\n");
                buf->len = strlen (buf->data);
                client->format_data = buf;
                client->pos = 0;
@@ -1294,10 +1615,21 @@ static int http_client_request (client_t *client)
         return -1;
     if (refbuf == NULL)
     {
-        client->shared_data = refbuf = refbuf_new (PER_CLIENT_REFBUF_SIZE);
+        client->shared_data = refbuf = refbuf_new (PER_CLIENT_REQBUF_SIZE);
         refbuf->len = 0; // for building up the request coming in
     }
-    remaining = PER_CLIENT_REFBUF_SIZE - 1 - refbuf->len;
+    remaining = refbuf->alloc_len - 1 - refbuf->len;
+    if (remaining == 0 && refbuf->alloc_len < PER_CLIENT_REFBUF_SIZE)
+    {
+        /* headers overflowed the initial read buffer, grow to the cap */
+        refbuf_t *larger = refbuf_new (PER_CLIENT_REFBUF_SIZE);
+        memcpy (larger->data, refbuf->data, refbuf->len);
+        larger->len = refbuf->len;
+        client->shared_data = larger;
+        refbuf_release (refbuf);
+        refbuf = larger;
+        remaining = refbuf->alloc_len - 1 - refbuf->len;
+    }
 
     if (remaining && client->connection.discon.time > client->worker->current_time.tv_sec)
     {
@@ -1312,7 +1644,9 @@ static int http_client_request (client_t *client)
             }
         }
         ret = client_read_bytes (client, buf, remaining);
-        if (ret > 0)
+        if (ret < 0 && client->connection.error == 0 && refbuf->len > client->pos)
+            ret = 0;    /* no new bytes but carried pipelined ones are still unscanned */
+        if (ret > 0 || (ret == 0 && refbuf->len > client->pos))
         {
             char *ptr;
 
@@ -1331,10 +1665,12 @@ static int http_client_request (client_t *client)
                 client->check_buffer = format_generic_write_to_client;
                 return fserve_setup_client_fb (client, &fb);
             }
-            /* find a blank line */
+            /* find a blank line. Resume just short of the previously checked
+             * bytes so trickled headers are not rescanned from the start */
             do
             {
-                buf = refbuf->data;
+                int prior = client->pos;
+                buf = refbuf->data + (prior > 5 ? prior - 5 : 0);
                 ptr = strstr (buf, "\r\n\r\n");
                 if (ptr)
                 {
@@ -1353,6 +1689,7 @@ static int http_client_request (client_t *client)
                     ptr += 6;
                     break;
                 }
+                client->pos = refbuf->len;
                 client->schedule_ms = client->worker->time_ms + 100;
                 return 0;
             } while (0);
@@ -1424,7 +1761,31 @@ static int http_client_request (client_t *client)
                         client->flags &= ~CLIENT_KEEPALIVE;
                 }
 
+                if ((client->flags & CLIENT_KEEPALIVE) && refbuf->len > ptr - refbuf->data &&
+                        client->parser->req_type != httpp_req_source && client->parser->req_type != httpp_req_put)
+                {
+                    /* start of a pipelined request, hold it over the response */
+                    int unparsed = refbuf->len - (ptr - refbuf->data);
+                    client->pending = refbuf_new (unparsed >= PER_CLIENT_REQBUF_SIZE ?
+                            PER_CLIENT_REFBUF_SIZE : PER_CLIENT_REQBUF_SIZE);
+                    memcpy (client->pending->data, ptr, unparsed);
+                    client->pending->data [unparsed] = '\0';
+                    client->pending->len = unparsed;
+                }
+                client->pos = 0;
                 auth_check_http (client);
+                if (refbuf->alloc_len < PER_CLIENT_REFBUF_SIZE)
+                {
+                    /* later stages treat the client refbuf as a full sized scratch or
+                     * read block, so swap the small request buffer out here, keeping
+                     * the content for the source paths which read past the headers */
+                    refbuf_t *larger = refbuf_new (PER_CLIENT_REFBUF_SIZE);
+                    memcpy (larger->data, refbuf->data, refbuf->len);
+                    larger->len = refbuf->len;
+                    ptr = larger->data + (ptr - refbuf->data);
+                    refbuf_release (refbuf);
+                    client->refbuf = refbuf = larger;
+                }
                 switch (client->parser->req_type)
                 {
                     case httpp_req_head:
@@ -1470,6 +1831,243 @@ static int http_client_request (client_t *client)
 }
 
 
+#ifdef HAVE_OPENSSL
+/* complete TLS handshakes away from the workers. New SSL clients are queued
+ * here after accept and only join the incoming worker once SSL_accept has
+ * finished, so a burst of TLS connects cannot stall audio pacing.
+ */
+static void *connection_handshake_thread (void *arg)
+{
+    client_t *pending = NULL;
+    int count = 0;
+
+    INFO0 ("TLS handshake thread started");
+    while (1)
+    {
+        client_t *fresh, **trail;
+        int running;
+        time_t now;
+
+        thread_spin_lock (&handshake_lock);
+        running = handshake_running;
+        fresh = handshake_queue;
+        handshake_queue = NULL;
+        thread_spin_unlock (&handshake_lock);
+
+        for (trail = &pending; *trail; trail = &(*trail)->next_on_worker)
+            ;
+        *trail = fresh;
+        for (; fresh; fresh = fresh->next_on_worker)
+            count++;
+
+        if (pending == NULL)
+        {
+            if (running == 0)
+                break;
+            thread_sleep (30000);
+            continue;
+        }
+#ifdef HAVE_POLL
+        {
+            struct pollfd ufds [count];
+            client_t *cl;
+            int i = 0;
+            for (cl = pending; cl; cl = cl->next_on_worker, i++)
+            {
+                ufds[i].fd = cl->connection.sock;
+                ufds[i].events = POLLIN;
+                ufds[i].revents = 0;
+            }
+            poll (ufds, count, 50);
+        }
+#else
+        thread_sleep (50000);
+#endif
+        now = time (NULL);
+        trail = &pending;
+        while (*trail)
+        {
+            client_t *client = *trail;
+            int ret = SSL_accept (client->connection.ssl), code;
+
+            if (ret > 0)
+            {
+                *trail = client->next_on_worker;
+                count--;
+                client->next_on_worker = NULL;
+                DEBUG1 ("TLS handshake completed for %s", client->connection.ip);
+#ifdef SSL_OP_ENABLE_KTLS
+                if (BIO_get_ktls_send (SSL_get_wbio (client->connection.ssl)))
+                {
+                    client->connection.ktls_tx = 1;
+                    DEBUG1 ("kTLS sending enabled for %s", client->connection.ip);
+                }
+#endif
+                client_add_incoming (client);
+                continue;
+            }
+            code = SSL_get_error (client->connection.ssl, ret);
+            if ((code == SSL_ERROR_WANT_READ || code == SSL_ERROR_WANT_WRITE) &&
+                    running && now < client->connection.discon.time)
+            {
+                trail = &client->next_on_worker;
+                continue;
+            }
+            *trail = client->next_on_worker;
+            count--;
+            client->next_on_worker = NULL;
+            if (code == SSL_ERROR_WANT_READ || code == SSL_ERROR_WANT_WRITE)
+                DEBUG1 ("TLS handshake timeout for %s", client->connection.ip);
+            else
+                DEBUG2 ("TLS handshake failed for %s (%d)", client->connection.ip, code);
+            client->connection.error = 1;
+            client_destroy (client);
+        }
+    }
+    INFO0 ("TLS handshake thread finished");
+    return NULL;
+}
+#endif
+
+
+/* common handoff of a freshly accepted client onto the incoming worker */
+static void connection_queue_client (client_t *client)
+{
+    /* do a small delay here so the client has chance to send the request after
+     * getting a connect. */
+    client->counter = client->schedule_ms = timing_cached_time();
+    client->connection.con_time = client->schedule_ms/1000;
+    client->connection.start_ms = client->schedule_ms;
+    client->connection.discon.time = client->connection.con_time + header_timeout;
+    client->schedule_ms += 30;
+    stats_event_inc (NULL, "connections");
+#ifdef HAVE_OPENSSL
+    if (client->connection.ssl && handshake_running)
+    {   /* workers only see this client once the handshake has completed */
+        thread_spin_lock (&handshake_lock);
+        client->next_on_worker = handshake_queue;
+        handshake_queue = client;
+        thread_spin_unlock (&handshake_lock);
+        return;
+    }
+#endif
+    client_add_incoming (client);
+}
+
+
+/* extra accept thread. Keeps its own SO_REUSEPORT duplicates of the listen
+ * sockets so the kernel spreads incoming connections across the accepters,
+ * and rebuilds them whenever the main thread reworks the listener set.
+ */
+static void *connection_accept_thread (void *arg)
+{
+    sock_t *socks = NULL;
+    listener_t **conns = NULL;
+    int count = 0, generation = -1;
+
+    while (1)
+    {
+        int i, running, gen_now;
+
+        thread_spin_lock (&_connection_lock);
+        running = connection_running;
+        thread_spin_unlock (&_connection_lock);
+        if (running == 0)
+            break;
+
+        global_lock ();
+        gen_now = listen_generation;
+        global_unlock ();
+        if (generation != gen_now)
+        {
+            int n;
+            for (i = 0; i < count; i++)
+            {
+                if (socks [i] != SOCK_ERROR)
+                    sock_close (socks [i]);
+            }
+            global_lock ();
+            for (i = 0; i < count; i++)
+                config_clear_listener (conns [i]);
+            free (socks);   socks = NULL;
+            free (conns);   conns = NULL;
+            count = 0;
+            n = global.server_sockets;
+            if (n)
+            {
+                socks = calloc (n, sizeof (sock_t));
+                conns = calloc (n, sizeof (listener_t *));
+                for (i = 0; i < n; i++)
+                {
+                    listener_t *listener = global.server_conn [i];
+                    sock_t sock = sock_get_server_socket (listener->port, listener->bind_address);
+                    if (sock == SOCK_ERROR || sock_listen (sock, listener->qlen) == SOCK_ERROR)
+                    {
+                        if (sock != SOCK_ERROR)
+                            sock_close (sock);
+                        WARN1 ("unable to duplicate listener socket for port %d", listener->port);
+                        continue;
+                    }
+                    sock_set_blocking (sock, 0);
+                    listener->refcount++;
+                    socks [count] = sock;
+                    conns [count] = listener;
+                    count++;
+                }
+            }
+            generation = gen_now;
+            global_unlock ();
+            DEBUG1 ("accept thread tracking %d listening sockets", count);
+        }
+        if (count == 0)
+        {
+            thread_sleep (500000);
+            continue;
+        }
+#ifdef HAVE_POLL
+        struct pollfd ufds [count];
+        for (i = 0; i < count; i++)
+        {
+            ufds[i].fd = socks [i];
+            ufds[i].events = POLLIN;
+            ufds[i].revents = 0;
+        }
+        if (poll (ufds, count, 333) > 0)
+        {
+            for (i = 0; i < count; i++)
+            {
+                if (ufds[i].revents & POLLIN)
+                    accept_clients (socks [i], conns [i]);
+                if (ufds[i].revents & (POLLHUP|POLLERR|POLLNVAL))
+                {
+                    sock_close (socks [i]);
+                    socks [i] = SOCK_ERROR;
+                }
+            }
+        }
+#else
+        thread_sleep (333000);
+        for (i = 0; i < count; i++)
+            accept_clients (socks [i], conns [i]);
+#endif
+        if (global.new_connections_slowdown)
+            thread_sleep (global.new_connections_slowdown * 5000);
+    }
+    for (count--; count >= 0; count--)
+    {
+        if (socks [count] != SOCK_ERROR)
+            sock_close (socks [count]);
+        global_lock ();
+        config_clear_listener (conns [count]);
+        global_unlock ();
+    }
+    free (socks);
+    free (conns);
+    INFO0 ("accept thread finished");
+    return NULL;
+}
+
+
 static void *connection_thread (void *arg)
 {
     ice_config_t *config;
@@ -1480,38 +2078,47 @@ static void *connection_thread (void *arg)
     sigaddset(&mask, SIGINT);
     sigaddset(&mask, SIGHUP);
     sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGCHLD);
     sigfd = signalfd(-1, &mask, 0);
 #endif
 
     config = config_get_config ();
     /* setup the banned/allowed IP filenames from the xml */
     cached_file_init (&banned_ip,  config->banfile,   add_banned_ip, compare_banned_ip);
-    cached_file_init (&allowed_ip, config->allowfile, NULL, NULL);
+    cached_file_init (&allowed_ip, config->allowfile, add_allowed_ip, NULL);
     cached_file_init (&useragents, config->agentfile, NULL, NULL);
 
     connection_setup_sockets (config);
     header_timeout = config->header_timeout;
+    accept_threads = config->accept_threads;
     config_release_config ();
 
     INFO0 ("connection thread started");
 
     thread_spin_lock (&_connection_lock);
     connection_running = 1;
+    thread_spin_unlock (&_connection_lock);
+
+    int i, extra = 0;
+    for (i = 1; i < accept_threads; i++, extra++)
+        accept_tids [extra] = thread_create ("accept", connection_accept_thread, NULL, THREAD_ATTACHED);
+    if (extra)
+        INFO1 ("%d extra accept threads started", extra);
+#ifdef HAVE_OPENSSL
+    if (ssl_ok && handshake_tid == NULL)
+    {
+        thread_spin_lock (&handshake_lock);
+        handshake_running = 1;
+        thread_spin_unlock (&handshake_lock);
+        handshake_tid = thread_create ("tls", connection_handshake_thread, NULL, THREAD_ATTACHED);
+    }
+#endif
+
+    thread_spin_lock (&_connection_lock);
     while (connection_running)
     {
         thread_spin_unlock (&_connection_lock);
-        client_t *client = accept_client ();
-        if (client)
-        {
-            /* do a small delay here so the client has chance to send the request after
-             * getting a connect. */
-            client->counter = client->schedule_ms = timing_get_time();
-            client->connection.con_time = client->schedule_ms/1000;
-            client->connection.discon.time = client->connection.con_time + header_timeout;
-            client->schedule_ms += 30;
-            client_add_incoming (client);
-            stats_event_inc (NULL, "connections");
-        }
+        accept_clients (wait_for_serversock (), NULL);
         if (global.new_connections_slowdown)
             thread_sleep (global.new_connections_slowdown * 5000);
         thread_spin_lock (&_connection_lock);
@@ -1519,6 +2126,22 @@ static void *connection_thread (void *arg)
     connection_running = 0;
     thread_spin_unlock (&_connection_lock);
 
+    while (extra > 0)
+    {
+        thread_join (accept_tids [--extra]);
+        accept_tids [extra] = NULL;
+    }
+#ifdef HAVE_OPENSSL
+    if (handshake_tid)
+    {
+        thread_spin_lock (&handshake_lock);
+        handshake_running = 0;
+        thread_spin_unlock (&handshake_lock);
+        thread_join (handshake_tid);
+        handshake_tid = NULL;
+    }
+#endif
+
     global_lock();
     cached_file_clear (&banned_ip);
     cached_file_clear (&allowed_ip);
@@ -1800,28 +2423,24 @@ static int _handle_get_request (client_t *client)
         serverport = client->server_conn->port;
     }
 
-    alias = config->aliases;
-
     /* there are several types of HTTP GET clients
     ** media clients, which are looking for a source (eg, URI = /stream.ogg)
     ** stats clients, which are looking for /admin/stats.xml
-    ** and directory server authorizers, which are looking for /GUID-xxxxxxxx 
+    ** and directory server authorizers, which are looking for /GUID-xxxxxxxx
     ** (where xxxxxx is the GUID in question) - this isn't implemented yet.
     ** we need to handle the latter two before the former, as the latter two
     ** aren't subject to the limits.
     */
     /* TODO: add GUID-xxxxxx */
 
-    /* Handle aliases */
-    while(alias) {
-        if(strcmp(uri, alias->source) == 0 && (alias->port == -1 || alias->port == serverport) && (alias->bind_address == NULL || (serverhost != NULL && strcmp(alias->bind_address, serverhost) == 0))) {
-            char *newuri = strdup (alias->destination);
-            DEBUG2 ("alias has made %s into %s", uri, newuri);
-            free (uri);
-            uri = newuri;
-            break;
-        }
-        alias = alias->next;
+    /* Handle aliases, a single probe of the index built at config load */
+    alias = config_find_alias (config, uri, serverport, serverhost);
+    if (alias)
+    {
+        char *newuri = strdup (alias->destination);
+        DEBUG2 ("alias has made %s into %s", uri, newuri);
+        free (uri);
+        uri = newuri;
     }
     int client_limit = config->client_limit;
     config_release_config();
@@ -1838,6 +2457,8 @@ static int _handle_get_request (client_t *client)
 
     if (strcmp (uri, "/admin.cgi") == 0 || strncmp("/admin/", uri, 7) == 0)
         ret = admin_handle_request (client, uri);
+    else if (strcmp (uri, "/metrics") == 0)
+        ret = admin_handle_request (client, "/admin/metrics");   /* scraper friendly alias */
     else
     {
         /* drop non-admin GET requests here if clients limit reached */
@@ -1916,12 +2537,209 @@ void connection_listen_sockets_close (ice_config_t *config, int all_sockets)
 }
 
 
+#ifndef _WIN32
+/* ask a running instance for its listen sockets. Returns the number received
+ * into the pool, 0 when no instance answers on the handover path. */
+static int handover_request_sockets (const char *path)
+{
+    struct sockaddr_un sa;
+    char manifest [2048];
+    char cbuf [CMSG_SPACE (sizeof (int) * HANDOVER_MAX_FDS)];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t len;
+    int fd, fds = 0;
+
+    if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return 0;
+    memset (&sa, 0, sizeof sa);
+    sa.sun_family = AF_UNIX;
+    snprintf (sa.sun_path, sizeof (sa.sun_path), "%s", path);
+    if (connect (fd, (struct sockaddr *)&sa, sizeof sa) < 0)
+    {
+        close (fd);
+        return 0;
+    }
+    memset (&msg, 0, sizeof msg);
+    iov.iov_base = manifest;
+    iov.iov_len = sizeof manifest - 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof cbuf;
+    len = recvmsg (fd, &msg, 0);
+    close (fd);
+    if (len <= 0)
+        return 0;
+    manifest [len] = '\0';
+    cmsg = CMSG_FIRSTHDR (&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        int count = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+        int *fdp = (int *)CMSG_DATA (cmsg);
+        char *line = manifest;
+
+        for (fds = 0; fds < count && fds < HANDOVER_MAX_FDS && line; fds++)
+        {
+            struct handover_sock *h = &handover_pool [fds];
+
+            h->sock = fdp [fds];
+            h->port = 0;
+            h->bind [0] = '\0';
+            sscanf (line, "%d %127s", &h->port, h->bind);
+            if (strcmp (h->bind, "*") == 0)
+                h->bind [0] = '\0';
+            fcntl (h->sock, F_SETFD, FD_CLOEXEC);
+            line = strchr (line, '\n');
+            if (line) line++;
+        }
+        while (count > fds)     /* more fds than manifest lines, drop extras */
+            close (fdp [--count]);
+    }
+    handover_pool_count = fds;
+    return fds;
+}
+
+
+/* take a received listen socket matching the configured listener, SOCK_ERROR
+ * when the pool has none left for it */
+static sock_t handover_take (int port, const char *bind, int peek)
+{
+    int i;
+
+    for (i = 0; i < handover_pool_count; i++)
+    {
+        struct handover_sock *h = &handover_pool [i];
+
+        if (h->sock == SOCK_ERROR || h->port != port)
+            continue;
+        if (bind ? strcmp (bind, h->bind) != 0 : h->bind [0] != '\0')
+            continue;
+        if (peek)
+            return h->sock;
+        sock_t taken = h->sock;
+        h->sock = SOCK_ERROR;
+        return taken;
+    }
+    return SOCK_ERROR;
+}
+
+
+static void handover_listen (const char *path)
+{
+    struct sockaddr_un sa;
+    mode_t prev_mask;
+    int fd;
+
+    unlink (path);
+    if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        WARN2 ("unable to create handover socket %s (%s)", path, strerror (errno));
+        return;
+    }
+    memset (&sa, 0, sizeof sa);
+    sa.sun_family = AF_UNIX;
+    snprintf (sa.sun_path, sizeof (sa.sun_path), "%s", path);
+    /* owner-only, anyone connecting here is handed the listen sockets */
+    prev_mask = umask (077);
+    if (bind (fd, (struct sockaddr *)&sa, sizeof sa) < 0 || listen (fd, 2) < 0)
+    {
+        umask (prev_mask);
+        WARN2 ("unable to bind handover socket %s (%s)", path, strerror (errno));
+        close (fd);
+        return;
+    }
+    umask (prev_mask);
+    fcntl (fd, F_SETFD, FD_CLOEXEC);
+    sock_set_blocking (fd, 0);
+    snprintf (handover_path, sizeof handover_path, "%s", path);
+    handover_fd = fd;
+    INFO1 ("handover socket available on %s", path);
+}
+
+
+/* a successor has connected, send it the listen sockets with their port and
+ * bind details. The listen fds stay shared until this process is stopped so
+ * neither accept queue loses connections during the change over. */
+static void handover_serve (void)
+{
+    char manifest [2048];
+    char cbuf [CMSG_SPACE (sizeof (int) * HANDOVER_MAX_FDS)];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int conn, i, count = 0, mlen = 0;
+
+    conn = accept (handover_fd, NULL, NULL);
+    if (conn < 0)
+        return;
+#ifdef SO_PEERCRED
+    do
+    {
+        struct ucred cred = { .uid = (uid_t)-1 };
+        socklen_t clen = sizeof cred;
+
+        /* the socket file is owner-only but verify the peer as well, the
+         * path may sit in a directory others can rename within */
+        if (getsockopt (conn, SOL_SOCKET, SO_PEERCRED, &cred, &clen) < 0 ||
+                (cred.uid != geteuid () && cred.uid != 0))
+        {
+            WARN1 ("rejecting handover request from uid %d", (int)cred.uid);
+            close (conn);
+            return;
+        }
+    } while (0);
+#endif
+    memset (cbuf, 0, sizeof cbuf);
+    memset (&msg, 0, sizeof msg);
+    msg.msg_control = cbuf;
+    msg.msg_controllen = CMSG_SPACE (sizeof (int) * HANDOVER_MAX_FDS);
+    cmsg = CMSG_FIRSTHDR (&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+
+    global_lock ();
+    for (i = 0; i < global.server_sockets && count < HANDOVER_MAX_FDS; i++)
+    {
+        listener_t *listener = global.server_conn [i];
+        int r = snprintf (manifest + mlen, sizeof manifest - mlen, "%d %s\n",
+                listener->port, listener->bind_address ? listener->bind_address : "*");
+        if (r < 0 || r >= (int)sizeof manifest - mlen)
+            break;
+        mlen += r;
+        ((int *)CMSG_DATA (cmsg)) [count++] = global.serversock [i];
+    }
+    global_unlock ();
+
+    cmsg->cmsg_len = CMSG_LEN (sizeof (int) * count);
+    msg.msg_controllen = CMSG_SPACE (sizeof (int) * count);
+    iov.iov_base = manifest;
+    iov.iov_len = mlen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (sendmsg (conn, &msg, 0) < 0)
+        WARN1 ("failed to send listen sockets to successor (%s)", strerror (errno));
+    else
+    {
+        INFO1 ("%d listen sockets handed over to successor process", count);
+        /* superseded, leave the handover path for the successor to claim */
+        sock_close (handover_fd);
+        handover_fd = SOCK_ERROR;
+        handover_path [0] = '\0';
+    }
+    close (conn);
+}
+#endif
+
+
 int connection_setup_sockets (ice_config_t *config)
 {
     static int sockets_setup = 2;
     int count = 0, socket_count = 0, socket_attempt = 0, arr_size;
     listener_t *listener, **prev;
 
+    sock_server_reuseport (config->accept_threads > 1);
     global_lock();
 
     listener = config->listen_sock;
@@ -1938,6 +2756,16 @@ int connection_setup_sockets (ice_config_t *config)
     if (sockets_setup > 0)
         sockets_setup--;
     get_ssl_certificate (config);
+#ifndef _WIN32
+    if (config->handover_socket && handover_fd == SOCK_ERROR && handover_path [0] == '\0')
+    {
+        int fds = handover_request_sockets (config->handover_socket);
+        if (fds)
+            INFO2 ("received %d listen sockets from running instance via %s",
+                    fds, config->handover_socket);
+        handover_listen (config->handover_socket);
+    }
+#endif
     if (count)
         INFO1 ("%d listening sockets already open", count);
     while (listener)
@@ -1945,13 +2773,27 @@ int connection_setup_sockets (ice_config_t *config)
         socket_count = 0;
         socket_attempt = 0;
 
-        sock_server_t sockets = sock_get_server_sockets (listener->port, listener->bind_address);
+        sock_server_t sockets = NULL;
+#ifndef _WIN32
+        /* prefer sockets handed over from a running instance, they are
+         * already bound and listening with live accept queues */
+        if (handover_take (listener->port, listener->bind_address, 1) == SOCK_ERROR)
+#endif
+            sockets = sock_get_server_sockets (listener->port, listener->bind_address);
 
         do
         {
             sock_t sock = SOCK_ERROR;
-            if (sock_get_next_server_socket (sockets, &sock) < 0)
-                break;   // end of any available sockets
+            int handed_over = 0;
+#ifndef _WIN32
+            sock = handover_take (listener->port, listener->bind_address, 0);
+            handed_over = (sock != SOCK_ERROR);
+#endif
+            if (handed_over == 0)
+            {
+                if (sockets == NULL || sock_get_next_server_socket (sockets, &sock) < 0)
+                    break;   // end of any available sockets
+            }
             socket_attempt++;
             if (sock == SOCK_ERROR)
                 continue;
@@ -1960,7 +2802,7 @@ int connection_setup_sockets (ice_config_t *config)
                 sock_set_send_buffer (sock, listener->so_sndbuf);
             if (listener->so_mss)
                 sock_set_mss (sock, listener->so_mss);
-            if (sock_listen (sock, listener->qlen) == SOCK_ERROR)
+            if (handed_over == 0 && sock_listen (sock, listener->qlen) == SOCK_ERROR)
             {
                 sock_close (sock);
                 continue;
@@ -1984,7 +2826,8 @@ int connection_setup_sockets (ice_config_t *config)
             count++;
         } while(1);
 
-        sock_free_server_sockets (sockets);
+        if (sockets)
+            sock_free_server_sockets (sockets);
         if (socket_count != socket_attempt)
         {
             if (socket_count == 0)
@@ -2014,7 +2857,20 @@ int connection_setup_sockets (ice_config_t *config)
         prev = &listener->next;
         listener = listener->next;
     }
+#ifndef _WIN32
+    {   /* close any received sockets no configured listener claimed */
+        int i;
+        for (i = 0; i < handover_pool_count; i++)
+            if (handover_pool [i].sock != SOCK_ERROR)
+            {
+                sock_close (handover_pool [i].sock);
+                handover_pool [i].sock = SOCK_ERROR;
+            }
+        handover_pool_count = 0;
+    }
+#endif
     global.server_sockets = count;
+    listen_generation++;        /* accept threads rebuild their duplicates */
     global_unlock();
 
     if (count)
@@ -2025,9 +2881,19 @@ int connection_setup_sockets (ice_config_t *config)
 }
 
 
+/* record time to first byte, called on the sent bytes 0 to N edge. skipped
+ * for connections set up without a ms timestamp, eg outgoing relays */
+void connection_first_byte (connection_t *con)
+{
+    if (con->start_ms)
+        stats_hist_record (STATS_HIST_TTFB, timing_get_time() - con->start_ms);
+}
+
+
 void connection_reset (connection_t *con, uint64_t time_ms)
 {
     con->con_time = time_ms/1000;
+    con->start_ms = time_ms;
     con->discon.time = con->con_time + 7;
     con->sent_bytes = 0;
 #ifdef HAVE_OPENSSL
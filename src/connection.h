@@ -39,6 +39,7 @@ struct connection_tag
     uint64_t id;
 
     time_t con_time;
+    uint64_t start_ms;      /* ms timestamp of setup, for first byte latency */
     struct {
         time_t      time;
         uint64_t    offset;
@@ -52,6 +53,7 @@ struct connection_tag
 
 #ifdef HAVE_OPENSSL
     unsigned char sslflags;
+    unsigned char ktls_tx;  /* kernel does TLS framing on the send side */
     SSL *ssl;   /* SSL handler */
 #endif
 
@@ -62,6 +64,7 @@ struct connection_tag
 struct connection_bufs
 {
     short count, max;
+    short fixed;        /* block is caller storage, do not free */
     int total;
     IOVEC *block;
 };
@@ -76,8 +79,10 @@ struct connection_bufs
 
 #ifdef HAVE_OPENSSL
 #define not_ssl_connection(x)    ((x)->ssl==NULL)
+#define connection_ktls_tx(x)    ((x)->ktls_tx)
 #else
 #define not_ssl_connection(x)    (1)
+#define connection_ktls_tx(x)    (0)
 #endif
 void connection_initialize(void);
 void connection_shutdown(void);
@@ -85,6 +90,7 @@ void connection_thread_startup();
 void connection_thread_shutdown();
 int  connection_setup_sockets (struct ice_config_tag *config);
 void connection_reset (connection_t *con, uint64_t time_ms);
+void connection_first_byte (connection_t *con);
 void connection_close(connection_t *con);
 int  connection_init (connection_t *con, sock_t sock, const char *addr);
 void connection_uses_ssl (connection_t *con);
@@ -93,6 +99,7 @@ void connection_release_banned_ip (const char *ip);
 void connection_stats (void);
 
 void connection_bufs_init (struct connection_bufs *vectors, short start);
+void connection_bufs_init_fixed (struct connection_bufs *vectors, IOVEC *storage, short max);
 void connection_bufs_release (struct connection_bufs *v);
 void connection_bufs_flush (struct connection_bufs *v);
 int  connection_bufs_append (struct connection_bufs *vectors, void *buf, unsigned int len);
@@ -13,6 +13,7 @@
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
+#include <stdio.h>
 #include <string.h>
 
 #include "event.h"
@@ -29,12 +30,121 @@
 
 #define CATMODULE "event"
 
+/* subsystems which need prodding after a reload, determined by diffing the
+ * new config against the active snapshot */
+typedef struct
+{
+    unsigned int listeners:1;
+    unsigned int redirects:1;
+    unsigned int master:1;
+    unsigned int yp:1;
+    unsigned int files:1;
+    unsigned int stats:1;
+    unsigned int workers:1;
+} config_diff_t;
+
+
+static int str_changed (const char *old, const char *new)
+{
+    if (old == NULL || new == NULL)
+        return old != new;
+    return strcmp (old, new) != 0;
+}
+
+
+static int listeners_changed (listener_t *old, listener_t *new)
+{
+    while (old && new)
+    {
+        if (old->port != new->port || old->qlen != new->qlen ||
+                old->shoutcast_compat != new->shoutcast_compat ||
+                old->ssl != new->ssl || old->so_sndbuf != new->so_sndbuf ||
+                old->so_mss != new->so_mss ||
+                str_changed (old->bind_address, new->bind_address) ||
+                str_changed (old->shoutcast_mount, new->shoutcast_mount))
+            return 1;
+        old = old->next;
+        new = new->next;
+    }
+    return old != new;
+}
+
+
+static int redirects_changed (ice_config_t *old, ice_config_t *new)
+{
+    redirect_host *o = old->redirect_hosts, *n = new->redirect_hosts;
+
+    if (old->max_redirects != new->max_redirects || old->master_redirect != new->master_redirect)
+        return 1;
+    while (o && n)
+    {
+        if (o->port != n->port || str_changed (o->server, n->server))
+            return 1;
+        o = o->next;
+        n = n->next;
+    }
+    return o != n;
+}
+
+
+static int master_changed (ice_config_t *old, ice_config_t *new)
+{
+    if (old->master_server_port != new->master_server_port ||
+            old->master_ssl_port != new->master_ssl_port ||
+            old->master_relay_auth != new->master_relay_auth ||
+            old->master_relay_retry != new->master_relay_retry ||
+            old->master_run_on != new->master_run_on ||
+            old->master_update_interval != new->master_update_interval)
+        return 1;
+    return str_changed (old->master_server, new->master_server) ||
+        str_changed (old->master_bind, new->master_bind) ||
+        str_changed (old->master_username, new->master_username) ||
+        str_changed (old->master_password, new->master_password);
+}
+
+
+static int yp_changed (ice_config_t *old, ice_config_t *new)
+{
+    int i;
+
+    if (old->num_yp_directories != new->num_yp_directories)
+        return 1;
+    for (i = 0; i < new->num_yp_directories; i++)
+    {
+        if (old->yp_url_timeout[i] != new->yp_url_timeout[i] ||
+                old->yp_touch_interval[i] != new->yp_touch_interval[i] ||
+                str_changed (old->yp_url[i], new->yp_url[i]))
+            return 1;
+    }
+    return 0;
+}
+
+
+static void config_diff (config_diff_t *diff, ice_config_t *old, ice_config_t *new)
+{
+    memset (diff, 0, sizeof (*diff));
+    diff->listeners = listeners_changed (old->listen_sock, new->listen_sock);
+    diff->redirects = redirects_changed (old, new);
+    diff->master = master_changed (old, new);
+    diff->yp = yp_changed (old, new);
+    diff->files = str_changed (old->mimetypes_fn, new->mimetypes_fn) ||
+        str_changed (old->webroot_dir, new->webroot_dir) ||
+        old->fileserve != new->fileserve;
+    diff->stats = old->max_bandwidth != new->max_bandwidth ||
+        str_changed (old->server_id, new->server_id) ||
+        str_changed (old->hostname, new->hostname) ||
+        str_changed (old->location, new->location) ||
+        str_changed (old->admin, new->admin);
+    diff->workers = old->workers_count != new->workers_count;
+}
+
+
 void event_config_read (void)
 {
     int ret;
     char *filename;
     ice_config_t *config;
-    ice_config_t new_config, old_config;
+    ice_config_t new_config;
     /* reread config file */
 
     INFO0("Re-reading XML");
@@ -65,28 +175,60 @@ void event_config_read (void)
     }
     else
     {
+        config_diff_t diff;
+        int bounce_conn;
+        char applied [100];
+
         config = config_grab_config();
 
+        config_diff (&diff, config, &new_config);
         restart_logging (&new_config);
-        config_set_config (&new_config, &old_config);
+        config_set_config (&new_config);
         config_release_config();
 
-        connection_thread_shutdown();
-        redirector_clearall();
-        fserve_scan ((time_t)0);
+        /* only kick the subsystems whose settings actually changed, a reload
+         * for one mount should not tear down listeners or redirects. The
+         * connection thread is also bounced when it was asked to stop (admin
+         * updatecfg) so the slave loop can bring it back up */
+        bounce_conn = diff.listeners || connection_running == 0;
+        if (bounce_conn)
+            connection_thread_shutdown();
+        if (diff.redirects)
+            redirector_clearall();
+        if (diff.files)
+            fserve_scan ((time_t)0);
 
         config = config_get_config();
-        yp_recheck_config (config);
-        fserve_recheck_mime_types (config);
-        stats_global (config);
-        workers_adjust (config->workers_count);
-        connection_listen_sockets_close (config, 0);
-        redirector_setup (config);
+        if (diff.yp)
+            yp_recheck_config (config);
+        if (diff.files)
+            fserve_recheck_mime_types (config);
+        fserve_recheck_config (config);
+        source_stream_mem_limit (config->stream_mem_limit);
+        if (diff.stats)
+            stats_global (config);
+        if (diff.workers)
+            workers_adjust (config->workers_count);
+        if (diff.listeners)
+            connection_listen_sockets_close (config, 0);
+        if (diff.redirects)
+            redirector_setup (config);
         update_relays (config);
         config_release_config();
 
-        slave_restart();
-        config_clear (&old_config);
+        if (bounce_conn)
+            connection_thread_startup();
+        if (diff.master)
+            slave_restart();
+        else
+            slave_update_all_mounts();
+        snprintf (applied, sizeof applied, "%s%s%s%s%s%s%s",
+                diff.listeners ? " listeners" : "", diff.redirects ? " redirects" : "",
+                diff.master ? " master" : "", diff.yp ? " yp" : "",
+                diff.files ? " files" : "", diff.stats ? " stats" : "",
+                diff.workers ? " workers" : "");
+        INFO1 ("config applied, changed subsystems:%s", applied [0] ? applied : " none");
+        /* the replaced snapshot is retired and cleared once readers drain */
     }
     free (filename);
 }
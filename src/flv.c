@@ -317,8 +317,46 @@ int flv_write_metadata (struct flv *flv, struct metadata_block *meta, const char
 }
 
 
+/* run the tag callbacks off the frame map built on the source thread, instead
+ * of parsing the block. timestamps stay per-listener as they are relative to
+ * the join point, so only the parse is shared, not the tag bytes */
+static int flv_pack_from_map (struct flv *flv, refbuf_t *ref, unsigned int offset)
+{
+    struct mpeg_frame_map *hdr = (struct mpeg_frame_map *)ref->frame_map->data;
+    struct mpeg_frame_entry *entry = mpeg_frame_map_entries (hdr);
+    mpeg_sync *mp = &flv->mpeg_sync;
+    unsigned int i, required;
+
+    if ((uint32_t)syncframe_samplerate (mp) != hdr->samplerate || mp->type != hdr->type)
+        mpeg_sync_set_details (mp, hdr->samplerate, hdr->channels, hdr->type);
+
+    /* make sure the scratch buffer can take a tag header per frame */
+    required = hdr->count * 17 + 40;
+    if (flv->raw->len < required)
+    {
+        void *p = realloc (flv->raw->data, required);
+        if (p == NULL) return -1;
+        flv->raw->data = p;
+        flv->raw->len = required;
+        flv->raw->alloc_len = 0;
+    }
+    for (i = 0; i < hdr->count; i++, entry++)
+    {
+        if (entry->offset < offset)
+            continue;
+        mp->sample_count = entry->samples;
+        if (flv->cb.frame_callback (mp, &flv->cb, (unsigned char *)ref->data + entry->offset,
+                    entry->len, entry->hdr_len) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+
 int flv_process_buffer (struct flv *flv, refbuf_t *refbuf)
 {
+    if (refbuf->frame_map)
+        return flv_pack_from_map (flv, refbuf, 0);
     return mpeg_complete_frames_cb (&flv->mpeg_sync, &flv->cb, refbuf, 0);
 }
 
@@ -359,7 +397,12 @@ int write_flv_buf_to_client (client_t *client)
         flv->samples -= flv->samples_in_buffer; // role back the sample count;
 
         uint64_t prev_samples = flv->samples;
-        int unprocessed = mpeg_complete_frames_cb (&flv->mpeg_sync, &flv->cb, ref, client->pos);
+        int unprocessed;
+
+        if (ref->frame_map)
+            unprocessed = flv_pack_from_map (flv, ref, client->pos);
+        else
+            unprocessed = mpeg_complete_frames_cb (&flv->mpeg_sync, &flv->cb, ref, client->pos);
 
         if (unprocessed < 0)
             return -1;
@@ -511,22 +554,29 @@ void flv_meta_append_string (refbuf_t *buffer, const char *tag, const char *valu
 void flv_create_client_data (format_plugin_t *plugin, client_t *client)
 {
     struct flv *flv = calloc (1, sizeof (struct flv));
+    mp3_state *source_mp3 = plugin->_state;
     int bytes;
     char *ptr = client->refbuf->data;
 
+    if (source_mp3)
+        source_mp3->build_frame_map = 1; // have the source map out frames for us
+
     mpeg_setup (&flv->mpeg_sync, client->connection.ip);
     mpeg_check_numframes (&flv->mpeg_sync, 1);
     client->format_data = flv;
     client->free_client_data = free_flv_client_data;
     client->refbuf->flags |= WRITE_BLOCK_GENERIC;
 
-    bytes = snprintf (ptr, 200, "HTTP/1.0 200 OK\r\n"
+    /* response and FLV signature never vary, no point formatting per join */
+    static const char flv_header [] = "HTTP/1.0 200 OK\r\n"
             "content-type: video/x-flv\r\n"
             "Cache-Control: no-cache\r\n"
             "Expires: Thu, 01 Jan 1970 00:00:01 GMT\r\n"
             "Pragma: no-cache\r\n"
             "\r\n"
-            "FLV\x1\x4%c%c%c\x9", 0,0,0);
+            "FLV\x1\x4\x0\x0\x0\x9";
+    bytes = sizeof flv_header - 1;
+    memcpy (ptr, flv_header, bytes);
 
     // only flv headers in here, allows for up to 64 frames per read block, expandable
     flv->raw = refbuf_new (1024);
@@ -40,11 +40,14 @@
 #include "format_ogg.h"
 #include "format_mp3.h"
 #include "format_ebml.h"
+#include "format_raw.h"
 
 #include "logging.h"
 #include "stats.h"
 #define CATMODULE "format"
 
+static void format_header_cache_flush (format_plugin_t *format);
+
 
 format_type_t format_get_type(const char *content_type)
 {
@@ -92,6 +95,7 @@ void format_apply_client (format_plugin_t *format, client_t *client)
     {
         if (format->parser) httpp_destroy (format->parser);
         format->parser = client->parser;
+        format_header_cache_flush (format);
     }
     if (format->apply_client)
         format->apply_client (format, client);
@@ -111,6 +115,7 @@ void format_plugin_clear (format_plugin_t *format, client_t *client)
     if (format->parser)
         if (client == NULL || format->parser != client->parser) // a relay client may have a new parser
             httpp_destroy (format->parser);
+    format_header_cache_flush (format);
     memset (format, 0, sizeof (format_plugin_t));
 }
 
@@ -137,6 +142,9 @@ int format_get_plugin (format_plugin_t *plugin)
         case FORMAT_TYPE_EBML:
             ret = format_ebml_get_plugin (plugin);
             break;
+        case FORMAT_TYPE_RAW:
+            ret = format_raw_get_plugin (plugin);
+            break;
         default:
             INFO1 ("unparsed format detected for %s", plugin->mount);
             break;
@@ -237,7 +245,13 @@ int format_file_read (client_t *client, format_plugin_t *plugin, icefile_handle
             if (client->connection.discon.time && client->worker->current_time.tv_sec >= client->connection.discon.time)
                 return -1;
 
-        bytes = pread (f, refbuf->data, len, client->intro_offset);
+        /* plain pass-through clients can work straight off the shared file
+         * mapping, anything reworking the stream needs its own copy */
+        bytes = -1;
+        if (client->check_buffer == format_generic_write_to_client)
+            bytes = file_cached_slice (f, refbuf, len, client->intro_offset);
+        if (bytes == -1)
+            bytes = file_cached_read (f, refbuf->data, len, client->intro_offset);
         if (bytes <= 0)
         {
             client->flags &= ~CLIENT_HAS_INTRO_CONTENT;
@@ -278,6 +292,23 @@ int format_generic_write_to_client (client_t *client)
     const char *buf = refbuf->data + client->pos;
     unsigned int len = refbuf->len - client->pos;
 
+    /* mapping slices stay out of the async engines, those hold block
+     * references past the send call and a slice is only guaranteed while
+     * the client remains attached to its file handle */
+#ifdef HAVE_IO_URING
+    if ((refbuf->flags & REFBUF_DATA_EXTERNAL) == 0)
+    {
+        ret = worker_uring_queue (client, refbuf);
+        if (ret != -2)
+            return ret;     /* accounting is applied when the send completes */
+    }
+#endif
+#ifdef HAVE_MSG_ZEROCOPY
+    ret = -2;
+    if ((refbuf->flags & REFBUF_DATA_EXTERNAL) == 0)
+        ret = client_send_zc (client, refbuf, buf, len);
+    if (ret == -2)
+#endif
     ret = client_send_bytes (client, buf, len);
 
     if (ret > 0)
@@ -291,15 +322,181 @@ int format_generic_write_to_client (client_t *client)
 }
 
 
+/* vectored variant of the generic write for listeners working through the
+ * stream queue. Gathers from the current position across the pending queue
+ * blocks and sends them with one writev, walking the client along the chain
+ * by whatever was taken. Returns -2 when the client needs the per-buffer
+ * path (metadata interleaving, chunking, TLS or an async send engine holding
+ * per-block references), otherwise bytes written.
+ */
+#define FANOUT_MAX_BLOCKS 8
+
+int format_queued_writev (client_t *client)
+{
+    IOVEC iov [FANOUT_MAX_BLOCKS];
+    refbuf_t *refbuf = client->refbuf;
+    unsigned int pos = client->pos;
+    int count = 0, ret;
+
+    if (client->format_data || (client->flags & (CLIENT_WANTS_FLV|CLIENT_WANTS_META|CLIENT_CHUNKED)))
+        return -2;
+    if (not_ssl_connection (&client->connection) == 0)
+        return -2;
+#ifdef HAVE_IO_URING
+    if (client->worker && client->worker->uring)
+        return -2;
+#endif
+#ifdef HAVE_MSG_ZEROCOPY
+    if (client->flags & CLIENT_ZEROCOPY)
+        return -2;
+#endif
+    while (refbuf && count < FANOUT_MAX_BLOCKS && (refbuf->flags & SOURCE_QUEUE_BLOCK))
+    {
+        if (refbuf->len > pos)
+        {
+            IO_VECTOR_BASE (iov + count) = refbuf->data + pos;
+            IO_VECTOR_LEN (iov + count) = refbuf->len - pos;
+            count++;
+        }
+        pos = 0;
+        refbuf = refbuf->next;
+    }
+    if (count < 2)
+        return -2;      /* nothing gained over the single block send */
+    if (connection_unreadable (&client->connection))
+        return -1;
+    ret = sock_writev (client->connection.sock, iov, count);
+    if (ret < 0)
+    {
+        if (!sock_recoverable (sock_error()))
+            client->connection.error = 1;
+        return ret;
+    }
+    if (client->connection.sent_bytes == 0)
+        connection_first_byte (&client->connection);
+    client->connection.sent_bytes += ret;
+    client->counter += ret;
+    client->queue_pos += ret;
+
+    unsigned int rem = client->pos + ret;
+    refbuf = client->refbuf;
+    while (rem >= refbuf->len && refbuf->next && (refbuf->next->flags & SOURCE_QUEUE_BLOCK))
+    {
+        rem -= refbuf->len;
+        refbuf = refbuf->next;
+    }
+    client->refbuf = refbuf;
+    client->pos = rem;
+    return ret;
+}
+
+
+/* build the icy side of the response headers from the source client headers,
+ * both the parsed header table and any tree-stored additions. The result is
+ * the same for every listener for the life of the source connection, so it
+ * is built once, published atomically and shared; callers copy from the
+ * returned block while holding the source or file lock.
+ */
+static refbuf_t *format_cached_icy_headers (format_plugin_t *plugin)
+{
+    refbuf_t *cached = __atomic_load_n (&plugin->header_cache, __ATOMIC_ACQUIRE), *r, *expected = NULL;
+    http_parser_t *parser = plugin->parser;
+    unsigned remaining = 4096;
+    int bytes, bitrate_filtered = 0, hdr = 0;
+    char *ptr;
+    avl_node *node;
+
+    if (cached)
+        return cached;
+    r = refbuf_new (remaining);
+    ptr = r->data;
+    avl_tree_rlock (parser->vars);
+    node = avl_get_first (parser->vars);
+    while (hdr < parser->headers || node)
+    {
+        int next = 1;
+        http_var_t *var = hdr < parser->headers ?
+            &parser->header [hdr] : (http_var_t *)node->key;
+        bytes = 0;
+        if (!strcasecmp (var->name, "ice-audio-info"))
+        {
+            /* convert ice-audio-info to icy-br */
+            char *brfield = NULL;
+            unsigned int bitrate;
+
+            if (bitrate_filtered == 0)
+                brfield = strstr (var->value, "bitrate=");
+            if (brfield && sscanf (brfield, "bitrate=%u", &bitrate))
+            {
+                bytes = snprintf (ptr, remaining, "icy-br:%u\r\n", bitrate);
+                next = 0;
+                bitrate_filtered = 1;
+            }
+            else
+                /* show ice-audio_info header as well because of relays */
+                bytes = snprintf (ptr, remaining, "%s: %s\r\n", var->name, var->value);
+        }
+        else
+        {
+            if (strcasecmp (var->name, "ice-password") &&
+                    strcasecmp (var->name, "icy-metaint") &&
+                    strncasecmp (var->name, "Access-control-", 15))
+            {
+                if (!strncasecmp ("ice-", var->name, 4))
+                {
+                    if (!strcasecmp ("ice-public", var->name))
+                        bytes = snprintf (ptr, remaining, "icy-pub:%s\r\n", var->value);
+                    else
+                        if (!strcasecmp ("ice-bitrate", var->name))
+                            bytes = snprintf (ptr, remaining, "icy-br:%s\r\n", var->value);
+                        else
+                            bytes = snprintf (ptr, remaining, "icy%s:%s\r\n",
+                                    var->name + 3, var->value);
+                }
+                else
+                    if (!strncasecmp ("icy-", var->name, 4))
+                    {
+                        bytes = snprintf (ptr, remaining, "icy%s:%s\r\n",
+                                var->name + 3, var->value);
+                    }
+            }
+        }
+
+        remaining -= bytes;
+        ptr += bytes;
+        if (next)
+        {
+            if (hdr < parser->headers)
+                hdr++;
+            else
+                node = avl_get_next (node);
+        }
+    }
+    avl_tree_unlock (parser->vars);
+    r->len = 4096 - remaining;
+    if (__atomic_compare_exchange_n (&plugin->header_cache, &expected, r, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        return r;
+    refbuf_release (r);     /* another join got there first */
+    return expected;
+}
+
+
+static void format_header_cache_flush (format_plugin_t *format)
+{
+    refbuf_t *cached = __atomic_exchange_n (&format->header_cache, NULL, __ATOMIC_ACQ_REL);
+
+    if (cached)
+        refbuf_release (cached);
+}
+
+
 int format_general_headers (format_plugin_t *plugin, client_t *client)
 {
     unsigned remaining = 4096 - client->refbuf->len;
     char *ptr = client->refbuf->data + client->refbuf->len;
     int bytes = 0;
-    int bitrate_filtered = 0;
-    avl_node *node;
     ice_config_t *config;
-    uint64_t length = 0; 
+    uint64_t length = 0;
 
     /* hack for flash player, it wants a length. */
     if (httpp_getvar (client->parser, "x-flash-version"))
@@ -483,64 +680,14 @@ int format_general_headers (format_plugin_t *plugin, client_t *client)
 
     if (plugin && plugin->parser)
     {
-        /* iterate through source http headers and send to client */
-        avl_tree_rlock (plugin->parser->vars);
-        node = avl_get_first (plugin->parser->vars);
-        while (node)
-        {
-            int next = 1;
-            http_var_t *var = (http_var_t *)node->key;
-            bytes = 0;
-            if (!strcasecmp (var->name, "ice-audio-info"))
-            {
-                /* convert ice-audio-info to icy-br */
-                char *brfield = NULL;
-                unsigned int bitrate;
+        refbuf_t *icy = format_cached_icy_headers (plugin);
 
-                if (bitrate_filtered == 0)
-                    brfield = strstr (var->value, "bitrate=");
-                if (brfield && sscanf (brfield, "bitrate=%u", &bitrate))
-                {
-                    bytes = snprintf (ptr, remaining, "icy-br:%u\r\n", bitrate);
-                    next = 0;
-                    bitrate_filtered = 1;
-                }
-                else
-                    /* show ice-audio_info header as well because of relays */
-                    bytes = snprintf (ptr, remaining, "%s: %s\r\n", var->name, var->value);
-            }
-            else
-            {
-                if (strcasecmp (var->name, "ice-password") &&
-                        strcasecmp (var->name, "icy-metaint") &&
-                        strncasecmp (var->name, "Access-control-", 15))
-                {
-                    if (!strncasecmp ("ice-", var->name, 4))
-                    {
-                        if (!strcasecmp ("ice-public", var->name))
-                            bytes = snprintf (ptr, remaining, "icy-pub:%s\r\n", var->value);
-                        else
-                            if (!strcasecmp ("ice-bitrate", var->name))
-                                bytes = snprintf (ptr, remaining, "icy-br:%s\r\n", var->value);
-                            else
-                                bytes = snprintf (ptr, remaining, "icy%s:%s\r\n",
-                                        var->name + 3, var->value);
-                    }
-                    else 
-                        if (!strncasecmp ("icy-", var->name, 4))
-                        {
-                            bytes = snprintf (ptr, remaining, "icy%s:%s\r\n",
-                                    var->name + 3, var->value);
-                        }
-                }
-            }
-
-            remaining -= bytes;
-            ptr += bytes;
-            if (next)
-                node = avl_get_next (node);
+        if (icy && icy->len < remaining)
+        {
+            memcpy (ptr, icy->data, icy->len);
+            remaining -= icy->len;
+            ptr += icy->len;
         }
-        avl_tree_unlock (plugin->parser->vars);
     }
 
     config = config_get_config();
@@ -75,6 +75,10 @@ struct _format_plugin_tag
     void (*detach_queue_block)(struct source_tag *source, refbuf_t *refbuf);
     refbuf_t *(*qblock_copy)(refbuf_t *refbuf);
 
+    /* prebuilt icy response header block, shared by listener joins and
+     * atomically published; flushed when the source parser changes */
+    refbuf_t *header_cache;
+
     /* for internal state management */
     void *_state;
 };
@@ -82,6 +86,7 @@ struct _format_plugin_tag
 format_type_t format_get_type(const char *contenttype);
 int format_get_plugin (format_plugin_t *plugin);
 int format_generic_write_to_client (client_t *client);
+int format_queued_writev (client_t *client);
 
 int format_check_frames (struct format_check_t *c);
 int format_file_read (client_t *client, format_plugin_t *plugin, icefile_handle f);
@@ -82,6 +82,7 @@ static int ebml_read(ebml_t *ebml, char *buffer, int len);
 static int ebml_last_was_sync(ebml_t *ebml);
 static char *ebml_write_buffer(ebml_t *ebml, int len);
 static int ebml_wrote(ebml_t *ebml, int len);
+static int ebml_cluster_starts_keyframe(refbuf_t *refbuf);
 
 int format_ebml_get_plugin (format_plugin_t *plugin)
 {
@@ -199,7 +200,11 @@ static refbuf_t *ebml_get_buffer (source_t *source)
 
             if (ebml_last_was_sync(ebml_source_state->ebml))
             {
-                refbuf->flags |= SOURCE_BLOCK_SYNC;
+                /* only mark clusters leading with a keyframe as join points, so
+                 * that the sync index places video listeners on decodable data.
+                 * anything we cannot parse is assumed joinable as before */
+                if (ebml_cluster_starts_keyframe(refbuf) != 0)
+                    refbuf->flags |= SOURCE_BLOCK_SYNC;
             }
             if (refbuf->len > 0)
             {
@@ -270,8 +275,7 @@ static void ebml_free_client_data (client_t *client)
 static void ebml_write_buf_to_file_fail (source_t *source)
 {
     WARN0 ("Write to dump file failed, disabling");
-    fclose (source->dumpfile);
-    source->dumpfile = NULL;
+    source_dump_stop (source);
 }
 
 
@@ -282,15 +286,14 @@ static void ebml_write_buf_to_file (source_t *source, refbuf_t *refbuf)
 
     if (ebml_source_state->file_headers_written == 0)
     {
-        if (fwrite (ebml_source_state->header->data, 1,
-                    ebml_source_state->header->len, 
-                    source->dumpfile) != ebml_source_state->header->len)
+        if (source_dump_write (source, ebml_source_state->header->data,
+                    ebml_source_state->header->len) < 0)
             ebml_write_buf_to_file_fail(source);
         else
             ebml_source_state->file_headers_written = 1;
     }
 
-    if (fwrite (refbuf->data, 1, refbuf->len, source->dumpfile) != refbuf->len)
+    if (source->dumpfile && source_dump_write (source, refbuf->data, refbuf->len) < 0)
     {
         ebml_write_buf_to_file_fail(source);
     }
@@ -410,6 +413,112 @@ static int ebml_read(ebml_t *ebml, char *buffer, int len)
 
 }
 
+/* parse an EBML variable length integer at p. returns the value (length
+ * marker stripped unless keeping it for element ids) and sets *used to the
+ * bytes consumed. returns -1 if the data present is short or malformed
+ */
+static int64_t ebml_parse_var_int(unsigned char *p, int avail, int *used, int strip_marker)
+{
+
+    int size = 1, i;
+    int64_t value;
+    unsigned char mask = 0x80;
+
+    *used = 0;
+    if (avail < 1 || p[0] == 0)
+        return -1;
+    while ((p[0] & mask) == 0)
+    {
+        size++;
+        mask >>= 1;
+    }
+    if (size > 8 || size > avail)
+        return -1;
+    value = strip_marker ? (p[0] & (mask - 1)) : p[0];
+    for (i = 1; i < size; i++)
+        value = (value << 8) | p[i];
+    *used = size;
+    return value;
+
+}
+
+
+/* determine whether the cluster starting this block leads with a keyframe.
+ * returns 1 for a keyframe, 0 for an explicit non-keyframe and -1 when it
+ * cannot be determined from the data present
+ */
+static int ebml_cluster_starts_keyframe(refbuf_t *refbuf)
+{
+
+    unsigned char *p = (unsigned char *)refbuf->data;
+    int remaining = refbuf->len, used;
+    int64_t id, size;
+
+    if (remaining < 8 || memcmp(p, "\x1F\x43\xB6\x75", 4) != 0)
+        return -1;
+    p += 4;
+    remaining -= 4;
+    /* cluster size, typically the unknown-length marker on live streams */
+    if (ebml_parse_var_int(p, remaining, &used, 1) < 0)
+        return -1;
+    p += used;
+    remaining -= used;
+
+    /* walk the cluster children (timestamp etc) for the first block element */
+    while (remaining > 0)
+    {
+        id = ebml_parse_var_int(p, remaining, &used, 0);
+        if (id < 0)
+            return -1;
+        p += used;
+        remaining -= used;
+        size = ebml_parse_var_int(p, remaining, &used, 1);
+        if (size < 0)
+            return -1;
+        p += used;
+        remaining -= used;
+
+        if (id == 0xA3)     /* SimpleBlock, flags follow the track and timecode */
+        {
+            if (ebml_parse_var_int(p, remaining, &used, 1) < 0)
+                return -1;
+            if (remaining < used + 3)
+                return -1;
+            return (p[used + 2] & 0x80) ? 1 : 0;
+        }
+        if (id == 0xA0)     /* BlockGroup, keyframes carry no reference block */
+        {
+            if (size > remaining)
+                return -1;
+            while (size > 0)
+            {
+                int64_t child = ebml_parse_var_int(p, (int)size, &used, 0);
+                int64_t child_size;
+
+                if (child < 0)
+                    return -1;
+                if (child == 0xFB)
+                    return 0;
+                p += used;
+                size -= used;
+                child_size = ebml_parse_var_int(p, (int)size, &used, 1);
+                if (child_size < 0 || child_size > size - used)
+                    return -1;
+                p += used + child_size;
+                size -= used + child_size;
+            }
+            return 1;
+        }
+        if (size > remaining)
+            return -1;
+        p += size;
+        remaining -= size;
+    }
+    return -1;
+
+}
+
+
 static int ebml_last_was_sync(ebml_t *ebml)
 {
 
@@ -77,7 +77,7 @@ static void size_up_qblock (source_t *source);
 #define ICY_DEFAULT_CHARSET             "UTF-8"
 #endif
 
-static refbuf_t blank_icy = { 0 , 1, NULL, NULL, "\001StreamTitle='';", 17 };
+static refbuf_t blank_icy = { ._count = 1, .data = "\001StreamTitle='';", .len = 17 };
 static struct metadata_block blank_meta = { 1, 1, &blank_icy, NULL, NULL, NULL };
 
 
@@ -254,6 +254,11 @@ static void mp3_set_tag (format_plugin_t *plugin, const char *tag, const char *i
 
     if (in_value)
     {
+        if (charset == NULL && util_valid_utf8 (in_value) == 0)
+        {
+            WARN1 ("non-UTF8 data passed as UTF8 (%.60s), assuming Latin-1", in_value);
+            charset = "ISO8859-1";
+        }
         if (charset)
             value = util_conv_string (in_value, charset, "UTF8");
         if (value == NULL)
@@ -603,7 +608,8 @@ static int send_icy_metadata (client_t *client, refbuf_t *refbuf)
     if (block_len > client_mp3->interval)
         block_len = client_mp3->interval; // handle small intervals
 
-    connection_bufs_init (&bufs, 2);
+    IOVEC iov [2];
+    connection_bufs_init_fixed (&bufs, iov, 2);
     len = connection_bufs_append (&bufs, metadata, meta_len);
     if (block_len)
         len = connection_bufs_append (&bufs, refbuf->data + client->pos, block_len);
@@ -664,8 +670,9 @@ static int format_mp3_write_buf_to_client (client_t *client)
             int overall;
             char chunk_hdr [CHUNK_HDR_SZ];
             struct connection_bufs bufs;
+            IOVEC iov [4];
 
-            connection_bufs_init (&bufs, 4);
+            connection_bufs_init_fixed (&bufs, iov, 4);
             connection_chunk_start (&client->connection, &bufs, chunk_hdr, len);
             connection_bufs_append (&bufs, buf, len);
             overall = connection_chunk_end (&client->connection, &bufs, chunk_hdr, len);
@@ -713,8 +720,9 @@ static int send_iceblock_to_client (client_t *client)
     refbuf_t *refbuf = client->refbuf;
     unsigned char lengthbytes[2];
     struct connection_bufs v;
+    IOVEC iov [3];
 
-    connection_bufs_init (&v, 3);
+    connection_bufs_init_fixed (&v, iov, 3);
     if (refbuf->associated != client_mpg->associated)
     {
         struct metadata_block *mb = refbuf->associated;
@@ -805,7 +813,7 @@ static int complete_read (source_t *source)
     if (source_mp3->read_data == NULL)
     {
         size_up_qblock (source);
-        source_mp3->read_data = refbuf_new (source_mp3->qblock_sz);
+        source_mp3->read_data = source_qblock_new (source, source_mp3->qblock_sz);
         source_mp3->read_count = 0;
     }
     if (format->read_bytes > 20000 && source_mp3->update_metadata) // only update after 20k received
@@ -867,6 +875,50 @@ static void size_up_qblock (source_t *source)
 }
 
 
+struct frame_map_build
+{
+    refbuf_t *map;
+    refbuf_t *block;
+    unsigned int alloc;
+};
+
+#define FRAME_MAP_INITIAL   64
+
+/* frame callback for the source side parse, recording each frame so listener
+ * repackers can walk the block without parsing it again */
+static int record_frame (struct mpeg_sync *mp, sync_callback_t *cb, unsigned char *p, unsigned int len, unsigned int header_len)
+{
+    struct frame_map_build *b = cb->callback_key;
+    struct mpeg_frame_map *hdr;
+    struct mpeg_frame_entry *entry;
+
+    if (b->map == NULL)
+    {
+        b->alloc = FRAME_MAP_INITIAL;
+        b->map = refbuf_new (sizeof (*hdr) + b->alloc * sizeof (*entry));
+        ((struct mpeg_frame_map *)b->map->data)->count = 0;
+    }
+    hdr = (struct mpeg_frame_map *)b->map->data;
+    if (hdr->count == b->alloc)
+    {
+        b->alloc += b->alloc;
+        char *d = realloc (b->map->data, sizeof (*hdr) + b->alloc * sizeof (*entry));
+        if (d == NULL) return 0;
+        b->map->data = d;
+        b->map->alloc_len = 0;
+        hdr = (struct mpeg_frame_map *)b->map->data;
+    }
+    entry = mpeg_frame_map_entries (hdr) + hdr->count;
+    entry->offset = p - (unsigned char *)b->block->data;
+    entry->len = len;
+    entry->samples = mp->sample_count;
+    entry->hdr_len = header_len;
+    entry->reserved = 0;
+    hdr->count++;
+    return 0;
+}
+
+
 /* validate the frames, sending any partial frames either back for reading or
  * keep them for later mpeg parsing.
  */
@@ -875,8 +927,32 @@ static int validate_mpeg (source_t *source, refbuf_t *refbuf)
     client_t *client = source->client;
     mp3_state *source_mp3 = source->format->_state;
     mpeg_sync *mpeg_sync = client->format_data;
+    int unprocessed;
 
-    int unprocessed = mpeg_complete_frames (mpeg_sync, refbuf, 0);
+    if (source_mp3->build_frame_map)
+    {
+        struct frame_map_build build = { NULL, refbuf, 0 };
+        sync_callback_t cb = { &build, record_frame };
+
+        unprocessed = mpeg_complete_frames_cb (mpeg_sync, &cb, refbuf, 0);
+        if (build.map)
+        {
+            frame_type_t type = mpeg_get_type (mpeg_sync);
+            if ((type == FORMAT_TYPE_MPEG || type == FORMAT_TYPE_AAC) &&
+                    mpeg_block_expanded (mpeg_sync) == 0)
+            {
+                struct mpeg_frame_map *hdr = (struct mpeg_frame_map *)build.map->data;
+                hdr->type = type;
+                hdr->channels = mpeg_get_channels (mpeg_sync);
+                hdr->samplerate = mpeg_get_samplerate (mpeg_sync);
+                refbuf->frame_map = build.map;
+            }
+            else
+                refbuf_release (build.map);
+        }
+    }
+    else
+        unprocessed = mpeg_complete_frames (mpeg_sync, refbuf, 0);
 
     if (unprocessed < 0 || unprocessed > 20000) /* too much unprocessed really, may not be parsing */
     {
@@ -944,7 +1020,7 @@ static int validate_mpeg (source_t *source, refbuf_t *refbuf)
             WARN3 ("source %s, len %ld, unprocessed %d", source->mount, (long)len, unprocessed);
             len = unprocessed + 1000;
         }
-        leftover = refbuf_new (len);
+        leftover = source_qblock_new (source, len);
         memcpy (leftover->data, refbuf->data + refbuf->len, unprocessed);
         source_mp3->read_data = leftover;
         source_mp3->read_count = unprocessed;
@@ -1220,11 +1296,10 @@ static void write_mp3_to_file (struct source_tag *source, refbuf_t *refbuf)
 {
     if (refbuf->len == 0)
         return;
-    if (fwrite (refbuf->data, 1, refbuf->len, source->dumpfile) < refbuf->len)
+    if (source_dump_write (source, refbuf->data, refbuf->len) < 0)
     {
         WARN0 ("Write to dump file failed, disabling");
-        fclose (source->dumpfile);
-        source->dumpfile = NULL;
+        source_dump_stop (source);
     }
 }
 
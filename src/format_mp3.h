@@ -67,6 +67,7 @@ typedef struct {
     int read_count;
     unsigned short qblock_sz;
     unsigned short max_send_size;
+    char build_frame_map;   /* an flv listener has been seen, map frames per block */
 
     unsigned short build_metadata_len;
     unsigned build_metadata_offset;
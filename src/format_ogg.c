@@ -99,6 +99,7 @@ void format_ogg_attach_header (ogg_codec_t *codec, ogg_page *page)
         return;
 
     refbuf = make_refbuf_with_page (codec, page);
+    ogg_info->headers_changed = 1;
 
     if (ogg_page_bos (page))
     {
@@ -120,13 +121,64 @@ void format_ogg_attach_header (ogg_codec_t *codec, ogg_page *page)
 }
 
 
+/* flatten the collected header pages into one contiguous block. This is what
+ * gets attached to the queued buffers, so each listener join sends codec
+ * headers from a single buffer instead of walking the page chain
+ */
+static void rebuild_header_block (ogg_state_t *ogg_info)
+{
+    refbuf_t *page;
+    unsigned int total = 0;
+
+    refbuf_release (ogg_info->header_block);
+    ogg_info->header_block = NULL;
+    for (page = ogg_info->header_pages; page; page = page->associated)
+        total += page->len;
+    if (total)
+    {
+        refbuf_t *block = refbuf_new (total);
+        char *p = block->data;
+
+        for (page = ogg_info->header_pages; page; page = page->associated)
+        {
+            memcpy (p, page->data, page->len);
+            p += page->len;
+        }
+        ogg_info->header_block = block;
+        DEBUG1 ("header block rebuilt, %u bytes", total);
+    }
+}
+
+
+/* drop the header pages following the BOS pages, so that a codec can attach
+ * a regenerated set (eg updated comments) without restarting the stream
+ */
+void format_ogg_drop_trailing_headers (ogg_state_t *ogg_info)
+{
+    refbuf_t *trailing = *ogg_info->bos_end, *page;
+
+    if (trailing == NULL)
+        return;
+    *ogg_info->bos_end = NULL;
+    ogg_info->header_pages_tail = NULL;
+    for (page = ogg_info->header_pages; page; page = page->associated)
+        ogg_info->header_pages_tail = page;
+    refbuf_release (trailing);
+    ogg_info->headers_changed = 1;
+    DEBUG0 ("dropped trailing header pages");
+}
+
+
 void format_ogg_free_headers (ogg_state_t *ogg_info)
 {
     /* release the header pages first */
     DEBUG0 ("releasing header pages");
     refbuf_release (ogg_info->header_pages);
+    refbuf_release (ogg_info->header_block);
     ogg_info->header_pages = NULL;
     ogg_info->header_pages_tail = NULL;
+    ogg_info->header_block = NULL;
+    ogg_info->headers_changed = 0;
     ogg_info->bos_end = &ogg_info->header_pages;
 }
 
@@ -382,7 +434,12 @@ static refbuf_t *complete_buffer (source_t *source, refbuf_t *refbuf)
 {
     ogg_state_t *ogg_info = source->format->_state;
 
-    refbuf->associated = ogg_info->header_pages;
+    if (ogg_info->headers_changed)
+    {
+        rebuild_header_block (ogg_info);
+        ogg_info->headers_changed = 0;
+    }
+    refbuf->associated = ogg_info->header_block;
     refbuf_addref (refbuf->associated);
 
     if (ogg_info->log_metadata)
@@ -432,9 +489,19 @@ static refbuf_t *ogg_get_buffer (source_t *source)
     ogg_state_t *ogg_info = source->format->_state;
     format_plugin_t *format = source->format;
     char *data = NULL;
-    int bytes = 0, total = 0;
+    int bytes = 0, total = 0, chunk = 4096, limit;
+
+    /* larger reads on higher bitrate streams, fewer syscalls and sync scans.
+     * pages themselves stay inside the libogg sync buffer either way */
+    if (source->incoming_rate > 100000)
+    {
+        chunk = 4096 * (source->incoming_rate / 100000 + 1);
+        if (chunk > 32768)
+            chunk = 32768;
+    }
+    limit = chunk * 15000 / 4096;
 
-    while (total < 15000)
+    while (total < limit)
     {
         while (1)
         {
@@ -477,9 +544,9 @@ static refbuf_t *ogg_get_buffer (source_t *source)
             break;
         }
         /* we need more data to continue getting pages */
-        data = ogg_sync_buffer (&ogg_info->oy, 4096);
+        data = ogg_sync_buffer (&ogg_info->oy, chunk);
 
-        bytes = client_read_bytes (source->client, data, 4096);
+        bytes = client_read_bytes (source->client, data, chunk);
         if (bytes <= 0)
         {
             ogg_sync_wrote (&ogg_info->oy, 0);
@@ -522,8 +589,8 @@ static void free_ogg_client_data (client_t *client)
 }
 
 
-/* send out the header pages. These are for all codecs but are
- * in the order for the stream, ie BOS pages first
+/* send out the codec headers, normally a single flattened block covering
+ * all codecs in stream order, ie BOS pages first
  */
 static int send_ogg_headers (client_t *client, refbuf_t *headers)
 {
@@ -624,11 +691,10 @@ static int write_ogg_data (struct source_tag *source, refbuf_t *refbuf)
 {
     int ret = 1;
 
-    if (fwrite (refbuf->data, 1, refbuf->len, source->dumpfile) != refbuf->len)
+    if (source_dump_write (source, refbuf->data, refbuf->len) < 0)
     {
         WARN0 ("Write to dump file failed, disabling");
-        fclose (source->dumpfile);
-        source->dumpfile = NULL;
+        source_dump_stop (source);
         ret = 0;
     }
     return ret;
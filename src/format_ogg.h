@@ -39,6 +39,8 @@ typedef struct ogg_state_tag
     refbuf_t *file_headers;
     refbuf_t *header_pages;
     refbuf_t *header_pages_tail;
+    refbuf_t *header_block;
+    int headers_changed;
     refbuf_t **bos_end;
     int bos_completed;
     long bitrate;
@@ -71,6 +73,7 @@ typedef struct ogg_codec_tag
 
 refbuf_t *make_refbuf_with_page (ogg_codec_t *codec, ogg_page *page);
 void format_ogg_attach_header (ogg_codec_t *codec, ogg_page *page);
+void format_ogg_drop_trailing_headers (ogg_state_t *ogg_info);
 void format_ogg_free_headers (ogg_state_t *ogg_info);
 int  format_ogg_get_plugin (format_plugin_t *plugin);
 
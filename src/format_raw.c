@@ -0,0 +1,167 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* format_raw.c
+**
+** raw passthrough format plugin. Source data is moved onto the queue in
+** rate sized blocks with no codec parsing at all, for mounts fed by a
+** trusted upstream which has already framed and validated the stream.
+** Selected per mount with <raw-passthrough>.
+**
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "refbuf.h"
+#include "source.h"
+#include "client.h"
+
+#include "stats.h"
+#include "format.h"
+#include "format_raw.h"
+
+#define CATMODULE "format-raw"
+
+#include "logging.h"
+#include "global.h"
+
+typedef struct {
+    refbuf_t *read_data;
+    int read_count;
+    unsigned short qblock_sz;
+} raw_state_t;
+
+static void raw_free_plugin (format_plugin_t *plugin, client_t *client);
+static refbuf_t *raw_get_buffer (source_t *source);
+static int  raw_create_client_data (format_plugin_t *plugin, client_t *client);
+static void raw_write_buf_to_file (source_t *source, refbuf_t *refbuf);
+static void raw_apply_client (format_plugin_t *plugin, client_t *client);
+
+
+int format_raw_get_plugin (format_plugin_t *plugin)
+{
+    raw_state_t *state = calloc (1, sizeof (raw_state_t));
+
+    plugin->get_buffer = raw_get_buffer;
+    plugin->write_buf_to_client = format_generic_write_to_client;
+    plugin->create_client_data = raw_create_client_data;
+    plugin->free_plugin = raw_free_plugin;
+    plugin->write_buf_to_file = raw_write_buf_to_file;
+    plugin->set_tag = NULL;
+    plugin->apply_settings = NULL;
+    plugin->apply_client = raw_apply_client;
+    plugin->_state = state;
+
+    return 0;
+}
+
+
+static void raw_free_plugin (format_plugin_t *plugin, client_t *client)
+{
+    raw_state_t *state = plugin->_state;
+
+    refbuf_release (state->read_data);
+    free (state);
+}
+
+
+static void raw_apply_client (format_plugin_t *plugin, client_t *client)
+{
+    raw_state_t *state = plugin->_state;
+    const char *s;
+
+    refbuf_release (state->read_data);
+    state->read_data = NULL;
+    state->read_count = 0;
+    free (plugin->contenttype);
+
+    if (client == NULL)
+        return;
+
+    s = plugin->parser ? httpp_getvar (plugin->parser, "content-type") : NULL;
+    plugin->contenttype = strdup (s ? s : "application/octet-stream");
+}
+
+
+/* package the source data into blocks near a multiple of the common MTU
+ * size, like the mp3 reader, but hand them straight back with no frame
+ * parsing. There is no framing to honour so every block is a join point
+ */
+static refbuf_t *raw_get_buffer (source_t *source)
+{
+    format_plugin_t *format = source->format;
+    raw_state_t *state = format->_state;
+    client_t *client = source->client;
+    refbuf_t *refbuf;
+
+    if (state->read_data == NULL)
+    {
+        int multi = 6;
+        if (source->incoming_rate)
+            multi = (source->incoming_rate/100000) + 1;
+        state->qblock_sz = 1400 * (multi < 17 ? multi : 17);
+        state->read_data = source_qblock_new (source, state->qblock_sz);
+        state->read_count = 0;
+    }
+    if (state->read_count < state->read_data->len)
+    {
+        char *buf = state->read_data->data + state->read_count;
+        int read_in = state->read_data->len - state->read_count;
+        int bytes = client_read_bytes (client, buf, read_in);
+
+        if (bytes > 0)
+        {
+            rate_add (source->in_bitrate, bytes, client->worker->current_time.tv_sec);
+            state->read_count += bytes;
+            format->read_bytes += bytes;
+            // increase retry delay on small read, to reduce rescheduling
+            if (read_in - bytes > 700)
+                client->schedule_ms += 10;
+        }
+    }
+    if (state->read_count < state->read_data->len)
+        return NULL;
+    if (source->incoming_rate && source->incoming_rate < 65536)
+        client->schedule_ms += (65536/source->incoming_rate);
+    else
+        client->schedule_ms += 1;
+
+    refbuf = state->read_data;
+    state->read_data = NULL;
+    refbuf->flags |= SOURCE_BLOCK_SYNC;
+    source->client->queue_pos += refbuf->len;
+    return refbuf;
+}
+
+
+static int raw_create_client_data (format_plugin_t *plugin, client_t *client)
+{
+    if (client->refbuf == NULL)
+        client->refbuf = refbuf_new (4096);
+    client->refbuf->len = 0;
+    return format_general_headers (plugin, client);
+}
+
+
+static void raw_write_buf_to_file (source_t *source, refbuf_t *refbuf)
+{
+    if (source_dump_write (source, refbuf->data, refbuf->len) < 0)
+    {
+        WARN0 ("Write to dump file failed, disabling");
+        source_dump_stop (source);
+    }
+}
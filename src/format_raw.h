@@ -0,0 +1,25 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* format_raw.h
+**
+** raw passthrough format plugin
+**
+*/
+#ifndef __FORMAT_RAW_H__
+#define __FORMAT_RAW_H__
+
+#include "format.h"
+
+int format_raw_get_plugin (format_plugin_t *plugin);
+
+#endif  /* __FORMAT_RAW_H__ */
@@ -42,7 +42,7 @@ typedef struct vorbis_codec_tag
     vorbis_comment vc;
 
     int rebuild_comment;
-    int stream_notify;
+    int comment_update;
     int initial_audio_page;
 
     ogg_stream_state new_os;
@@ -231,7 +231,63 @@ static void initiate_flush (vorbis_codec_t *source_vorbis)
 }
 
 
-/* process the vorbis audio packets. Here we just take each packet out 
+/* construct a comment packet reflecting the currently set artist/title */
+static void build_comment_packet (ogg_state_t *ogg_info, ogg_packet *header)
+{
+    vorbis_comment vc;
+    ice_config_t *config;
+
+    vorbis_comment_init (&vc);
+    if (ogg_info->artist)
+        vorbis_comment_add_tag (&vc, "artist", ogg_info->artist);
+    if (ogg_info->title)
+        vorbis_comment_add_tag (&vc, "title", ogg_info->title);
+    config = config_get_config();
+    vorbis_comment_add_tag (&vc, "server", config->server_id);
+    config_release_config();
+    vorbis_commentheader_out (&vc, header);
+    vorbis_comment_clear (&vc);
+}
+
+
+/* regenerate just the comment page(s) in the header set. The secondary
+ * headers are repaginated on a scratch stream with the outgoing serial, the
+ * leading BOS page is flushed off and dropped so the replacements carry the
+ * usual sequence numbers. The stream and queued data are left untouched,
+ * avoiding the EOS/BOS chain restart of a full rebuild
+ */
+static int refresh_comment_page (ogg_state_t *ogg_info, ogg_codec_t *codec)
+{
+    vorbis_codec_t *source_vorbis = codec->specific;
+    ogg_stream_state os;
+    ogg_packet comment;
+    ogg_page page;
+
+    if (source_vorbis->header [0] == NULL || source_vorbis->header [2] == NULL)
+        return -1;
+    ogg_stream_init (&os, source_vorbis->new_os.serialno);
+    ogg_stream_packetin (&os, source_vorbis->header [0]);
+    if (ogg_stream_flush (&os, &page) <= 0)
+    {
+        ogg_stream_clear (&os);
+        return -1;
+    }
+    build_comment_packet (ogg_info, &comment);
+    ogg_stream_packetin (&os, &comment);
+    ogg_packet_clear (&comment);
+    ogg_stream_packetin (&os, source_vorbis->header [2]);
+
+    format_ogg_drop_trailing_headers (ogg_info);
+    while (ogg_stream_flush (&os, &page) > 0)
+        format_ogg_attach_header (codec, &page);
+    ogg_stream_clear (&os);
+    ogg_info->log_metadata = 1;
+    DEBUG0 ("comment page spliced into headers");
+    return 0;
+}
+
+
+/* process the vorbis audio packets. Here we just take each packet out
  * and add them into the new stream, flushing after so many samples. We
  * also check if an new headers are requested after each processed page
  */
@@ -296,10 +352,15 @@ static int process_vorbis_audio (ogg_state_t *ogg_info, ogg_codec_t *codec)
         if (source_vorbis->samples_in_page > source_vorbis->page_samples_trigger)
             return 1;
     }
-    if (source_vorbis->stream_notify)
+    if (source_vorbis->comment_update)
     {
+        source_vorbis->comment_update = 0;
+        if (source_vorbis->get_buffer_page == get_buffer_audio &&
+                refresh_comment_page (ogg_info, codec) == 0)
+            return -1;
+        /* mid transition or the splice failed, rebuild the stream as before */
+        source_vorbis->rebuild_comment = 1;
         initiate_flush (source_vorbis);
-        source_vorbis->stream_notify = 0;
         return 1;
     }
     return -1;
@@ -321,22 +382,10 @@ static int process_vorbis_headers (ogg_state_t *ogg_info, ogg_codec_t *codec)
     /* NOTE: we could build a separate comment packet each time */
     if (source_vorbis->rebuild_comment)
     {
-        vorbis_comment vc;
         ogg_packet header;
-        ice_config_t *config;
-
-        vorbis_comment_init (&vc);
-        if (ogg_info->artist) 
-            vorbis_comment_add_tag (&vc, "artist", ogg_info->artist);
-        if (ogg_info->title)
-            vorbis_comment_add_tag (&vc, "title", ogg_info->title);
-        config = config_get_config();
-        vorbis_comment_add_tag (&vc, "server", config->server_id);
-        config_release_config();
-        vorbis_commentheader_out (&vc, &header);
 
+        build_comment_packet (ogg_info, &header);
         ogg_stream_packetin (&source_vorbis->new_os, &header);
-        vorbis_comment_clear (&vc);
         ogg_packet_clear (&header);
     }
     else
@@ -435,8 +484,7 @@ static void vorbis_set_tag (format_plugin_t *plugin, const char *tag, const char
 
     if (tag == NULL)
     {
-        source_vorbis->stream_notify = 1;
-        source_vorbis->rebuild_comment = 1;
+        source_vorbis->comment_update = 1;
         return;
     }
 
@@ -44,6 +44,12 @@
 # ifndef SCN_OFF_T
 #  define SCN_OFF_T SCNdMAX
 # endif
+# ifdef HAVE_SENDFILE
+#  include <sys/sendfile.h>
+# endif
+# ifndef _WIN32
+#  include <sys/mman.h>
+# endif
 # ifndef PRI_OFF_T
 #  define PRI_OFF_T PRIdMAX
 # endif
@@ -81,6 +87,7 @@
 #define BUFSIZE 4096
 
 static spin_t pending_lock;
+static spin_t filemap_lock;
 static avl_tree *mimetypes = NULL;
 static avl_tree *fh_cache = NULL;
 #ifndef HAVE_PREAD
@@ -92,6 +99,18 @@ typedef struct {
     char *type;
 } mime_type;
 
+/* read-only hash over the mimetype entries, swapped in whole on rebuild so
+ * the per-request lookup takes no lock. The superseded generation is kept
+ * until the next rebuild, a racing reader never sees freed entries */
+struct mime_index
+{
+    unsigned int mask;
+    mime_type *entry [];
+};
+static struct mime_index *mime_index_live;
+static struct mime_index *mime_index_old;
+static avl_tree *mimetypes_old;
+
 typedef struct {
     fbinfo finfo;
     mutex_t lock;
@@ -100,6 +119,11 @@ typedef struct {
     int peak;
     int max;
     icefile_handle f;
+    uint64_t ra_pos;        /* end of the readahead window advised so far */
+    uint64_t file_size;     /* bytes on disk, counted into the cache total */
+    uint64_t hits;          /* client attaches to this entry */
+    uint64_t bytes_sent;    /* output summed from detaching clients */
+    time_t last_used;
     time_t stats_update;
     time_t expire;
     long frame_start_pos;
@@ -111,13 +135,60 @@ typedef struct {
 
 int fserve_running;
 
+#define FSERVE_READAHEAD    (1 << 19)
+
 static int _delete_mapping(void *mapping);
 static int prefile_send (client_t *client);
 static int file_send (client_t *client);
+static void fserve_readahead (fh_node *fh, off_t offset);
+static int  file_mapped (icefile_handle f);
+
+/* async read offload. a worker facing a chunk read on an unmapped file
+ * queues the client here and moves on, a reader thread does the read and
+ * hands the client back, so cold disk latency never rides on the media
+ * workers. threads come up on demand and exit when the queue drains,
+ * like the auth handlers
+ */
+typedef struct file_read_request
+{
+    client_t *client;
+    fh_node *fh;
+    struct file_read_request *next;
+} file_read_t;
+
+#define FSERVE_READ_THREADS_MAX 4
+#define FSERVE_READ_RESULT      ((uint64_t)1 << 63)
+
+static mutex_t read_queue_lock;
+static file_read_t *read_queue, **read_queue_tailp = &read_queue;
+static int read_threads;
 static int _compare_fh(void *arg, void *a, void *b);
 static int _delete_fh (void *mapping);
 static void remove_fh_from_cache (fh_node *fh);
 
+/* byte accounting for fh_cache. entries normally drop on a 10s idle timeout
+ * but a crawler walking an archive can pull in far more than is worth caching
+ * before that fires, so once the configured budget is passed idle entries go
+ * in least recently used order. hit/miss/eviction totals feed the stats
+ */
+static uint64_t fh_cache_bytes;
+static uint64_t fh_cache_limit;
+static uint64_t fh_cache_hits, fh_cache_misses, fh_cache_evictions;
+
+/* file backed fallback mounts noted at config load, opened and pinned on the
+ * next scan pass. a source drop is exactly when thousands of listeners switch
+ * at once, so the file wants to be open with its pages resident beforehand
+ * rather than starting a disk read storm at that moment. list rides on
+ * pending_lock as config reload and the scan run on different threads
+ */
+typedef struct fallback_preload
+{
+    char *mount;
+    struct fallback_preload *next;
+} fallback_preload_t;
+
+static fallback_preload_t *preload_list;
+
 static fh_node no_file;
 
 
@@ -129,15 +200,22 @@ void fserve_initialize(void)
 
     mimetypes = NULL;
     thread_spin_create (&pending_lock);
+    thread_spin_create (&filemap_lock);
+    thread_mutex_create (&read_queue_lock);
 #ifndef HAVE_PREAD
     thread_mutex_create (&seekread_lock);
 #endif
     fh_cache = avl_tree_new (_compare_fh, NULL);
 
     fserve_recheck_mime_types (config);
+    fserve_recheck_config (config);
     config_release_config();
 
     stats_event_flags (NULL, "file_connections", "0", STATS_COUNTERS);
+    stats_event_flags (NULL, "fserve_cache_bytes", "0", STATS_COUNTERS);
+    stats_event_flags (NULL, "fserve_cache_hits", "0", STATS_COUNTERS);
+    stats_event_flags (NULL, "fserve_cache_misses", "0", STATS_COUNTERS);
+    stats_event_flags (NULL, "fserve_cache_evictions", "0", STATS_COUNTERS);
     fserve_running = 1;
     memset (&no_file, 0, sizeof (no_file));
     thread_mutex_create (&no_file.lock);
@@ -152,8 +230,23 @@ void fserve_initialize(void)
 void fserve_shutdown(void)
 {
     fserve_running = 0;
+    while (preload_list)
+    {
+        fallback_preload_t *p = preload_list;
+        preload_list = p->next;
+        free (p->mount);
+        free (p);
+    }
     if (mimetypes)
         avl_tree_free (mimetypes, _delete_mapping);
+    mimetypes = NULL;
+    if (mimetypes_old)
+        avl_tree_free (mimetypes_old, _delete_mapping);
+    mimetypes_old = NULL;
+    free (mime_index_live);
+    mime_index_live = NULL;
+    free (mime_index_old);
+    mime_index_old = NULL;
     if (fh_cache)
     {
         int count = 20;
@@ -173,7 +266,21 @@ void fserve_shutdown(void)
         avl_tree_free (fh_cache, _delete_fh);
     }
 
+    int count = 20;
+    while (count)
+    {
+        thread_mutex_lock (&read_queue_lock);
+        int active = read_threads;
+        thread_mutex_unlock (&read_queue_lock);
+        if (active == 0)
+            break;
+        DEBUG1 ("waiting for %d reader threads", active);
+        thread_sleep (100000);
+        count--;
+    }
+    thread_mutex_destroy (&read_queue_lock);
     thread_spin_destroy (&pending_lock);
+    thread_spin_destroy (&filemap_lock);
 #ifndef HAVE_PREAD
     thread_mutex_destroy (&seekread_lock);
 #endif
@@ -181,29 +288,40 @@ void fserve_shutdown(void)
 }
 
 
+static unsigned int mime_hash_of (const char *ext)
+{
+    unsigned int hash = 5381;
+
+    while (*ext)
+        hash = ((hash << 5) + hash) ^ (unsigned char)*ext++;
+    return hash;
+}
+
+
 /* string returned needs to be free'd */
 char *fserve_content_type (const char *path)
 {
     char *ext = util_get_extension(path);
-    mime_type exttype = { NULL, NULL };
-    void *result;
-    char *type;
+    struct mime_index *index;
 
     if (ext == NULL)
         return strdup ("text/html");
-    exttype.ext = strdup (ext);
 
-    thread_spin_lock (&pending_lock);
-    if (mimetypes && !avl_get_by_key (mimetypes, &exttype, &result))
+    /* lock free probe of the read-only index, see mime_index for why the
+     * entries stay valid against a concurrent rebuild */
+    index = __atomic_load_n (&mime_index_live, __ATOMIC_ACQUIRE);
+    if (index)
     {
-        mime_type *mime = result;
-        type = strdup (mime->type);
+        unsigned int idx = mime_hash_of (ext) & index->mask;
+
+        while (index->entry [idx])
+        {
+            if (strcmp (index->entry [idx]->ext, ext) == 0)
+                return strdup (index->entry [idx]->type);
+            idx = (idx + 1) & index->mask;
+        }
     }
-    else
-        type = strdup ("application/octet-stream");
-    thread_spin_unlock (&pending_lock);
-    free (exttype.ext);
-    return type;
+    return strdup ("application/octet-stream");
 }
 
 
@@ -239,6 +357,12 @@ static int _delete_fh (void *mapping)
     else
         thread_mutex_destroy (&fh->lock);
 
+#ifdef POSIX_FADV_DONTNEED
+    if (fh->f >= 0 && fh->ra_pos)
+        posix_fadvise (fh->f, 0, 0, POSIX_FADV_DONTNEED);   // nobody reading, release the cached pages
+#endif
+    if (fh->file_size)
+        __atomic_fetch_sub (&fh_cache_bytes, fh->file_size, __ATOMIC_RELAXED);
     file_close (&fh->f);
     if (fh->format)
     {
@@ -269,6 +393,10 @@ static void remove_from_fh (fh_node *fh, client_t *client)
 {
     thread_mutex_lock (&fh->lock);
     fh->refcount--;
+    /* connection totals, so close enough for sizing the cache even though a
+     * client moving between handles carries its earlier bytes with it */
+    fh->bytes_sent += client->connection.sent_bytes;
+    fh->last_used = time (NULL);
     if (fh->clients)
     {
         avl_delete (fh->clients, client, NULL);
@@ -351,6 +479,9 @@ static fh_node *open_fh (fbinfo *finfo)
     {
         free (fh);
         thread_mutex_lock (&result->lock);
+        fh_cache_hits++;
+        result->hits++;
+        result->last_used = time (NULL);
         avl_tree_unlock (fh_cache);
         if (finfo->flags & FS_FALLBACK)
         {
@@ -360,6 +491,12 @@ static fh_node *open_fh (fbinfo *finfo)
                 thread_mutex_unlock (&result->lock);
                 return NULL;
             }
+            if (finfo->limit && result->finfo.limit == 0)
+            {   // preloaded without a rate, adopt the caller's
+                result->finfo.limit = finfo->limit;
+                if (result->out_bitrate == NULL)
+                    result->out_bitrate = rate_setup (10000, 1000);
+            }
             result->expire = (time_t)-1;
         }
         return result;
@@ -390,7 +527,7 @@ static fh_node *open_fh (fbinfo *finfo)
         }
         else
             INFO1 ("lookup of \"%s\"", finfo->mount);
-        if (file_open (&fh->f, fullpath) < 0)
+        if (file_open_cached (&fh->f, fullpath) < 0)
         {
             INFO1 ("Failed to open \"%s\"", fullpath);
             avl_tree_unlock (fh_cache);
@@ -400,10 +537,21 @@ static fh_node *open_fh (fbinfo *finfo)
             return NULL;
         }
         free (fullpath);
+        struct stat st;
+        if (fstat (fh->f, &st) == 0 && S_ISREG (st.st_mode))
+            fh->file_size = st.st_size;
+#ifdef POSIX_FADV_SEQUENTIAL
+        /* streaming is sequential, tell the kernel so cold files do not
+         * stall the first clients on default readahead */
+        posix_fadvise (fh->f, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise (fh->f, 0, FSERVE_READAHEAD, POSIX_FADV_WILLNEED);
+        fh->ra_pos = FSERVE_READAHEAD;
+#endif
         fh->format = calloc (1, sizeof (format_plugin_t));
         fh->format->type = fh->finfo.type;
-        fh->format->contenttype = strdup (contenttype);
-        free (contenttype);
+        /* the resolved type stays cached on the fh for its lifetime, repeat
+         * requests for the file never reach the mime lookup again */
+        fh->format->contenttype = contenttype;
         if (fh->finfo.type != FORMAT_TYPE_UNDEFINED)
         {
             fh->format->mount = strdup (fh->finfo.mount);
@@ -411,6 +559,7 @@ static fh_node *open_fh (fbinfo *finfo)
             {
                 avl_tree_unlock (fh_cache);
                 file_close (&fh->f);
+                free (fh->format->contenttype);
                 free (fh->format);
                 free (fh);
                 return NULL;
@@ -436,6 +585,11 @@ static fh_node *open_fh (fbinfo *finfo)
     fh->clients = avl_tree_new (client_compare, NULL);
     thread_mutex_create (&fh->lock);
     thread_mutex_lock (&fh->lock);
+    fh_cache_misses++;
+    fh->hits = 1;
+    fh->last_used = time (NULL);
+    if (fh->file_size)
+        __atomic_fetch_add (&fh_cache_bytes, fh->file_size, __ATOMIC_RELAXED);
     avl_insert (fh_cache, fh);
     avl_tree_unlock (fh_cache);
 
@@ -719,7 +873,7 @@ static int fserve_change_worker (client_t *client)
     if (this_worker->move_allocations == 0)
         return 0;
     thread_rwlock_rlock (&workers_lock);
-    worker = worker_selected ();
+    worker = worker_preferred (this_worker);
     if (worker && worker != client->worker)
     {
         long diff = this_worker->move_allocations < 1000000 ? this_worker->count - worker->count : 1000;
@@ -738,6 +892,76 @@ static int fserve_change_worker (client_t *client)
 
 struct _client_functions throttled_file_content_ops;
 
+/* gather the pending chained generic blocks into one writev, so a small
+ * response header block and the start of the content leave in a single
+ * syscall instead of one write per block. Consumed blocks are released as
+ * the per-block loop would have done. Returns -2 when the caller needs the
+ * per-block path.
+ */
+static int prefile_chained_writev (client_t *client, fh_node *fh)
+{
+    IOVEC iov [8];
+    refbuf_t *refbuf = client->refbuf;
+    unsigned int pos = client->pos;
+    int count = 0, ret;
+
+    if (client->format_data || (client->flags & (CLIENT_WANTS_FLV|CLIENT_WANTS_META|CLIENT_CHUNKED)))
+        return -2;
+    if (not_ssl_connection (&client->connection) == 0)
+        return -2;
+#ifdef HAVE_IO_URING
+    if (client->worker && client->worker->uring)
+        return -2;
+#endif
+#ifdef HAVE_MSG_ZEROCOPY
+    if (client->flags & CLIENT_ZEROCOPY)
+        return -2;
+#endif
+    while (refbuf && count < 8 && (refbuf->flags & REFBUF_SHARED) == 0)
+    {
+        if (refbuf->len > pos)
+        {
+            IO_VECTOR_BASE (iov + count) = refbuf->data + pos;
+            IO_VECTOR_LEN (iov + count) = refbuf->len - pos;
+            count++;
+        }
+        pos = 0;
+        refbuf = refbuf->next;
+    }
+    if (count < 2)
+        return -2;      /* nothing gained over the single block send */
+    if (connection_unreadable (&client->connection))
+        return -1;
+    ret = sock_writev (client->connection.sock, iov, count);
+    if (ret < 0)
+    {
+        if (!sock_recoverable (sock_error()))
+            client->connection.error = 1;
+        return ret;
+    }
+    if (client->connection.sent_bytes == 0)
+        connection_first_byte (&client->connection);
+    client->connection.sent_bytes += ret;
+    client->counter += ret;
+    client->queue_pos += ret;
+
+    pos = client->pos + ret;
+    while (pos >= client->refbuf->len && client->refbuf->next)
+    {
+        refbuf_t *to_go = client->refbuf;
+
+        pos -= to_go->len;
+        client->refbuf = to_go->next;
+        to_go->next = NULL;
+        if (fh->format && fh->format->detach_queue_block)
+            fh->format->detach_queue_block (NULL, client->refbuf);
+        refbuf_release (to_go);
+    }
+    client->pos = pos;
+    return ret;
+}
+
+
 static int prefile_send (client_t *client)
 {
     int loop = 8, bytes, written = 0;
@@ -791,10 +1015,17 @@ static int prefile_send (client_t *client)
             }
             client->pos = 0;
         }
-        if (refbuf->flags & WRITE_BLOCK_GENERIC)
-            bytes = format_generic_write_to_client (client);
-        else 
-            bytes = client->check_buffer (client);
+        if ((refbuf->flags & WRITE_BLOCK_GENERIC) || client->check_buffer == format_generic_write_to_client)
+            bytes = prefile_chained_writev (client, fh);
+        else
+            bytes = -2;
+        if (bytes == -2)
+        {
+            if (refbuf->flags & WRITE_BLOCK_GENERIC)
+                bytes = format_generic_write_to_client (client);
+            else
+                bytes = client->check_buffer (client);
+        }
         if (bytes < 0)
         {
             client->schedule_ms = worker->time_ms + (written ? 150 : 300);
@@ -809,6 +1040,167 @@ static int prefile_send (client_t *client)
 }
 
 
+#ifdef HAVE_SENDFILE
+/* zero copy variant of file_send for plain http clients. Nothing rewrites
+ * the stream for these so the file can go straight to the socket without
+ * passing through a refbuf.
+ */
+static int file_send_direct (client_t *client)
+{
+    fh_node *fh = client->shared_data;
+    worker_t *worker = client->worker;
+    int loop = 6;
+    ssize_t written = 0;
+
+    client->schedule_ms = worker->time_ms;
+    /* slowdown if max bandwidth is exceeded, see file_send */
+    if (throttle_sends > 1 && worker->current_time.tv_sec - client->connection.con_time > 1)
+    {
+        client->schedule_ms += 300;
+        loop = 1;
+    }
+    if (client->refbuf)
+        client_set_queue (client, NULL);    // anything buffered has been sent by now
+    while (loop && written < 48000)
+    {
+        size_t len = 48000 - written;
+        off_t offset = client->intro_offset;
+        ssize_t bytes;
+
+        loop--;
+        if (fserve_running == 0 || client->connection.error)
+            return -1;
+        if (file_in_use (fh->f) == 0)
+            return -1;
+        if (client->flags & CLIENT_RANGE_END)
+        {
+            if (client->intro_offset >= (off_t)client->connection.discon.offset)
+                return -1;
+            if (client->connection.discon.offset < (uint64_t)-1)
+            {
+                off_t range = client->connection.discon.offset - client->intro_offset + 1;
+                if (range < (off_t)len)
+                    len = range;
+            }
+        }
+        else
+            if (client->connection.discon.time && worker->current_time.tv_sec >= client->connection.discon.time)
+                return -1;
+
+        fserve_readahead (fh, offset);
+        bytes = sendfile (client->connection.sock, fh->f, &offset, len);
+        if (bytes < 0)
+        {
+            if (sock_recoverable (sock_error()))
+            {
+                client->schedule_ms += (written ? 80 : 150);
+                return 0;
+            }
+            client->connection.error = 1;
+            return -1;
+        }
+        if (bytes == 0)     // end of file
+            return -1;
+        client->intro_offset = offset;
+        client->counter += bytes;
+        client->queue_pos += bytes;
+        client->connection.sent_bytes += bytes;
+        written += bytes;
+    }
+    client->schedule_ms += 4;
+    return 0;
+}
+#endif
+
+
+/* keep an async readahead window ahead of the leading reader. the window end
+ * only moves forward, and by compare exchange so of the workers racing on a
+ * popular file just one issues the advice. laggards and backward seeks fall
+ * inside the window and cost a relaxed load only
+ */
+static void fserve_readahead (fh_node *fh, off_t offset)
+{
+#ifdef POSIX_FADV_WILLNEED
+    uint64_t pos = __atomic_load_n (&fh->ra_pos, __ATOMIC_RELAXED);
+
+    if (pos == 0 || (uint64_t)offset + FSERVE_READAHEAD/2 < pos)
+        return;
+    if (__atomic_compare_exchange_n (&fh->ra_pos, &pos, pos + FSERVE_READAHEAD,
+                0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        posix_fadvise (fh->f, pos, FSERVE_READAHEAD, POSIX_FADV_WILLNEED);
+#endif
+}
+
+
+static void *fserve_read_thread (void *arg)
+{
+    while (1)
+    {
+        thread_mutex_lock (&read_queue_lock);
+        if (read_queue)
+        {
+            file_read_t *req = read_queue;
+            client_t *client = req->client;
+            int ret;
+
+            read_queue = req->next;
+            if (read_queue == NULL)
+                read_queue_tailp = &read_queue;
+            thread_mutex_unlock (&read_queue_lock);
+
+            ret = format_file_read (client, req->fh->format, req->fh->f);
+            client->aux_data = FSERVE_READ_RESULT | (uint32_t)(ret + 2);
+            free (req);
+            client->flags |= CLIENT_ACTIVE;
+            worker_wakeup (client->worker);
+            continue;
+        }
+        read_threads--;
+        thread_mutex_unlock (&read_queue_lock);
+        break;
+    }
+    return NULL;
+}
+
+
+/* as format_file_read, but a chunk needing the file on an unmapped handle
+ * goes to a reader thread, returning -3 with the client parked until the
+ * read completes. mapped files stay inline, those are memory copies
+ */
+static int fserve_file_read (client_t *client, fh_node *fh)
+{
+    refbuf_t *refbuf = client->refbuf;
+
+    if (client->aux_data & FSERVE_READ_RESULT)
+    {
+        int ret = (int)(client->aux_data & 0xffffffff) - 2;
+        client->aux_data = 0;
+        return ret;
+    }
+    if (fserve_running && fh->f >= 0 &&
+            (refbuf == NULL || (client->pos == refbuf->len && refbuf->next == NULL)) &&
+            file_mapped (fh->f) == 0)
+    {
+        file_read_t *req = calloc (1, sizeof (*req));
+
+        req->client = client;
+        req->fh = fh;
+        client->flags &= ~CLIENT_ACTIVE;
+        thread_mutex_lock (&read_queue_lock);
+        *read_queue_tailp = req;
+        read_queue_tailp = &req->next;
+        if (read_threads < FSERVE_READ_THREADS_MAX)
+        {
+            read_threads++;
+            thread_create ("file read", fserve_read_thread, NULL, THREAD_DETACHED);
+        }
+        thread_mutex_unlock (&read_queue_lock);
+        return -3;
+    }
+    return format_file_read (client, fh->format, fh->f);
+}
+
+
 /* fast send routine */
 static int file_send (client_t *client)
 {
@@ -820,6 +1212,11 @@ static int file_send (client_t *client)
 #if 0
     if (fserve_change_worker (client)) // allow for balancing
         return 1;
+#endif
+#ifdef HAVE_SENDFILE
+    if (client->check_buffer == format_generic_write_to_client &&
+            (not_ssl_connection (&client->connection) || connection_ktls_tx (&client->connection)))
+        return file_send_direct (client);
 #endif
     client->schedule_ms = worker->time_ms;
     now = worker->current_time.tv_sec;
@@ -835,7 +1232,11 @@ static int file_send (client_t *client)
         loop--;
         if (fserve_running == 0 || client->connection.error)
             return -1;
-        if (format_file_read (client, fh->format, fh->f) < 0)
+        fserve_readahead (fh, client->intro_offset);
+        bytes = fserve_file_read (client, fh);
+        if (bytes == -3)
+            return 0;   /* parked, the reader thread hands the client back */
+        if (bytes < 0)
             return -1;
         bytes = client->check_buffer (client);
         if (bytes < 0)
@@ -888,8 +1289,11 @@ static int throttled_file_send (client_t *client)
         if (client->counter > 8192)
             return 0; // allow an initial amount without throttling
     }
-    switch (format_file_read (client, fh->format, fh->f))
+    fserve_readahead (fh, client->intro_offset);
+    switch (fserve_file_read (client, fh))
     {
+        case -3: // parked, the reader thread hands the client back
+            return 0;
         case -1: // DEBUG0 ("loop of file triggered");
             client->intro_offset = 0;
             client->schedule_ms += client->throttle ? client->throttle : 150;
@@ -940,6 +1344,15 @@ int fserve_setup_client_fb (client_t *client, fbinfo *finfo)
         if (fh)
         {
             thread_mutex_lock (&fh->lock);
+            fh_cache_hits++;
+            fh->hits++;
+            fh->last_used = time (NULL);
+            if ((finfo->flags & FS_FALLBACK) && finfo->limit && fh->finfo.limit == 0)
+            {   // preloaded without a rate, adopt the one from the dropped source
+                fh->finfo.limit = finfo->limit;
+                if (fh->out_bitrate == NULL)
+                    fh->out_bitrate = rate_setup (10000, 1000);
+            }
             avl_tree_unlock (fh_cache);
             client->shared_data = NULL;
             if (minfo)
@@ -1080,6 +1493,11 @@ int fserve_set_override (const char *mount, const char *dest, format_type_t type
             copy->stats = result->stats;
             copy->format = result->format;
             copy->f = result->f;
+            copy->file_size = result->file_size;
+            copy->hits = result->hits;
+            copy->bytes_sent = result->bytes_sent;
+            copy->last_used = result->last_used;
+            result->file_size = 0;  // accounting follows the fd
             thread_mutex_create (&copy->lock);
             copy->out_bitrate = rate_setup (10000, 1000);
             copy->clients = avl_tree_new (client_compare, NULL);
@@ -1151,11 +1569,38 @@ void fserve_write_mime_ext (const char *mimetype, char *buf, unsigned int len)
 }
 
 
+static void fserve_note_fallback (const char *fallback)
+{
+    if (fallback == NULL || fallback [0] != '/' || strchr (fallback, '$'))
+        return;     // unset, invalid, or a pattern needing expansion
+    fallback_preload_t *p = calloc (1, sizeof (*p));
+    p->mount = strdup (fallback);
+    thread_spin_lock (&pending_lock);
+    p->next = preload_list;
+    preload_list = p;
+    thread_spin_unlock (&pending_lock);
+}
+
+
+void fserve_recheck_config (ice_config_t *config)
+{
+    mount_proxy *minfo;
+    avl_node *node;
+
+    __atomic_store_n (&fh_cache_limit, (uint64_t)config->fserve_cache_limit, __ATOMIC_RELAXED);
+    for (minfo = config->mounts; minfo; minfo = minfo->next)
+        fserve_note_fallback (minfo->fallback_mount);
+    for (node = avl_get_first (config->mounts_tree); node; node = avl_get_next (node))
+        fserve_note_fallback (((mount_proxy *)node->key)->fallback_mount);
+}
+
+
 void fserve_recheck_mime_types (ice_config_t *config)
 {
     mime_type *mapping;
     int i;
     avl_tree *old_mimetypes = NULL, *new_mimetypes = avl_tree_new(_compare_mappings, NULL);
+    struct mime_index *new_index = NULL, *old_index;
 
     mime_type defaults[] = {
         { "m3u",            "audio/x-mpegurl" },
@@ -1245,12 +1690,41 @@ void fserve_recheck_mime_types (ice_config_t *config)
         fclose(mimefile);
     } while (0);
 
+    /* flatten the tree into the lookup index, single probe for the usual case */
+    do
+    {
+        unsigned int size = 16;
+        avl_node *anode;
+
+        while (size < new_mimetypes->length * 2)
+            size <<= 1;
+        new_index = calloc (1, sizeof (*new_index) + (size * sizeof (mime_type *)));
+        new_index->mask = size - 1;
+        for (anode = avl_get_first (new_mimetypes); anode; anode = avl_get_next (anode))
+        {
+            mime_type *mime = (mime_type *)anode->key;
+            unsigned int idx = mime_hash_of (mime->ext) & new_index->mask;
+
+            while (new_index->entry [idx])
+                idx = (idx + 1) & new_index->mask;
+            new_index->entry [idx] = mime;
+        }
+    } while (0);
+
     thread_spin_lock (&pending_lock);
     old_mimetypes = mimetypes;
     mimetypes = new_mimetypes;
+    old_index = mime_index_live;
+    __atomic_store_n (&mime_index_live, new_index, __ATOMIC_RELEASE);
     thread_spin_unlock (&pending_lock);
-    if (old_mimetypes)
-        avl_tree_free (old_mimetypes, _delete_mapping);
+
+    /* readers of the generation retired at the previous rebuild have long
+     * finished, drop it and park the one just replaced in its place */
+    free (mime_index_old);
+    if (mimetypes_old)
+        avl_tree_free (mimetypes_old, _delete_mapping);
+    mime_index_old = old_index;
+    mimetypes_old = old_mimetypes;
 }
 
 
@@ -1422,7 +1896,10 @@ int file_in_use (icefile_handle f)
 void file_close (icefile_handle *f)
 {
    if (*f != -1)
+   {
+       file_unmap (*f);
        close (*f);
+   }
    *f = -1;
 }
 
@@ -1434,6 +1911,247 @@ int file_open (icefile_handle *f, const char *fn)
 }
 
 
+/* shared mapping cache for small frequently replayed files such as intros and
+ * prerolls, so that each joining listener reads from a common mapping instead
+ * of going back to the file. Maps are keyed on path, shared between handles,
+ * checked against the mtime at open time and dropped when the last user goes.
+ */
+#ifndef _WIN32
+
+#define FILEMAP_SIZE_LIMIT      (1 << 26)   /* do not map oversized files */
+#define FILEMAP_HANDLES         64
+
+struct filemap
+{
+    struct filemap *next;
+    char *path;
+    time_t mtime;
+    size_t len;
+    void *ptr;
+    int refs;
+};
+
+static struct filemap *filemaps;
+static struct { icefile_handle f; struct filemap *map; } filemap_fd [FILEMAP_HANDLES];
+
+
+/* drop a reference, releasing the mapping with the last one. lock held */
+static void filemap_deref (struct filemap *map)
+{
+    if (--map->refs == 0)
+    {
+        struct filemap **trail = &filemaps;
+        while (*trail && *trail != map)
+            trail = &(*trail)->next;
+        if (*trail)
+            *trail = map->next;
+        munmap (map->ptr, map->len);
+        free (map->path);
+        free (map);
+    }
+}
+#endif
+
+
+int file_open_cached (icefile_handle *f, const char *fn)
+{
+    if (file_open (f, fn) < 0)
+        return -1;
+#ifndef _WIN32
+    struct stat st;
+
+    if (fstat (*f, &st) == 0 && S_ISREG (st.st_mode) && st.st_size > 0 && st.st_size <= FILEMAP_SIZE_LIMIT)
+    {
+        struct filemap *map;
+        int i;
+
+        thread_spin_lock (&filemap_lock);
+        for (map = filemaps; map; map = map->next)
+            if (strcmp (map->path, fn) == 0)
+                break;
+        if (map && map->mtime != st.st_mtime)
+        {
+            /* content has changed, unlink so new opens map it afresh while
+             * existing users keep the old copy until they close */
+            struct filemap **trail = &filemaps;
+            while (*trail && *trail != map)
+                trail = &(*trail)->next;
+            if (*trail)
+                *trail = map->next;
+            map = NULL;
+        }
+        if (map == NULL)
+        {
+            void *ptr;
+            thread_spin_unlock (&filemap_lock);
+            ptr = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, *f, 0);
+            if (ptr == MAP_FAILED)
+                return 0;   /* plain handle still works */
+            map = calloc (1, sizeof (*map));
+            map->path = strdup (fn);
+            map->mtime = st.st_mtime;
+            map->len = st.st_size;
+            map->ptr = ptr;
+            thread_spin_lock (&filemap_lock);
+            map->next = filemaps;
+            filemaps = map;
+        }
+        for (i = 0; i < FILEMAP_HANDLES; i++)
+            if (filemap_fd [i].map == NULL)
+            {
+                filemap_fd [i].f = *f;
+                filemap_fd [i].map = map;
+                map->refs++;
+                break;
+            }
+        if (i == FILEMAP_HANDLES && map->refs == 0)
+        {   /* handle table full and no other user, do not orphan the map */
+            map->refs = 1;
+            filemap_deref (map);
+        }
+        thread_spin_unlock (&filemap_lock);
+    }
+#endif
+    return 0;
+}
+
+
+/* detach any shared mapping from the handle, called as part of file_close */
+void file_unmap (icefile_handle f)
+{
+#ifndef _WIN32
+    if (filemaps)
+    {
+        int i;
+        thread_spin_lock (&filemap_lock);
+        for (i = 0; i < FILEMAP_HANDLES; i++)
+            if (filemap_fd [i].map && filemap_fd [i].f == f)
+            {
+                filemap_deref (filemap_fd [i].map);
+                filemap_fd [i].map = NULL;
+                break;
+            }
+        thread_spin_unlock (&filemap_lock);
+    }
+#endif
+}
+
+
+/* point the refbuf at a slice of the shared mapping when the handle has one,
+ * so every reader of a popular file works from the same pages instead of a
+ * private copy per chunk. the mapping is pinned by the open handle itself so
+ * a slice stays valid for as long as the refbuf can, the caller releases the
+ * block before detaching from the fh. returns bytes available, 0 at the end
+ * of the mapped content, or -1 when there is no mapping and the caller
+ * should read normally
+ */
+ssize_t file_cached_slice (icefile_handle f, refbuf_t *refbuf, size_t count, off_t offset)
+{
+#ifndef _WIN32
+    if (filemaps)
+    {
+        struct filemap *map = NULL;
+        int i;
+
+        thread_spin_lock (&filemap_lock);
+        for (i = 0; i < FILEMAP_HANDLES; i++)
+            if (filemap_fd [i].map && filemap_fd [i].f == f)
+            {
+                map = filemap_fd [i].map;
+                break;
+            }
+        thread_spin_unlock (&filemap_lock);
+        if (map)
+        {
+            if ((refbuf->flags & REFBUF_DATA_EXTERNAL) == 0)
+            {
+                free (refbuf->data);
+                refbuf->data = NULL;
+                refbuf->alloc_len = 0;
+                refbuf->flags |= REFBUF_DATA_EXTERNAL;
+            }
+            if (offset < 0 || (size_t)offset >= map->len)
+                return 0;
+            if (count > map->len - offset)
+                count = map->len - offset;
+            refbuf->data = (char *)map->ptr + offset;
+            return count;
+        }
+    }
+#endif
+    if (refbuf->flags & REFBUF_DATA_EXTERNAL)
+    {
+        /* mapping has gone, give the block its own storage back */
+        refbuf->data = malloc (count);
+        refbuf->alloc_len = count;
+        refbuf->flags &= ~REFBUF_DATA_EXTERNAL;
+    }
+    return -1;
+}
+
+
+/* does the handle have a shared mapping attached */
+static int file_mapped (icefile_handle f)
+{
+#ifndef _WIN32
+    if (filemaps)
+    {
+        int i, found = 0;
+
+        thread_spin_lock (&filemap_lock);
+        for (i = 0; i < FILEMAP_HANDLES; i++)
+            if (filemap_fd [i].map && filemap_fd [i].f == f)
+            {
+                found = 1;
+                break;
+            }
+        thread_spin_unlock (&filemap_lock);
+        return found;
+    }
+#endif
+    return 0;
+}
+
+
+/* read from the shared mapping when the handle has one, else from the file */
+ssize_t file_cached_read (icefile_handle f, void *data, size_t count, off_t offset)
+{
+#ifndef _WIN32
+    if (filemaps)
+    {
+        struct filemap *map = NULL;
+        int i;
+
+        thread_spin_lock (&filemap_lock);
+        for (i = 0; i < FILEMAP_HANDLES; i++)
+            if (filemap_fd [i].map && filemap_fd [i].f == f)
+            {
+                map = filemap_fd [i].map;
+                map->refs++;        /* pin over the copy */
+                break;
+            }
+        thread_spin_unlock (&filemap_lock);
+        if (map)
+        {
+            ssize_t bytes = 0;
+            if (offset >= 0 && (size_t)offset < map->len)
+            {
+                bytes = map->len - offset;
+                if ((size_t)bytes > count)
+                    bytes = count;
+                memcpy (data, (char *)map->ptr + offset, bytes);
+            }
+            thread_spin_lock (&filemap_lock);
+            filemap_deref (map);
+            thread_spin_unlock (&filemap_lock);
+            return bytes;
+        }
+    }
+#endif
+    return pread (f, data, count, offset);
+}
+
+
 #ifndef HAVE_PREAD
 ssize_t pread (icefile_handle f, void *data, size_t count, off_t offset)
 {
@@ -1450,10 +2168,70 @@ ssize_t pread (icefile_handle f, void *data, size_t count, off_t offset)
 #endif
 
 
+/* open and pin any fallback files the config reader queued. entries go in
+ * with FS_FALLBACK and no rate so they never time out, the rate is adopted
+ * from the dropped source when listeners actually arrive
+ */
+static void fserve_preload_fallbacks (void)
+{
+    do
+    {
+        fallback_preload_t *p;
+        struct stat st;
+        fbinfo finfo;
+
+        thread_spin_lock (&pending_lock);
+        p = preload_list;
+        if (p)
+            preload_list = p->next;
+        thread_spin_unlock (&pending_lock);
+        if (p == NULL)
+            break;
+
+        memset (&finfo, 0, sizeof (finfo));
+        finfo.mount = p->mount;
+        finfo.flags = FS_FALLBACK;
+        finfo.type = FORMAT_TYPE_UNDEFINED;
+        char *path = util_get_path_from_normalised_uri (p->mount, 0);
+        if (path && stat (path, &st) == 0 && S_ISREG (st.st_mode))
+        {
+            avl_tree_wlock (fh_cache);
+            if (find_fh (&finfo))
+                avl_tree_unlock (fh_cache);     // already open, stays pinned
+            else
+            {
+                fh_node *fh = open_fh (&finfo);     // drops the tree lock
+                if (fh)
+                {
+#ifdef POSIX_FADV_WILLNEED
+                    if (fh->f >= 0 && fh->file_size)
+                    {
+                        posix_fadvise (fh->f, 0, 0, POSIX_FADV_WILLNEED);   // whole file this time
+                        fh->ra_pos = fh->file_size;
+                    }
+#endif
+                    INFO2 ("preloaded fallback %s (%" PRIu64 " bytes)", p->mount, fh->file_size);
+                    thread_mutex_unlock (&fh->lock);
+                }
+                else
+                    WARN1 ("failed to preload fallback %s", p->mount);
+            }
+        }
+        // else the fallback names another stream, nothing to preload
+        free (path);
+        free (p->mount);
+        free (p);
+    } while (1);
+}
+
+
 void fserve_scan (time_t now)
 {
     avl_node *node;
 
+    if (now)
+        fserve_preload_fallbacks ();
+
     global_lock();
     if (global.running != ICE_RUNNING)
         now = (time_t)0;
@@ -1475,7 +2253,7 @@ void fserve_scan (time_t now)
             continue;
         }
 
-        if (fh->finfo.limit)
+        if (fh->finfo.limit || fh->file_size)
         {
             fbinfo *finfo = &fh->finfo;
             if (fh->stats == 0)
@@ -1486,7 +2264,15 @@ void fserve_scan (time_t now)
                 snprintf (str, len, "%s-%s", (finfo->flags & FS_FALLBACK) ? "fallback" : "file", finfo->mount);
                 fh->stats = stats_handle (str);
                 stats_set_flags (fh->stats, "fallback", "file", STATS_COUNTERS|STATS_HIDDEN);
-                stats_set_flags (fh->stats, "outgoing_kbitrate", "0", STATS_COUNTERS|STATS_HIDDEN);
+                if (finfo->limit)
+                    stats_set_flags (fh->stats, "outgoing_kbitrate", "0", STATS_COUNTERS|STATS_HIDDEN);
+                if (fh->file_size)
+                {
+                    snprintf (buf, sizeof (buf), "%" PRIu64, fh->file_size);
+                    stats_set_flags (fh->stats, "file_size", buf, STATS_COUNTERS|STATS_HIDDEN);
+                }
+                stats_set_flags (fh->stats, "cache_hits", "0", STATS_COUNTERS|STATS_HIDDEN);
+                stats_set_flags (fh->stats, "cache_bytes_sent", "0", STATS_COUNTERS|STATS_HIDDEN);
                 snprintf (buf, sizeof (buf), "%d", fh->refcount);
                 stats_set_flags (fh->stats, "listeners", buf, STATS_GENERAL|STATS_HIDDEN);
                 snprintf (buf, sizeof (buf), "%d", fh->peak);
@@ -1506,8 +2292,11 @@ void fserve_scan (time_t now)
             if (fh->stats_update <= now)
             {
                 fh->stats_update = now + 5;
-                stats_set_args (fh->stats, "outgoing_kbitrate", "%ld",
-                        (long)((8 * rate_avg (fh->out_bitrate))/1024));
+                if (fh->finfo.limit)
+                    stats_set_args (fh->stats, "outgoing_kbitrate", "%ld",
+                            (long)((8 * rate_avg (fh->out_bitrate))/1024));
+                stats_set_args (fh->stats, "cache_hits", "%" PRIu64, fh->hits);
+                stats_set_args (fh->stats, "cache_bytes_sent", "%" PRIu64, fh->bytes_sent);
             }
             stats_release (fh->stats);
         }
@@ -1527,6 +2316,43 @@ void fserve_scan (time_t now)
         }
         thread_mutex_unlock (&fh->lock);
     }
+    uint64_t limit = __atomic_load_n (&fh_cache_limit, __ATOMIC_RELAXED);
+    while (now && limit && __atomic_load_n (&fh_cache_bytes, __ATOMIC_RELAXED) > limit)
+    {
+        /* over budget, drop the least recently used idle entry. attaches need
+         * the tree lock held here so a 0 refcount cannot change under us */
+        fh_node *oldest = NULL;
+        node = avl_get_first (fh_cache);
+        while (node)
+        {
+            fh_node *fh = node->key;
+            node = avl_get_next (node);
+            if (fh == &no_file || fh->refcount || fh->expire == (time_t)-1 || fh->file_size == 0)
+                continue;
+            if (oldest == NULL || fh->last_used < oldest->last_used)
+                oldest = fh;
+        }
+        if (oldest == NULL)
+            break;      // everything left is busy or pinned
+        thread_mutex_lock (&oldest->lock);
+        INFO2 ("cache over budget, dropping %s (%" PRIu64 " bytes)", oldest->finfo.mount, oldest->file_size);
+        if (oldest->stats)
+        {
+            stats_lock (oldest->stats, NULL);
+            stats_set (oldest->stats, NULL, NULL);
+        }
+        fh_cache_evictions++;
+        remove_fh_from_cache (oldest);
+        thread_mutex_unlock (&oldest->lock);
+        _delete_fh (oldest);
+    }
+    if (now)
+    {
+        stats_event_args (NULL, "fserve_cache_bytes", "%" PRIu64, __atomic_load_n (&fh_cache_bytes, __ATOMIC_RELAXED));
+        stats_event_args (NULL, "fserve_cache_hits", "%" PRIu64, fh_cache_hits);
+        stats_event_args (NULL, "fserve_cache_misses", "%" PRIu64, fh_cache_misses);
+        stats_event_args (NULL, "fserve_cache_evictions", "%" PRIu64, fh_cache_evictions);
+    }
     avl_tree_unlock (fh_cache);
 }
 
@@ -43,6 +43,7 @@ void fserve_shutdown(void);
 int fserve_client_create(client_t *httpclient, const char *path);
 char *fserve_content_type (const char *path);
 void fserve_recheck_mime_types (ice_config_t *config);
+void fserve_recheck_config (ice_config_t *config);
 
 int  fserve_setup_client (client_t *client);
 int  fserve_setup_client_fb (client_t *client, fbinfo *finfo);
@@ -55,7 +56,11 @@ void fserve_write_mime_ext (const char *mimetype, char *buf, unsigned int len);
 
 int  file_in_use (icefile_handle f);
 int  file_open (icefile_handle *f, const char *fn);
+int  file_open_cached (icefile_handle *f, const char *fn);
 void file_close (icefile_handle *f);
+void file_unmap (icefile_handle f);
+ssize_t file_cached_read (icefile_handle f, void *data, size_t count, off_t offset);
+ssize_t file_cached_slice (icefile_handle f, refbuf_t *refbuf, size_t count, off_t offset);
 #ifndef HAVE_PREAD
 ssize_t pread (icefile_handle f, void *data, size_t count, off_t offset);
 #endif
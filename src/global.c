@@ -42,11 +42,13 @@ void global_initialize(void)
 #endif
     thread_mutex_create(&_global_mutex);
     thread_rwlock_create(&global.workers_rw);
+    client_pool_init ();
     global.out_bitrate = rate_setup (20000, 1000);
 }
 
 void global_shutdown(void)
 {
+    client_pool_shutdown ();
     thread_rwlock_destroy(&global.workers_rw);
     thread_mutex_destroy(&_global_mutex);
     avl_tree_free(global.source_tree, NULL);
@@ -82,7 +84,10 @@ unsigned long global_getrate_avg (struct rate_calc *rate)
     unsigned long avg = rate_avg (rate);
     if (global.max_rate)
     {
-        float ratio = avg / global.max_rate;
+        /* throttle off the instant rate when it runs ahead of the windowed
+         * average, a burst should back sends off before the window catches up */
+        long inst = rate_avg_inst (rate);
+        float ratio = (inst > (long)avg ? inst : avg) / global.max_rate;
         if (ratio > 0.99)
             throttle_sends = 3;
         else if (ratio > 0.9)
@@ -119,34 +124,33 @@ typedef struct
 void *my_calloc (const char *file, int line, size_t num, size_t size)
 {
     alloc_node match, *result;
+    allocheader *block = calloc (1, (num*size)+sizeof(allocheader));
+
+    if (block == NULL)
+        return NULL;
     snprintf (match.name, sizeof (match.name), "%s:%d", file, line);
 
     avl_tree_wlock (global.alloc_tree);
-    if (avl_get_by_key (global.alloc_tree, &match, (void**)&result) == 0)
-    {
-        allocheader *block = calloc (1, (num*size)+sizeof(allocheader));
-        result->count++;
-        result->allocated += (num*size);
-        block->info = result;
-        block->len = num*size;
-        avl_tree_unlock (global.alloc_tree);
-        return block+1;
-    }
-    result = calloc (1, sizeof(alloc_node));
-    if (result)
+    if (avl_get_by_key (global.alloc_tree, &match, (void**)&result))
     {
-        allocheader *block = calloc (1, (num*size)+sizeof(allocheader));
+        result = calloc (1, sizeof(alloc_node));
+        if (result == NULL)
+        {
+            avl_tree_unlock (global.alloc_tree);
+            free (block);
+            return NULL;
+        }
         snprintf (result->name, sizeof (result->name), "%s:%d", file, line);
-        result->count = 1;
-        result->allocated = (num * size);
         avl_insert (global.alloc_tree, result);
-        block->info = result;
-        block->len = num*size;
-        avl_tree_unlock (global.alloc_tree);
-        return block+1;
     }
+    result->count++;
+    result->allocated += (num*size);
+    if (result->allocated > result->peak)
+        result->peak = result->allocated;
+    block->info = result;
+    block->len = num*size;
     avl_tree_unlock (global.alloc_tree);
-    return NULL;
+    return block+1;
 }
 int free_alloc_node(void *key)
 {
@@ -188,6 +192,8 @@ void *my_realloc (const char *file, int line, void *ptr, size_t size)
     info = newblock->info;
     info->allocated -= newblock->len;
     info->allocated += size;
+    if (info->allocated > info->peak)
+        info->peak = info->allocated;
     newblock->len = size;
     avl_tree_unlock (global.alloc_tree);
     return newblock+1;
@@ -25,6 +25,7 @@
 #include "net/sock.h"
 #include "compat.h"
 #include "avl/avl.h"
+#include "util.h"
 
 typedef struct ice_global_tag
 {
@@ -55,6 +56,7 @@ typedef struct ice_global_tag
     int64_t max_rate;
 
     struct rate_calc *out_bitrate;
+    bw_bucket_t bw_out;     /* server wide outgoing token bucket */
 
     rwlock_t workers_rw;
 } ice_global_t;
@@ -82,8 +84,9 @@ int free_alloc_node(void *key);
 
 typedef struct {
     char name[54];
-    int count;
-    int allocated;
+    ssize_t count;
+    ssize_t allocated;
+    ssize_t peak;       /* high water mark of allocated, never reset */
 } alloc_node;
 
 #endif
@@ -0,0 +1,327 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* hls.c
+**
+** rolling in-memory HLS segmenter. The mpeg framed formats already queue
+** frame aligned blocks, so segments are built by collecting references to
+** the queue blocks until the target duration passes and cutting at the
+** next block boundary. Segments therefore share memory with the live
+** queue, only a playlist or segment request generates separate buffers.
+**
+** enabled per mount with <hls>, the playlist is served from <mount>.m3u8
+** and segments from <mount>.m3u8?seg=N
+**
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compat.h"
+#include "refbuf.h"
+#include "source.h"
+#include "client.h"
+#include "global.h"
+#include "cfgfile.h"
+#include "fserve.h"
+#include "util.h"
+#include "httpp/httpp.h"
+
+#include "hls.h"
+
+#define CATMODULE "hls"
+
+#include "logging.h"
+
+/* segments kept beyond the playlist window, so a player fetching the
+ * oldest advertised segment still finds it after the window moves on */
+#define HLS_WINDOW_EXTRA    2
+#define HLS_SEGMENTS_MAX    (16 + HLS_WINDOW_EXTRA)
+
+struct hls_segment
+{
+    int64_t id;
+    unsigned int len;
+    unsigned int duration_ms;
+    unsigned int count;
+    refbuf_t **blocks;
+};
+
+struct hls_output
+{
+    int64_t next_id;
+    unsigned int target_ms;     /* requested segment length */
+    unsigned int window;        /* segments listed in the playlist */
+    unsigned int depth;         /* segments held, window plus a little history */
+
+    uint64_t build_start;       /* worker time the building segment began */
+    struct
+    {
+        unsigned int count;
+        unsigned int alloc;
+        unsigned int len;
+        refbuf_t **blocks;
+    } building;
+
+    struct hls_segment ring [HLS_SEGMENTS_MAX];
+    unsigned int head;
+    unsigned int count;
+};
+
+
+static void segment_clear (struct hls_segment *seg)
+{
+    unsigned int i;
+
+    for (i = 0; i < seg->count; i++)
+        refbuf_release (seg->blocks [i]);
+    free (seg->blocks);
+    memset (seg, 0, sizeof (*seg));
+}
+
+
+/* create the segmenter on a source if the mount asks for one. Called with
+ * the source locked when the first block is about to be queued, so the
+ * format type is known by now
+ */
+void hls_check (source_t *source, mount_proxy *mountinfo)
+{
+    struct hls_output *out;
+    int length, window;
+
+    if (source->hls || mountinfo == NULL || mountinfo->hls == 0)
+        return;
+    if (source->format->type != FORMAT_TYPE_MPEG && source->format->type != FORMAT_TYPE_AAC)
+    {
+        WARN1 ("hls requested on %s but the format is not mpeg framed", source->mount);
+        return;
+    }
+    length = mountinfo->hls_segment_length;
+    if (length < 1 || length > 30)
+        length = 4;
+    window = mountinfo->hls_segment_count;
+    if (window < 2 || window > 16)
+        window = 5;
+
+    out = calloc (1, sizeof (*out));
+    out->target_ms = length * 1000;
+    out->window = window;
+    out->depth = window + HLS_WINDOW_EXTRA;
+    source->hls = out;
+    INFO3 ("hls segmenter on %s, %d second segments, window of %d", source->mount, length, window);
+}
+
+
+void hls_stop (source_t *source)
+{
+    struct hls_output *out = source->hls;
+    unsigned int i;
+
+    if (out == NULL)
+        return;
+    for (i = 0; i < out->count; i++)
+        segment_clear (&out->ring [(out->head + i) % out->depth]);
+    for (i = 0; i < out->building.count; i++)
+        refbuf_release (out->building.blocks [i]);
+    free (out->building.blocks);
+    free (out);
+    source->hls = NULL;
+}
+
+
+/* take a reference on the queue block for the building segment, cutting a
+ * segment once the target duration has passed. Runs on the source thread
+ * with the source locked, blocks are already frame aligned
+ */
+void hls_queue_block (source_t *source, refbuf_t *refbuf)
+{
+    struct hls_output *out = source->hls;
+    uint64_t now = source->client->worker->time_ms;
+
+    if (out->building.count == 0)
+        out->build_start = now;
+    if (out->building.count == out->building.alloc)
+    {
+        unsigned int alloc = out->building.alloc ? out->building.alloc << 1 : 64;
+        refbuf_t **blocks = realloc (out->building.blocks, alloc * sizeof (refbuf_t *));
+        if (blocks == NULL)
+            return;
+        out->building.blocks = blocks;
+        out->building.alloc = alloc;
+    }
+    refbuf_addref (refbuf);
+    out->building.blocks [out->building.count++] = refbuf;
+    out->building.len += refbuf->len;
+
+    if (now - out->build_start >= out->target_ms)
+    {
+        struct hls_segment *seg;
+
+        if (out->count == out->depth)
+        {
+            segment_clear (&out->ring [out->head]);
+            out->head = (out->head + 1) % out->depth;
+            out->count--;
+        }
+        seg = &out->ring [(out->head + out->count) % out->depth];
+        seg->id = out->next_id++;
+        seg->len = out->building.len;
+        seg->duration_ms = (unsigned int)(now - out->build_start);
+        seg->count = out->building.count;
+        seg->blocks = out->building.blocks;
+        out->count++;
+
+        memset (&out->building, 0, sizeof (out->building));
+    }
+}
+
+
+static int hls_send_playlist (source_t *source, const char *mount, client_t *client)
+{
+    struct hls_output *out = source->hls;
+    refbuf_t *body = refbuf_new (4096);
+    const char *name = strrchr (mount, '/');
+    unsigned int i, first = 0, target = 1;
+    int len = 0;
+
+    name = name ? name + 1 : mount;
+    if (out->count > out->window)
+        first = out->count - out->window;
+    for (i = first; i < out->count; i++)
+    {
+        struct hls_segment *seg = &out->ring [(out->head + i) % out->depth];
+        if ((seg->duration_ms + 999) / 1000 > target)
+            target = (seg->duration_ms + 999) / 1000;
+    }
+    len = snprintf (body->data, body->len, "#EXTM3U\r\n"
+            "#EXT-X-VERSION:3\r\n"
+            "#EXT-X-TARGETDURATION:%u\r\n"
+            "#EXT-X-MEDIA-SEQUENCE:%" PRId64 "\r\n",
+            target,
+            out->count ? out->ring [(out->head + first) % out->depth].id : (int64_t)0);
+    for (i = first; i < out->count; i++)
+    {
+        struct hls_segment *seg = &out->ring [(out->head + i) % out->depth];
+        len += snprintf (body->data + len, body->len - len,
+                "#EXTINF:%u.%03u,\r\n%s?seg=%" PRId64 "\r\n",
+                seg->duration_ms / 1000, seg->duration_ms % 1000, name, seg->id);
+    }
+    body->len = len;
+    body->flags |= WRITE_BLOCK_GENERIC;
+
+    snprintf (client->refbuf->data, PER_CLIENT_REFBUF_SIZE,
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: application/vnd.apple.mpegurl\r\n"
+            "Content-Length: %d\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Access-Control-Allow-Origin: *\r\n\r\n", len);
+    client->refbuf->len = strlen (client->refbuf->data);
+    client->refbuf->flags |= WRITE_BLOCK_GENERIC;
+    client->refbuf->next = body;
+    client->respcode = 200;
+    thread_rwlock_unlock (&source->lock);
+    return fserve_setup_client (client);
+}
+
+
+static int hls_send_segment (source_t *source, client_t *client, int64_t id)
+{
+    struct hls_output *out = source->hls;
+    struct hls_segment *seg = NULL;
+    const char *contenttype = source->format->contenttype;
+    refbuf_t *body;
+    unsigned int i, len = 0;
+
+    for (i = 0; i < out->count; i++)
+    {
+        struct hls_segment *check = &out->ring [(out->head + i) % out->depth];
+        if (check->id == id)
+        {
+            seg = check;
+            break;
+        }
+    }
+    if (seg == NULL)
+    {
+        thread_rwlock_unlock (&source->lock);
+        return client_send_404 (client, "segment expired");
+    }
+    /* the blocks are shared with the live queue so cannot be chained for
+     * sending, a fetch flattens the segment into one buffer instead */
+    body = refbuf_new (seg->len);
+    for (i = 0; i < seg->count; i++)
+    {
+        memcpy (body->data + len, seg->blocks [i]->data, seg->blocks [i]->len);
+        len += seg->blocks [i]->len;
+    }
+    body->len = len;
+    body->flags |= WRITE_BLOCK_GENERIC;
+    client->refbuf->next = body;
+    snprintf (client->refbuf->data, PER_CLIENT_REFBUF_SIZE,
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %u\r\n"
+            "Cache-Control: max-age=%u\r\n"
+            "Access-Control-Allow-Origin: *\r\n\r\n",
+            contenttype ? contenttype : "application/octet-stream",
+            seg->len, (out->target_ms / 1000) * out->window);
+    client->refbuf->len = strlen (client->refbuf->data);
+    client->refbuf->flags |= WRITE_BLOCK_GENERIC;
+    client->respcode = 200;
+    thread_rwlock_unlock (&source->lock);
+    return fserve_setup_client (client);
+}
+
+
+/* handle a request ending in .m3u8, mapping it back to the source mount.
+ * returns the playlist or, with a seg query parameter, a stored segment
+ */
+int hls_client_request (const char *mount, client_t *client)
+{
+    char stream [4096];
+    size_t len = strlen (mount);
+    source_t *source;
+    const char *param;
+
+    if (len < 6 || len >= sizeof (stream))
+        return client_send_404 (client, "Not found");
+    memcpy (stream, mount, len - 5);    /* drop the .m3u8 */
+    stream [len - 5] = '\0';
+
+    avl_tree_rlock (global.source_tree);
+    source = source_find_mount_raw (stream);
+    if (source)
+    {
+        thread_rwlock_wlock (&source->lock);
+        avl_tree_unlock (global.source_tree);
+        if (source_available (source) && source->hls)
+        {
+            param = httpp_get_query_param (client->parser, "seg");
+            if (param)
+            {
+                int64_t id = -1;
+                sscanf (param, "%" SCNd64, &id);
+                return hls_send_segment (source, client, id);
+            }
+            return hls_send_playlist (source, mount, client);
+        }
+        thread_rwlock_unlock (&source->lock);
+    }
+    else
+        avl_tree_unlock (global.source_tree);
+    return client_send_404 (client, "hls stream not found");
+}
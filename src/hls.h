@@ -0,0 +1,32 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* hls.h
+**
+** rolling in-memory HLS segmenter
+**
+*/
+#ifndef __HLS_H__
+#define __HLS_H__
+
+#include "refbuf.h"
+#include "client.h"
+#include "cfgfile.h"
+
+struct source_tag;
+
+void hls_check (struct source_tag *source, mount_proxy *mountinfo);
+void hls_stop (struct source_tag *source);
+void hls_queue_block (struct source_tag *source, refbuf_t *refbuf);
+int  hls_client_request (const char *mount, client_t *client);
+
+#endif  /* __HLS_H__ */
@@ -27,7 +27,7 @@
 #define strcasecmp stricmp
 #endif
 
-#define MAX_HEADERS 32
+#define MAX_HEADERS HTTPP_MAX_HEADERS
 
 /* internal functions */
 
@@ -49,6 +49,9 @@ void httpp_initialize(http_parser_t *parser, http_varlist_t *defaults)
 
     parser->req_type = httpp_req_none;
     parser->uri = NULL;
+    parser->block = NULL;
+    parser->headers = 0;
+    parser->queries = 0;
     parser->vars = avl_tree_new(_compare_vars, NULL);
     parser->queryvars = avl_tree_new(_compare_vars, NULL);
 
@@ -90,6 +93,57 @@ static int split_headers(char *data, unsigned long len, char **line)
     return lines;
 }
 
+/* the parsed headers live in a flat table pointing into the request copy held
+ * on the parser, so no allocations are made per header. Lookup order is not
+ * significant, removal swaps the last entry in. A folded hash of each name is
+ * kept alongside the table so a probe is a byte compare in the common case,
+ * with the strcmp only confirming an actual hit.
+ */
+static unsigned char _name_hash(const char *name)
+{
+    unsigned int hash = 5381;
+
+    while (*name)
+        hash = hash * 33 + (unsigned char)*name++;
+    return (unsigned char)(hash ^ (hash >> 8));
+}
+
+static http_var_t *_header_find(http_parser_t *parser, const char *name)
+{
+    int i;
+    unsigned char hash = _name_hash(name);
+
+    for (i = 0; i < parser->headers; i++)
+        if (parser->header_hash[i] == hash && strcmp(parser->header[i].name, name) == 0)
+            return &parser->header[i];
+    return NULL;
+}
+
+static void _header_remove(http_parser_t *parser, const char *name)
+{
+    http_var_t *var = _header_find(parser, name);
+
+    if (var)
+    {
+        int last = --parser->headers;
+        *var = parser->header[last];
+        parser->header_hash[var - parser->header] = parser->header_hash[last];
+    }
+}
+
+/* query parameters get the same flat table treatment, but own their strings
+ * as the values are unescaped copies */
+static http_var_t *_query_find(http_parser_t *parser, const char *name)
+{
+    int i;
+    unsigned char hash = _name_hash(name);
+
+    for (i = 0; i < parser->queries; i++)
+        if (parser->query_hash[i] == hash && strcmp(parser->query[i].name, name) == 0)
+            return &parser->query[i];
+    return NULL;
+}
+
 static void parse_headers(http_parser_t *parser, char **line, int lines)
 {
     int i,l;
@@ -115,15 +169,23 @@ static void parse_headers(http_parser_t *parser, char **line, int lines)
 
                     if (i < slen)
                         value = &line[l][i];
-                    
+
                     break;
                 }
             }
         }
-        
+
         if (name != NULL && value != NULL) {
-            httpp_setvar(parser, _lowercase(name), value);
-            name = NULL; 
+            http_var_t *var = _header_find(parser, _lowercase(name));
+            if (var == NULL && parser->headers < MAX_HEADERS) {
+                var = &parser->header[parser->headers];
+                parser->header_hash[parser->headers++] = _name_hash(name);
+            }
+            if (var) {
+                var->name = name;
+                var->value = value;
+            }
+            name = NULL;
             value = NULL;
         }
     }
@@ -184,7 +246,8 @@ int httpp_parse_response(http_parser_t *parser, const char *http_data, unsigned
 
     parse_headers(parser, line, lines);
 
-    free(data);
+    free(parser->block);
+    parser->block = data;   /* the header table points into this */
 
     return 1;
 }
@@ -432,7 +495,8 @@ int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len)
 
     parse_headers(parser, line, lines);
 
-    free(data);
+    free(parser->block);
+    parser->block = data;   /* the header table points into this */
 
     return 1;
 }
@@ -443,6 +507,7 @@ void httpp_deletevar(http_parser_t *parser, const char *name)
 
     if (parser == NULL || name == NULL)
         return;
+    _header_remove(parser, name);
     var.name = (char*)name;
     var.value = NULL;
     avl_delete(parser->vars, (void *)&var, _free_vars);
@@ -458,6 +523,7 @@ void httpp_setvar(http_parser_t *parser, const char *name, const char *value)
     var = (http_var_t *)malloc(sizeof(http_var_t));
     if (var == NULL) return;
 
+    _header_remove(parser, name);   /* tree entries take precedence */
     var->name = strdup(name);
     var->value = strdup(value);
 
@@ -478,6 +544,10 @@ const char *httpp_getvar(http_parser_t *parser, const char *name)
     if (parser == NULL || name == NULL || parser->vars == NULL)
         return NULL;
 
+    found = _header_find(parser, name);
+    if (found)
+        return found->value;
+
     fp = &found;
     var.name = (char*)name;
     var.value = NULL;
@@ -495,6 +565,21 @@ void httpp_set_query_param(http_parser_t *parser, const char *name, const char *
     if (name == NULL || value == NULL)
         return;
 
+    var = _query_find(parser, name);
+    if (var) {
+        free(var->value);
+        var->value = url_escape(value);
+        return;
+    }
+    if (parser->queries < MAX_HEADERS) {
+        var = &parser->query[parser->queries];
+        parser->query_hash[parser->queries++] = _name_hash(name);
+        var->name = strdup(name);
+        var->value = url_escape(value);
+        return;
+    }
+
+    /* table full, overflow into the tree */
     var = (http_var_t *)malloc(sizeof(http_var_t));
     if (var == NULL) return;
 
@@ -515,6 +600,10 @@ const char *httpp_get_query_param(http_parser_t *parser, const char *name)
     http_var_t *found;
     void *fp;
 
+    found = _query_find(parser, name);
+    if (found)
+        return found->value;
+
     fp = &found;
     var.name = (char *)name;
     var.value = NULL;
@@ -531,6 +620,14 @@ void httpp_clear(http_parser_t *parser)
     if (parser->uri)
         free(parser->uri);
     parser->uri = NULL;
+    free(parser->block);
+    parser->block = NULL;
+    parser->headers = 0;
+    while (parser->queries > 0) {
+        parser->queries--;
+        free(parser->query[parser->queries].name);
+        free(parser->query[parser->queries].value);
+    }
     avl_tree_free(parser->vars, _free_vars);
     avl_tree_free(parser->queryvars, _free_vars);
     parser->vars = NULL;
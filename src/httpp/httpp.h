@@ -36,9 +36,19 @@ typedef struct http_varlist_tag {
     struct http_varlist_tag *next;
 } http_varlist_t;
 
+#define HTTPP_MAX_HEADERS 32
+
 typedef struct http_parser_tag {
     httpp_request_type_e req_type;
     char *uri;
+    char *block;        /* copy of the request, the header table points into it */
+    int headers;
+    int queries;
+    http_var_t header [HTTPP_MAX_HEADERS];
+    http_var_t query [HTTPP_MAX_HEADERS];
+    /* name hashes matching the tables above, checked ahead of the strcmp */
+    unsigned char header_hash [HTTPP_MAX_HEADERS];
+    unsigned char query_hash [HTTPP_MAX_HEADERS];
     avl_tree *vars;
     avl_tree *queryvars;
 } http_parser_t;
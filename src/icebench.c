@@ -0,0 +1,434 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org>,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* icebench.c
+ *
+ * listener load generator for benchmarking scheduler and send path changes.
+ * Simulates N concurrent listeners against a running server with optional
+ * join/leave churn, per-client read throttling (slow client emulation) and
+ * ICY metadata parsing. Reports achieved throughput, connect latency
+ * percentiles and, when given the server pid, server CPU usage, so changes
+ * to client.c and source.c can ship with before/after numbers.
+ *
+ * Not built by default, use  make icebench  in src.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define BENCH_READ_SIZE         8192
+
+typedef enum
+{
+    BENCH_FREE = 0,             /* slot unused, candidate for a join */
+    BENCH_CONNECTING,           /* connect() in progress */
+    BENCH_REQ_SENT,             /* request written, awaiting response */
+    BENCH_STREAMING             /* headers consumed, counting body bytes */
+} bench_state_t;
+
+typedef struct bench_client
+{
+    int fd;
+    bench_state_t state;
+    uint64_t connect_ms;        /* when connect() was issued */
+    uint64_t bytes;             /* stream bytes read on this connection */
+    long tick_allowance;        /* bytes still readable this tick, throttled */
+    long metaint;               /* from icy-metaint response header */
+    long meta_countdown;        /* stream bytes until next metadata block */
+    int meta_remaining;         /* metadata block bytes still to consume */
+    int hdr_len;
+    char hdr [2048];
+} bench_client_t;
+
+static struct sockaddr_in bench_addr;
+static const char *bench_mount = "/test.mp3";
+static int bench_clients = 10,
+           bench_duration = 10,
+           bench_churn = 0,         /* listeners replaced per second */
+           bench_want_meta = 0;
+static long bench_throttle = 0;     /* per client bytes/sec, 0 is unlimited */
+static long bench_server_pid = 0;
+
+static uint64_t total_bytes, total_meta_blocks, total_joins, total_failures;
+static uint64_t *latencies;
+static unsigned latency_count;
+
+
+static uint64_t bench_time_ms (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* utime+stime of the server process in clock ticks, 0 on any failure */
+static uint64_t bench_server_cpu (void)
+{
+    char path [64], buf [1024], *p;
+    unsigned long utime, stime;
+    int fd, len;
+
+    if (bench_server_pid == 0)
+        return 0;
+    snprintf (path, sizeof path, "/proc/%ld/stat", bench_server_pid);
+    fd = open (path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    len = read (fd, buf, sizeof buf - 1);
+    close (fd);
+    if (len <= 0)
+        return 0;
+    buf [len] = '\0';
+    p = strrchr (buf, ')');     /* comm may contain spaces, skip past it */
+    if (p == NULL || sscanf (p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return 0;
+    return (uint64_t)utime + stime;
+}
+
+
+static void bench_drop (bench_client_t *client)
+{
+    if (client->fd >= 0)
+        close (client->fd);
+    client->fd = -1;
+    client->state = BENCH_FREE;
+}
+
+
+static int bench_join (bench_client_t *client)
+{
+    int fd = socket (AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0)
+        return -1;
+    fcntl (fd, F_SETFL, O_NONBLOCK);
+    client->fd = fd;
+    client->connect_ms = bench_time_ms ();
+    client->bytes = 0;
+    client->hdr_len = 0;
+    client->metaint = 0;
+    client->meta_countdown = 0;
+    client->meta_remaining = 0;
+    if (connect (fd, (struct sockaddr *)&bench_addr, sizeof bench_addr) < 0 && errno != EINPROGRESS)
+    {
+        bench_drop (client);
+        total_failures++;
+        return -1;
+    }
+    client->state = BENCH_CONNECTING;
+    total_joins++;
+    return 0;
+}
+
+
+static void bench_send_request (bench_client_t *client)
+{
+    char req [512];
+    int len = snprintf (req, sizeof req,
+            "GET %s HTTP/1.0\r\nHost: icebench\r\nUser-Agent: icebench\r\n%s\r\n",
+            bench_mount, bench_want_meta ? "Icy-MetaData: 1\r\n" : "");
+
+    if (send (client->fd, req, len, 0) < len)
+    {
+        bench_drop (client);
+        total_failures++;
+        return;
+    }
+    client->state = BENCH_REQ_SENT;
+}
+
+
+/* consume stream bytes, stepping over interleaved metadata blocks when the
+ * server honoured Icy-MetaData. */
+static void bench_account (bench_client_t *client, char *buf, int len)
+{
+    while (len > 0)
+    {
+        if (client->meta_remaining)
+        {
+            int meta = client->meta_remaining < len ? client->meta_remaining : len;
+            client->meta_remaining -= meta;
+            buf += meta;
+            len -= meta;
+            continue;
+        }
+        if (client->metaint)
+        {
+            if (client->meta_countdown == 0)
+            {
+                client->meta_remaining = ((unsigned char)buf [0]) * 16;
+                client->meta_countdown = client->metaint;
+                if (client->meta_remaining)
+                    total_meta_blocks++;
+                buf++;
+                len--;
+                continue;
+            }
+            if (len > client->meta_countdown)
+            {
+                client->bytes += client->meta_countdown;
+                total_bytes += client->meta_countdown;
+                buf += client->meta_countdown;
+                len -= client->meta_countdown;
+                client->meta_countdown = 0;
+                continue;
+            }
+            client->meta_countdown -= len;
+        }
+        client->bytes += len;
+        total_bytes += len;
+        break;
+    }
+}
+
+
+static void bench_read (bench_client_t *client)
+{
+    char buf [BENCH_READ_SIZE];
+    long limit = sizeof buf;
+    int len;
+
+    if (bench_throttle)
+    {
+        if (client->tick_allowance <= 0)
+            return;
+        if (limit > client->tick_allowance)
+            limit = client->tick_allowance;
+    }
+    len = recv (client->fd, buf, limit, 0);
+    if (len <= 0)
+    {
+        if (len < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        bench_drop (client);    /* server closed us, count as a leave */
+        return;
+    }
+    if (bench_throttle)
+        client->tick_allowance -= len;
+
+    if (client->state == BENCH_REQ_SENT)
+    {
+        char *body;
+        int copy = (int)(sizeof client->hdr) - 1 - client->hdr_len;
+
+        if (copy > len) copy = len;
+        memcpy (client->hdr + client->hdr_len, buf, copy);
+        client->hdr_len += copy;
+        client->hdr [client->hdr_len] = '\0';
+        body = strstr (client->hdr, "\r\n\r\n");
+        if (body == NULL)
+            return;
+        if (strncmp (client->hdr, "HTTP/1.0 200", 12) && strncmp (client->hdr, "HTTP/1.1 200", 12) &&
+                strncmp (client->hdr, "ICY 200", 7))
+        {
+            bench_drop (client);
+            total_failures++;
+            return;
+        }
+        if (latency_count < (unsigned)bench_clients * 1000)
+            latencies [latency_count++] = bench_time_ms () - client->connect_ms;
+        if (bench_want_meta)
+        {
+            char *mi = strstr (client->hdr, "icy-metaint:");
+            if (mi)
+            {
+                client->metaint = atol (mi + 12);
+                client->meta_countdown = client->metaint;
+            }
+        }
+        client->state = BENCH_STREAMING;
+        bench_account (client, body + 4, client->hdr_len - (int)(body + 4 - client->hdr));
+        return;
+    }
+    bench_account (client, buf, len);
+}
+
+
+static int bench_cmp_u64 (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+
+static uint64_t bench_percentile (int pct)
+{
+    if (latency_count == 0)
+        return 0;
+    return latencies [(latency_count - 1) * pct / 100];
+}
+
+
+int main (int argc, char **argv)
+{
+    bench_client_t *clients;
+    struct pollfd *pfds;
+    const char *host = "127.0.0.1";
+    int port = 8000, i, opt;
+    uint64_t start_ms, tick_ms, now, cpu_start, cpu_end;
+    double elapsed, cpu_pct = 0.0;
+
+    while ((opt = getopt (argc, argv, "h:p:m:n:d:c:r:iP:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'h':   host = optarg;                  break;
+            case 'p':   port = atoi (optarg);           break;
+            case 'm':   bench_mount = optarg;           break;
+            case 'n':   bench_clients = atoi (optarg);  break;
+            case 'd':   bench_duration = atoi (optarg); break;
+            case 'c':   bench_churn = atoi (optarg);    break;
+            case 'r':   bench_throttle = atol (optarg); break;
+            case 'i':   bench_want_meta = 1;            break;
+            case 'P':   bench_server_pid = atol (optarg); break;
+            default:
+                fprintf (stderr, "usage: icebench [-h host] [-p port] [-m mount] [-n listeners]\n"
+                        "       [-d seconds] [-c churn/sec] [-r bytes/sec per client] [-i icy metadata]\n"
+                        "       [-P server pid]\n");
+                return 1;
+        }
+    }
+    if (bench_clients < 1 || bench_duration < 1)
+        return 1;
+
+    memset (&bench_addr, 0, sizeof bench_addr);
+    bench_addr.sin_family = AF_INET;
+    bench_addr.sin_port = htons (port);
+    if (inet_pton (AF_INET, host, &bench_addr.sin_addr) != 1)
+    {
+        fprintf (stderr, "icebench: bad host %s, use a dotted quad\n", host);
+        return 1;
+    }
+    signal (SIGPIPE, SIG_IGN);
+
+    clients = calloc (bench_clients, sizeof *clients);
+    pfds = calloc (bench_clients, sizeof *pfds);
+    latencies = calloc ((size_t)bench_clients * 1000, sizeof *latencies);
+    if (clients == NULL || pfds == NULL || latencies == NULL)
+        return 1;
+    for (i = 0; i < bench_clients; i++)
+        clients [i].fd = -1;
+
+    printf ("icebench: %d listeners on http://%s:%d%s for %ds, churn %d/s, throttle %ld B/s%s\n",
+            bench_clients, host, port, bench_mount, bench_duration, bench_churn,
+            bench_throttle, bench_want_meta ? ", icy metadata" : "");
+
+    cpu_start = bench_server_cpu ();
+    start_ms = tick_ms = bench_time_ms ();
+
+    for (i = 0; i < bench_clients; i++)
+        bench_join (&clients [i]);
+
+    while ((now = bench_time_ms ()) < start_ms + (uint64_t)bench_duration * 1000)
+    {
+        int nfds = 0, churned = 0;
+
+        if (now >= tick_ms + 100)   /* 100ms housekeeping tick */
+        {
+            tick_ms = now;
+            for (i = 0; i < bench_clients; i++)
+            {
+                if (bench_throttle)
+                    clients [i].tick_allowance = bench_throttle / 10;
+                /* replace up to churn/10 established listeners per tick */
+                if (bench_churn && churned < (bench_churn + 9) / 10 &&
+                        clients [i].state == BENCH_STREAMING)
+                {
+                    bench_drop (&clients [i]);
+                    churned++;
+                }
+                if (clients [i].state == BENCH_FREE)
+                    bench_join (&clients [i]);
+            }
+        }
+        for (i = 0; i < bench_clients; i++)
+        {
+            if (clients [i].fd < 0)
+                continue;
+            pfds [nfds].fd = clients [i].fd;
+            pfds [nfds].events = clients [i].state == BENCH_CONNECTING ? POLLOUT : POLLIN;
+            nfds++;
+        }
+        if (poll (pfds, nfds, 50) <= 0)
+            continue;
+        for (i = nfds = 0; i < bench_clients; i++)
+        {
+            bench_client_t *client = &clients [i];
+
+            if (client->fd < 0)
+                continue;
+            if (pfds [nfds].fd == client->fd && pfds [nfds].revents)
+            {
+                if (client->state == BENCH_CONNECTING)
+                {
+                    int err = 0;
+                    socklen_t errlen = sizeof err;
+                    getsockopt (client->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+                    if (err || (pfds [nfds].revents & (POLLERR|POLLHUP)))
+                    {
+                        bench_drop (client);
+                        total_failures++;
+                    }
+                    else
+                        bench_send_request (client);
+                }
+                else
+                    bench_read (client);
+            }
+            nfds++;
+        }
+    }
+    cpu_end = bench_server_cpu ();
+    elapsed = (bench_time_ms () - start_ms) / 1000.0;
+
+    for (i = 0; i < bench_clients; i++)
+        bench_drop (&clients [i]);
+    qsort (latencies, latency_count, sizeof *latencies, bench_cmp_u64);
+
+    if (cpu_end >= cpu_start && bench_server_pid)
+        cpu_pct = (cpu_end - cpu_start) * 100.0 / sysconf (_SC_CLK_TCK) / elapsed;
+
+    printf ("joins %llu, failures %llu, metadata blocks %llu\n",
+            (unsigned long long)total_joins, (unsigned long long)total_failures,
+            (unsigned long long)total_meta_blocks);
+    printf ("throughput %.2f Mbit/s (%llu bytes in %.1fs)\n",
+            total_bytes * 8 / elapsed / 1000000.0, (unsigned long long)total_bytes, elapsed);
+    printf ("connect latency ms: p50 %llu, p90 %llu, p99 %llu, max %llu (%u samples)\n",
+            (unsigned long long)bench_percentile (50), (unsigned long long)bench_percentile (90),
+            (unsigned long long)bench_percentile (99),
+            (unsigned long long)(latency_count ? latencies [latency_count-1] : 0), latency_count);
+    if (bench_server_pid)
+        printf ("server cpu %.1f%% of one core\n", cpu_pct);
+
+    free (clients);
+    free (pfds);
+    free (latencies);
+    return 0;
+}
@@ -0,0 +1,185 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* icelogdump
+**
+** expand binary access logs (accesslog <type>binary</type>) back into the
+** usual CLF text lines on stdout. The format is a stream of records, each a
+** type byte then LEB128 varints and length prefixed strings:
+**
+**   'S' id str      define string table entry id
+**   'R'             clear the string table (defs are re-emitted after)
+**   'A' time code bytes duration ip user method proto/ver uri ref agent
+**
+** where uri, ref and agent are table ids. The table persists across log
+** rotation, so pass archived files in rotation order for full expansion;
+** an id from a file not given is printed as #id.
+**
+** usage: icelogdump [file ...]      with no files, reads stdin
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+
+static char **strtable;
+static unsigned int strtable_len;
+
+
+static void table_clear (void)
+{
+    unsigned int i;
+
+    for (i = 0; i < strtable_len; i++)
+        free (strtable [i]);
+    free (strtable);
+    strtable = NULL;
+    strtable_len = 0;
+}
+
+
+static const char *table_get (uint64_t id, char *fallback)
+{
+    if (id < strtable_len && strtable [id])
+        return strtable [id];
+    snprintf (fallback, 30, "#%" PRIu64, id);
+    return fallback;
+}
+
+
+static int read_varint (FILE *in, uint64_t *v)
+{
+    int c, shift = 0;
+
+    *v = 0;
+    do
+    {
+        if ((c = getc (in)) == EOF || shift > 62)
+            return -1;
+        *v |= (uint64_t)(c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 0;
+}
+
+
+static char *read_string (FILE *in)
+{
+    uint64_t len;
+    char *s;
+
+    if (read_varint (in, &len) < 0 || len > 10000)
+        return NULL;
+    s = malloc (len + 1);
+    if (fread (s, 1, len, in) != len)
+    {
+        free (s);
+        return NULL;
+    }
+    s [len] = '\0';
+    return s;
+}
+
+
+static int dump_file (FILE *in, const char *name)
+{
+    int c;
+
+    while ((c = getc (in)) != EOF)
+    {
+        if (c == 'R')
+        {
+            table_clear ();
+            continue;
+        }
+        if (c == 'S')
+        {
+            uint64_t id;
+            char *s = NULL;
+
+            if (read_varint (in, &id) < 0 || id > 100000 || (s = read_string (in)) == NULL)
+                break;
+            if (id >= strtable_len)
+            {
+                unsigned int newlen = id + 64;
+                strtable = realloc (strtable, newlen * sizeof (char*));
+                memset (strtable + strtable_len, 0, (newlen - strtable_len) * sizeof (char*));
+                strtable_len = newlen;
+            }
+            free (strtable [id]);
+            strtable [id] = s;
+            continue;
+        }
+        if (c == 'A')
+        {
+            uint64_t logged_at, respcode, sent_bytes, stayed, uri_id, ref_id, agent_id;
+            char *ip = NULL, *user = NULL, *method = NULL, *protover = NULL;
+            char datebuf [50], fb1 [30], fb2 [30], fb3 [30];
+            struct tm thetime;
+            time_t when;
+
+            if (read_varint (in, &logged_at) < 0 || read_varint (in, &respcode) < 0 ||
+                    read_varint (in, &sent_bytes) < 0 || read_varint (in, &stayed) < 0 ||
+                    (ip = read_string (in)) == NULL || (user = read_string (in)) == NULL ||
+                    (method = read_string (in)) == NULL || (protover = read_string (in)) == NULL ||
+                    read_varint (in, &uri_id) < 0 || read_varint (in, &ref_id) < 0 ||
+                    read_varint (in, &agent_id) < 0)
+            {
+                free (ip); free (user); free (method); free (protover);
+                break;
+            }
+            when = (time_t)logged_at;
+            strftime (datebuf, sizeof (datebuf), "%d/%b/%Y:%H:%M:%S %z", localtime_r (&when, &thetime));
+            printf ("%s - %s [%s] \"%s %s %s\" %" PRIu64 " %" PRIu64 " \"%s\" \"%s\" %" PRIu64 "\n",
+                    ip, user, datebuf, method, table_get (uri_id, fb1), protover,
+                    respcode, sent_bytes, table_get (ref_id, fb2), table_get (agent_id, fb3), stayed);
+            free (ip); free (user); free (method); free (protover);
+            continue;
+        }
+        break;
+    }
+    if (ferror (in) || !feof (in))
+    {
+        fprintf (stderr, "icelogdump: %s: malformed record, stopping\n", name);
+        return 1;
+    }
+    return 0;
+}
+
+
+int main (int argc, char **argv)
+{
+    int i, ret = 0;
+
+    if (argc < 2)
+        return dump_file (stdin, "stdin");
+    for (i = 1; i < argc; i++)
+    {
+        FILE *in = fopen (argv [i], "rb");
+        if (in == NULL)
+        {
+            fprintf (stderr, "icelogdump: cannot open %s\n", argv [i]);
+            ret = 1;
+            continue;
+        }
+        ret |= dump_file (in, argv [i]);
+        fclose (in);
+    }
+    table_clear ();
+    return ret;
+}
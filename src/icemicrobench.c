@@ -0,0 +1,357 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org>,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* icemicrobench.c
+ *
+ * corpus driven microbenchmarks for the frame parsers and the refbuf
+ * pipeline, so changes to mpeg.c and refbuf.c ship with baseline numbers.
+ * With no arguments synthetic MP3, ADTS and Ogg corpora are generated,
+ * otherwise each named file is detected by content and run through the
+ * matching parser. Reported per corpus: MB/s, frames (or pages) per
+ * second, cycles per frame and heap allocations per MB processed.
+ *
+ * Built by  make bench  in src, which also runs it. Allocation counting
+ * relies on ld --wrap so this stays a linux-only developer tool.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <ogg/ogg.h>
+
+#include "refbuf.h"
+#include "mpeg.h"
+
+/* mpeg.o and refbuf.o log through the server error log, keep it disabled */
+int errorlog = -1;
+
+#define BENCH_CHUNK         4096        /* matches the source read size */
+#define BENCH_CORPUS_SIZE   (4 * 1024 * 1024)
+#define BENCH_VOLUME        (256 * 1024 * 1024L)
+
+/* heap counters fed by the ld --wrap interposers below */
+static uint64_t alloc_count;
+
+void *__real_malloc (size_t len);
+void *__real_realloc (void *p, size_t len);
+int   __real_posix_memalign (void **p, size_t align, size_t len);
+
+void *__wrap_malloc (size_t len)
+{
+    alloc_count++;
+    return __real_malloc (len);
+}
+
+void *__wrap_realloc (void *p, size_t len)
+{
+    alloc_count++;
+    return __real_realloc (p, len);
+}
+
+int __wrap_posix_memalign (void **p, size_t align, size_t len)
+{
+    alloc_count++;
+    return __real_posix_memalign (p, align, len);
+}
+
+
+static uint64_t bench_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static uint64_t bench_cycles (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    return 0;
+#endif
+}
+
+
+/* MPEG1 layer 3, 44100, 128k, joint stereo. 417 byte frames */
+static size_t bench_mp3_corpus (unsigned char *buf, size_t len)
+{
+    static const unsigned char hdr [4] = { 0xFF, 0xFB, 0x90, 0x64 };
+    size_t used = 0;
+    unsigned i;
+
+    while (used + 417 <= len)
+    {
+        memcpy (buf + used, hdr, 4);
+        for (i = 4; i < 417; i++)
+            buf [used + i] = (unsigned char)(used + i);
+        used += 417;
+    }
+    return used;
+}
+
+
+/* AAC LC in ADTS framing, 44100 stereo, 400 byte frames */
+static size_t bench_adts_corpus (unsigned char *buf, size_t len)
+{
+    static const unsigned char hdr [7] = { 0xFF, 0xF1, 0x50, 0x80, 0x32, 0x1F, 0xFC };
+    size_t used = 0;
+    unsigned i;
+
+    while (used + 400 <= len)
+    {
+        memcpy (buf + used, hdr, 7);
+        for (i = 7; i < 400; i++)
+            buf [used + i] = (unsigned char)(used + i);
+        used += 400;
+    }
+    return used;
+}
+
+
+/* ogg page crc, polynomial 0x04c11db7, no reflection, zero init */
+static uint32_t bench_ogg_crc (const unsigned char *buf, size_t len)
+{
+    static uint32_t table [256];
+    uint32_t crc = 0;
+    size_t i;
+
+    if (table [1] == 0)
+    {
+        for (i = 0; i < 256; i++)
+        {
+            uint32_t r = (uint32_t)i << 24;
+            int j;
+            for (j = 0; j < 8; j++)
+                r = (r & 0x80000000) ? (r << 1) ^ 0x04c11db7 : (r << 1);
+            table [i] = r;
+        }
+    }
+    for (i = 0; i < len; i++)
+        crc = (crc << 8) ^ table [((crc >> 24) & 0xFF) ^ buf [i]];
+    return crc;
+}
+
+
+/* well formed ogg pages, 17 segments of around 4k payload each */
+static size_t bench_ogg_corpus (unsigned char *buf, size_t len)
+{
+    size_t used = 0;
+    uint32_t seq = 0;
+    unsigned i;
+
+    while (used + 27 + 17 + 16 * 255 + 200 <= len)
+    {
+        unsigned char *page = buf + used;
+        size_t page_len = 27 + 17 + 16 * 255 + 200;
+        uint32_t crc;
+
+        memcpy (page, "OggS", 4);
+        memset (page + 4, 0, 23);
+        page [5] = seq ? 0 : 2;         /* bos on the first page */
+        page [14] = 0xBE;               /* serial number */
+        memcpy (page + 18, &seq, 4);
+        page [26] = 17;
+        memset (page + 27, 255, 16);
+        page [27 + 16] = 200;
+        for (i = 0; i < 16 * 255 + 200; i++)
+            page [27 + 17 + i] = (unsigned char)(used + i);
+        crc = bench_ogg_crc (page, page_len);
+        memcpy (page + 22, &crc, 4);
+        used += page_len;
+        seq++;
+    }
+    return used;
+}
+
+
+static int bench_count_frame (struct mpeg_sync *mp, struct sync_callback_t *cb, unsigned char *p, unsigned int len, unsigned int offset)
+{
+    (*(uint64_t *)cb->callback_key)++;
+    return 0;
+}
+
+
+/* feed the corpus through mpeg_complete_frames in source sized refbuf
+ * chunks, fresh block per chunk as the source read path would take */
+static void bench_mpeg (const char *label, const unsigned char *corpus, size_t len)
+{
+    mpeg_sync sync;
+    sync_callback_t cb;
+    uint64_t frames = 0, start_ns, ns, start_cy, cy;
+    size_t processed = 0, offset;
+    double mb;
+
+    cb.callback_key = &frames;
+    cb.frame_callback = bench_count_frame;
+    alloc_count = 0;
+    start_ns = bench_ns ();
+    start_cy = bench_cycles ();
+    while (processed < BENCH_VOLUME)
+    {
+        mpeg_setup (&sync, "bench");
+        for (offset = 0; offset < len; offset += BENCH_CHUNK)
+        {
+            size_t chunk = len - offset > BENCH_CHUNK ? BENCH_CHUNK : len - offset;
+            refbuf_t *block = refbuf_new (BENCH_CHUNK);
+
+            memcpy (block->data, corpus + offset, chunk);
+            block->len = chunk;
+            mpeg_complete_frames_cb (&sync, &cb, block, 0);
+            refbuf_release (block);
+        }
+        mpeg_cleanup (&sync);
+        processed += len;
+    }
+    ns = bench_ns () - start_ns;
+    cy = bench_cycles () - start_cy;
+    mb = processed / 1048576.0;
+
+    printf ("%-14s %8.1f MB/s, %9.0f frames/s, %5.0f cycles/frame, %6.1f allocs/MB\n",
+            label, mb * 1000000000.0 / ns, frames * 1000000000.0 / ns,
+            frames ? (double)cy / frames : 0.0, alloc_count / mb);
+}
+
+
+/* the ogg path in format_ogg.c is driven off libogg page sync, time the
+ * same sync/pageout loop it runs per source read */
+static void bench_ogg (const char *label, const unsigned char *corpus, size_t len)
+{
+    ogg_sync_state oy;
+    ogg_page page;
+    uint64_t pages = 0, start_ns, ns, start_cy, cy;
+    size_t processed = 0, offset;
+    double mb;
+
+    alloc_count = 0;
+    start_ns = bench_ns ();
+    start_cy = bench_cycles ();
+    ogg_sync_init (&oy);
+    while (processed < BENCH_VOLUME)
+    {
+        for (offset = 0; offset < len; offset += BENCH_CHUNK)
+        {
+            size_t chunk = len - offset > BENCH_CHUNK ? BENCH_CHUNK : len - offset;
+            char *buffer = ogg_sync_buffer (&oy, chunk);
+
+            memcpy (buffer, corpus + offset, chunk);
+            ogg_sync_wrote (&oy, chunk);
+            while (ogg_sync_pageout (&oy, &page) > 0)
+                pages++;
+        }
+        processed += len;
+    }
+    ogg_sync_clear (&oy);
+    ns = bench_ns () - start_ns;
+    cy = bench_cycles () - start_cy;
+    mb = processed / 1048576.0;
+
+    printf ("%-14s %8.1f MB/s, %9.0f pages/s, %5.0f cycles/page, %6.1f allocs/MB\n",
+            label, mb * 1000000000.0 / ns, pages * 1000000000.0 / ns,
+            pages ? (double)cy / pages : 0.0, alloc_count / mb);
+}
+
+
+/* allocate, share and tear down chains the way the stream queue does */
+static void bench_refbuf (void)
+{
+    uint64_t blocks = 0, start_ns, ns;
+    int i, pass;
+
+    alloc_count = 0;
+    start_ns = bench_ns ();
+    for (pass = 0; pass < 200000; pass++)
+    {
+        refbuf_t *head = NULL, **tail = &head, *block;
+
+        for (i = 0; i < 32; i++)
+        {
+            block = refbuf_new (BENCH_CHUNK);
+            block->len = BENCH_CHUNK;
+            *tail = block;
+            tail = &block->next;
+            blocks++;
+        }
+        for (block = head; block; block = block->next)
+            refbuf_addref (block);      /* a listener holding the chain */
+        for (block = head; block; block = block->next)
+            refbuf_release (block);
+        while (head)
+        {
+            block = head;
+            head = head->next;
+            block->next = NULL;
+            refbuf_release (block);
+        }
+    }
+    ns = bench_ns () - start_ns;
+    printf ("%-14s %8.1f M blocks/s, %5.1f ns/block, %6.2f allocs/block\n",
+            "refbuf churn", blocks * 1000.0 / ns, (double)ns / blocks,
+            (double)alloc_count / blocks);
+}
+
+
+int main (int argc, char **argv)
+{
+    unsigned char *corpus = malloc (BENCH_CORPUS_SIZE);
+    size_t len;
+    int i;
+
+    if (corpus == NULL)
+        return 1;
+    refbuf_initialize ();
+
+    if (argc > 1)
+    {
+        for (i = 1; i < argc; i++)
+        {
+            FILE *f = fopen (argv [i], "rb");
+
+            if (f == NULL)
+            {
+                fprintf (stderr, "icemicrobench: cannot open %s\n", argv [i]);
+                continue;
+            }
+            len = fread (corpus, 1, BENCH_CORPUS_SIZE, f);
+            fclose (f);
+            if (len < BENCH_CHUNK)
+                continue;
+            if (memcmp (corpus, "OggS", 4) == 0)
+                bench_ogg (argv [i], corpus, len);
+            else
+                bench_mpeg (argv [i], corpus, len);
+        }
+    }
+    else
+    {
+        len = bench_mp3_corpus (corpus, BENCH_CORPUS_SIZE);
+        bench_mpeg ("mp3 sync", corpus, len);
+        len = bench_adts_corpus (corpus, BENCH_CORPUS_SIZE);
+        bench_mpeg ("adts sync", corpus, len);
+        len = bench_ogg_corpus (corpus, BENCH_CORPUS_SIZE);
+        bench_ogg ("ogg pages", corpus, len);
+    }
+    bench_refbuf ();
+
+    refbuf_shutdown ();
+    free (corpus);
+    return 0;
+}
@@ -14,6 +14,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 #ifdef HAVE_SYS_TYPES_H
@@ -25,6 +26,9 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 
 
 #include "log.h"
@@ -46,6 +50,7 @@ typedef struct _log_entry_t
    struct _log_entry_t *next;
    char *line;
    unsigned int len;
+   unsigned short block;    /* raw bytes, written as-is without a newline */
 } log_entry_t;
 
 
@@ -62,6 +67,7 @@ typedef struct log_tag
     time_t reopen_at;
     unsigned int duration;
     short archive_timestamp;
+    short pending_reopen;       /* reopen asked for mid-run, apply at run end */
     time_t recheck_time;
 
     unsigned long buffer_bytes;
@@ -82,75 +88,179 @@ static void _release_log_id(int log_id);
 static void _lock_logger(void);
 static void _unlock_logger(void);
 static int do_log_run (int log_id);
+static int append_log_entry (int log_id, const char *line);
+
+
+/* bounded lock-free ring carrying formatted lines to the commit thread, so
+ * a log call on a hot path is a format and an atomic slot claim instead of
+ * queueing on the logger mutex. Only used once a commit callback is set, as
+ * that is when a background writer exists to drain it; the committer is sole
+ * consumer, serialised by the logger mutex. A full ring falls back to the
+ * locked path rather than dropping the line
+ */
+#define LOG_RING_SIZE 2048
+
+typedef struct
+{
+    uint64_t seq;
+    int log_id;
+    char *line;
+} log_ring_entry_t;
+
+static log_ring_entry_t log_ring [LOG_RING_SIZE];
+static uint64_t log_ring_head, log_ring_tail;
+
+
+static int log_ring_push (int log_id, const char *line)
+{
+    uint64_t tail = __atomic_load_n (&log_ring_tail, __ATOMIC_RELAXED);
+
+    for (;;)
+    {
+        log_ring_entry_t *entry = &log_ring [tail & (LOG_RING_SIZE-1)];
+        uint64_t seq = __atomic_load_n (&entry->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - tail);
+
+        if (diff < 0)
+            return 0;       /* ring full, caller takes the locked path */
+        if (diff > 0)
+        {
+            tail = __atomic_load_n (&log_ring_tail, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (__atomic_compare_exchange_n (&log_ring_tail, &tail, tail+1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED) == 0)
+            continue;
+        entry->log_id = log_id;
+        entry->line = strdup (line);
+        __atomic_store_n (&entry->seq, tail + 1, __ATOMIC_RELEASE);
+        /* only poke the committer on an empty to non-empty transition, it
+         * picks up anything later in the same batch or on its timeout */
+        if (log_callback && tail == __atomic_load_n (&log_ring_head, __ATOMIC_RELAXED))
+            log_callback (log_id);
+        return 1;
+    }
+}
 
 
+/* detach the oldest published line, the logger mutex is expected to be held
+ * to keep this single consumer
+ */
+static int log_ring_pop (int *log_id, char **line)
+{
+    uint64_t head = log_ring_head;
+    log_ring_entry_t *entry = &log_ring [head & (LOG_RING_SIZE-1)];
+    uint64_t seq = __atomic_load_n (&entry->seq, __ATOMIC_ACQUIRE);
+
+    if (seq != head + 1)
+        return 0;
+    *log_id = entry->log_id;
+    *line = entry->line;
+    entry->line = NULL;
+    log_ring_head = head + 1;
+    __atomic_store_n (&entry->seq, head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+/* move anything queued on the ring onto the per-log entry lists, the logger
+ * mutex is expected to be held
+ */
+static void log_ring_drain (void)
+{
+    int log_id;
+    char *line;
+
+    while (log_ring_pop (&log_id, &line))
+    {
+        if (log_id >= 0 && log_id < logs_allocated && loglist [log_id].in_use)
+            append_log_entry (log_id, line);
+        free (line);
+    }
+}
+
+
+/* called with the logger lock held. When the log needs opening or cycling
+ * the rename, open and close of the old descriptor all happen with the lock
+ * dropped, as archiving a multi-GB access log can take a while and none of
+ * it needs the lock. The log is mid-run (in_use 3) so nothing else opens or
+ * writes it in the meantime, writers just queue
+ */
 static int _log_open (int id, time_t now)
 {
     if (loglist [id] . in_use == 0)
         return 0;
 
     /* check for cases where an open of the logfile is wanted */
-    if (loglist [id] . logfile == NULL || 
+    if (loglist [id] . logfile == NULL ||
        (loglist [id] . duration && loglist [id] . reopen_at <= now) ||
        (loglist [id] . trigger_level && loglist [id] . size > loglist [id] . trigger_level))
     {
         if (loglist [id] . filename)  /* only re-open files where we have a name */
         {
-            FILE *f = NULL;
+            char filename [4096];
+            FILE *old = NULL, *f;
             struct stat st;
+            off_t size = 0, cycle_level = 0;
             int exists = 0, archive = 1;
+            int archive_timestamp = loglist [id].archive_timestamp;
 
-            if (stat (loglist [id] . filename, &st) == 0)
+            if (loglist [id].trigger_level && loglist [id].size > loglist [id].trigger_level)
+                cycle_level = loglist [id].trigger_level;
+            snprintf (filename, sizeof filename, "%s", loglist [id].filename);
+            if (loglist [id].logfile && loglist [id].logfile != stderr)
+                old = loglist [id].logfile;
+            loglist [id].logfile = NULL;
+            _unlock_logger ();
+
+            if (stat (filename, &st) == 0)
             {
                 exists = 1;
-                if ((loglist [id] . trigger_level && loglist [id] . size > loglist [id] . trigger_level) &&
-                        st.st_size < loglist [id] . trigger_level)
+                if (cycle_level && st.st_size < cycle_level)
                 {  // log changed from under us, but less than trigger size, better reopen this and not archive for now.
                    archive = 0;
                 }
             }
-            if (loglist [id].logfile && loglist [id].logfile != stderr)
+            if (old)
             {
                 char new_name [4096];
-                fclose (loglist [id] . logfile);
-                loglist [id] . logfile = NULL;
+                fclose (old);
                 if (archive)
                 {
-                    if (loglist[id].archive_timestamp)
+                    if (archive_timestamp)
                     {
                         char timestamp [128];
 
                         strftime (timestamp, sizeof (timestamp), "%Y%m%d_%H%M%S", localtime (&now));
-                        snprintf (new_name,  sizeof(new_name), "%s.%s", loglist[id].filename, timestamp);
+                        snprintf (new_name,  sizeof(new_name), "%s.%s", filename, timestamp);
                     }
                     else {
-                        snprintf (new_name,  sizeof(new_name), "%s.old", loglist [id] . filename);
+                        snprintf (new_name,  sizeof(new_name), "%s.old", filename);
                     }
                     if (exists)
                     {
 #ifdef _WIN32
                         remove (new_name);
 #endif
-                        rename (loglist [id] . filename, new_name);
+                        rename (filename, new_name);
                     }
                 }
             }
-            f = fopen (loglist [id] . filename, "a");
-            if (f == NULL)
+            f = fopen (filename, "a");
+            if (f)
             {
-                if (loglist [id] . logfile != stderr)
-                {
-                    loglist [id] . logfile = stderr;
-                    do_log_run (id);
-                }
-                return 0;
+                setvbuf (f, NULL, IO_BUFFER_TYPE, 0);
+                if (stat (filename, &st) == 0)
+                    size = st.st_size;
+            }
+            _lock_logger ();
+            if (f == NULL)
+            {   /* the current run pushes queued entries to stderr instead */
+                loglist [id] . logfile = stderr;
+                return 1;
             }
             loglist [id].logfile = f;
-            setvbuf (loglist [id] . logfile, NULL, IO_BUFFER_TYPE, 0);
-            if (stat (loglist [id] . filename, &st) < 0)
-                loglist [id] . size = 0;
-            else
-                loglist [id] . size = st.st_size;
+            loglist [id].size = size;
             if (loglist [id] . duration)
                 loglist [id] . reopen_at = now + loglist [id] . duration;
             loglist [id].recheck_time = now + 10;
@@ -168,6 +278,7 @@ static void log_init (log_t *log)
     log->size = 0;
     log->trigger_level = 50*1024*1024;
     log->duration = 0;
+    log->pending_reopen = 0;
     log->filename = NULL;
     log->logfile = NULL;
     log->buffer = NULL;
@@ -179,11 +290,21 @@ static void log_init (log_t *log)
     log->log_tail = NULL;
 }
 
+static void log_ring_init (void)
+{
+    int i;
+    for (i = 0; i < LOG_RING_SIZE; i++)
+        log_ring [i].seq = i;
+    log_ring_head = log_ring_tail = 0;
+}
+
+
 void log_initialize_lib (mx_create_func mxc, mx_lock_func mxl)
 {
     if (_initialized) return;
     logs_allocated = 0;
     loglist = NULL;
+    log_ring_init ();
     log_mutex_alloc = mxc ? mxc : NULL;
     log_mutex_lock = mxl ? mxl : NULL;
 
@@ -200,6 +321,7 @@ void log_initialize(void)
 
     logs_allocated = 0;
     loglist = NULL;
+    log_ring_init ();
     /* initialize mutexes */
 
     _initialized = 1;
@@ -359,6 +481,11 @@ void log_reopen(int log_id)
     {
         if (loglist [log_id] . filename == NULL || loglist [log_id] . logfile == NULL)
             break;
+        if (loglist [log_id] . in_use == 3)
+        {   /* a run has the lock dropped and may be writing this file */
+            loglist [log_id] . pending_reopen = 1;
+            break;
+        }
         if (loglist [log_id]. archive_timestamp < 0)
         {
             struct stat st;
@@ -434,6 +561,12 @@ void log_shutdown(void)
     log_commit_entries ();
     for (log_id = 0; log_id < logs_allocated ; log_id++)
         log_close (log_id);
+    do      /* free any lines that raced in after the final commit */
+    {
+        char *line;
+        while (log_ring_pop (&log_id, &line))
+            free (line);
+    } while (0);
     logs_allocated = 0;
     free (loglist);
     /* destroy mutexes */
@@ -470,6 +603,8 @@ static int do_log_run (int log_id)
     int loop = 0;
     time_t now;
 
+    if (loglist [log_id].in_use == 3)
+        return 0;   /* already mid-run, possibly with the lock dropped */
     loglist [log_id].in_use = 3;
     time (&now);
     if (loglist [log_id].written_entry == NULL)
@@ -493,20 +628,78 @@ static int do_log_run (int log_id)
         }
     }
     // fprintf (stderr, "in log run, id %d\n", log_id);
-    while (next && ++loop < 300)
+#define LOG_WRITE_BATCH     32
+    while (next && loop < 300)
     {
+        log_entry_t *batch [LOG_WRITE_BATCH];
+        FILE *file;
+        int count = 0;
+        off_t written = 0;
+
         if (_log_open (log_id, now) == 0)
             break;
+        file = loglist [log_id].logfile;
 
-        loglist [log_id].written_entry = next;
+        /* take a group of entries in one go, entries past written_entry are
+         * never purged so they stay valid while the lock is dropped */
+        while (next && count < LOG_WRITE_BATCH && ++loop < 300)
+        {
+            batch [count++] = next;
+            loglist [log_id].written_entry = next;
+            next = next->next;
+        }
         _unlock_logger ();
 
-        // fprintf (stderr, "in log run, line is %s\n", next->line);
-        if (fprintf (loglist [log_id].logfile, "%s\n", next->line) >= 0)
-            loglist [log_id].size += (next->len + 1);
+#if defined(HAVE_WRITEV) && defined(HAVE_SYS_UIO_H)
+        do
+        {
+            struct iovec iov [LOG_WRITE_BATCH*2];
+            int i, n = 0;
 
+            for (i = 0; i < count; i++)
+            {
+                iov [n].iov_base = batch [i]->line;
+                iov [n].iov_len = batch [i]->len;
+                n++;
+                written += batch [i]->len;
+                if (batch [i]->block == 0)
+                {
+                    iov [n].iov_base = "\n";
+                    iov [n].iov_len = 1;
+                    n++;
+                    written++;
+                }
+            }
+            if (writev (fileno (file), iov, n) < 0)
+                written = 0;
+        } while (0);
+#else
+        do
+        {
+            int i;
+            for (i = 0; i < count; i++)
+            {
+                if (batch [i]->block)
+                {
+                    if (fwrite (batch [i]->line, 1, batch [i]->len, file) == batch [i]->len)
+                        written += batch [i]->len;
+                }
+                else if (fprintf (file, "%s\n", batch [i]->line) >= 0)
+                    written += batch [i]->len + 1;
+            }
+        } while (0);
+#endif
         _lock_logger ();
-        next = next->next;
+        loglist [log_id].size += written;
+    }
+    if (loglist [log_id].pending_reopen)
+    {
+        loglist [log_id].pending_reopen = 0;
+        if (loglist [log_id].logfile && loglist [log_id].logfile != stderr)
+        {
+            fclose (loglist [log_id].logfile);
+            loglist [log_id].logfile = NULL;
+        }
     }
     if (loglist [log_id].in_use == 3)
         loglist [log_id].in_use = 1;    // normal route
@@ -521,6 +714,7 @@ void log_commit_entries ()
 
     //fprintf (stderr, "in log commit\n");
     _lock_logger ();
+    log_ring_drain ();
     for (log_id = 0; log_id < logs_allocated ; log_id++)
     {
         do
@@ -565,15 +759,8 @@ static void do_purge (int log_id)
 }
 
 
-static int create_log_entry (int log_id, const char *line)
+static void append_log_link (int log_id, log_entry_t *entry)
 {
-    log_entry_t *entry;
-    int len;
-
-    entry = calloc (1, sizeof (log_entry_t));
-    len = entry->len = strlen (line);
-    entry->line = malloc (entry->len+1);
-    snprintf (entry->line, entry->len+1, "%s", line);
     loglist [log_id].buffer_bytes += entry->len;
 
     if (loglist [log_id].log_tail)
@@ -583,11 +770,46 @@ static int create_log_entry (int log_id, const char *line)
 
     loglist [log_id].log_tail = entry;
     loglist [log_id].entries++;
+    do_purge (log_id);
+}
+
+
+static int append_log_entry (int log_id, const char *line)
+{
+    log_entry_t *entry;
+    int len;
+
+    entry = calloc (1, sizeof (log_entry_t));
+    len = entry->len = strlen (line);
+    entry->line = malloc (entry->len+1);
+    snprintf (entry->line, entry->len+1, "%s", line);
+    append_log_link (log_id, entry);
+    return len;
+}
+
+
+static int append_log_block (int log_id, const void *buf, unsigned len)
+{
+    log_entry_t *entry;
+
+    entry = calloc (1, sizeof (log_entry_t));
+    entry->len = len;
+    entry->block = 1;
+    entry->line = malloc (len);
+    memcpy (entry->line, buf, len);
+    append_log_link (log_id, entry);
+    return len;
+}
+
+
+static int create_log_entry (int log_id, const char *line)
+{
+    int len = append_log_entry (log_id, line);
+
     if (log_callback)
         log_callback (log_id);
     else
         do_log_run (log_id);
-    do_purge (log_id);
     return len;
 }
 
@@ -619,11 +841,14 @@ int log_contents (int log_id, char **_contents, unsigned int *_len)
     *ptr = '\0';
     while (entry && remain)
     {
-        int len = snprintf (ptr, remain, "%s\n", entry->line);
-        if (len > 0)
+        if (entry->block == 0)  /* binary records make no sense on a display */
         {
-            ptr += len;
-            remain -= len;
+            int len = snprintf (ptr, remain, "%s\n", entry->line);
+            if (len > 0)
+            {
+                ptr += len;
+                remain -= len;
+            }
         }
         entry = entry->next;
     }
@@ -656,12 +881,14 @@ void log_write(int log_id, unsigned priority, const char *cat, const char *func,
 
     datelen += snprintf (line+datelen, sizeof line-datelen, " %s %s%s ", prior [priority-1], cat, func);
     vsnprintf (line+datelen, sizeof line-datelen, fmt, ap);
+    va_end(ap);
+
+    if (log_callback && log_ring_push (log_id, line))
+        return;     /* committer picks it up, no lock taken */
 
     _lock_logger();
     create_log_entry (log_id, line);
     _unlock_logger();
-
-    va_end(ap);
 }
 
 void log_write_direct(int log_id, const char *fmt, ...)
@@ -670,15 +897,38 @@ void log_write_direct(int log_id, const char *fmt, ...)
     char line[LOG_MAXLINELEN];
 
     if (log_id < 0 || log_id >= LOG_MAXLOGS) return;
-    
+
     va_start(ap, fmt);
+    vsnprintf(line, LOG_MAXLINELEN, fmt, ap);
+    va_end(ap);
+
+    if (log_callback && log_ring_push (log_id, line))
+        return;
 
     _lock_logger();
-    vsnprintf(line, LOG_MAXLINELEN, fmt, ap);
     create_log_entry (log_id, line);
     _unlock_logger();
+}
 
-    va_end(ap);
+
+/* queue a preformatted binary record, written verbatim with no newline. Used
+ * for the structured access log format, so no ring shortcut is needed as the
+ * caller is normally the commit thread itself
+ */
+void log_write_raw (int log_id, const void *buf, unsigned len)
+{
+    if (log_id < 0 || log_id >= LOG_MAXLOGS || len == 0) return;
+
+    _lock_logger();
+    if (log_id < logs_allocated && loglist [log_id].in_use)
+    {
+        append_log_block (log_id, buf, len);
+        if (log_callback)
+            log_callback (log_id);
+        else
+            do_log_run (log_id);
+    }
+    _unlock_logger();
 }
 
 static int _get_log_id(void)
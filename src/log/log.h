@@ -46,6 +46,7 @@ void log_shutdown(void);
 void log_write(int log_id, unsigned priority, const char *cat, const char *func, 
         const char *fmt, ...)  __attribute__ ((format (gnu_printf, 5, 6)));
 void log_write_direct(int log_id, const char *fmt, ...) __attribute__ ((format (gnu_printf, 2, 3)));
+void log_write_raw(int log_id, const void *buf, unsigned len);
 void log_set_commit_callback (log_commit_callback f);
 void log_commit_entries ();
 
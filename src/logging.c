@@ -53,66 +53,290 @@ int playlistlog = 0;
 ** AGENT = get from client->parser
 ** TIME = timing_get_time() - client->con->con_time
 */
+/* access log lines are deferred. Client teardown just captures the raw
+ * fields into one allocation and pushes it onto a lock-free list, the log
+ * writer thread does the time formatting, URL escaping and write so a
+ * disconnect storm does not turn into a formatting burst on the workers
+ */
+typedef struct access_entry
+{
+    struct access_entry *next;
+    int logid;
+    int type;
+    int respcode;
+    uint64_t sent_bytes;
+    time_t logged_at;
+    unsigned long stayed;
+    char *ip, *username, *req_type, *uri, *protocol, *version, *referrer, *agent;
+} access_entry_t;
+
+static access_entry_t *access_pending;
+
+
+static char *access_pack_str (char **p, const char *s)
+{
+    char *dest = *p;
+    size_t len = strlen (s) + 1;
+
+    memcpy (dest, s, len);
+    *p += len;
+    return dest;
+}
+
+
 void logging_access_id (access_log *accesslog, client_t *client)
 {
     const char *req = NULL;
     time_t now;
-    time_t stayed;
     const char *referrer, *user_agent, *ip = "-";
-    char *username, datebuf[50];
-    char reqbuf[256];
+    const char *username, *req_type, *protocol, *version;
+    access_entry_t *entry, *head;
+    char *p;
 
     if (client->flags & CLIENT_SKIP_ACCESSLOG)
         return;
 
     now = time(NULL);
 
-    /* build the data */
-    util_get_clf_time (datebuf, sizeof(datebuf), now);
     if (accesslog->qstr)
         req = httpp_getvar (client->parser, HTTPP_VAR_RAWURI);
     if (req == NULL)
         req = httpp_getvar (client->parser, HTTPP_VAR_URI);
-    /* build the request */
-    snprintf (reqbuf, sizeof(reqbuf), "%.10s %.235s %.5s/%s",
-            httpp_getvar (client->parser, HTTPP_VAR_REQ_TYPE), req,
-            httpp_getvar (client->parser, HTTPP_VAR_PROTOCOL),
-            httpp_getvar (client->parser, HTTPP_VAR_VERSION));
-
-    stayed = (client->connection.con_time > now) ? 0 : (now - client->connection.con_time); // in case the clock has shifted
-    username = (client->username && client->username[0]) ? util_url_escape (client->username) : strdup("-");
+    if (req == NULL)
+        req = "";
+    req_type = httpp_getvar (client->parser, HTTPP_VAR_REQ_TYPE);
+    protocol = httpp_getvar (client->parser, HTTPP_VAR_PROTOCOL);
+    version = httpp_getvar (client->parser, HTTPP_VAR_VERSION);
+    if (req_type == NULL)   req_type = "";
+    if (protocol == NULL)   protocol = "";
+    if (version == NULL)    version = "";
+
+    username = (client->username && client->username[0]) ? client->username : "-";
     referrer = httpp_getvar (client->parser, "referer");
     user_agent = httpp_getvar (client->parser, "user-agent");
+    if (referrer == NULL)           referrer = "-";
+    if (user_agent == NULL)         user_agent = "-";
 
     if (accesslog->log_ip)
         ip = client->connection.ip;
 
-    if (accesslog->type == LOG_ACCESS_CLF_ESC)
+    entry = malloc (sizeof (*entry) + strlen (ip) + strlen (username) +
+            strlen (req_type) + strlen (req) + strlen (protocol) +
+            strlen (version) + strlen (referrer) + strlen (user_agent) + 8);
+    p = (char *)(entry + 1);
+    entry->logid = accesslog->logid;
+    entry->type = accesslog->type;
+    entry->respcode = client->respcode;
+    entry->sent_bytes = client->connection.sent_bytes;
+    entry->logged_at = now;
+    // in case the clock has shifted
+    entry->stayed = (client->connection.con_time > now) ? 0 :
+        (unsigned long)(now - client->connection.con_time);
+    entry->ip = access_pack_str (&p, ip);
+    entry->username = access_pack_str (&p, username);
+    entry->req_type = access_pack_str (&p, req_type);
+    entry->uri = access_pack_str (&p, req);
+    entry->protocol = access_pack_str (&p, protocol);
+    entry->version = access_pack_str (&p, version);
+    entry->referrer = access_pack_str (&p, referrer);
+    entry->agent = access_pack_str (&p, user_agent);
+
+    head = __atomic_load_n (&access_pending, __ATOMIC_RELAXED);
+    do
+    {
+        entry->next = head;
+    } while (__atomic_compare_exchange_n (&access_pending, &head, entry, 0,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED) == 0);
+    if (head == NULL)
+        worker_logger_wake ();  /* list went non-empty, poke the writer */
+
+    client->respcode = -1;
+}
+
+
+/* compact binary access format (<type>binary</type>), for setups where the
+ * text log is only ever machine parsed. A record is a type byte followed by
+ * LEB128 varints and length prefixed strings; uris, referrers and agents go
+ * through a per-log string table so a repeated agent costs a couple of bytes
+ * instead of a hundred. 'S' defines a table entry, 'R' clears the table, 'A'
+ * is one access. icelogdump expands the files back to CLF. The tables live
+ * for the process so a lone archived file can reference ids defined in an
+ * earlier one; feed the files in rotation order for full expansion.
+ * Only ever touched from the log writer thread, so no locking.
+ */
+#define BINLOG_STRINGS      1024
+
+typedef struct binlog_table
+{
+    struct binlog_table *next;
+    int logid;
+    unsigned int used;
+    struct {
+        unsigned int hash;
+        unsigned int id;
+        char *str;
+    } slot [BINLOG_STRINGS];
+} binlog_table_t;
+
+static binlog_table_t *binlog_tables;
+
+
+static int binlog_varint (unsigned char *p, uint64_t v)
+{
+    int len = 0;
+
+    do {
+        p [len++] = (v & 0x7F) | (v > 0x7F ? 0x80 : 0);
+        v >>= 7;
+    } while (v);
+    return len;
+}
+
+
+static int binlog_string (unsigned char *p, const char *s, unsigned int cap)
+{
+    unsigned int len = strlen (s);
+    int hdr;
+
+    if (len > cap) len = cap;
+    hdr = binlog_varint (p, len);
+    memcpy (p + hdr, s, len);
+    return hdr + len;
+}
+
+
+/* return the table id for the string, appending a definition record (and a
+ * table reset when nearly full) to the caller's buffer when one is needed
+ */
+static unsigned int binlog_string_id (binlog_table_t *table, const char *s, unsigned char *rec, int *len)
+{
+    unsigned int hash = 5381, idx;
+    const char *p = s;
+
+    while (*p)
+        hash = ((hash << 5) + hash) ^ (unsigned char)*p++;
+    if (table->used >= BINLOG_STRINGS - (BINLOG_STRINGS>>2))
+    {   /* keep probes short, restart the table and let defs re-emit */
+        for (idx = 0; idx < BINLOG_STRINGS; idx++)
+        {
+            free (table->slot [idx].str);
+            table->slot [idx].str = NULL;
+        }
+        table->used = 0;
+        rec [(*len)++] = 'R';
+    }
+    idx = hash & (BINLOG_STRINGS-1);
+    while (table->slot [idx].str)
     {
-        char *rq = util_url_escape (reqbuf),
-             *rf = referrer ? util_url_escape (referrer) : strdup ("-"),
-             *ua = user_agent ? util_url_escape (user_agent) : strdup ("-");
-
-        log_write_direct (accesslog->logid,
-                "%s - %s %s %s %d %" PRIu64 " %.150s %.150s %lu",
-                ip, username, datebuf, rq, client->respcode, client->connection.sent_bytes,
-                rf, ua, (unsigned long)stayed);
-        free (ua);
-        free (rf);
-        free (rq);
+        if (table->slot [idx].hash == hash && strcmp (table->slot [idx].str, s) == 0)
+            return table->slot [idx].id;
+        idx = (idx + 1) & (BINLOG_STRINGS-1);
     }
-    else
+    table->slot [idx].hash = hash;
+    table->slot [idx].str = strdup (s);
+    table->slot [idx].id = table->used++;
+    rec [(*len)++] = 'S';
+    *len += binlog_varint (rec + *len, table->slot [idx].id);
+    *len += binlog_string (rec + *len, s, 1000);
+    return table->slot [idx].id;
+}
+
+
+static void binlog_access (access_entry_t *entry)
+{
+    unsigned char rec [8192];
+    unsigned int uri_id, ref_id, agent_id;
+    int len = 0;
+    char protover [20];
+    binlog_table_t *table = binlog_tables;
+
+    while (table && table->logid != entry->logid)
+        table = table->next;
+    if (table == NULL)
     {
-        if (referrer == NULL)           referrer = "-";
-        if (user_agent == NULL)         user_agent = "-";
+        table = calloc (1, sizeof (*table));
+        table->logid = entry->logid;
+        table->next = binlog_tables;
+        binlog_tables = table;
+    }
+    uri_id = binlog_string_id (table, entry->uri, rec, &len);
+    ref_id = binlog_string_id (table, entry->referrer, rec, &len);
+    agent_id = binlog_string_id (table, entry->agent, rec, &len);
+
+    snprintf (protover, sizeof protover, "%s/%s", entry->protocol, entry->version);
+    rec [len++] = 'A';
+    len += binlog_varint (rec + len, (uint64_t)entry->logged_at);
+    len += binlog_varint (rec + len, entry->respcode < 0 ? 0 : entry->respcode);
+    len += binlog_varint (rec + len, entry->sent_bytes);
+    len += binlog_varint (rec + len, entry->stayed);
+    len += binlog_string (rec + len, entry->ip, 60);
+    len += binlog_string (rec + len, entry->username, 250);
+    len += binlog_string (rec + len, entry->req_type, 15);
+    len += binlog_string (rec + len, protover, 15);
+    len += binlog_varint (rec + len, uri_id);
+    len += binlog_varint (rec + len, ref_id);
+    len += binlog_varint (rec + len, agent_id);
+    log_write_raw (entry->logid, rec, len);
+}
+
 
-        log_write_direct (accesslog->logid,
-                "%s - %s [%s] \"%s\" %d %" PRIu64 " \"%.150s\" \"%.150s\" %lu",
-                ip, username, datebuf, reqbuf, client->respcode, client->connection.sent_bytes,
-                referrer, user_agent, (unsigned long)stayed);
+/* format and hand over the captured access entries, run from the log writer
+ * thread. Entries were pushed most recent first so reverse for write order
+ */
+void logging_flush_access (void)
+{
+    access_entry_t *entry, *next, *prev = NULL;
+    access_entry_t *list = __atomic_exchange_n (&access_pending, NULL, __ATOMIC_ACQ_REL);
+
+    while (list)
+    {
+        next = list->next;
+        list->next = prev;
+        prev = list;
+        list = next;
+    }
+    for (entry = prev; entry; entry = next)
+    {
+        char datebuf[50], reqbuf[256];
+        char *username;
+
+        next = entry->next;
+        if (entry->type == LOG_ACCESS_BIN)
+        {
+            binlog_access (entry);
+            free (entry);
+            continue;
+        }
+        util_get_clf_time (datebuf, sizeof(datebuf), entry->logged_at);
+        snprintf (reqbuf, sizeof(reqbuf), "%.10s %.235s %.5s/%s",
+                entry->req_type, entry->uri, entry->protocol, entry->version);
+        username = entry->username[0] != '-' || entry->username[1] ?
+            util_url_escape (entry->username) : strdup ("-");
+
+        if (entry->type == LOG_ACCESS_CLF_ESC)
+        {
+            char *rq = util_url_escape (reqbuf),
+                 *rf = util_url_escape (entry->referrer),
+                 *ua = util_url_escape (entry->agent);
+
+            log_write_direct (entry->logid,
+                    "%s - %s %s %s %d %" PRIu64 " %.150s %.150s %lu",
+                    entry->ip, username, datebuf, rq, entry->respcode, entry->sent_bytes,
+                    rf, ua, entry->stayed);
+            free (ua);
+            free (rf);
+            free (rq);
+        }
+        else
+        {
+            log_write_direct (entry->logid,
+                    "%s - %s [%s] \"%s\" %d %" PRIu64 " \"%.150s\" \"%.150s\" %lu",
+                    entry->ip, username, datebuf, reqbuf, entry->respcode, entry->sent_bytes,
+                    entry->referrer, entry->agent, entry->stayed);
+        }
+        free (username);
+        free (entry);
     }
-    free (username);
-    client->respcode = -1;
 }
 
 
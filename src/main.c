@@ -61,6 +61,7 @@
 #include "xslt.h"
 #include "fserve.h"
 #include "auth.h"
+#include "source.h"
 
 #include <libxml/xmlmemory.h>
 
@@ -94,6 +95,16 @@ static void _print_usage(void)
 }
 
 
+#if defined(HAVE_CURL_GLOBAL_INIT) && defined(MY_ALLOC)
+/* attribute libcurl's internal buffers to a single profiler site */
+static void *curl_alloc_cb (size_t size)              { return my_calloc ("curl", 0, 1, size); }
+static void  curl_free_cb (void *ptr)                 { my_free (ptr); }
+static void *curl_realloc_cb (void *ptr, size_t size) { return my_realloc ("curl", 0, ptr, size); }
+static char *curl_strdup_cb (const char *s)           { return my_strdup ("curl", 0, s); }
+static void *curl_calloc_cb (size_t num, size_t size) { return my_calloc ("curl", 0, num, size); }
+#endif
+
+
 void initialize_subsystems(void)
 {
     global_initialize();
@@ -109,8 +120,13 @@ void initialize_subsystems(void)
     stats_initialize();
     xslt_initialize();
 #ifdef HAVE_CURL_GLOBAL_INIT
+#ifdef MY_ALLOC
+    curl_global_init_mem (CURL_GLOBAL_ALL, curl_alloc_cb, curl_free_cb,
+            curl_realloc_cb, curl_strdup_cb, curl_calloc_cb);
+#else
     curl_global_init (CURL_GLOBAL_ALL);
 #endif
+#endif
 }
 
 
@@ -432,7 +448,10 @@ int main (int argc, char *argv[])
     initialize_subsystems();
 
     if (server_init (argc, argv) == 0)
+    {
+        source_scripter_initialize();
         server_process();
+    }
 
     shutdown_subsystems();
 
@@ -46,9 +46,11 @@
 
 static void MD5Transform(uint32_t buf[4], uint32_t const in[HASH_LEN]);
 
-/*
- * Note: this code is harmless on little-endian machines.
- */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/* the words are already in MD5 order, no pass over the block needed */
+#define byteReverse(buf,longs)  do { } while (0)
+#define MD5_LITTLE_ENDIAN 1
+#else
 static void byteReverse(unsigned char *buf, unsigned longs)
 {
     uint32_t t;
@@ -61,6 +63,7 @@ static void byteReverse(unsigned char *buf, unsigned longs)
     }
 	while (--longs);
 }
+#endif
 
 /*
  * Start MD5 accumulation.  Set bit count to 0 and buffer to mysterious
@@ -117,6 +120,17 @@ void MD5Update(struct MD5Context *ctx, unsigned char const *buf,
     }
     /* Process data in 64-byte chunks */
 
+#ifdef MD5_LITTLE_ENDIAN
+    if (((uintptr_t)buf & 3) == 0)
+    {   /* aligned caller data can feed the transform directly */
+        while (len >= 64)
+        {
+            MD5Transform(ctx->buf, (uint32_t const *) buf);
+            buf += 64;
+            len -= 64;
+        }
+    }
+#endif
     while (len >= 64)
 	{
 		memcpy(ctx->in, buf, 64);
@@ -20,6 +20,12 @@
 #include <string.h>
 #include <stdlib.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "compat.h"
 #include "mpeg.h"
 #include "format_mp3.h"
@@ -66,6 +72,19 @@ int mpeg_samplerates [4][4] = {
 #define SYNC_CHANGED                    (1<<1)
 #define SYNC_RESIZE                     (1<<5)
 #define SYNC_CHK_TAG                    (1<<6)
+#define SYNC_DISCARD                    ((uint64_t)1<<56)   /* drop the frame just parsed */
+
+/* per-stream TS PID state. the drop bitmap covers the 13-bit PID space and the
+ * continuity counters are rewritten on the packets we keep, so listeners see a
+ * clean sequence with the unwanted PIDs excised. only ever applied at ingest
+ * where the blocks are still private to the source thread. */
+struct mpeg_ts_filter
+{
+    uint64_t dropped;               /* packets excised, for the log on cleanup */
+    uint16_t pkt_len;               /* 188/204/208, set on detection */
+    unsigned char drop [0x2000/8];
+    unsigned char cc [0x2000];      /* next-1 counter per PID, 0xFF until seen */
+};
 
 #define SYNC_BITRATE_OFF                8
 #define SYNC_CHANNELS_OFF               24
@@ -159,11 +178,109 @@ void mpeg_set_flags (mpeg_sync *mpsync, uint64_t flags)
 }
 
 
+/* comma or space separated list of TS PIDs (decimal or 0x hex) to drop at
+ * ingest. NULL or an empty list clears the filter. returns the number of
+ * PIDs marked, -1 if nothing in the list parsed. */
+int mpeg_set_ts_drop (mpeg_sync *mpsync, const char *pids)
+{
+    struct mpeg_ts_filter *f;
+    const char *s = pids;
+    int count = 0;
+
+    if (pids == NULL || *pids == '\0')
+    {
+        free (mpsync->ts_filter);
+        mpsync->ts_filter = NULL;
+        return 0;
+    }
+    f = calloc (1, sizeof (*f));
+    memset (f->cc, 0xFF, sizeof (f->cc));
+    while (*s)
+    {
+        char *end;
+        long pid = strtol (s, &end, 0);
+
+        if (end == s)
+            break;
+        if (pid >= 0 && pid < 0x2000)
+        {
+            f->drop [pid >> 3] |= (1 << (pid & 7));
+            count++;
+        }
+        for (s = end; *s == ',' || *s == ' '; s++)
+            ;
+    }
+    if (count == 0)
+    {
+        free (f);
+        return -1;
+    }
+    free (mpsync->ts_filter);
+    mpsync->ts_filter = f;
+    if (mpsync->marker == 0x47)
+    {
+        /* TS detected before the filter arrived, force a redetect so the
+         * packet length is re-established and parsing resumes */
+        mpsync->settings &= ~MPEG_SKIP_SYNC;
+        mpsync->mask = 0;
+    }
+    if (mpsync->settings & MPEG_LOG_MESSAGES)
+        INFO2 ("dropping %d TS PIDs on %s", count, mpsync->reference);
+    return count;
+}
+
+
+/* seed the stream details directly, for consumers working off a prebuilt
+ * frame map instead of parsing the data themselves */
+void mpeg_sync_set_details (mpeg_sync *mp, int samplerate, int channels, frame_type_t type)
+{
+    syncframe_set_samplerate (mp, samplerate);
+    syncframe_set_channels (mp, channels);
+    mp->type = type;
+}
+
+
 static int get_aac_frame_len (unsigned char *p)
 {
     return ((p[3] & 0x3) << 11) + (p[4] << 3) + ((p[5] & 0xE0) >> 5);
 }
 
+
+/* cheap dead-air estimate without decoding. digital silence compresses to
+ * next to nothing, for mp3 the huffman region is left as padding zeros and
+ * aac frames shrink to a few bytes, so a frame with hardly any non-zero
+ * payload bytes is counted as quiet. bails out early on normal audio as
+ * the spectral data is dense
+ */
+#define METER_QUIET_BYTES   48
+
+static void meter_frame (struct mpeg_sync *mp, unsigned char *p, int frame_len, int header_len)
+{
+    int count = 0;
+    unsigned char *end = p + frame_len;
+
+    mp->meter_frames++;
+    for (p += header_len; p < end; p++)
+        if (*p && ++count > METER_QUIET_BYTES)
+            return;
+    mp->meter_quiet++;
+}
+
+
+/* percentage of frames carrying audio since the last call, -1 when the
+ * meter is off or nothing has been parsed in the interval
+ */
+int mpeg_meter_level (struct mpeg_sync *mp)
+{
+    int level;
+
+    if (mp == NULL || (mp->settings & MPEG_AUDIO_METER) == 0 || mp->meter_frames == 0)
+        return -1;
+    level = (int)(100 * (mp->meter_frames - mp->meter_quiet) / mp->meter_frames);
+    mp->meter_frames = mp->meter_quiet = 0;
+    return level;
+}
+
 static int handle_aac_frame (struct mpeg_sync *mp, sync_callback_t *cb, unsigned char *p, int len)
 {
     int frame_len = get_aac_frame_len (p);
@@ -192,6 +309,8 @@ static int handle_aac_frame (struct mpeg_sync *mp, sync_callback_t *cb, unsigned
             mp->sample_count = 0;
             return -1;
         }
+    if (mp->settings & MPEG_AUDIO_METER)
+        meter_frame (mp, p, frame_len, header_len);
 
     return frame_len;
 }
@@ -202,7 +321,7 @@ static int get_mpegframe_samplerate (unsigned char *p)
     return mpeg_samplerates [(p[2]&0xC) >> 2][ver];
 }
 
-static int get_mpeg_bitrate (struct mpeg_sync *mp, unsigned char *p)
+static int get_mpeg_bitrate (unsigned char *p)
 {
     int bitrate = -1;
     int bitrate_code = (p[2] & 0xF0) >> 4;
@@ -243,35 +362,74 @@ static int get_samples_per_mpegframe (int version, int layer)
 }
 
 
-static int get_mpeg_frame_length (struct mpeg_sync *mp, unsigned char *p)
+/* table over the header bits that determine mpeg frame size, so per-frame
+ * parsing is a single load instead of the bitrate/samplerate arithmetic.
+ * keyed on version+layer (p[1]) and bitrate+samplerate+padding (p[2]) */
+#define MPEG_FRAME_KEY(p)   ((((p)[1] & 0x1E) << 6) | ((p)[2] >> 1))
+
+struct mpeg_frame_info
 {
-    int padding = (p[2] & 0x2) >> 1;
-    int frame_len = 0;
+    int16_t len;        /* frame length in bytes, 0 when not computable */
+    int16_t samples;
+    int16_t bitrate;    /* kbps */
+    int samplerate;     /* 0 marks an invalid header */
+};
 
-    int64_t bitrate = get_mpeg_bitrate (mp, p);
-    int layer = get_mpegframe_layer (p);
-    int samples = get_samples_per_mpegframe (get_mpegframe_version (p), layer);
-    int samplerate = get_mpegframe_samplerate (p);
+static struct mpeg_frame_info mpeg_frame_info_tab [2048];
+static int mpeg_frame_info_ready;
 
-    if (samplerate == 0 || (mp->mask && syncframe_samplerate (mp) != samplerate))
-        return -1;
-    mp->sample_count = samples;
-    if (bitrate > 0 && samples > 0)
+/* fill the frame info table from the usual header arithmetic. idempotent, so
+ * a racing first use from two sources is harmless */
+static void mpeg_frame_info_init (void)
+{
+    unsigned int key;
+
+    for (key = 0; key < 2048; key++)
     {
-        if (mp->type != FORMAT_TYPE_MPEG)  // detection phase
-            syncframe_set_bitrate (mp, bitrate);
+        unsigned char hdr [4] = { 0xFF, 0, 0, 0 };
+        struct mpeg_frame_info *f = &mpeg_frame_info_tab [key];
+        int layer, samples, samplerate, padding;
+        int64_t bitrate;
 
+        hdr[1] = 0xE0 | ((key >> 6) & 0x1E);
+        hdr[2] = (key & 0x7F) << 1;
+
+        samplerate = get_mpegframe_samplerate (hdr);
+        if (samplerate == 0)
+            continue;
+        f->samplerate = samplerate;
+        layer = get_mpegframe_layer (hdr);
+        samples = get_samples_per_mpegframe (get_mpegframe_version (hdr), layer);
+        f->samples = samples;
+        bitrate = get_mpeg_bitrate (hdr);
+        if (bitrate <= 0 || samples <= 0)
+            continue;
+        f->bitrate = bitrate;
+        padding = (hdr[2] & 0x2) >> 1;
         bitrate *= 1000;
         if (layer == MPEG_LAYER_1)
-        {
-            frame_len = (int)(12 * bitrate / samplerate + padding) * 4; // ??
-        }
+            f->len = (int)(12 * bitrate / samplerate + padding) * 4; // ??
         else
-        {
-            frame_len = (int)(samples / 8 * bitrate / samplerate + padding);
-        }
+            f->len = (int)(samples / 8 * bitrate / samplerate + padding);
     }
-    return frame_len;
+    mpeg_frame_info_ready = 1;
+}
+
+
+static int get_mpeg_frame_length (struct mpeg_sync *mp, unsigned char *p)
+{
+    struct mpeg_frame_info *f;
+
+    if (mpeg_frame_info_ready == 0)
+        mpeg_frame_info_init ();
+    f = &mpeg_frame_info_tab [MPEG_FRAME_KEY (p)];
+
+    if (f->samplerate == 0 || (mp->mask && syncframe_samplerate (mp) != f->samplerate))
+        return -1;
+    mp->sample_count = f->samples;
+    if (f->len && mp->type != FORMAT_TYPE_MPEG)  // detection phase
+        syncframe_set_bitrate (mp, f->bitrate);
+    return f->len;
 }
 
 
@@ -305,13 +463,16 @@ static int handle_mpeg_frame (struct mpeg_sync *mp, sync_callback_t *cb, unsigne
             mp->sample_count = 0;
             return -1;
         }
+    if (mp->settings & MPEG_AUDIO_METER)
+        meter_frame (mp, p, frame_len, (p[1] & 0x1) ? 4 : 6);
     return frame_len;
 }
 
 
 static int handle_ts_frame (struct mpeg_sync *mp, sync_callback_t *cb, unsigned char *p, int remaining)
 {
-    int frame_len = mp->sample_count;
+    /* sample_count is reset per block, the filter carries the packet length */
+    int frame_len = mp->ts_filter ? mp->ts_filter->pkt_len : mp->sample_count;
 
     if (remaining - frame_len < 0)
         return 0;
@@ -320,7 +481,23 @@ static int handle_ts_frame (struct mpeg_sync *mp, sync_callback_t *cb, unsigned
         if (mp->settings & MPEG_LOG_MESSAGES)
             INFO1 ("missing frame marker from %s", mp->reference);
         mp->sample_count = 0;
-        frame_len = -1;
+        return -1;
+    }
+    if (mp->ts_filter)
+    {
+        struct mpeg_ts_filter *f = mp->ts_filter;
+        unsigned int pid = ((p[1] & 0x1F) << 8) | p[2];
+
+        if (f->drop [pid >> 3] & (1 << (pid & 7)))
+        {
+            f->dropped++;
+            mp->settings |= SYNC_DISCARD;
+        }
+        else if (p[3] & 0x10)   /* payload present, counter advances */
+        {
+            f->cc [pid] = (f->cc [pid] + 1) & 0xF;
+            p[3] = (p[3] & 0xF0) | f->cc [pid];
+        }
     }
     return frame_len;
 }
@@ -550,7 +727,11 @@ static int check_for_ts (struct mpeg_sync *mp, unsigned char *p, unsigned remain
     mp->mask = 0xFF000000;
     mp->marker = 0x47;
     mp->sample_count = pkt_len;
-    mp->settings |= MPEG_SKIP_SYNC | SYNC_CHANGED;
+    mp->settings |= SYNC_CHANGED;
+    if (mp->ts_filter)          /* keep walking the packets if PIDs are to go */
+        mp->ts_filter->pkt_len = pkt_len;
+    else
+        mp->settings |= MPEG_SKIP_SYNC;
     return 1;
 }
 
@@ -704,7 +885,7 @@ static int get_initial_frame (struct mpeg_sync *mp, unsigned char *p, unsigned r
         return 2; // we should skip processing
 
     // reset all but external options
-    mp->settings &= (MPEG_LOG_MESSAGES|MPEG_KEEP_META|MPEG_COPY_META|SYNC_CHKFRAME_MASK);
+    mp->settings &= (MPEG_LOG_MESSAGES|MPEG_KEEP_META|MPEG_COPY_META|MPEG_AUDIO_METER|SYNC_CHKFRAME_MASK);
 
     mp->type = FORMAT_TYPE_UNDEFINED;
 
@@ -762,6 +943,59 @@ static int match_syncbits (mpeg_sync *mp, unsigned char *p, unsigned remaining)
 }
 
 
+/* bulk scan for bytes which could start any of the markers the detection
+ * loop below checks for (frame sync, TS, USAC, OggS, ID3/TAG, APETAGEX).
+ * returns a count of leading bytes that cannot match, 0 when unsure, so the
+ * caller always falls back to the byte checks. */
+static int sync_skip_unmatchable (const unsigned char *p, int remaining)
+{
+    int skip = 0;
+#ifdef __SSE2__
+    const __m128i c47 = _mm_set1_epi8 (0x47), c56 = _mm_set1_epi8 (0x56),
+                  cff = _mm_set1_epi8 ((char)0xFF), cO = _mm_set1_epi8 ('O'),
+                  cI = _mm_set1_epi8 ('I'), cT = _mm_set1_epi8 ('T'),
+                  cA = _mm_set1_epi8 ('A');
+
+    while (remaining - skip >= 16)
+    {
+        __m128i v = _mm_loadu_si128 ((const __m128i *)(p + skip));
+        __m128i m = _mm_or_si128 (_mm_cmpeq_epi8 (v, c47), _mm_cmpeq_epi8 (v, c56));
+        int bits;
+
+        m = _mm_or_si128 (m, _mm_cmpeq_epi8 (v, cff));
+        m = _mm_or_si128 (m, _mm_or_si128 (_mm_cmpeq_epi8 (v, cO), _mm_cmpeq_epi8 (v, cI)));
+        m = _mm_or_si128 (m, _mm_or_si128 (_mm_cmpeq_epi8 (v, cT), _mm_cmpeq_epi8 (v, cA)));
+        bits = _mm_movemask_epi8 (m);
+        if (bits)
+        {
+            skip += __builtin_ctz (bits);
+            break;
+        }
+        skip += 16;
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8x16_t c47 = vdupq_n_u8 (0x47), c56 = vdupq_n_u8 (0x56),
+                     cff = vdupq_n_u8 (0xFF), cO = vdupq_n_u8 ('O'),
+                     cI = vdupq_n_u8 ('I'), cT = vdupq_n_u8 ('T'),
+                     cA = vdupq_n_u8 ('A');
+
+    while (remaining - skip >= 16)
+    {
+        uint8x16_t v = vld1q_u8 (p + skip);
+        uint8x16_t m = vorrq_u8 (vceqq_u8 (v, c47), vceqq_u8 (v, c56));
+
+        m = vorrq_u8 (m, vceqq_u8 (v, cff));
+        m = vorrq_u8 (m, vorrq_u8 (vceqq_u8 (v, cO), vceqq_u8 (v, cI)));
+        m = vorrq_u8 (m, vorrq_u8 (vceqq_u8 (v, cT), vceqq_u8 (v, cA)));
+        if (vmaxvq_u8 (m))
+            break;      // candidate within this block, byte checks take over
+        skip += 16;
+    }
+#endif
+    return skip;
+}
+
+
 /* return number from 0 to remaining */
 static int find_align_sync (mpeg_sync *mp, unsigned char *start, int remaining, int prevent_move)
 {
@@ -818,7 +1052,15 @@ static int find_align_sync (mpeg_sync *mp, unsigned char *start, int remaining,
         {
             int offset = remaining;
             do {
+                int jump;
                 if (offset < 3) break;
+                jump = sync_skip_unmatchable (p, offset);
+                if (jump)
+                {
+                    p += jump;
+                    offset -= jump;
+                    if (offset < 3) break;
+                }
                 if (*p == 0x47) break;   // MPEG TS
                 if (*p == 0x56)
                     if ((p[1] & 0xE0) == 0xE0) break; // USAC
@@ -877,12 +1119,16 @@ int mpeg_complete_frames_cb (mpeg_sync *mp, sync_callback_t *cb, refbuf_t *new_b
         else
         {
             int new_len = mp->surplus->len + new_block->len;
-            unsigned char *p = realloc (mp->surplus->data, new_len);
+            unsigned char *p = refbuf_data_resize (mp->surplus, new_len);
 
             memcpy (p+mp->surplus->len, new_block->data, new_block->len);
+            /* swap payloads, the backing flag has to follow the pointer */
             mp->surplus->data = new_block->data;
+            mp->surplus->flags |= (new_block->flags & REFBUF_DATA_ARENA);
             new_block->data = (void*)p;
+            new_block->flags &= ~REFBUF_DATA_ARENA;
             new_block->len = new_len;
+            new_block->alloc_len = 0;   /* data swapped, capacity untracked */
         }
         refbuf_release (mp->surplus);
         mp->surplus = NULL;
@@ -905,9 +1151,9 @@ int mpeg_complete_frames_cb (mpeg_sync *mp, sync_callback_t *cb, refbuf_t *new_b
                 {
                     unsigned old_len = new_block->len;
                     unsigned new_len = old_len - remaining + (mp->sample_count ? mp->sample_count : 5000);
-                    unsigned char *p = realloc (new_block->data, new_len);
-                    new_block->data = (void*)p;
+                    refbuf_data_resize (new_block, new_len);
                     new_block->len = new_len;
+                    new_block->alloc_len = 0;
                     mp->settings &= ~SYNC_CHK_TAG;
                     return old_len;
                 }
@@ -919,6 +1165,20 @@ int mpeg_complete_frames_cb (mpeg_sync *mp, sync_callback_t *cb, refbuf_t *new_b
                 break;
             if (frame_len > 0)
             {
+                if (mp->settings & SYNC_DISCARD)
+                {
+                    /* frame checked out but is unwanted, excise it in place */
+                    mp->settings &= ~SYNC_DISCARD;
+                    if ((new_block->flags & REFBUF_SHARED) == 0)
+                    {
+                        memmove (start, start+frame_len, remaining-frame_len);
+                        new_block->len -= frame_len;
+                    }
+                    else
+                        start += frame_len;
+                    mp->resync_count = 0;
+                    continue;
+                }
                 samples += mp->sample_count;
                 start += frame_len;
                 mp->resync_count = 0;
@@ -983,9 +1243,9 @@ int mpeg_complete_frames_cb (mpeg_sync *mp, sync_callback_t *cb, refbuf_t *new_b
                 if ((new_block->flags & REFBUF_SHARED) == 0 && (mp->settings & SYNC_RESIZE))
                 {
                     unsigned new_len = mp->sample_count ? mp->sample_count : new_block->len + 5000;
-                    unsigned char *p = realloc (new_block->data, new_len);
-                    new_block->data = (void*)p;
+                    refbuf_data_resize (new_block, new_len);
                     new_block->len = new_len;
+                    new_block->alloc_len = 0;
                 }
                 else
                     new_block->len = offset;
@@ -998,10 +1258,9 @@ int mpeg_complete_frames_cb (mpeg_sync *mp, sync_callback_t *cb, refbuf_t *new_b
                 if ((mp->settings & SYNC_RESIZE) && mp->sample_count < 2000000)
                 {
                     unsigned new_len = mp->sample_count + (new_block->len - remaining);
-                    unsigned char *p = realloc (new_block->data, new_len);
-
-                    new_block->data = (void*)p;
+                    refbuf_data_resize (new_block, new_len);
                     new_block->len = new_len;
+                    new_block->alloc_len = 0;
                     return remaining;
                 }
             }
@@ -1070,6 +1329,13 @@ void mpeg_cleanup (mpeg_sync *mpsync)
 {
     if (mpsync)
     {
+        if (mpsync->ts_filter)
+        {
+            if (mpsync->ts_filter->dropped && (mpsync->settings & MPEG_LOG_MESSAGES))
+                INFO2 ("dropped %" PRIu64 " TS packets on %s", mpsync->ts_filter->dropped, mpsync->reference);
+            free (mpsync->ts_filter);
+            mpsync->ts_filter = NULL;
+        }
         free (mpsync->tag_data);
         refbuf_release (mpsync->surplus);
         mpsync->reference = NULL;
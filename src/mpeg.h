@@ -28,6 +28,7 @@ typedef uint8_t frame_type_t;
 #define FORMAT_TYPE_MP4             4
 #define FORMAT_TYPE_EBML            5
 #define FORMAT_TYPE_USAC            6   // USAC/LOAS framed aac
+#define FORMAT_TYPE_RAW             7   // opaque content, queued without parsing
 
 
 typedef struct sync_callback_t
@@ -36,6 +37,28 @@ typedef struct sync_callback_t
     int (*frame_callback)(struct mpeg_sync *mp, struct sync_callback_t *cb, unsigned char *p, unsigned int len, unsigned int offset);
 } sync_callback_t;
 
+
+/* map of the parsed frame layout of a queue block, built once on the source
+ * thread and attached to the block so listener side repackers (flv) do not
+ * have to run the frame parser per listener. entries follow the header */
+struct mpeg_frame_entry
+{
+    uint32_t offset;        /* from the start of the block data */
+    uint16_t len;
+    uint16_t samples;
+    uint16_t hdr_len;
+    uint16_t reserved;
+};
+
+struct mpeg_frame_map
+{
+    uint16_t count;
+    frame_type_t type;
+    uint8_t  channels;
+    uint32_t samplerate;
+};
+#define mpeg_frame_map_entries(m)   ((struct mpeg_frame_entry *)((struct mpeg_frame_map *)(m) + 1))
+
 typedef struct mpeg_sync
 {
     uint64_t settings;
@@ -52,8 +75,12 @@ typedef struct mpeg_sync
 
     uint64_t sample_count;
 
+    uint32_t meter_frames;
+    uint32_t meter_quiet;
+
     int (*process_frame) (struct mpeg_sync *mp, sync_callback_t *cb, unsigned char *p, int len);
 
+    struct mpeg_ts_filter *ts_filter;   /* optional TS PID drop/restamp state */
     refbuf_t *surplus;
     const char *reference;
 } mpeg_sync;
@@ -63,11 +90,13 @@ typedef struct mpeg_sync
 #define MPEG_SKIP_SYNC      (1<<2)
 #define MPEG_KEEP_META      (1<<3)
 #define MPEG_COPY_META      (1<<4)
+#define MPEG_AUDIO_METER    (1<<7)
 
 void mpeg_setup (mpeg_sync *mpsync, const char *mount);
 void mpeg_cleanup (mpeg_sync *mpsync);
 void mpeg_check_numframes (mpeg_sync *mpsync, unsigned count);
 void mpeg_set_flags (mpeg_sync *mpsync, uint64_t flags);
+int  mpeg_set_ts_drop (mpeg_sync *mpsync, const char *pids);
 frame_type_t mpeg_get_type (mpeg_sync *mp);
 
 int  mpeg_complete_frames_cb (mpeg_sync *mp, sync_callback_t *cb, refbuf_t *new_block, unsigned offset);
@@ -79,6 +108,7 @@ int  mpeg_get_bitrate (struct mpeg_sync *mp);
 int  mpeg_get_channels (struct mpeg_sync *mp);
 int  mpeg_get_samplerate (struct mpeg_sync *mp);
 int  mpeg_has_changed (struct mpeg_sync *mp);
+int  mpeg_meter_level (struct mpeg_sync *mp);
 int  mpeg_block_expanded (struct mpeg_sync *mp);
 int  mpeg_tag_found (mpeg_sync *mp, const unsigned char **p, unsigned int *l);
 
@@ -86,4 +116,6 @@ int syncframe_bitrate (mpeg_sync *mp);
 int syncframe_channels (mpeg_sync *mp);
 int syncframe_samplerate (mpeg_sync *mp);
 
+void mpeg_sync_set_details (mpeg_sync *mp, int samplerate, int channels, frame_type_t type);
+
 #endif /* __MPEG_SYNC_H */
@@ -25,6 +25,7 @@
 #include <sys/types.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #ifndef _WIN32
 #include <netdb.h>
@@ -51,12 +52,38 @@
 /* internal function */
 
 static int _isip(const char *what);
+static char *_lookup_ip (const char *name, char *buff, int len);
 
 /* internal data */
 
 #ifndef NO_THREAD
 static mutex_t _resolver_mutex;
+
+/* TTL cache over name to address lookups, refreshed by a couple of worker
+ * threads. A lapsed entry hands back its last known address and queues a
+ * background refresh, so repeat lookups (relay failover, yp updates) never
+ * sit behind a slow DNS server; only the very first lookup of a name blocks.
+ */
+#define RESOLVER_WORKERS        2
+#define RESOLVER_TTL            120
+#define RESOLVER_NEGATIVE_TTL   10
+
+struct resolver_entry
+{
+    struct resolver_entry *next;
+    char *name;
+    char ip [MAX_ADDR_LEN];
+    time_t expires;
+    char pending;       // refresh queued (1) or being resolved (2)
+    char negative;      // last lookup failed
+};
+
+static struct resolver_entry *resolver_cache;
+static cond_t resolver_cond;
+static int resolver_running;
+static thread_type *resolver_tids [RESOLVER_WORKERS];
 #endif
+
 static int _initialized = 0;
 
 #ifdef HAVE_INET_PTON
@@ -104,7 +131,7 @@ char *resolver_getname(const char *ip, char *buff, int len)
 
     if (head)
     {
-        if (getnameinfo(head->ai_addr, head->ai_addrlen, buff, len, NULL, 
+        if (getnameinfo(head->ai_addr, head->ai_addrlen, buff, len, NULL,
                     0, NI_NAMEREQD) == 0)
             ret = buff;
 
@@ -115,17 +142,11 @@ char *resolver_getname(const char *ip, char *buff, int len)
 }
 
 
-char *resolver_getip(const char *name, char *buff, int len)
+static char *_lookup_ip (const char *name, char *buff, int len)
 {
     struct addrinfo *head, hints;
     char *ret = NULL;
 
-    if (_isip(name)) {
-        strncpy(buff, name, len);
-        buff [len-1] = '\0';
-        return buff;
-    }
-
     memset (&hints, 0, sizeof (hints));
     hints . ai_family = AF_UNSPEC;
     hints . ai_socktype = SOCK_STREAM;
@@ -134,7 +155,7 @@ char *resolver_getip(const char *name, char *buff, int len)
 
     if (head)
     {
-        if (getnameinfo(head->ai_addr, head->ai_addrlen, buff, len, NULL, 
+        if (getnameinfo(head->ai_addr, head->ai_addrlen, buff, len, NULL,
                     0, NI_NUMERICHOST) == 0)
             ret = buff;
         freeaddrinfo (head);
@@ -171,17 +192,11 @@ char *resolver_getname(const char *ip, char *buff, int len)
     return ret;
 }
 
-char *resolver_getip(const char *name, char *buff, int len)
+static char *_lookup_ip (const char *name, char *buff, int len)
 {
     struct hostent *host;
     char *ret = NULL;
 
-    if (_isip(name))
-    {
-        strncpy(buff, name, len);
-        buff [len-1] = '\0';
-        return buff;
-    }
     thread_mutex_lock(&_resolver_mutex);
     host = gethostbyname(name);
     if (host)
@@ -197,6 +212,142 @@ char *resolver_getip(const char *name, char *buff, int len)
 #endif
 
 
+#ifndef NO_THREAD
+static struct resolver_entry *resolver_cache_find (const char *name)
+{
+    struct resolver_entry *entry = resolver_cache;
+    while (entry && strcmp (entry->name, name))
+        entry = entry->next;
+    return entry;
+}
+
+
+/* worker thread, services queued refreshes and re-resolves entries shortly
+ * before they lapse. Entries are never freed outside shutdown so holding a
+ * pointer over the blocking lookup is safe.
+ */
+static void *resolver_worker (void *arg)
+{
+    thread_mutex_lock (&_resolver_mutex);
+    while (resolver_running)
+    {
+        struct resolver_entry *entry = resolver_cache;
+        char ip [MAX_ADDR_LEN], name [256], *ret;
+        time_t now = time (NULL);
+
+        while (entry)
+        {
+            if (entry->pending == 1)
+                break;
+            if (entry->pending == 0 && entry->negative == 0 && entry->expires <= now + 10)
+                break;      // refresh ahead of the lapse
+            entry = entry->next;
+        }
+        if (entry == NULL)
+        {
+            struct timespec ts;
+            thread_get_timespec (&ts);
+            thread_time_add_ms (&ts, 1000);
+            thread_cond_timedwait (&resolver_cond, &_resolver_mutex, &ts);
+            continue;
+        }
+        entry->pending = 2;
+        snprintf (name, sizeof name, "%s", entry->name);
+        thread_mutex_unlock (&_resolver_mutex);
+
+        ret = _lookup_ip (name, ip, sizeof ip);
+
+        thread_mutex_lock (&_resolver_mutex);
+        now = time (NULL);
+        if (ret)
+        {
+            memcpy (entry->ip, ip, sizeof (entry->ip));
+            entry->negative = 0;
+            entry->expires = now + RESOLVER_TTL;
+        }
+        else if (entry->negative || entry->ip[0] == '\0')
+        {
+            entry->negative = 1;
+            entry->expires = now + RESOLVER_NEGATIVE_TTL;
+        }
+        else    // keep the last known address a while longer
+            entry->expires = now + RESOLVER_NEGATIVE_TTL;
+        entry->pending = 0;
+    }
+    thread_mutex_unlock (&_resolver_mutex);
+    return NULL;
+}
+#endif
+
+
+char *resolver_getip(const char *name, char *buff, int len)
+{
+    if (_isip(name))
+    {
+        strncpy(buff, name, len);
+        buff [len-1] = '\0';
+        return buff;
+    }
+#ifdef NO_THREAD
+    return _lookup_ip (name, buff, len);
+#else
+    {
+        struct resolver_entry *entry;
+        char *ret = NULL;
+        time_t now = time (NULL);
+
+        thread_mutex_lock (&_resolver_mutex);
+        entry = resolver_cache_find (name);
+        if (entry)
+        {
+            if (entry->expires <= now && entry->pending == 0)
+            {   // serve the stale answer, let a worker chase the update
+                entry->pending = 1;
+                thread_cond_signal (&resolver_cond);
+            }
+            if (entry->negative == 0 && entry->ip[0])
+            {
+                strncpy (buff, entry->ip, len);
+                buff [len-1] = '\0';
+                ret = buff;
+            }
+            thread_mutex_unlock (&_resolver_mutex);
+            return ret;
+        }
+        thread_mutex_unlock (&_resolver_mutex);
+
+        // first sight of this name, the caller wears the blocking lookup
+        ret = _lookup_ip (name, buff, len);
+
+        thread_mutex_lock (&_resolver_mutex);
+        entry = resolver_cache_find (name);
+        if (entry == NULL && (entry = calloc (1, sizeof (*entry))) != NULL)
+        {
+            entry->name = strdup (name);
+            entry->next = resolver_cache;
+            resolver_cache = entry;
+        }
+        if (entry)
+        {
+            if (ret)
+            {
+                snprintf (entry->ip, sizeof (entry->ip), "%s", ret);
+                entry->negative = 0;
+                entry->expires = time (NULL) + RESOLVER_TTL;
+            }
+            else if (entry->ip[0] == '\0')
+            {
+                entry->negative = 1;
+                entry->expires = time (NULL) + RESOLVER_NEGATIVE_TTL;
+            }
+        }
+        thread_mutex_unlock (&_resolver_mutex);
+        return ret;
+    }
+#endif
+}
+
+
 void resolver_initialize()
 {
     /* initialize the lib if we havne't done so already */
@@ -205,6 +356,15 @@ void resolver_initialize()
     {
         _initialized = 1;
         thread_mutex_create (&_resolver_mutex);
+#ifndef NO_THREAD
+        {
+            int i;
+            thread_cond_create (&resolver_cond);
+            resolver_running = 1;
+            for (i = 0; i < RESOLVER_WORKERS; i++)
+                resolver_tids[i] = thread_create ("resolver", resolver_worker, NULL, THREAD_ATTACHED);
+        }
+#endif
 
         /* keep dns connects (TCP) open */
 #ifdef HAVE_SETHOSTENT
@@ -217,6 +377,24 @@ void resolver_shutdown(void)
 {
     if (_initialized)
     {
+#ifndef NO_THREAD
+        int i;
+        thread_mutex_lock (&_resolver_mutex);
+        resolver_running = 0;
+        thread_cond_broadcast (&resolver_cond);
+        thread_mutex_unlock (&_resolver_mutex);
+        for (i = 0; i < RESOLVER_WORKERS; i++)
+            if (resolver_tids[i])
+                thread_join (resolver_tids[i]);
+        while (resolver_cache)
+        {
+            struct resolver_entry *entry = resolver_cache;
+            resolver_cache = entry->next;
+            free (entry->name);
+            free (entry);
+        }
+        thread_cond_destroy (&resolver_cond);
+#endif
         thread_mutex_destroy(&_resolver_mutex);
         _initialized = 0;
 #ifdef HAVE_ENDHOSTENT
@@ -224,4 +402,3 @@ void resolver_shutdown(void)
 #endif
     }
 }
-
@@ -57,6 +57,10 @@
 #ifdef HAVE_NETDB_H
 #include <netdb.h>
 #endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#endif
 
 #ifndef EINPROGRESS
 #define EINPROGRESS WSAEINPROGRESS
@@ -323,6 +327,46 @@ int sock_set_cork (sock_t sock, int yes)
 #endif
 }
 
+/* cap unacknowledged-to-kernel data so writability tracks actual draining
+ * instead of a deep socket buffer */
+int sock_set_notsent_lowat (sock_t sock, int bytes)
+{
+#ifdef TCP_NOTSENT_LOWAT
+    return setsockopt (sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (void *)&bytes, sizeof(bytes));
+#else
+    return -1;
+#endif
+}
+
+/* let the kernel (fq/sch pacing) smooth bursts down to the given byte rate,
+ * 0 removes the cap */
+int sock_set_pacing_rate (sock_t sock, unsigned long bytes_sec)
+{
+#ifdef SO_MAX_PACING_RATE
+    unsigned int rate = bytes_sec > 0xFFFFFFFF ? 0xFFFFFFFF : (unsigned int)bytes_sec;
+
+    if (bytes_sec == 0)
+        rate = ~0U;     /* unlimited */
+    return setsockopt (sock, SOL_SOCKET, SO_MAX_PACING_RATE, (void *)&rate, sizeof(rate));
+#else
+    return -1;
+#endif
+}
+
+/* bytes accepted for sending but not yet put on the wire, -1 if unknown */
+int sock_unsent_bytes (sock_t sock)
+{
+#ifdef SIOCOUTQNSD
+    int unsent = 0;
+
+    if (ioctl (sock, SIOCOUTQNSD, &unsent) < 0)
+        return -1;
+    return unsent;
+#else
+    return -1;
+#endif
+}
+
 int sock_set_nodelay(sock_t sock)
 {
     int nodelay = 1;
@@ -725,6 +769,18 @@ sock_t sock_connect_wto (const char *hostname, int port, int timeout)
 }
 
 
+/* when set, listening sockets are created with SO_REUSEPORT (where the
+ * platform has it) so several threads can bind the same port and have the
+ * kernel spread incoming connections between them.
+ */
+static int sock_reuseport;
+
+void sock_server_reuseport (int enable)
+{
+    sock_reuseport = enable;
+}
+
+
 #ifdef HAVE_GETADDRINFO
 struct _server_sockets
 {
@@ -905,6 +961,10 @@ int sock_get_next_server_socket (sock_server_t _s, sock_t *serversock)
 #ifndef WIN32
         /* reuse it if we can */
         setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, (void *)&on, sizeof(on));
+#ifdef SO_REUSEPORT
+        if (sock_reuseport)
+            setsockopt (sock, SOL_SOCKET, SO_REUSEPORT, (void *)&on, sizeof(on));
+#endif
 #endif
 #ifdef IPV6_V6ONLY
         on = 1;
@@ -1079,6 +1139,10 @@ int sock_get_next_server_socket (sock_server_t _s, sock_t *serversock)
     /* reuse it if we can */
     int opt = 1;
     setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const void *)&opt, sizeof(int));
+#ifdef SO_REUSEPORT
+    if (sock_reuseport)
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const void *)&opt, sizeof(int));
+#endif
 #endif
 
     /* bind socket to port */
@@ -1144,6 +1208,18 @@ void sock_set_send_buffer (sock_t sock, int win_size)
     setsockopt (sock, SOL_SOCKET, SO_SNDBUF, (char *) &win_size, sizeof(win_size));
 }
 
+/* request MSG_ZEROCOPY capable sends on the socket, non-0 return means the
+ * caller should stick to copying sends */
+int sock_enable_zerocopy (sock_t sock)
+{
+#ifdef SO_ZEROCOPY
+    int on = 1;
+    return setsockopt (sock, SOL_SOCKET, SO_ZEROCOPY, (void *)&on, sizeof(on));
+#else
+    return -1;
+#endif
+}
+
 int sock_listen(sock_t serversock, int backlog)
 {
     if (!sock_valid_socket(serversock))
@@ -1188,6 +1264,55 @@ sock_t sock_accept(sock_t serversock, char *ip, size_t len)
     return ret;
 }
 
+
+/* accept variant for draining a nonblocking listener. Uses accept4() where
+ * available so the client socket comes back nonblocking and close-on-exec
+ * without the fcntl round trips after each accept.
+ */
+sock_t sock_accept_nb (sock_t serversock, char *ip, size_t len)
+{
+#ifdef HAVE_GETNAMEINFO
+    struct sockaddr_storage sa;
+#else
+    struct sockaddr_in sa;
+#endif
+    sock_t ret;
+    socklen_t slen;
+
+    slen = sizeof(sa);
+#if defined(__linux__) && defined(SOCK_NONBLOCK)
+    ret = accept4 (serversock, (struct sockaddr *)&sa, &slen, SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+    ret = accept (serversock, (struct sockaddr *)&sa, &slen);
+    if (ret != SOCK_ERROR)
+    {
+        sock_set_cloexec (ret);
+        if (sock_set_blocking (ret, 0))
+        {
+            sock_close (ret);
+            return SOCK_ERROR;
+        }
+    }
+#endif
+    if (ret != SOCK_ERROR)
+    {
+        if (ip)
+        {
+#ifdef HAVE_GETNAMEINFO
+            if (getnameinfo ((struct sockaddr *)&sa, slen, ip, len, NULL, 0, NI_NUMERICHOST))
+                snprintf (ip, len, "unknown");
+#else
+            /* inet_ntoa is not reentrant, we should protect this */
+            strncpy(ip, inet_ntoa(sa.sin_addr), len);
+#endif
+        }
+        sock_set_nolinger(ret);
+        sock_set_keepalive(ret);
+    }
+
+    return ret;
+}
+
 #ifdef _WIN32
 int sock_create_pipe_emulation (SOCKET handles[2])
 {
@@ -100,8 +100,13 @@ ssize_t sock_writev (sock_t sock, WSABUF *iov, size_t count);
 # define sock_get_server_socket _mangle(sock_get_server_socket)
 # define sock_listen _mangle(sock_listen)
 # define sock_set_send_buffer _mangle(sock_set_send_buffer)
+# define sock_enable_zerocopy _mangle(sock_enable_zerocopy)
+# define sock_set_notsent_lowat _mangle(sock_set_notsent_lowat)
+# define sock_set_pacing_rate _mangle(sock_set_pacing_rate)
+# define sock_unsent_bytes _mangle(sock_unsent_bytes)
 # define sock_set_mss _mangle(sock_set_mss)
 # define sock_accept _mangle(sock_accept)
+# define sock_accept_nb _mangle(sock_accept_nb)
 # define sock_create_pipe_emulation _mangle(sock_create_pipe_emulation)
 #endif
 
@@ -122,6 +127,10 @@ int sock_set_nodelay(sock_t sock);
 int sock_set_cork (sock_t sock, int yes);
 
 void sock_set_send_buffer (sock_t sock, int win_size);
+int sock_enable_zerocopy (sock_t sock);
+int sock_set_notsent_lowat (sock_t sock, int bytes);
+int sock_set_pacing_rate (sock_t sock, unsigned long bytes_sec);
+int sock_unsent_bytes (sock_t sock);
 int sock_set_delay(sock_t sock);
 void sock_set_error(int val);
 int sock_close(sock_t  sock);
@@ -148,12 +157,14 @@ int sock_read_pending(sock_t sock, unsigned timeout);
 
 /* server socket functions */
 sock_server_t sock_get_server_sockets (int port, const char *sinterface);
+void sock_server_reuseport (int enable);
 int sock_get_next_server_socket (sock_server_t, sock_t *socket);
 void sock_free_server_sockets (sock_server_t);
 
 sock_t sock_get_server_socket(int port, const char *sinterface);
 int sock_listen(sock_t serversock, int backlog);
 sock_t sock_accept(sock_t serversock, char *ip, size_t len);
+sock_t sock_accept_nb(sock_t serversock, char *ip, size_t len);
 
 #ifndef HAVE_INET_ATON
 int inet_aton(const char *s, struct in_addr *a);
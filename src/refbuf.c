@@ -22,7 +22,12 @@
 
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <stdint.h>
+#include <sys/mman.h>
+#endif
 
+#include "thread/thread.h"
 #include "refbuf.h"
 
 #define CATMODULE "refbuf"
@@ -31,12 +36,223 @@
 #include "global.h"
 
 
+/* optional hugepage arena for stream queue payloads. Queue blocks are a few
+ * KB each but massed in their thousands across sources, so carving them from
+ * 2MB chunks keeps the send path within a handful of TLB entries instead of
+ * touching one per block. Chunks are aligned to their own size so a payload
+ * pointer maps back to its chunk header with a mask. Off unless <hugepages>
+ * is set in the config, and degrades to a plain (THP eligible) mapping, then
+ * to malloc, when hugepages are not available. Left out of MY_ALLOC builds
+ * so the profiler keeps seeing every allocation.
+ */
+#if !defined(_WIN32) && !defined(MY_ALLOC)
+#define REFBUF_ARENA
+#endif
+
+#ifdef REFBUF_ARENA
+
+#define ARENA_CHUNK_SIZE        (2*1024*1024)
+#define ARENA_HDR_SIZE          REFBUF_ALIGNMENT
+#define ARENA_ALLOC_MAX         (256*1024)
+
+typedef struct
+{
+    unsigned int blocks;    /* live payloads carved from this chunk */
+    unsigned int fill;      /* bump offset of the next payload */
+} arena_chunk_t;
+
+static spin_t arena_lock;
+static char *arena_current;
+static int arena_enabled;
+
+
+static void *arena_map (void)
+{
+    void *p = MAP_FAILED;
+    arena_chunk_t *chunk;
+
+#ifdef MAP_HUGETLB
+    p = mmap (NULL, ARENA_CHUNK_SIZE, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED)
+    {
+        /* no hugepage pool, take an aligned plain mapping which THP can
+         * still promote, trimming the over-allocation used for alignment */
+        size_t span = ARENA_CHUNK_SIZE * 2;
+        char *raw = mmap (NULL, span, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        char *base;
+
+        if (raw == MAP_FAILED)
+            return NULL;
+        base = (char *)(((uintptr_t)raw + ARENA_CHUNK_SIZE-1) & ~(uintptr_t)(ARENA_CHUNK_SIZE-1));
+        if (base > raw)
+            munmap (raw, base - raw);
+        if (raw + span > base + ARENA_CHUNK_SIZE)
+            munmap (base + ARENA_CHUNK_SIZE, raw + span - (base + ARENA_CHUNK_SIZE));
+#ifdef MADV_HUGEPAGE
+        madvise (base, ARENA_CHUNK_SIZE, MADV_HUGEPAGE);
+#endif
+        p = base;
+    }
+    chunk = p;
+    chunk->blocks = 0;
+    chunk->fill = ARENA_HDR_SIZE;
+    return p;
+}
+
+
+static void *arena_alloc (unsigned int len)
+{
+    void *p = NULL;
+    unsigned int need = (len + REFBUF_ALIGNMENT-1) & ~(unsigned int)(REFBUF_ALIGNMENT-1);
+
+    if (arena_enabled == 0 || len == 0 || len > ARENA_ALLOC_MAX)
+        return NULL;
+    thread_spin_lock (&arena_lock);
+    do
+    {
+        arena_chunk_t *chunk = (arena_chunk_t *)arena_current;
+        if (chunk && chunk->fill + need > ARENA_CHUNK_SIZE)
+        {
+            if (chunk->blocks)
+                arena_current = NULL;   /* full, unmapped with its last payload */
+            else
+                chunk->fill = ARENA_HDR_SIZE;   /* all returned, start over in place */
+            chunk = (arena_chunk_t *)arena_current;
+        }
+        if (chunk == NULL)
+        {
+            /* rare enough that mapping under the lock does not matter, the
+             * block caches mean a chunk serves a long stretch of the stream */
+            if ((arena_current = arena_map ()) == NULL)
+            {
+                arena_enabled = 0;
+                WARN0 ("arena mapping failed, reverting stream queues to malloc");
+                break;
+            }
+            chunk = (arena_chunk_t *)arena_current;
+        }
+        p = arena_current + chunk->fill;
+        chunk->fill += need;
+        chunk->blocks++;
+    } while (0);
+    thread_spin_unlock (&arena_lock);
+    return p;
+}
+
+
+static void arena_release (void *p)
+{
+    char *base = (char *)((uintptr_t)p & ~(uintptr_t)(ARENA_CHUNK_SIZE-1));
+    arena_chunk_t *chunk = (arena_chunk_t *)base;
+    int unmap = 0;
+
+    thread_spin_lock (&arena_lock);
+    if (--chunk->blocks == 0)
+    {
+        if (base == arena_current)
+            chunk->fill = ARENA_HDR_SIZE;   /* keep the active chunk around */
+        else
+            unmap = 1;
+    }
+    thread_spin_unlock (&arena_lock);
+    if (unmap)
+        munmap (base, ARENA_CHUNK_SIZE);
+}
+#endif  /* REFBUF_ARENA */
+
+
+void refbuf_arena_enable (int setting)
+{
+#ifdef REFBUF_ARENA
+    arena_enabled = setting;
+    if (setting)
+        INFO0 ("hugepage arena enabled for stream queues");
+#else
+    if (setting)
+        WARN0 ("hugepage arena not available in this build");
+#endif
+}
+
+
+/* queue block constructor, places the payload in the arena when it is on,
+ * identical to refbuf_new otherwise */
+refbuf_t *refbuf_new_arena (unsigned int size)
+{
+#ifdef REFBUF_ARENA
+    void *data = arena_alloc (size);
+    if (data)
+    {
+        refbuf_t *refbuf = refbuf_new (0);
+        refbuf->data = data;
+        refbuf->len = size;
+        refbuf->alloc_len = size;
+        refbuf->flags = REFBUF_DATA_ARENA;
+        return refbuf;
+    }
+#endif
+    return refbuf_new (size);
+}
+
+
+/* grow or shrink the payload of a block. Arena payloads cannot be resized in
+ * place so they migrate to the heap, which also keeps later realloc calls on
+ * the block legal whatever backing it started with */
+void *refbuf_data_resize (refbuf_t *r, unsigned int len)
+{
+#ifdef REFBUF_ARENA
+    if (r->flags & REFBUF_DATA_ARENA)
+    {
+        void *p = malloc (len);
+        if (p)
+        {
+            memcpy (p, r->data, r->len < len ? r->len : len);
+            arena_release (r->data);
+            r->flags &= ~REFBUF_DATA_ARENA;
+            r->data = p;
+        }
+        return p;
+    }
+#endif
+    return r->data = realloc (r->data, len);
+}
+
+
+#ifndef MY_ALLOC
+/* header allocation honouring the cache line alignment of refbuf_t, as
+ * malloc only guarantees enough for the basic types */
+static refbuf_t *refbuf_alloc (void)
+{
+#if defined(REFBUF_ALIGNMENT) && !defined(_WIN32)
+    void *p = NULL;
+    if (posix_memalign (&p, REFBUF_ALIGNMENT, sizeof (refbuf_t)) == 0)
+        return memset (p, 0, sizeof (refbuf_t));
+    return NULL;
+#else
+    return calloc (1, sizeof (refbuf_t));
+#endif
+}
+#endif
+
+
 void refbuf_initialize(void)
 {
+#ifdef REFBUF_ARENA
+    thread_spin_create (&arena_lock);
+#endif
 }
 
 void refbuf_shutdown(void)
 {
+#ifdef REFBUF_ARENA
+    if (arena_current)
+    {
+        munmap (arena_current, ARENA_CHUNK_SIZE);
+        arena_current = NULL;
+    }
+    thread_spin_destroy (&arena_lock);
+#endif
 }
 
 #ifdef MY_ALLOC
@@ -55,9 +271,12 @@ refbuf_t *refbuf_new_s (unsigned int size, const char *file, const int line)
             abort();
     }
     refbuf->len = size;
+    refbuf->alloc_len = size;
     refbuf->_count = 1;
     refbuf->next = NULL;
     refbuf->associated = NULL;
+    refbuf->frame_map = NULL;
+    refbuf->queue_ms = 0;
 
     return refbuf;
 }
@@ -66,7 +285,7 @@ refbuf_t *refbuf_new (unsigned int size)
 {
     refbuf_t *refbuf;
 
-    refbuf = (refbuf_t *)calloc(1, sizeof(refbuf_t));
+    refbuf = refbuf_alloc ();
     if (refbuf == NULL)
         abort();
     refbuf->data = NULL;
@@ -77,9 +296,12 @@ refbuf_t *refbuf_new (unsigned int size)
             abort();
     }
     refbuf->len = size;
+    refbuf->alloc_len = size;
     refbuf->_count = 1;
     refbuf->next = NULL;
     refbuf->associated = NULL;
+    refbuf->frame_map = NULL;
+    refbuf->queue_ms = 0;
 
     return refbuf;
 }
@@ -139,9 +361,19 @@ void refbuf_release(refbuf_t *self)
     if (self->_count == 0)
     {
         refbuf_release_associated (self->associated);
+        if (self->frame_map)
+            refbuf_release (self->frame_map);
         if (self->next)
             DEBUG0 ("next not null");
-        free(self->data);
+        if ((self->flags & REFBUF_DATA_EXTERNAL) == 0)
+        {
+#ifdef REFBUF_ARENA
+            if (self->flags & REFBUF_DATA_ARENA)
+                arena_release (self->data);
+            else
+#endif
+                free(self->data);
+        }
         free(self);
     }
 }
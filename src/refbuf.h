@@ -19,20 +19,42 @@
 #define __REFBUF_H__
 
 #include <sys/types.h>
+#include <stdint.h>
 
+#ifdef __GNUC__
+#define REFBUF_ALIGNMENT    64      /* typical cache line */
+#define REFBUF_ALIGNED      __attribute__((aligned(REFBUF_ALIGNMENT)))
+#else
+#define REFBUF_ALIGNED
+#endif
+
+/* the header is sized and aligned to a cache line so that refcount updates
+ * on one block do not invalidate the line holding a neighbouring one. The
+ * write-hot accounting fields are grouped ahead of the mostly-read pointers.
+ */
 typedef struct _refbuf_tag
 {
-    unsigned int flags;
     unsigned int _count;
+    unsigned int flags;
+    unsigned int len;
+    unsigned int alloc_len;     /* bytes allocated for data, 0 if untracked */
+
     struct _refbuf_tag *next;
     void *associated;
     char *data;
-    unsigned int len;
+    struct _refbuf_tag *frame_map;  /* optional parsed frame layout, see mpeg.h */
 
-} refbuf_t;
+    /* worker clock (ms) when queued on a source, 0 for non-queue blocks.
+     * listener sends subtract this for the glass to glass latency stats */
+    uint64_t queue_ms;
+
+} REFBUF_ALIGNED refbuf_t;
 
 void refbuf_initialize(void);
 void refbuf_shutdown(void);
+void refbuf_arena_enable (int setting);
+refbuf_t *refbuf_new_arena (unsigned int size);
+void *refbuf_data_resize (refbuf_t *r, unsigned int len);
 
 #ifdef MY_ALLOC
 refbuf_t *refbuf_new_s(unsigned int size, const char *file, int line);
@@ -48,9 +70,16 @@ refbuf_t *refbuf_copy_default (refbuf_t *orig);
 
 #define PER_CLIENT_REFBUF_SIZE  4096
 
+/* initial size of the request read buffer. most requests fit well within
+ * this, it is swapped for a PER_CLIENT_REFBUF_SIZE block only when the
+ * headers overflow it or the client moves onto a streaming path */
+#define PER_CLIENT_REQBUF_SIZE  1024
+
 #define WRITE_BLOCK_GENERIC     01000
 #define REFBUF_SHARED           02000
 #define BUFFER_LOCAL_USE        04000
+#define REFBUF_DATA_EXTERNAL    010000  /* data points into memory owned elsewhere, eg a file mapping */
+#define REFBUF_DATA_ARENA       020000  /* data carved from the queue arena, see refbuf_new_arena */
 
 #endif  /* __REFBUF_H__ */
 
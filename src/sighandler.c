@@ -38,6 +38,20 @@ void _sig_ignore(int signo);
 void sighandler_initialize(void)
 {
 #ifndef _WIN32
+#ifdef HAVE_SIGNALFD
+    /* block the routed signals in this thread before any others are created
+     * so every thread inherits the mask and the signalfd in the connection
+     * loop is the one place they get consumed, making reloads, shutdown and
+     * child reaping deterministic instead of landing on a random thread */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGCHLD);
+    pthread_sigmask (SIG_BLOCK, &mask, NULL);
+#endif
+    /* async handlers remain as the fallback for builds without signalfd */
     signal(SIGHUP, _sig_hup);
     signal(SIGINT, _sig_die);
     signal(SIGTERM, _sig_die);
@@ -46,6 +60,24 @@ void sighandler_initialize(void)
 #endif
 }
 
+
+/* put signal state back to defaults in a freshly forked child, before an
+ * exec or a long lived child loop, so helpers and event scripts do not run
+ * with the server's blocked mask */
+void sighandler_child_reset (void)
+{
+#ifndef _WIN32
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask (SIG_SETMASK, &mask, NULL);
+    signal(SIGHUP, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+#endif
+}
+
 #ifndef _WIN32
 void _sig_ignore(int signo)
 {
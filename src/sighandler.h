@@ -16,6 +16,7 @@
 extern int schedule_config_reread;
 
 void sighandler_initialize(void);
+void sighandler_child_reset(void);
 
 
 #endif  /* __SIGHANDLER_H__ */
@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 
 #ifdef HAVE_SYS_SOCKET_H
@@ -80,6 +81,10 @@ struct master_conn_details
     int ok;
     int max_interval;
     int run_on;
+    int delta;          /* master is sending a binary framed delta */
+    int delta_ok;       /* terminating frame of the delta seen */
+    int has_gen;
+    uint64_t gen;       /* streamlist generation reported by the master */
     time_t synctime;
     char *buffer;
     char *username;
@@ -93,6 +98,7 @@ struct master_conn_details
 
 static void _slave_thread(void);
 static void redirector_add (const char *server, int port, int interval);
+static void redirect_table_rebuild (void);
 static redirect_host *find_slave_host (const char *server, int port);
 static int  relay_startup (client_t *client);
 static int  relay_initialise (client_t *client);
@@ -106,10 +112,19 @@ int streamlister;
 time_t relay_barrier_master;
 time_t relay_barrier_xml;
 
+/* last streamlist generation accepted from the master, sent back on the next
+ * poll so only the changes need to come over. Only touched by the slave
+ * thread and the one-off streamlist thread, serialised by streamlister
+ */
+static uint64_t streamlist_gen;
+static int streamlist_have_gen;
+
 static volatile int update_settings = 0;
 static volatile int update_all_sources = 0;
 static volatile int restart_connection_thread = 0;
 static time_t streamlist_check = 0;
+static time_t config_reread_at = 0;     /* debounced reload, 0 for none pending */
+static time_t config_reread_cap = 0;    /* hard deadline for a prodded burst */
 static rwlock_t slaves_lock;
 static spin_t relay_start_lock;
 static time_t inactivity_timer;
@@ -119,6 +134,58 @@ redirect_host *redirectors;
 worker_t *workers;
 rwlock_t workers_lock;
 
+/* weighted slot table over the redirectors, guarded by slaves_lock. Each
+ * slave occupies slots in proportion to the headroom it last reported so
+ * picking a redirect target is one random slot lookup instead of dogpiling
+ * whichever slave happens to head the list
+ */
+#define REDIRECT_TABLE_SIZE     64
+static redirect_host *redirect_table [REDIRECT_TABLE_SIZE];
+static int redirect_table_len;
+
+/* warm state from the previous run, rewritten periodically so a crash loses
+ * a minute at most. Per relay the listener count and recent host failures,
+ * so the busiest relays clear the connect gate first and start against the
+ * host that was healthy, and per mount the stat baselines so the counters
+ * carry on rather than restart from zero. Only the slave thread touches the
+ * relay hints, during startup and shutdown; mount hints are consumed from
+ * source threads as mounts come up so they sit behind their own lock.
+ */
+typedef struct host_hint
+{
+    struct host_hint *next;
+    int port;
+    int fails;
+    char *ip;
+} host_hint;
+
+typedef struct
+{
+    char *mount;
+    long listeners;
+    uint64_t delay;
+    host_hint *hosts;
+} relay_hint;
+
+typedef struct mount_hint
+{
+    struct mount_hint *next;
+    char *mount;
+    uint64_t peak;
+    uint64_t connections;
+} mount_hint;
+
+static relay_hint *relay_hints;
+static int relay_hint_count;
+static mount_hint *mount_hints;
+static spin_t mount_hint_lock;
+static time_t state_save_at;
+
+#define RELAY_STATE_FILE        "relay.state"
+#define RELAY_STATE_INTERVAL    60      /* secs between snapshot rewrites */
+#define RELAY_START_SPACING     20      /* ms between ranked relay starts */
+#define RELAY_START_MAX_DELAY   5000
+
 
 struct _client_functions relay_client_ops =
 {
@@ -207,6 +274,7 @@ void slave_restart (void)
     update_settings = 1;
     update_all_sources = 1;
     streamlist_check = 0;
+    streamlist_have_gen = 0;    /* master may have changed, full fetch */
     thread_spin_unlock (&relay_start_lock);
 }
 
@@ -229,6 +297,7 @@ void slave_initialize(void)
     slave_running = 1;
     streamlister = 0;
     streamlist_check = 0;
+    streamlist_have_gen = 0;
     update_settings = 0;
     update_all_sources = 0;
     restart_connection_thread = 0;
@@ -237,6 +306,9 @@ void slave_initialize(void)
     worker_count = 0;
     relays_connecting = 0;
     thread_spin_create (&relay_start_lock);
+    thread_spin_register (&relay_start_lock, "relay_start");
+    thread_spin_create (&mount_hint_lock);
+    thread_spin_register (&mount_hint_lock, "mount_hint");
     thread_rwlock_create (&workers_lock);
     global.relays = avl_tree_new (_compare_relay, NULL);
     inactivity_timeout = 0;
@@ -266,34 +338,38 @@ void slave_shutdown(void)
 
     //INFO0 ("all workers shut down");
     avl_tree_free (global.relays, NULL);
+    while (mount_hints)
+    {
+        mount_hint *hint = mount_hints;
+        mount_hints = hint->next;
+        free (hint->mount);
+        free (hint);
+    }
     thread_rwlock_destroy (&slaves_lock);
     thread_rwlock_destroy (&workers_lock);
     thread_spin_destroy (&relay_start_lock);
+    thread_spin_destroy (&mount_hint_lock);
     slave_running = 0;
 }
 
 
 int redirect_client (const char *mountpoint, client_t *client)
 {
-    int ret = 0, which;
+    int ret = 0, changed = 0;
     redirect_host *checking, **trail;
+    time_t now = time (NULL);
 
-    thread_rwlock_rlock (&slaves_lock);
-    /* select slave entry */
+    thread_rwlock_wlock (&slaves_lock);
     if (global.redirect_count == 0)
     {
         thread_rwlock_unlock (&slaves_lock);
         return 0;
     }
-    which=(int) (((float)global.redirect_count)*rand()/(RAND_MAX+1.0)) + 1;
     checking = redirectors;
     trail = &redirectors;
-
-    DEBUG2 ("random selection %d (out of %d)", which, global.redirect_count);
     while (checking)
     {
-        DEBUG2 ("...%s:%d", checking->server, checking->port);
-        if (checking->next_update && checking->next_update+10 < time(NULL))
+        if (checking->next_update && checking->next_update+10 < now)
         {
             /* no streamist request, expire slave for now */
             *trail = checking->next;
@@ -303,43 +379,47 @@ int redirect_client (const char *mountpoint, client_t *client)
             free (checking->server);
             free (checking);
             checking = *trail;
-            if (which > 0)
-                which--; /* we are 1 less now */
+            changed = 1;
             continue;
         }
-        if (--which == 0)
-        {
-            char *location;
-            /* add enough for "http://" the port ':' and nul */
-            int len = strlen (mountpoint) + strlen (checking->server) + 20;
-            const char *user = client->username;
-            const char *pass = client->password;
-            const char *args = httpp_getvar (client->parser, HTTPP_VAR_QUERYARGS);
-            const char *colon = ":", *at_sign = "@";
-            const char *protocol = httpp_getvar (client->parser, HTTPP_VAR_PROTOCOL);
-
-            if (strcmp("HTTP", protocol) == 0)
-                protocol = not_ssl_connection (&client->connection) ? "http" : "https";
-
-            if (args)
-                len += strlen (args);
-            else
-                args = "";
-            if (user && pass)
-                len += strlen (user) + strlen (pass);
-            else
-                colon = at_sign = user = pass = "";
-            INFO2 ("redirecting listener to slave server at %s:%d", checking->server, checking->port);
-            location = alloca (len);
-            snprintf (location, len, "%s://%s%s%s%s%s:%d%s%s", protocol,
-                    user, colon, pass, at_sign,
-                    checking->server, checking->port, mountpoint, args);
-            client_send_302 (client, location);
-            ret = 1;
-        }
         trail = &checking->next;
         checking = checking->next;
     }
+    if (changed)
+        redirect_table_rebuild ();
+    if (redirect_table_len)
+    {
+        redirect_host *selected = redirect_table [(unsigned int)rand() % redirect_table_len];
+        char *location;
+        /* add enough for "http://" the port ':' and nul */
+        int len = strlen (mountpoint) + strlen (selected->server) + 20;
+        const char *user = client->username;
+        const char *pass = client->password;
+        const char *args = httpp_getvar (client->parser, HTTPP_VAR_QUERYARGS);
+        const char *colon = ":", *at_sign = "@";
+        const char *protocol = httpp_getvar (client->parser, HTTPP_VAR_PROTOCOL);
+
+        if (strcmp("HTTP", protocol) == 0)
+            protocol = not_ssl_connection (&client->connection) ? "http" : "https";
+
+        if (args)
+            len += strlen (args);
+        else
+            args = "";
+        if (user && pass)
+            len += strlen (user) + strlen (pass);
+        else
+            colon = at_sign = user = pass = "";
+        DEBUG3 ("selected %s:%d from %d weighted slots", selected->server,
+                selected->port, redirect_table_len);
+        INFO2 ("redirecting listener to slave server at %s:%d", selected->server, selected->port);
+        location = alloca (len);
+        snprintf (location, len, "%s://%s%s%s%s%s:%d%s%s", protocol,
+                user, colon, pass, at_sign,
+                selected->server, selected->port, mountpoint, args);
+        client_send_302 (client, location);
+        ret = 1;
+    }
     thread_rwlock_unlock (&slaves_lock);
     return ret;
 }
@@ -404,10 +484,211 @@ static void encode_auth_header (char *userpass, unsigned int remain)
 }
 
 
+/* A relay marked hot-standby keeps a second master connection established
+ * with its data read off and discarded, so losing the active master is a
+ * socket swap rather than a reconnect and resync through the burst. The
+ * opener runs detached and re-finds the relay by name before attaching,
+ * as the relay may be dropped while the connection is being set up.
+ */
+struct standby_opener
+{
+    char *localmount;
+    char *ip;
+    char *mount;
+    char *bind;
+    int port;
+    int timeout;
+    char headers [512];
+};
+
+
+static void standby_clear (relay_server *relay)
+{
+    if (relay->standby_parser)
+    {
+        httpp_destroy (relay->standby_parser);
+        relay->standby_parser = NULL;
+    }
+    if (relay->standby_con)
+    {
+        INFO1 ("dropping standby connection for %s", relay->localmount);
+        connection_close (relay->standby_con);
+        free (relay->standby_con);
+        relay->standby_con = NULL;
+    }
+    relay->standby_host = NULL;
+}
+
+
+static void *standby_open_thread (void *arg)
+{
+    struct standby_opener *so = arg;
+    connection_t *con = calloc (1, sizeof (connection_t));
+    http_parser_t *parser = NULL;
+    relay_server *relay = NULL, find;
+
+    do
+    {
+        sock_t sock = sock_connect_wto_bind (so->ip, so->port, so->bind, so->timeout);
+        if (connection_init (con, sock, so->ip) < 0)
+        {
+            WARN3 ("standby for %s failed to reach %s:%d", so->localmount, so->ip, so->port);
+            break;
+        }
+        parser = get_relay_response (con, so->mount, so->ip, so->headers);
+        if (parser == NULL || httpp_getvar (parser, HTTPP_VAR_ERROR_MESSAGE))
+        {
+            WARN2 ("standby request for %s refused by %s", so->localmount, so->ip);
+            connection_close (con);
+            if (parser)
+            {
+                httpp_destroy (parser);
+                parser = NULL;
+            }
+            break;
+        }
+        sock_set_blocking (con->sock, 0);
+    } while (0);
+
+    find.localmount = so->localmount;
+    avl_tree_wlock (global.relays);
+    if (avl_get_by_key (global.relays, &find, (void*)&relay) != 0)
+        relay = NULL;
+    if (relay && parser && relay->standby_con == NULL && (relay->flags & RELAY_RUNNING))
+    {
+        relay_server_host *host;
+
+        for (host = relay->hosts; host; host = host->next)
+            if (host->port == so->port && strcmp (host->ip, so->ip) == 0)
+                break;
+        relay->standby_con = con;
+        relay->standby_parser = parser;
+        relay->standby_host = host;
+        con = NULL;
+        parser = NULL;
+        INFO2 ("standby connection ready on %s via %s", so->localmount, so->ip);
+    }
+    if (relay)
+        relay->standby_opening = 0;
+    avl_tree_unlock (global.relays);
+    if (parser)
+        httpp_destroy (parser);
+    if (con)
+    {
+        connection_close (con);
+        free (con);
+    }
+    free (so->localmount);
+    free (so->ip);
+    free (so->mount);
+    free (so->bind);
+    free (so);
+    return NULL;
+}
+
+
+/* called regularly off the relay client. Keeps an established standby
+ * drained, drops it if it has died and kicks off the opener when one is
+ * wanted but not up.
+ */
+static void standby_check (relay_server *relay)
+{
+    relay_server_host *host;
+    struct standby_opener *so;
+    int remain;
+    char *p;
+
+    if ((relay->flags & RELAY_HOT_STANDBY) == 0 || relay->standby_opening)
+        return;
+    if (relay->standby_con)
+    {
+        /* discard whatever the standby has sent, it only has to be kept
+         * moving; frame sync is recovered after the swap */
+        char discard [4096];
+        int loop = 16;
+
+        while (loop--)
+        {
+            int ret = connection_read (relay->standby_con, discard, sizeof discard);
+            if (ret < (int)sizeof discard)
+            {
+                if (relay->standby_con->error)
+                {
+                    WARN1 ("standby connection for %s has died", relay->localmount);
+                    standby_clear (relay);
+                }
+                break;
+            }
+        }
+        return;
+    }
+    if (relay->standby_retry > time (NULL))
+        return;
+    relay->standby_retry = time (NULL) + 10;    /* don't hammer a refusing server */
+    for (host = relay->hosts; host; host = host->next)
+        if (host != relay->in_use && host->skip == 0)
+            break;
+    if (host == NULL)
+        return;
+    so = calloc (1, sizeof (*so));
+    so->localmount = strdup (relay->localmount);
+    so->ip = strdup (host->ip);
+    so->mount = strdup (host->mount);
+    if (host->bind)
+        so->bind = strdup (host->bind);
+    so->port = host->port;
+    so->timeout = host->timeout;
+    remain = sizeof (so->headers);
+    if (relay->flags & RELAY_ICY_META)
+        remain -= snprintf (so->headers, remain, "Icy-MetaData: 1\r\n");
+    p = so->headers + strlen (so->headers);
+    if (relay->username && relay->password)
+    {
+        snprintf (p, remain, "%s:%s", relay->username, relay->password);
+        encode_auth_header (p, remain);
+    }
+    relay->standby_opening = 1;
+    thread_create ("standby opener", standby_open_thread, so, THREAD_DETACHED);
+}
+
+
+/* swap the relay client over to the standby connection after the active
+ * master has dropped. Returns non-zero if the source is carrying on.
+ */
+static int standby_takeover (relay_server *relay, client_t *client)
+{
+    source_t *source = relay->source;
+
+    if (relay->standby_con == NULL || client->connection.error == 0)
+        return 0;
+    if ((relay->flags & (RELAY_RUNNING|RELAY_CLEANUP)) != RELAY_RUNNING || global.running != ICE_RUNNING)
+        return 0;
+    INFO2 ("relay %s failing over to standby %s", relay->localmount,
+            relay->standby_host ? relay->standby_host->ip : "server");
+    connection_close (&client->connection);
+    memcpy (&client->connection, relay->standby_con, sizeof (connection_t));
+    free (relay->standby_con);
+    relay->standby_con = NULL;
+    client->parser = relay->standby_parser;     /* old parser freed on the format update */
+    relay->standby_parser = NULL;
+    if (relay->standby_host)
+        relay->in_use = relay->standby_host;
+    relay->standby_host = NULL;
+    client->connection.con_time = time (NULL);
+    client->connection.discon.time = 0;
+    if (source_format_init (source) < 0)
+        return 0;       /* unusable response, let the usual restart run */
+    source->flags |= SOURCE_RUNNING;
+    source->flags &= ~SOURCE_TIMEOUT;
+    client->schedule_ms = client->worker->time_ms + 20;
+    return 1;
+}
+
+
 /* Actually open the connection and do some http parsing, handle any 302
  * responses within here.
  */
-static int open_relay_connection (client_t *client, relay_server *relay, relay_server_host *host)
+static int open_relay_connection (client_t *client, relay_server *relay, relay_server_host *host, sock_t racesock)
 {
     int redirects = 0;
     http_parser_t *parser = NULL;
@@ -448,7 +729,13 @@ static int open_relay_connection (client_t *client, relay_server *relay, relay_s
 
         con->con_time = time (NULL);
         relay->in_use = host;
-        streamsock = sock_connect_wto_bind (server, port, bind, timeout);
+        if (racesock != SOCK_ERROR)
+        {
+            streamsock = racesock;      /* already established by the race */
+            racesock = SOCK_ERROR;
+        }
+        else
+            streamsock = sock_connect_wto_bind (server, port, bind, timeout);
         free (bind);
         if (connection_init (con, streamsock, server) < 0)
         {
@@ -535,14 +822,164 @@ static int open_relay_connection (client_t *client, relay_server *relay, relay_s
 }
 
 
+/* race non-blocking connects across the usable hosts and hand back the
+ * first to complete, so a dead first master no longer costs its whole
+ * connect timeout before the next one is tried. Candidates start in order
+ * of their recent failure counts. Hosts with a bind address are left to
+ * the blocking path as the non-blocking connect cannot bind, and a single
+ * host has nothing to race.
+ */
+#define RELAY_RACE_LIMIT 8
+
+static sock_t connect_relay_race (relay_server *relay, relay_server_host **winner)
+{
+    struct { relay_server_host *host; sock_t sock; } cand [RELAY_RACE_LIMIT];
+    relay_server_host *host;
+    int count = 0, i, timeout = 0, waited = 0;
+    sock_t ret = SOCK_ERROR;
+
+    for (host = relay->hosts; host && count < RELAY_RACE_LIMIT; host = host->next)
+    {
+        int pos;
+
+        if (host->skip || host->bind)
+            continue;
+        /* keep the candidates ordered, fewest recent failures first */
+        for (pos = count; pos > 0 && cand [pos-1].host->fails > host->fails; pos--)
+            cand [pos] = cand [pos-1];
+        cand [pos].host = host;
+        cand [pos].sock = SOCK_ERROR;
+        count++;
+        if (host->timeout > timeout)
+            timeout = host->timeout;
+    }
+    if (count < 2)
+        return SOCK_ERROR;
+    for (i = 0; i < count; i++)
+    {
+        cand [i].sock = sock_connect_non_blocking (cand [i].host->ip, cand [i].host->port);
+        if (cand [i].sock == SOCK_ERROR)
+            cand [i].host->fails++;
+    }
+    if (timeout < 1)
+        timeout = 10;
+    while (ret == SOCK_ERROR && waited <= timeout * 10)
+    {
+        int pending = 0;
+
+        for (i = 0; i < count && ret == SOCK_ERROR; i++)
+        {
+            if (cand [i].sock == SOCK_ERROR)
+                continue;
+            switch (sock_connected (cand [i].sock, 0))
+            {
+                case 1:
+                    ret = cand [i].sock;
+                    *winner = cand [i].host;
+                    cand [i].sock = SOCK_ERROR;
+                    break;
+                case 0:
+                case SOCK_TIMEOUT:
+                    pending++;
+                    break;
+                default:
+                    sock_close (cand [i].sock);
+                    cand [i].sock = SOCK_ERROR;
+                    cand [i].host->fails++;
+                    break;
+            }
+        }
+        if (pending == 0)
+            break;
+        if (ret == SOCK_ERROR)
+        {
+            thread_sleep (100000);
+            waited++;
+        }
+    }
+    for (i = 0; i < count; i++)
+        if (cand [i].sock != SOCK_ERROR)
+            sock_close (cand [i].sock);
+    if (ret != SOCK_ERROR)
+    {
+        sock_set_blocking (ret, 1);
+        INFO3 ("race for %s won by %s:%d", relay->localmount, (*winner)->ip, (*winner)->port);
+    }
+    return ret;
+}
+
+
+/* Several localmounts can be configured against the same upstream. Rather
+ * than paying for a pull per localmount, look for another relay already
+ * running off a host matching one of ours and return its localmount. The
+ * queue blocks are linked through the refbufs themselves so a block cannot
+ * sit on two source queues; instead the listeners of the duplicate are
+ * moved onto the one live source, sharing its queue and connection, and
+ * the upstream drops away when the last of them leaves.
+ */
+static char *find_shared_upstream (relay_server *relay, format_type_t *type)
+{
+    avl_node *node;
+    char *master = NULL;
+
+    avl_tree_rlock (global.relays);
+    node = avl_get_first (global.relays);
+    while (node && master == NULL)
+    {
+        relay_server *other = node->key;
+        relay_server_host *host;
+
+        node = avl_get_next (node);
+        if (other == relay || other->in_use == NULL || other->source == NULL)
+            continue;
+        if (strcmp (other->localmount, relay->localmount) == 0)
+            continue;
+        if (source_running (other->source) == 0)
+            continue;
+        for (host = relay->hosts; host; host = host->next)
+        {
+            if (host->port == other->in_use->port &&
+                    strcmp (host->ip, other->in_use->ip) == 0 &&
+                    strcmp (host->mount, other->in_use->mount) == 0)
+            {
+                master = strdup (other->localmount);
+                *type = other->source->format->type;
+                break;
+            }
+        }
+    }
+    avl_tree_unlock (global.relays);
+    return master;
+}
+
+
 /* This does the actual connection for a relay. A thread is
  * started off if a connection can be acquired
  */
 int open_relay (relay_server *relay)
 {
     source_t *src = relay->source;
-    relay_server_host *host = relay->hosts;
+    relay_server_host *host = relay->hosts, *raced = NULL;
     client_t *client = src->client;
+    sock_t racesock;
+
+    thread_rwlock_unlock (&src->lock);
+    racesock = connect_relay_race (relay, &raced);
+    thread_rwlock_wlock (&src->lock);
+    if (raced)
+    {
+        int ret;
+
+        thread_rwlock_unlock (&src->lock);
+        ret = open_relay_connection (client, relay, raced, racesock);
+        thread_rwlock_wlock (&src->lock);
+        if (ret == 0 && source_format_init (src) == 0)
+        {
+            raced->fails = 0;
+            return 1;
+        }
+        raced->fails++;     /* failed at the http stage, walk the list as usual */
+    }
     do
     {
         int ret;
@@ -553,17 +990,20 @@ int open_relay (relay_server *relay)
             continue;
         }
         thread_rwlock_unlock (&src->lock);
-        ret = open_relay_connection (client, relay, host);
+        ret = open_relay_connection (client, relay, host, SOCK_ERROR);
         thread_rwlock_wlock (&src->lock);
 
         if (ret < 0)
+        {
+            host->fails++;
             continue;
-
+        }
         if (source_format_init (src) < 0)
         {
             WARN1 ("Failed to complete initialisation on %s", relay->localmount);
             continue;
         }
+        host->fails = 0;
         return 1;
     } while ((host = host->next) && global.running == ICE_RUNNING);
     return -1;
@@ -601,6 +1041,19 @@ static void *start_relay_stream (void *arg)
         config_release_config();
         INFO1("Starting relayed source at mountpoint \"%s\"", relay->localmount);
 
+        format_type_t shared_type = relay->type;
+        char *master = find_shared_upstream (relay, &shared_type);
+        if (master)
+        {
+            INFO2 ("relay %s sharing upstream already pulled for %s", relay->localmount, master);
+            free (src->fallback.mount);
+            src->fallback.mount = master;
+            src->fallback.fallback = NULL;
+            src->fallback.flags = FS_FALLBACK;
+            src->fallback.limit = 0;
+            src->fallback.type = shared_type;
+            break;      /* take the failure path, listeners move over via the fallback */
+        }
         if (open_relay (relay) < 0)
             break;
         stats_event_inc (NULL, "source_relay_connections");
@@ -614,7 +1067,7 @@ static void *start_relay_stream (void *arg)
     } while (0);
 
     client->ops = &relay_client_ops;
-    client->schedule_ms = timing_get_time();
+    client->schedule_ms = timing_cached_time();
 
     if (failed)
     {
@@ -701,15 +1154,277 @@ int relay_has_source (relay_server *relay, client_t *client)
 }
 
 
+static void relay_state_filename (ice_config_t *config, char *buf, size_t len)
+{
+    snprintf (buf, len, "%s%s%s", config->log_dir, PATH_SEPARATOR, RELAY_STATE_FILE);
+}
+
+
+/* record the listener count and host health of each installed relay and the
+ * stat baselines of each running mount, so that the next startup can bring
+ * the popular ones back first and carry the counters on */
+static void relay_state_save (void)
+{
+    char filename [FILENAME_MAX], tmpname [FILENAME_MAX + 8];
+    FILE *file;
+    avl_node *node;
+    int count = 0;
+
+    ice_config_t *config = config_get_config();
+    relay_state_filename (config, filename, sizeof filename);
+    config_release_config();
+    /* write a scratch file and rename over, a part written state file is
+     * worse than the old one and the old one may predate a uid change */
+    snprintf (tmpname, sizeof tmpname, "%s.tmp", filename);
+    file = fopen (tmpname, "w");
+    if (file == NULL)
+    {
+        WARN2 ("failed to write %s (%s)", tmpname, strerror (errno));
+        return;
+    }
+    avl_tree_rlock (global.relays);
+    node = avl_get_first (global.relays);
+    while (node)
+    {
+        relay_server *relay = node->key;
+        relay_server_host *host;
+        long listeners = 0;
+
+        if (relay->source)
+        {
+            thread_rwlock_rlock (&relay->source->lock);
+            listeners = relay->source->listeners;
+            thread_rwlock_unlock (&relay->source->lock);
+        }
+        fprintf (file, "R %ld %s\n", listeners, relay->localmount);
+        for (host = relay->hosts; host; host = host->next)
+            if (host->fails)
+                fprintf (file, "H %d %d %s\n", host->fails, host->port, host->ip);
+        count++;
+        node = avl_get_next (node);
+    }
+    avl_tree_unlock (global.relays);
+    avl_tree_rlock (global.source_tree);
+    node = avl_get_first (global.source_tree);
+    while (node)
+    {
+        source_t *source = node->key;
+        unsigned long peak;
+        char *conns;
+
+        node = avl_get_next (node);
+        thread_rwlock_rlock (&source->lock);
+        peak = source->peak_listeners;
+        thread_rwlock_unlock (&source->lock);
+        conns = stats_get_value (source->mount, "listener_connections");
+        fprintf (file, "M %lu %s %s\n", peak, conns ? conns : "0", source->mount);
+        free (conns);
+        count++;
+    }
+    avl_tree_unlock (global.source_tree);
+    fclose (file);
+    if (count)
+    {
+        if (rename (tmpname, filename) < 0)
+            WARN2 ("failed to update %s (%s)", filename, strerror (errno));
+        else
+            DEBUG2 ("saved warm state of %d entries to %s", count, filename);
+    }
+    else
+    {
+        remove (tmpname);
+        remove (filename);
+    }
+}
+
+
+static int _compare_hint_listeners (const void *a, const void *b)
+{
+    const relay_hint *ha = a, *hb = b;
+
+    if (ha->listeners != hb->listeners)
+        return ha->listeners < hb->listeners ? 1 : -1;
+    return strcmp (ha->mount, hb->mount);
+}
+
+
+static int _compare_hint_mount (const void *a, const void *b)
+{
+    return strcmp (((const relay_hint *)a)->mount, ((const relay_hint *)b)->mount);
+}
+
+
+static void relay_state_load (ice_config_t *config)
+{
+    char filename [FILENAME_MAX], line [4096];
+    FILE *file;
+    int i;
+
+    relay_state_filename (config, filename, sizeof filename);
+    file = fopen (filename, "r");
+    if (file == NULL)
+        return;
+    while (fgets (line, sizeof line, file))
+    {
+        long listeners;
+        uint64_t peak, connections;
+        int fails, port;
+        char mount [4096];
+
+        /* bare "<listeners> <mount>" lines predate the record tags */
+        if (sscanf (line, "R %ld %4095s", &listeners, mount) == 2 ||
+                sscanf (line, "%ld %4095s", &listeners, mount) == 2)
+        {
+            if ((relay_hint_count & 255) == 0)
+                relay_hints = realloc (relay_hints, (relay_hint_count + 256) * sizeof *relay_hints);
+            relay_hints [relay_hint_count].mount = strdup (mount);
+            relay_hints [relay_hint_count].listeners = listeners;
+            relay_hints [relay_hint_count].hosts = NULL;
+            relay_hint_count++;
+            continue;
+        }
+        if (sscanf (line, "H %d %d %4095s", &fails, &port, mount) == 3 && relay_hint_count)
+        {
+            host_hint *host = calloc (1, sizeof (*host));
+
+            host->fails = fails;
+            host->port = port;
+            host->ip = strdup (mount);
+            host->next = relay_hints [relay_hint_count-1].hosts;
+            relay_hints [relay_hint_count-1].hosts = host;
+            continue;
+        }
+        if (sscanf (line, "M %" SCNu64 " %" SCNu64 " %4095s", &peak, &connections, mount) == 3)
+        {
+            mount_hint *hint = calloc (1, sizeof (*hint));
+
+            hint->mount = strdup (mount);
+            hint->peak = peak;
+            hint->connections = connections;
+            thread_spin_lock (&mount_hint_lock);
+            hint->next = mount_hints;
+            mount_hints = hint;
+            thread_spin_unlock (&mount_hint_lock);
+        }
+    }
+    fclose (file);
+    if (relay_hint_count == 0)
+        return;
+    /* busiest first, each rank scheduled a little behind the one before so
+     * the most listened-to relays win the startup gate */
+    qsort (relay_hints, relay_hint_count, sizeof *relay_hints, _compare_hint_listeners);
+    for (i = 0; i < relay_hint_count; i++)
+    {
+        uint64_t delay = (uint64_t)i * RELAY_START_SPACING;
+        relay_hints [i].delay = delay > RELAY_START_MAX_DELAY ? RELAY_START_MAX_DELAY : delay;
+    }
+    qsort (relay_hints, relay_hint_count, sizeof *relay_hints, _compare_hint_mount);
+    INFO1 ("ordering relay startup from listener counts of %d relays", relay_hint_count);
+}
+
+
+static uint64_t relay_start_delay (const char *mount)
+{
+    relay_hint find, *hint;
+
+    if (relay_hint_count == 0)
+        return 0;
+    find.mount = (char *)mount;
+    hint = bsearch (&find, relay_hints, relay_hint_count, sizeof find, _compare_hint_mount);
+    if (hint)
+        return hint->delay;
+    /* no history for this one, let the known busy relays go first */
+    return RELAY_START_MAX_DELAY;
+}
+
+
+static void relay_state_clear (void)
+{
+    while (relay_hint_count)
+    {
+        relay_hint *hint = &relay_hints [--relay_hint_count];
+
+        while (hint->hosts)
+        {
+            host_hint *host = hint->hosts;
+            hint->hosts = host->next;
+            free (host->ip);
+            free (host);
+        }
+        free (hint->mount);
+    }
+    free (relay_hints);
+    relay_hints = NULL;
+}
+
+
+/* seed the hosts of a newly installed relay with the failure counts of the
+ * previous run, so the first connect attempt starts from the host that was
+ * last known healthy instead of rediscovering the dead ones */
+static void relay_hint_health (relay_server *relay)
+{
+    relay_hint find, *hint;
+    relay_server_host *host;
+
+    if (relay_hint_count == 0)
+        return;
+    find.mount = relay->localmount;
+    hint = bsearch (&find, relay_hints, relay_hint_count, sizeof find, _compare_hint_mount);
+    if (hint == NULL)
+        return;
+    for (host = relay->hosts; host; host = host->next)
+    {
+        host_hint *h = hint->hosts;
+
+        for (; h; h = h->next)
+            if (h->port == host->port && strcmp (h->ip, host->ip) == 0)
+            {
+                host->fails = h->fails;
+                break;
+            }
+    }
+}
+
+
+/* hand a starting mount its saved stat baselines. The record is consumed,
+ * a restart of the same mount within this run carries the live numbers */
+void slave_mount_state_restore (source_t *source)
+{
+    mount_hint *hint, **trail;
+
+    thread_spin_lock (&mount_hint_lock);
+    trail = &mount_hints;
+    while (*trail && strcmp ((*trail)->mount, source->mount) != 0)
+        trail = &(*trail)->next;
+    hint = *trail;
+    if (hint)
+        *trail = hint->next;
+    thread_spin_unlock (&mount_hint_lock);
+    if (hint == NULL)
+        return;
+    if (hint->peak > source->peak_listeners)
+    {
+        source->peak_listeners = hint->peak;
+        stats_set_args (source->stats, "listener_peak", "%lu", source->peak_listeners);
+    }
+    if (hint->connections)
+        stats_set_args (source->stats, "listener_connections", "%" PRIu64, hint->connections);
+    INFO3 ("restored baselines for %s (peak %" PRIu64 ", connections %" PRIu64 ")",
+            source->mount, hint->peak, hint->connections);
+    free (hint->mount);
+    free (hint);
+}
+
+
 static int relay_installed (relay_server *relay)
 {
-    client_t *client = calloc (1, sizeof (client_t));
+    client_t *client = client_create ();
 
     connection_init (&client->connection, SOCK_ERROR, NULL);
     switch (relay_has_source (relay, client))
     {
         case -1:
-            free (client);
+            client_free (client);
             return 0;
         case 1: 
             thread_rwlock_unlock (&relay->source->lock);
@@ -722,6 +1437,9 @@ static int relay_installed (relay_server *relay)
     client->ops = &relay_init_ops;
     relay->flags |= RELAY_IN_LIST;
     avl_insert (global.relays, relay);
+    relay_hint_health (relay);
+    /* stagger startup so relays with the most listeners last time go first */
+    client->schedule_ms += relay_start_delay (relay->localmount);
     client->flags |= CLIENT_ACTIVE;
     client_add_worker (client);
     DEBUG2 ("adding relay client for %s (%p)", relay->localmount, relay);
@@ -838,11 +1556,115 @@ static size_t streamlist_header (void *ptr, size_t size, size_t nmemb, void *str
         else
             WARN1 ("Failed response from master \"%s\"", (char*)ptr);
     }
+    else if (strncasecmp (ptr, "X-Streamlist-Gen:", 17) == 0)
+    {
+        master->gen = (uint64_t)strtoull ((char*)ptr+17, NULL, 10);
+        master->has_gen = 1;
+    }
+    else if (strncasecmp (ptr, "X-Streamlist-Delta:", 19) == 0)
+        master->delta = 1;
     //DEBUG1 ("header is %s", ptr);
     return passed_len;
 }
 
 
+/* flag a master relay for expiry, the relays tree write lock is expected */
+static void drop_master_relay (const char *mount)
+{
+    relay_server *result, find;
+
+    find.localmount = (char *)mount;
+    if (avl_get_by_key (global.relays, &find, (void*)&result) == 0 &&
+            (result->flags & RELAY_FROM_MASTER))
+        result->updated = 0;    /* left behind when the expiry barrier moves */
+}
+
+
+/* process a binary framed streamlist delta from the master. Each frame is an
+ * op byte ('A' add, 'R' remove), a 2 byte network order length then the
+ * mount name, with a 'Z' frame marking a complete response. Frames can be
+ * split across reads so leftovers are carried over
+ */
+static size_t streamlist_delta (struct master_conn_details *master, char *ptr, size_t passed_len)
+{
+    size_t len = (size_t)master->previous + passed_len;
+    char *buffer = realloc (master->buffer, len + 1), *buf = buffer;
+
+    if (buffer == NULL)
+        return 0;
+    memcpy (buffer + master->previous, ptr, passed_len);
+
+    avl_tree_wlock (global.relays);
+    while (len >= 3)
+    {
+        char op = buf [0];
+        unsigned int mlen = (((unsigned char)buf [1]) << 8) | (unsigned char)buf [2];
+        char mount [1024];
+
+        if (op == 'Z')
+        {
+            master->delta_ok = 1;
+            len = 0;
+            break;
+        }
+        if ((op != 'A' && op != 'R') || mlen == 0 || mlen >= sizeof (mount))
+        {
+            WARN1 ("unexpected frame in streamlist delta (%d)", op);
+            master->ok = 0;
+            len = 0;
+            break;
+        }
+        if (len < (size_t)mlen + 3)
+            break;      /* rest of the frame is in the next read */
+        memcpy (mount, buf+3, mlen);
+        mount [mlen] = '\0';
+        if (op == 'A')
+        {
+            char line [1100];
+            snprintf (line, sizeof (line), "/admin/streams?mount=%s", mount);
+            DEBUG1 ("delta add from master \"%s\"", mount);
+            add_master_relay (line, NULL, master);
+        }
+        else
+        {
+            DEBUG1 ("delta remove from master \"%s\"", mount);
+            drop_master_relay (mount);
+        }
+        buf += mlen + 3;
+        len -= mlen + 3;
+    }
+    avl_tree_unlock (global.relays);
+
+    if (len && buf != buffer)
+        memmove (buffer, buf, len);
+    master->buffer = buffer;
+    master->previous = len;
+    return passed_len;
+}
+
+
+/* a delta only lists the changes, so before the expiry barrier moves the
+ * sync time on the surviving master relays needs refreshing. Removals were
+ * marked with a zero sync time and are left behind
+ */
+static void streamlist_delta_close (struct master_conn_details *master)
+{
+    avl_node *node;
+
+    avl_tree_wlock (global.relays);
+    node = avl_get_first (global.relays);
+    while (node)
+    {
+        relay_server *relay = node->key;
+
+        if ((relay->flags & RELAY_FROM_MASTER) && relay->updated)
+            relay->updated = master->synctime;
+        node = avl_get_next (node);
+    }
+    avl_tree_unlock (global.relays);
+}
+
+
 /* process mountpoint list from master server. This may be called multiple
  * times so watch for the last line in this block as it may be incomplete
  */
@@ -856,6 +1678,8 @@ static size_t streamlist_data (void *ptr, size_t size, size_t nmemb, void *strea
 
     if (master->ok == 0)
         return passed_len;
+    if (master->delta)
+        return streamlist_delta (master, ptr, passed_len);
     if (master->previous)
     {
         char *eol = memchr (ptr, '\n', passed_len < 150 ? passed_len : 150);
@@ -970,10 +1794,20 @@ static void *streamlist_thread (void *arg)
 
     master->ok = 0;
     master->synctime = time(NULL);
-    if (curl_easy_perform (handle) != 0 || master->ok == 0)
+    if (curl_easy_perform (handle) == 0 && master->ok && master->delta && master->delta_ok == 0)
+    {
+        INFO0 ("incomplete streamlist delta from master, retrying in full");
+        master->ok = 0;
+    }
+    if (master->ok == 0)
     {
         /* fall back to traditional request */
         INFO0 ("/admin/streams failed trying streamlist");
+        master->delta = 0;
+        master->has_gen = 0;
+        free (master->buffer);
+        master->buffer = NULL;
+        master->previous = 0;
         snprintf (url, sizeof (url), "%s://%s:%d/admin/streamlist.txt%s",
                 protocol, master->server, port, master->args);
         curl_easy_setopt (handle, CURLOPT_URL, url);
@@ -981,7 +1815,15 @@ static void *streamlist_thread (void *arg)
             WARN2 ("Failed URL access \"%s\" (%s)", url, error);
     }
     if (master->ok)
+    {
+        if (master->delta)
+            streamlist_delta_close (master);
         relay_barrier_master = master->synctime;
+        /* remember the generation so the next poll can ask for a delta */
+        streamlist_have_gen = master->has_gen;
+        if (master->has_gen)
+            streamlist_gen = master->gen;
+    }
 
     curl_easy_cleanup (handle);
     free (master->server);
@@ -1074,14 +1916,29 @@ static void update_from_master (ice_config_t *config)
     details->server_id = strdup (config->server_id);
     details->max_interval = config->master_relay_retry;
     details->run_on = config->master_run_on;
+    details->args = malloc (4096);
+    details->args [0] = '\0';
+    int args_len = 0;
     if (config->master_redirect)
     {
-        details->args = malloc (4096);
-        snprintf (details->args, 4096, "?rserver=%s&rport=%d&interval=%d",
-                config->hostname, config->port, config->master_update_interval);
+        long kbps_free = -1;
+
+        if (config->max_bandwidth)
+        {
+            int64_t used = (int64_t)8 * global_getrate_avg (global.out_bitrate);
+            kbps_free = used < config->max_bandwidth ?
+                (long)((config->max_bandwidth - used) / 1024) : 0;
+        }
+        /* listener count and headroom ride along so the master can weight
+         * its redirects, a slightly stale reading is fine here */
+        args_len = snprintf (details->args, 4096,
+                "?rserver=%s&rport=%d&interval=%d&rlisteners=%d&rkbps=%ld",
+                config->hostname, config->port, config->master_update_interval,
+                global.listeners, kbps_free);
     }
-    else
-        details->args = strdup ("");
+    if (streamlist_have_gen)
+        snprintf (details->args + args_len, 4096 - args_len, "%sstreams_gen=%" PRIu64,
+                args_len ? "&" : "?", streamlist_gen);
 
     thread_create ("streamlist", streamlist_thread, details, THREAD_DETACHED);
 #endif
@@ -1140,13 +1997,22 @@ static void slave_startup (void)
 
     redirector_setup (config);
     stats_global (config);
+#ifdef HAVE_IO_URING
+    worker_uring_configure (config->workers_uring);
+#endif
+    refbuf_arena_enable (config->hugepages);
+    source_stream_mem_limit (config->stream_mem_limit);
     workers_adjust (config->workers_count);
+    /* workers and listen sockets are ready, take listeners on board while
+     * the relays below are still warming up */
+    connection_thread_startup();
     yp_initialize (config);
+    relay_state_load (config);
     update_relays (config);
     config_release_config();
 
     source_recheck_mounts (1);
-    connection_thread_startup();
+    relay_state_clear ();
 }
 
 static void _slave_thread(void)
@@ -1163,10 +2029,20 @@ static void _slave_thread(void)
         global_lock();
         if (global.running != ICE_RUNNING)
             break;
-        /* re-read xml file if requested */
+        /* re-read xml file if requested. Orchestration tools tend to push a
+         * burst of file updates with a HUP after each one, so debounce a
+         * little and coalesce the burst into one re-parse, capped so a steady
+         * stream of prods cannot hold the reload off forever */
         if (global . schedule_config_reread)
         {
             global . schedule_config_reread = 0;
+            if (config_reread_cap == 0)
+                config_reread_cap = current.tv_sec + 10;
+            config_reread_at = current.tv_sec + 2;
+        }
+        if (config_reread_at && (current.tv_sec >= config_reread_at || current.tv_sec >= config_reread_cap))
+        {
+            config_reread_at = config_reread_cap = 0;
             do_reread = 1;
         }
 
@@ -1221,8 +2097,18 @@ static void _slave_thread(void)
         }
 
         stats_global_calc (current.tv_sec);
+        worker_stats_global ();
         fserve_scan (current.tv_sec);
 
+        /* periodic warm state rewrite, a crash costs a minute of history */
+        if (state_save_at == 0)
+            state_save_at = current.tv_sec + RELAY_STATE_INTERVAL;
+        else if (current.tv_sec >= state_save_at)
+        {
+            relay_state_save ();
+            state_save_at = current.tv_sec + RELAY_STATE_INTERVAL;
+        }
+
         /* allow for terminating icecast if no streams running */
         if (inactivity_timer)
         {
@@ -1252,6 +2138,7 @@ static void _slave_thread(void)
     connection_thread_shutdown();
     fserve_running = 0;
     stats_clients_wakeup ();
+    relay_state_save ();   /* capture listener counts before the relays drop */
     INFO0 ("shutting down current relays");
     time_t next = time(NULL) + 1000;
     thread_spin_lock (&relay_start_lock);
@@ -1290,6 +2177,7 @@ void redirector_clearall (void)
         free (current);
     }
     global.redirect_count = 0;
+    redirect_table_len = 0;
     thread_rwlock_unlock (&slaves_lock);
 }
 
@@ -1311,7 +2199,9 @@ void redirector_setup (ice_config_t *config)
 }
 
 
-/* Add new redirectors or update any existing ones
+/* Add new redirectors or update any existing ones. The slave piggybacks its
+ * listener count and bandwidth headroom on the poll so selection can favour
+ * the nodes with capacity to spare
  */
 void redirector_update (client_t *client)
 {
@@ -1319,6 +2209,7 @@ void redirector_update (client_t *client)
     const char *rserver = httpp_get_query_param (client->parser, "rserver");
     const char *value;
     int rport = 0, interval = 0;
+    long rlisteners = -1, rkbps = -1;
 
     if (rserver==NULL) return;
     value = httpp_get_query_param (client->parser, "rport");
@@ -1329,6 +2220,12 @@ void redirector_update (client_t *client)
     if (value == NULL) return;
     interval = atoi (value);
     if (interval < 5) return;
+    value = httpp_get_query_param (client->parser, "rlisteners");
+    if (value)
+        rlisteners = atol (value);
+    value = httpp_get_query_param (client->parser, "rkbps");
+    if (value)
+        rkbps = atol (value);
 
     thread_rwlock_wlock (&slaves_lock);
     redirect = find_slave_host (rserver, rport);
@@ -1340,7 +2237,10 @@ void redirector_update (client_t *client)
         config_release_config();
 
         if (global.redirect_count < allowed)
+        {
             redirector_add (rserver, rport, interval);
+            redirect = redirectors;
+        }
         else
             INFO2 ("redirect to slave limit reached (%d, %d)", global.redirect_count, allowed);
     }
@@ -1349,6 +2249,13 @@ void redirector_update (client_t *client)
         DEBUG2 ("touch update on %s:%d", redirect->server, redirect->port);
         redirect->next_update = time(NULL) + interval;
     }
+    if (redirect)
+    {
+        if (rlisteners >= 0)
+            redirect->listeners = rlisteners;
+        redirect->kbps_free = rkbps;
+        redirect_table_rebuild ();
+    }
     thread_rwlock_unlock (&slaves_lock);
 }
 
@@ -1381,11 +2288,49 @@ static void redirector_add (const char *server, int port, int interval)
         redirect->next_update = (time_t)0;
     else
         redirect->next_update = time(NULL) + interval;
+    redirect->listeners = 0;
+    redirect->kbps_free = -1;
     redirect->next = redirectors;
     redirectors = redirect;
     global.redirect_count++;
     INFO3 ("slave (%d) at %s:%d added", global.redirect_count,
             redirect->server, redirect->port);
+    redirect_table_rebuild ();
+}
+
+
+/* bigger is better. Prefer the reported bandwidth headroom, otherwise rank
+ * on how few listeners the slave is carrying
+ */
+static long redirector_score (redirect_host *redirect)
+{
+    if (redirect->kbps_free >= 0)
+        return redirect->kbps_free + 1;
+    return 100000 / (redirect->listeners + 10);
+}
+
+
+/* refill the weighted slot table used for redirect selection, the write lock
+ * on slaves_lock is expected to be held. Every slave keeps at least one slot
+ * so a loaded node still takes the odd listener rather than dropping out
+ */
+static void redirect_table_rebuild (void)
+{
+    redirect_host *redirect = redirectors;
+    long total = 0;
+    int slot = 0;
+
+    for (; redirect; redirect = redirect->next)
+        total += redirector_score (redirect);
+    for (redirect = redirectors; redirect && slot < REDIRECT_TABLE_SIZE; redirect = redirect->next)
+    {
+        int count = (int)((redirector_score (redirect) * REDIRECT_TABLE_SIZE) / total);
+        if (count < 1)
+            count = 1;
+        while (count-- && slot < REDIRECT_TABLE_SIZE)
+            redirect_table [slot++] = redirect;
+    }
+    redirect_table_len = slot;
 }
 
 
@@ -1414,6 +2359,12 @@ static relay_server *get_relay_details (client_t *client)
         relay = client->shared_data;
         relay->source = old_details->source;
         old_details->source = NULL;
+        /* carry any standby over, though its host pointer dies with the old details */
+        relay->standby_con = old_details->standby_con;
+        relay->standby_parser = old_details->standby_parser;
+        old_details->standby_con = NULL;
+        old_details->standby_parser = NULL;
+        old_details->standby_host = NULL;
         config_clear_relay (old_details);
     }
     if (relay_expired (relay))
@@ -1446,6 +2397,7 @@ static int relay_read (client_t *client)
     thread_rwlock_wlock (&source->lock);
     if (source_running (source))
     {
+        standby_check (relay);
         if ((relay->flags & RELAY_RUNNING) == 0)
             source->flags &= ~SOURCE_RUNNING;
         if (source->listeners == 0 && (relay->flags & RELAY_ON_DEMAND))
@@ -1464,6 +2416,11 @@ static int relay_read (client_t *client)
             return 0;
         }
     }
+    if ((source->flags & SOURCE_TERMINATING) == 0 && standby_takeover (relay, client))
+    {
+        thread_rwlock_unlock (&source->lock);
+        return 0;
+    }
     if ((source->flags & SOURCE_TERMINATING) == 0)
     {
         /* this section is for once through code */
@@ -1521,6 +2478,7 @@ static int relay_read (client_t *client)
     }
     client->timer_start = 0;
     client->parser = NULL;
+    standby_clear (relay);
     free (source->fallback.mount);
     source->fallback.mount = NULL;
     source->flags &= ~(SOURCE_TERMINATING|SOURCE_LISTENERS_SYNC|SOURCE_ON_DEMAND);
@@ -1597,6 +2555,7 @@ static void relay_release (client_t *client)
 {
     relay_server *relay = client->shared_data;
     DEBUG2("freeing relay %s (%p)", relay->localmount, relay);
+    standby_clear (relay);
     if (relay->source)
         source_free_source (relay->source);
     relay->source = NULL;
@@ -1684,7 +2643,7 @@ static int relay_startup (client_t *client)
         worker_t *dest_worker;
 
         thread_rwlock_rlock (&workers_lock);
-        dest_worker = worker_selected ();
+        dest_worker = worker_preferred (worker);
         if (dest_worker != worker)
         {
             long diff = worker->count - dest_worker->count;
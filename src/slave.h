@@ -29,5 +29,6 @@ void redirector_update (struct _client_tag *client);
 relay_server *relay_free (relay_server *relay);
 int  relay_toggle (relay_server *relay);
 int  fallback_count (ice_config_t *config, const char *mount);
+void slave_mount_state_restore (struct source_tag *source);
 
 #endif  /* __SLAVE_H__ */
@@ -39,11 +39,16 @@
 #ifdef HAVE_SYS_WAIT_H
 #include <sys/wait.h>
 #endif
+#ifndef _WIN32
+#include <signal.h>
+#include <fcntl.h>
+#endif
 
 #include "thread/thread.h"
 #include "avl/avl.h"
 #include "httpp/httpp.h"
 #include "net/sock.h"
+#include "timing/timing.h"
 
 #include "connection.h"
 #include "global.h"
@@ -58,6 +63,9 @@
 #include "fserve.h"
 #include "auth.h"
 #include "slave.h"
+#include "sighandler.h"
+#include "hls.h"
+#include "mpeg.h"
 
 #undef CATMODULE
 #define CATMODULE "source"
@@ -129,6 +137,68 @@ struct _client_functions source_client_http_ops =
 };
 
 
+/* server wide stream memory governor. Each mount is entitled to its own
+ * queue-size but thousands of such entitlements can add up past RAM, so all
+ * queues draw from one byte budget. Accounting is a relaxed atomic updated
+ * where queue_size already changes, and under pressure the mounts without
+ * listeners hand their queue back first */
+static int64_t stream_mem_limit;            /* from <stream-memory-limit>, 0 for off */
+static int64_t stream_mem_used;
+
+
+#define STREAM_MEM_OK           0
+#define STREAM_MEM_TRIM_IDLE    1   /* near the budget, idle mounts give back */
+#define STREAM_MEM_BREACHED     2   /* over budget, everyone down to minimum */
+
+static int stream_mem_pressure (void)
+{
+    int64_t limit = __atomic_load_n (&stream_mem_limit, __ATOMIC_RELAXED);
+    if (limit)
+    {
+        int64_t used = __atomic_load_n (&stream_mem_used, __ATOMIC_RELAXED);
+        if (used > limit)
+            return STREAM_MEM_BREACHED;
+        if (used > limit - (limit >> 2))
+            return STREAM_MEM_TRIM_IDLE;
+    }
+    return STREAM_MEM_OK;
+}
+
+
+void source_stream_mem_limit (int64_t bytes)
+{
+    if (bytes == __atomic_load_n (&stream_mem_limit, __ATOMIC_RELAXED))
+        return;
+    if (bytes)
+        INFO1 ("stream memory budget set to %" PRId64 " bytes", bytes);
+    else
+        INFO0 ("stream memory budget disabled");
+    __atomic_store_n (&stream_mem_limit, bytes, __ATOMIC_RELAXED);
+}
+
+
+int64_t source_stream_mem_used (void)
+{
+    return __atomic_load_n (&stream_mem_used, __ATOMIC_RELAXED);
+}
+
+
+/* hash index over the source tree for mount name lookups, maintained at the
+ * tree insert/delete sites and following the same lock discipline, so lookups
+ * are O(1) while the tree keeps providing ordered traversal */
+#define MOUNT_HASH_SIZE 256
+static source_t *mount_hash [MOUNT_HASH_SIZE];
+
+static unsigned int mount_hash_of (const char *mount)
+{
+    unsigned int hash = 5381;
+
+    while (*mount)
+        hash = hash * 33 + (unsigned char)*mount++;
+    return hash & (MOUNT_HASH_SIZE - 1);
+}
+
+
 /* Allocate a new source with the stated mountpoint, if one already
  * exists with that mountpoint in the global source tree then return
  * NULL.
@@ -136,6 +206,7 @@ struct _client_functions source_client_http_ops =
 source_t *source_reserve (const char *mount, int flags)
 {
     source_t *src = NULL;
+    unsigned int bucket;
 
     do
     {
@@ -164,9 +235,13 @@ source_t *source_reserve (const char *mount, int flags)
 
         thread_rwlock_create (&src->lock);
         thread_spin_create (&src->shrink_lock);
+        thread_spin_create (&src->hist_lock);
         src->flags |= SOURCE_RESERVED;
 
         avl_insert (global.source_tree, src);
+        bucket = mount_hash_of (mount);
+        src->hash_next = mount_hash [bucket];
+        mount_hash [bucket] = src;
 
     } while (0);
 
@@ -183,24 +258,15 @@ source_t *source_reserve (const char *mount, int flags)
 source_t *source_find_mount_raw(const char *mount)
 {
     source_t *source;
-    avl_node *node;
-    int cmp;
 
     if (!mount) {
         return NULL;
     }
-    /* get the root node */
-    node = global.source_tree->root->right;
-    
-    while (node) {
-        source = (source_t *)node->key;
-        cmp = strcmp (mount, source->mount);
-        if (cmp < 0) 
-            node = node->left;
-        else if (cmp > 0)
-            node = node->right;
-        else
+    source = mount_hash [mount_hash_of (mount)];
+    while (source) {
+        if (strcmp (mount, source->mount) == 0)
             return source;
+        source = source->hash_next;
     }
     
     /* didn't find it */
@@ -263,8 +329,7 @@ void source_clear_source (source_t *source)
     if (source->dumpfile)
     {
         INFO1 ("Closing dumpfile for %s", source->mount);
-        fclose (source->dumpfile);
-        source->dumpfile = NULL;
+        source_dump_stop (source);
     }
 
     /* flush out the stream data, we don't want any left over */
@@ -280,14 +345,23 @@ void source_clear_source (source_t *source)
     source->min_queue_point = NULL;
     source->stream_data_tail = NULL;
 
+    while (source->qcache_count)
+        refbuf_release (source->qcache [--source->qcache_count]);
+    source->sync_head = 0;
+    source->sync_count = 0;
+
+    hls_stop (source);
+
     source->min_queue_size = 0;
     source->min_queue_offset = 0;
     source->default_burst_size = 0;
+    __atomic_fetch_sub (&stream_mem_used, source->queue_size, __ATOMIC_RELAXED);
     source->queue_size = 0;
     source->queue_size_limit = 0;
     source->client_stats_update = 0;
     source->shrink_pos = 0;
     source->shrink_time = 0;
+    memset (&source->last_stats, 0, sizeof (source->last_stats));
     util_dict_free (source->audio_info);
     source->audio_info = NULL;
     rate_free (source->out_bitrate);
@@ -324,6 +398,7 @@ static int _free_source (void *p)
     thread_rwlock_unlock (&source->lock);
     thread_rwlock_destroy (&source->lock);
     thread_spin_destroy (&source->shrink_lock);
+    thread_spin_destroy (&source->hist_lock);
 
     INFO1 ("freeing source \"%s\"", source->mount);
     format_plugin_clear (source->format, source->client);
@@ -345,9 +420,18 @@ static void drop_source_from_tree (source_t *source)
 {
     if (source->flags & SOURCE_RESERVED)
     {
+        source_t **trail;
+
         avl_tree_wlock (global.source_tree);
         avl_delete (global.source_tree, source, NULL);
 
+        trail = &mount_hash [mount_hash_of (source->mount)];
+        while (*trail && *trail != source)
+            trail = &(*trail)->hash_next;
+        if (*trail)
+            *trail = source->hash_next;
+        source->hash_next = NULL;
+
         source->flags &= ~SOURCE_RESERVED;
         // this is only called from the sources client processing
         if (source->stats)
@@ -373,6 +457,8 @@ void source_free_source (source_t *source)
 }
 
 
+/* the clients tree is keyed on connection id, so this is an indexed lookup
+ * and not a scan of the listener list */
 client_t *source_find_client(source_t *source, uint64_t id)
 {
     client_t fakeclient;
@@ -448,30 +534,128 @@ uint32_t source_convert_qvalue (source_t *source, uint32_t value)
 /* Update stats from source processing, this should be called regulary (every
  * few seconds) to keep totals up to date.
  */
+/* index of the log2 histogram bucket for v, bucket 0 covers anything below unit */
+static unsigned int source_hist_bucket (unsigned long v, unsigned long unit)
+{
+    unsigned int b = 0;
+
+    v /= unit;
+    while (v && b < SOURCE_HIST_BUCKETS - 1)
+    {
+        v >>= 1;
+        b++;
+    }
+    return b;
+}
+
+
 static void update_source_stats (source_t *source)
 {
     unsigned long incoming_rate = (long)rate_avg (source->in_bitrate);
     unsigned long kbytes_sent = (source->format->sent_bytes - source->bytes_sent_at_update)/1024;
     unsigned long kbytes_read = source->bytes_read_since_update/1024;
+    long out_kbitrate = (long)(8 * rate_avg (source->out_bitrate))/1024;
 
+    /* one lock cycle for the batch, and only values that moved since the last
+     * interval are pushed through the stats pipeline */
     stats_lock (source->stats, source->mount);
-    stats_set_args (source->stats, "outgoing_kbitrate", "%ld",
-            (long)(8 * rate_avg (source->out_bitrate))/1024);
-    stats_set_args (source->stats, "incoming_bitrate", "%ld", (8 * incoming_rate));
-    stats_set_args (source->stats, "total_bytes_read", "%"PRIu64, source->format->read_bytes);
-    stats_set_args (source->stats, "total_bytes_sent", "%"PRIu64, source->format->sent_bytes);
-    stats_set_args (source->stats, "total_mbytes_sent",
-            "%"PRIu64, source->format->sent_bytes/(1024*1024));
-    stats_set_args (source->stats, "queue_size", "%u", source->queue_size);
+    if (out_kbitrate != source->last_stats.outgoing_kbitrate)
+    {
+        source->last_stats.outgoing_kbitrate = out_kbitrate;
+        stats_set_args (source->stats, "outgoing_kbitrate", "%ld", out_kbitrate);
+    }
+    if (incoming_rate != source->last_stats.incoming_bitrate)
+    {
+        source->last_stats.incoming_bitrate = incoming_rate;
+        stats_set_args (source->stats, "incoming_bitrate", "%ld", (8 * incoming_rate));
+    }
+    if (source->format->read_bytes != source->last_stats.read_bytes)
+    {
+        source->last_stats.read_bytes = source->format->read_bytes;
+        stats_set_args (source->stats, "total_bytes_read", "%"PRIu64, source->format->read_bytes);
+    }
+    if (source->format->sent_bytes != source->last_stats.sent_bytes)
+    {
+        source->last_stats.sent_bytes = source->format->sent_bytes;
+        stats_set_args (source->stats, "total_bytes_sent", "%"PRIu64, source->format->sent_bytes);
+        stats_set_args (source->stats, "total_mbytes_sent",
+                "%"PRIu64, source->format->sent_bytes/(1024*1024));
+    }
+    if (source->queue_size != source->last_stats.queue_size)
+    {
+        source->last_stats.queue_size = source->queue_size;
+        stats_set_args (source->stats, "queue_size", "%u", source->queue_size);
+    }
     if (source->client->connection.con_time)
     {
         worker_t *worker = source->client->worker;
         stats_set_args (source->stats, "connected", "%"PRIu64,
                 (uint64_t)(worker->current_time.tv_sec - source->client->connection.con_time));
     }
+    if (source->format->type == FORMAT_TYPE_MPEG || source->format->type == FORMAT_TYPE_AAC)
+    {
+        int level = mpeg_meter_level (source->client->format_data);
+        if (level >= 0)
+            stats_set_args (source->stats, "audio_activity", "%d", level);
+    }
+    do
+    {
+        /* publish the interval histograms of listener lag and send pass time */
+        unsigned long lag [SOURCE_HIST_BUCKETS], lat [SOURCE_HIST_BUCKETS],
+                      age [SOURCE_HIST_BUCKETS], total = 0, age_total = 0, seen;
+        char buf [256];
+        int i, r;
+
+        thread_spin_lock (&source->hist_lock);
+        memcpy (lag, source->lag_hist, sizeof lag);
+        memcpy (lat, source->latency_hist, sizeof lat);
+        memcpy (age, source->age_hist, sizeof age);
+        memset (source->lag_hist, 0, sizeof source->lag_hist);
+        memset (source->latency_hist, 0, sizeof source->latency_hist);
+        memset (source->age_hist, 0, sizeof source->age_hist);
+        thread_spin_unlock (&source->hist_lock);
+
+        /* glass to glass, ingest clock on the block against the send pass */
+        for (i = 0; i < SOURCE_HIST_BUCKETS; i++)
+            age_total += age [i];
+        if (age_total)
+        {
+            for (i = 0, r = 0; i < SOURCE_HIST_BUCKETS; i++)
+                r += snprintf (buf + r, sizeof buf - r, "%s%lu", i ? "/" : "", age [i]);
+            stats_set (source->stats, "buffer_age_hist_ms", buf);
+            for (i = 0, seen = 0; i < SOURCE_HIST_BUCKETS - 1; i++)
+            {
+                seen += age [i];
+                if (seen * 100 >= age_total * 99)
+                    break;
+            }
+            stats_set_args (source->stats, "buffer_age_p99_ms", "%lu", 16UL << i);
+        }
+
+        for (i = 0; i < SOURCE_HIST_BUCKETS; i++)
+            total += lag [i];
+        if (total == 0)
+            break;
+        for (i = 0, r = 0; i < SOURCE_HIST_BUCKETS; i++)
+            r += snprintf (buf + r, sizeof buf - r, "%s%lu", i ? "/" : "", lag [i]);
+        stats_set (source->stats, "listener_lag_hist", buf);
+        for (i = 0, r = 0; i < SOURCE_HIST_BUCKETS; i++)
+            r += snprintf (buf + r, sizeof buf - r, "%s%lu", i ? "/" : "", lat [i]);
+        stats_set (source->stats, "send_latency_hist_us", buf);
+        for (i = 0, seen = 0; i < SOURCE_HIST_BUCKETS - 1; i++)
+        {
+            seen += lag [i];
+            if (seen * 100 >= total * 99)
+                break;
+        }
+        /* upper bound of the bucket holding the 99th percentile sample */
+        stats_set_args (source->stats, "listener_lag_p99", "%lu", 1024UL << i);
+    } while (0);
     stats_release (source->stats);
-    stats_event_add (NULL, "stream_kbytes_sent", kbytes_sent);
-    stats_event_add (NULL, "stream_kbytes_read", kbytes_read);
+    if (kbytes_sent)
+        stats_event_add (NULL, "stream_kbytes_sent", kbytes_sent);
+    if (kbytes_read)
+        stats_event_add (NULL, "stream_kbytes_read", kbytes_read);
     if (incoming_rate)
     {
         int log = 0;
@@ -500,6 +684,11 @@ static void update_source_stats (source_t *source)
             INFO1 ("Adjusting queue size limit higher to allow for a minimum on %s", source->mount);
             source->queue_len_value = source->queue_size_limit;
         }
+        /* halve the burst on idle mounts while the server wide budget is
+         * tight, recomputed from the configured value each cycle so it
+         * recovers as soon as the pressure clears */
+        if (source->listeners == 0 && stream_mem_pressure () != STREAM_MEM_OK)
+            source->default_burst_size >>= 1;
 
         if (log)
         {
@@ -520,11 +709,177 @@ static void update_source_stats (source_t *source)
 }
 
 
+/* double buffered dump file writing. The source thread only ever appends to
+ * the fill buffer while the writer thread flushes the other, so a slow or
+ * busy disk never holds up stream ingest.
+ */
+#define DUMP_BUFFER_LIMIT       (1<<22)     /* give up on the dump past this backlog */
+
+struct dump_buf
+{
+    char *data;
+    unsigned int len;
+    unsigned int alloc;
+};
+
+struct dump_writer
+{
+    FILE *file;
+    int running;
+    int error;
+    mutex_t lock;
+    cond_t cond;
+    thread_type *thread;
+    struct dump_buf fill, flush;
+};
+
+
+static void *source_dump_thread (void *arg)
+{
+    struct dump_writer *dump = arg;
+
+    thread_mutex_lock (&dump->lock);
+    while (1)
+    {
+        if (dump->fill.len == 0)
+        {
+            struct timespec ts;
+            if (dump->running == 0)
+                break;
+            thread_get_timespec (&ts);
+            thread_time_add_ms (&ts, 500);
+            thread_cond_timedwait (&dump->cond, &dump->lock, &ts);
+            continue;
+        }
+        struct dump_buf buf = dump->fill;
+        dump->fill = dump->flush;
+        dump->fill.len = 0;
+        dump->flush = buf;
+        thread_mutex_unlock (&dump->lock);
+
+        size_t written = fwrite (buf.data, 1, buf.len, dump->file);
+
+        thread_mutex_lock (&dump->lock);
+        if (written < buf.len)
+            dump->error = 1;
+    }
+    thread_mutex_unlock (&dump->lock);
+    fclose (dump->file);
+    return NULL;
+}
+
+
+/* append dump content for the writer thread to flush. A negative return means
+ * the dump has failed and the caller should stop the writer.
+ */
+int source_dump_write (source_t *source, const void *ptr, unsigned int len)
+{
+    struct dump_writer *dump = source->dumper;
+    int ret = 0;
+
+    if (dump == NULL)
+        return -1;
+    thread_mutex_lock (&dump->lock);
+    do
+    {
+        if (dump->error)
+        {
+            ret = -1;
+            break;
+        }
+        if (dump->fill.len + len > DUMP_BUFFER_LIMIT)
+        {   /* disk cannot keep up, drop the dump rather than stall or grow */
+            dump->error = 1;
+            ret = -1;
+            break;
+        }
+        if (dump->fill.len + len > dump->fill.alloc)
+        {
+            unsigned int alloc = dump->fill.alloc ? dump->fill.alloc : 16384;
+            while (alloc < dump->fill.len + len)
+                alloc <<= 1;
+            dump->fill.data = realloc (dump->fill.data, alloc);
+            dump->fill.alloc = alloc;
+        }
+        memcpy (dump->fill.data + dump->fill.len, ptr, len);
+        dump->fill.len += len;
+        thread_cond_signal (&dump->cond);
+    } while (0);
+    thread_mutex_unlock (&dump->lock);
+    return ret;
+}
+
+
+/* flush outstanding dump content and close the file, joining the writer */
+void source_dump_stop (source_t *source)
+{
+    struct dump_writer *dump = source->dumper;
+
+    source->dumper = NULL;
+    source->dumpfile = NULL;
+    if (dump == NULL)
+        return;
+    thread_mutex_lock (&dump->lock);
+    dump->running = 0;
+    thread_cond_signal (&dump->cond);
+    thread_mutex_unlock (&dump->lock);
+    thread_join (dump->thread);
+    thread_cond_destroy (&dump->cond);
+    thread_mutex_destroy (&dump->lock);
+    free (dump->fill.data);
+    free (dump->flush.data);
+    free (dump);
+}
+
+
+static void source_dump_start (source_t *source, FILE *file)
+{
+    struct dump_writer *dump = calloc (1, sizeof (*dump));
+
+    dump->file = file;
+    dump->running = 1;
+    thread_mutex_create (&dump->lock);
+    thread_cond_create (&dump->cond);
+    source->dumper = dump;
+    dump->thread = thread_create ("dump writer", source_dump_thread, dump, THREAD_ATTACHED);
+}
+
+
+/* queue blocks on a source are uniform in size, so retired ones are kept on
+ * a small per-source cache and handed back out here instead of hitting the
+ * allocator for every block. Runs on the source thread only.
+ */
+refbuf_t *source_qblock_new (source_t *source, unsigned int len)
+{
+    int i;
+
+    for (i = 0; i < source->qcache_count; i++)
+    {
+        refbuf_t *r = source->qcache [i];
+        if (r->alloc_len >= len)
+        {
+            source->qcache [i] = source->qcache [--source->qcache_count];
+            r->len = len;
+            r->flags &= REFBUF_DATA_ARENA;  /* wipe all but the backing bit */
+            r->_count = 1;
+            return r;
+        }
+    }
+    if (source->qcache_count == SOURCE_QCACHE_DEPTH)
+    {   /* all cached blocks too small, retire one so the cache turns over */
+        refbuf_release (source->qcache [--source->qcache_count]);
+    }
+    return refbuf_new_arena (len);
+}
+
+
 void source_add_queue_buffer (source_t *source, refbuf_t *r)
 {
     source->bytes_read_since_update += r->len;
 
     r->flags |= SOURCE_QUEUE_BLOCK;
+    if (source->client && source->client->worker)
+        r->queue_ms = source->client->worker->time_ms;
 
     /* append buffer to the in-flight data queue,  */
     if (source->stream_data == NULL)
@@ -534,6 +889,13 @@ void source_add_queue_buffer (source_t *source, refbuf_t *r)
         {
             source_set_intro (source, mountinfo->intro_filename);
             source_set_override (mountinfo, source, source->format->type);
+            hls_check (source, mountinfo);
+            if (mountinfo->audio_meter && source->client->format_data &&
+                    (source->format->type == FORMAT_TYPE_MPEG || source->format->type == FORMAT_TYPE_AAC))
+                mpeg_set_flags (source->client->format_data, MPEG_AUDIO_METER);
+            if (mountinfo->ts_drop_pids && source->client->format_data &&
+                    source->format->type == FORMAT_TYPE_MPEG)
+                mpeg_set_ts_drop (source->client->format_data, mountinfo->ts_drop_pids);
         }
         config_release_config();
 
@@ -547,14 +909,34 @@ void source_add_queue_buffer (source_t *source, refbuf_t *r)
 
     source->stream_data_tail = r;
     source->queue_size += r->len;
+    __atomic_fetch_add (&stream_mem_used, r->len, __ATOMIC_RELAXED);
     source->wakeup = 1;
 
     /* move the starting point for new listeners */
     source->min_queue_offset += r->len;
 
+    if (r->flags & SOURCE_BLOCK_SYNC)
+    {
+        /* record the join point, dropping the oldest if the ring is full. Formats
+         * marking blocks after queueing (eg theora keyframes) are not seen here,
+         * locate_start_on_queue falls back to the queue walk for those */
+        if (source->sync_count == SOURCE_SYNC_RING)
+        {
+            source->sync_head = (source->sync_head + 1) % SOURCE_SYNC_RING;
+            source->sync_count--;
+        }
+        unsigned int slot = (source->sync_head + source->sync_count) % SOURCE_SYNC_RING;
+        source->sync_block [slot] = r;
+        source->sync_pos [slot] = source->client->queue_pos - r->len;
+        source->sync_count++;
+    }
+
     if ((source->buffer_count & 3) == 3)
         source->incoming_rate = (long)rate_avg (source->in_bitrate);
 
+    if (source->hls)
+        hls_queue_block (source, r);
+
     /* save stream to file */
     if (source->dumpfile && source->format->write_buf_to_file)
         source->format->write_buf_to_file (source, r);
@@ -666,6 +1048,11 @@ int source_read (source_t *source)
 
         source->last_read = current;
         unsigned int prev_qsize = source->queue_size;
+        /* scale the blocks taken per pass with the incoming rate, so high
+         * bitrate sources do not cost a scheduler trip per block read */
+        loop = 1 + (source->incoming_rate >> 14);
+        if (loop > 12)
+            loop = 12;
         do
         {
             refbuf = source->format->get_buffer (source);
@@ -681,7 +1068,7 @@ int source_read (source_t *source)
                 return 0;
             }
             loop--;
-        } while (loop);
+        } while (loop && refbuf);
 
         if (source->queue_size != prev_qsize)
         {
@@ -720,6 +1107,21 @@ int source_read (source_t *source)
         if ((queue_size_target < source->min_queue_size) || (queue_size_target > source->queue_size_limit))
             queue_size_target = (source->listeners) ? source->queue_size_limit : source->min_queue_size;
 
+        /* the server wide budget overrides the per-mount entitlement. Idle
+         * mounts give back as the budget nears, everyone once it is breached */
+        switch (stream_mem_pressure ())
+        {
+            case STREAM_MEM_TRIM_IDLE:
+                if (source->listeners)
+                    break;
+                /* fallthrough */
+            case STREAM_MEM_BREACHED:
+                if (queue_size_target > source->min_queue_size)
+                    queue_size_target = source->min_queue_size;
+            default:
+                break;
+        }
+
         loop = 48 + (source->incoming_rate >> 13); // scale max on high bitrates
         queue_size_target += 8000; // lets not be too tight to the limit
         while (source->queue_size > queue_size_target && loop)
@@ -729,6 +1131,7 @@ int source_read (source_t *source)
                 break;
             source->stream_data = to_go->next;
             source->queue_size -= to_go->len;
+            __atomic_fetch_sub (&stream_mem_used, to_go->len, __ATOMIC_RELAXED);
             if (source->min_queue_point == to_go)
             {
                 // adjust min queue in line with expectations
@@ -736,9 +1139,26 @@ int source_read (source_t *source)
                 source->min_queue_point = to_go->next;
             }
             to_go->next = NULL;
+            if (source->sync_count && source->sync_block [source->sync_head] == to_go)
+            {
+                source->sync_head = (source->sync_head + 1) % SOURCE_SYNC_RING;
+                source->sync_count--;
+            }
             if (source->format->detach_queue_block)
                 source->format->detach_queue_block (source, to_go);
-            refbuf_release (to_go);
+            if (to_go->_count == 1 && to_go->associated == NULL && to_go->data &&
+                    to_go->alloc_len && source->qcache_count < SOURCE_QCACHE_DEPTH)
+            {
+                if (to_go->frame_map)
+                {
+                    refbuf_release (to_go->frame_map);
+                    to_go->frame_map = NULL;
+                }
+                to_go->flags &= REFBUF_DATA_ARENA;
+                source->qcache [source->qcache_count++] = to_go;
+            }
+            else
+                refbuf_release (to_go);
             loop--;
         }
     } while (0);
@@ -948,7 +1368,13 @@ static int source_queue_advance (client_t *client)
         int ret = 0;
 
         if (client->pos < refbuf->len)
-            ret = source->format->write_buf_to_client (client);
+        {
+            ret = -2;
+            if (refbuf->next)   /* several blocks pending, try one gathered send */
+                ret = format_queued_writev (client);
+            if (ret == -2)
+                ret = source->format->write_buf_to_client (client);
+        }
         if (ret > 0)
             written += ret;
         if (client->pos >= refbuf->len)
@@ -1007,18 +1433,51 @@ static int locate_start_on_queue (source_t *source, client_t *client)
 
         if (v > client->connection.sent_bytes)
         {
+            refbuf_t *sync = NULL;
+
             v -= client->connection.sent_bytes; /* have we sent data already */
-            refbuf = source->min_queue_point;
-            lag = source->min_queue_offset;
-            // DEBUG3 ("size %lld, v %lld, lag %ld", size, v, lag);
-            while (size > v && refbuf && refbuf->next)
+            if (source->sync_count)
+            {
+                /* find the oldest recorded sync block within the requested burst,
+                 * but not beyond the min queue point */
+                uint64_t threshold = v < source->min_queue_offset ? v : source->min_queue_offset;
+                uint64_t target = source->client->queue_pos - threshold;
+                unsigned int low = 0, high = source->sync_count;
+
+                while (low < high)
+                {
+                    unsigned int mid = (low + high) / 2,
+                                 slot = (source->sync_head + mid) % SOURCE_SYNC_RING;
+                    if (source->sync_pos [slot] < target)
+                        low = mid + 1;
+                    else
+                        high = mid;
+                }
+                if (low < source->sync_count)
+                {
+                    unsigned int slot = (source->sync_head + low) % SOURCE_SYNC_RING;
+                    sync = source->sync_block [slot];
+                    lag = (long)(source->client->queue_pos - source->sync_pos [slot]);
+                }
+            }
+            if (sync)
+                refbuf = sync;
+            else
             {
-                size -= refbuf->len;
-                lag -= refbuf->len;
-                refbuf = refbuf->next;
+                /* no recorded sync point in range (eg marked after queueing),
+                 * fall back to walking the queue from the min queue point */
+                refbuf = source->min_queue_point;
+                lag = source->min_queue_offset;
+                // DEBUG3 ("size %lld, v %lld, lag %ld", size, v, lag);
+                while (size > v && refbuf && refbuf->next)
+                {
+                    size -= refbuf->len;
+                    lag -= refbuf->len;
+                    refbuf = refbuf->next;
+                }
+                if (lag < 0)
+                    ERROR1 ("Odd, lag is negative %ld", lag);
             }
-            if (lag < 0)
-                ERROR1 ("Odd, lag is negative %ld", lag);
         }
         else
             lag = refbuf->len;
@@ -1439,8 +1898,26 @@ static int send_listener (source_t *source, client_t *client)
                 client->schedule_ms += 100 + (client->throttle * 3);
         }
     }
+    /* token bucket governor, server then mount level. A sender in debt sits
+     * out the time owed instead of oscillating around a sampled average */
+    if (global.bw_out.rate || source->bw_out.rate)
+    {
+        long owed = bw_bucket_owed (&global.bw_out, worker->time_ms),
+             mount_owed = bw_bucket_owed (&source->bw_out, worker->time_ms);
+
+        if (mount_owed > owed)
+            owed = mount_owed;
+        if (owed > 0)
+        {
+            client->schedule_ms += (owed > 500 ? 500 : owed);
+            return 0;
+        }
+    }
     // set between 1 and 25
     client->throttle = source->incoming_adj > 25 ? 25 : (source->incoming_adj > 0 ? source->incoming_adj : 1);
+
+    struct timespec pass_start;
+    thread_get_timespec (&pass_start);
     while (1)
     {
         /* lets not send too much to one client in one go, but don't
@@ -1458,6 +1935,24 @@ static int send_listener (source_t *source, client_t *client)
                 ret = -1;
                 break;
             }
+            if (source->notsent_lowat && total_written == 0)
+            {
+                /* writes refused, see how much the kernel is still sitting on.
+                 * Way beyond the configured mark means the peer has stalled, so
+                 * drop it now instead of waiting for the queue lag to build. */
+                int unsent = sock_unsent_bytes (client->connection.sock);
+                if (unsent > (int)(source->notsent_lowat << 2))
+                {
+                    INFO4 ("Client %" PRIu64 " (%s) has %d unsent bytes on %s, dropping",
+                            client->connection.id, client->connection.ip, unsent, source->mount);
+                    stats_lock (source->stats, source->mount);
+                    stats_set_inc (source->stats, "slow_listeners");
+                    stats_release (source->stats);
+                    client->connection.error = 1;
+                    ret = -1;
+                    break;
+                }
+            }
             client->schedule_ms += 15;
             break;  /* can't write any more */
         }
@@ -1469,6 +1964,48 @@ static int send_listener (source_t *source, client_t *client)
     {
         rate_add_sum (source->out_bitrate, total_written, worker->time_ms, &source->format->sent_bytes);
         global_add_bitrates (global.out_bitrate, total_written, worker->time_ms);
+        bw_bucket_spend (&global.bw_out, total_written, worker->time_ms);
+        bw_bucket_spend (&source->bw_out, total_written, worker->time_ms);
+    }
+
+    /* absolute-deadline pacing. advance a per-listener clock by the time the
+     * written bytes represent at the stream rate and schedule against that,
+     * so sends spread across passes instead of batching at each wakeup */
+    if (source->pace_sends && client->connection.error == 0 && source->incoming_rate > 0)
+    {
+        long rate = source->incoming_rate;
+        uint64_t due = client->pace_ms;
+
+        if (due == 0)   /* first paced pass, let the kernel smooth sub-pass bursts too */
+            sock_set_pacing_rate (client->connection.sock, rate + (rate >> 2));
+        /* a lagging listener restarts from now rather than bursting off the debt */
+        if (due < worker->time_ms)
+            due = worker->time_ms;
+        due += ((uint64_t)total_written * 1000) / rate;
+        if (due > worker->time_ms + 1000)
+            due = worker->time_ms + 1000;   /* rate sample moved, don't go quiet for long */
+        client->pace_ms = due;
+        if (total_written || due > client->schedule_ms)
+            client->schedule_ms = due;
+    }
+
+    {   /* sample how far behind the tail this listener is and how long the pass took */
+        struct timespec pass_end;
+        thread_get_timespec (&pass_end);
+        long us = (pass_end.tv_sec - pass_start.tv_sec) * 1000000 +
+                  (pass_end.tv_nsec - pass_start.tv_nsec) / 1000;
+        uint64_t lag_bytes = source->client->queue_pos - client->queue_pos;
+        unsigned int lag_b = source_hist_bucket (lag_bytes, 1024),
+                     lat_b = source_hist_bucket (us > 0 ? us : 0, 1);
+        stats_hist_record (STATS_HIST_LAG, lag_bytes / 1024);
+        thread_spin_lock (&source->hist_lock);
+        source->lag_hist [lag_b]++;
+        source->latency_hist [lat_b]++;
+        /* age of the block this listener is being served from, ingest to send */
+        if (client->refbuf && (client->refbuf->flags & SOURCE_QUEUE_BLOCK) &&
+                client->refbuf->queue_ms && worker->time_ms >= client->refbuf->queue_ms)
+            source->age_hist [source_hist_bucket (worker->time_ms - client->refbuf->queue_ms, 16)]++;
+        thread_spin_unlock (&source->hist_lock);
     }
 
     if (source->shrink_time && client->connection.error == 0)
@@ -1507,6 +2044,8 @@ void source_init (source_t *source)
                 WARN2("Cannot open dump file \"%s\" for appending: %s, disabling.",
                         buffer, strerror(errno));
             }
+            else
+                source_dump_start (source, source->dumpfile);
         }
     }
 
@@ -1518,6 +2057,7 @@ void source_init (source_t *source)
     stats_set_flags (source->stats, "listener_peak", "0", STATS_COUNTERS);
     stats_set_args (source->stats, "listener_peak", "%lu", source->peak_listeners);
     stats_set_flags (source->stats, "listener_connections", "0", STATS_COUNTERS);
+    slave_mount_state_restore (source);
     stats_set_time (source->stats, "stream_start", STATS_COUNTERS, source->client->worker->current_time.tv_sec);
     stats_set_flags (source->stats, "total_mbytes_sent", "0", STATS_COUNTERS);
     stats_set_flags (source->stats, "total_bytes_sent", "0", STATS_COUNTERS);
@@ -1717,7 +2257,7 @@ int source_set_intro (source_t *source, const char *file_pattern)
             break;
 
         icefile_handle intro_file;
-        if (file_open (&intro_file, buffer) < 0)
+        if (file_open_cached (&intro_file, buffer) < 0)
         {
             WARN3 ("Cannot open intro for %s \"%s\": %s", source->mount, buffer, strerror(errno));
             break;
@@ -2031,7 +2571,7 @@ static void source_apply_mount (source_t *source, mount_proxy *mountinfo)
             format_type_t type = format_get_type (mountinfo->type);
             if (type == FORMAT_TYPE_UNDEFINED)
                 WARN2 ("type specified for %s is unrecognised (%s)", source->mount, mountinfo->type);
-            else
+            else if (source->format->type != FORMAT_TYPE_RAW) // raw passthrough keeps its plugin
                 source->format->type = format_get_type (mountinfo->type);
             free (source->format->contenttype);
             source->format->contenttype = strdup (mountinfo->type);
@@ -2054,6 +2594,16 @@ static void source_apply_mount (source_t *source, mount_proxy *mountinfo)
     if (mountinfo && mountinfo->limit_rate)
         source->limit_rate = mountinfo->limit_rate;
 
+    source->notsent_lowat = 0;
+    if (mountinfo && mountinfo->notsent_lowat > 0)
+        source->notsent_lowat = mountinfo->notsent_lowat;
+
+    source->pace_sends = (mountinfo && mountinfo->pace_sends) ? 1 : 0;
+
+    source->worker_affinity = 0;
+    if (mountinfo && mountinfo->worker_affinity > 0)
+        source->worker_affinity = mountinfo->worker_affinity;
+
     /* needs a better mechanism, probably via a client_t handle */
     free (source->dumpfilename);
     source->dumpfilename = NULL;
@@ -2140,6 +2690,9 @@ void source_update_settings (ice_config_t *config, source_t *source, mount_proxy
     stats_set_flags (source->stats, "listenurl", listen_url, STATS_COUNTERS);
 
     source_apply_mount (source, mountinfo);
+    bw_bucket_set (&source->bw_out,
+            (mountinfo && mountinfo->max_bandwidth > 0) ? mountinfo->max_bandwidth : 0,
+            timing_get_time ());
 
     if (source->dumpfilename)
         DEBUG1 ("Dumping stream to %s", source->dumpfilename);
@@ -2209,24 +2762,79 @@ static int source_client_callback (client_t *client)
 
 
 #ifndef _WIN32
-static void source_run_script (char *command, char *mountpoint)
+typedef struct
+{
+    char *command;
+    char *mount;
+} script_run_t;
+
+#define MAX_SCRIPT_ARGS          20
+
+static int scripter_fd = -1;
+static pid_t scripter_pid = -1;
+
+
+/* exec side of an event. Only ever runs in a freshly forked child so no
+ * logging from here; comm has already been split from its arguments at p.
+ */
+static void scripter_exec (char *comm, char *p, char *mountpoint)
+{
+    sighandler_child_reset ();
+#ifdef HAVE_STRSEP
+    int i = 1;
+    char *args [MAX_SCRIPT_ARGS+1], *tmp;
+
+    // default set unless overridden
+    args[0] = comm;
+    args[1] = mountpoint;
+    args[2] = NULL;
+    while (i < MAX_SCRIPT_ARGS && (tmp = strsep (&p, " \t")))
+    {
+        unsigned len = 4096;
+        char *str = malloc (len);
+        if (util_expand_pattern (mountpoint, tmp, str, &len) == 0)
+            args[i] = str;
+        i++;
+    }
+    close (0);
+    close (1);
+    close (2);
+    execvp ((const char *)args[0], args);
+#else
+    close (0);
+    close (1);
+    close (2);
+    execl (comm, comm, mountpoint, (char *)NULL);
+#endif
+    exit (1);
+}
+
+
+/* pool task, forks off the configured command. Runs on a pool thread so the
+ * source worker is not held up by the fork/waitpid of the intermediate child
+ */
+static void *source_script_task (void *arg)
 {
+    script_run_t *r = arg;
+    char *mountpoint = r->mount;
     pid_t pid, external_pid;
     char *p, *comm;
     int wstatus;
 
-    comm = p = strdup (command);
+    comm = p = r->command;
 #ifdef HAVE_STRSEP
     strsep (&p, " \t");
 #else
-    if (strchr (command, ' '))  // possible misconfiguration, but unlikely to occur.
+    if (strchr (comm, ' '))  // possible misconfiguration, but unlikely to occur.
         INFO1 ("arguments to command on %s not supported", mountpoint);
 #endif
     if (access (comm, X_OK) != 0)
     {
         ERROR3 ("Unable to run command %s on %s (%s)", comm, mountpoint, strerror (errno));
+        free (r->mount);
         free (comm);
-        return;
+        free (r);
+        return NULL;
     }
     DEBUG2 ("Starting command %s on %s", comm, mountpoint);
 
@@ -2240,36 +2848,7 @@ static void source_run_script (char *command, char *mountpoint)
                 case -1:
                     break;
                 case 0:  /* child */
-#ifdef HAVE_STRSEP
-#define MAX_SCRIPT_ARGS          20
-                    {
-                        int i = 1;
-                        char *args [MAX_SCRIPT_ARGS+1], *tmp;
-
-                        // default set unless overridden
-                        args[0] = comm;
-                        args[1] = mountpoint;
-                        args[2] = NULL;
-                        while (i < MAX_SCRIPT_ARGS && (tmp = strsep (&p, " \t")))
-                        {
-                            unsigned len = 4096;
-                            char *str = malloc (len);
-                            if (util_expand_pattern (mountpoint, tmp, str, &len) == 0)
-                                args[i] = str;
-                            i++;
-                        }
-                        close (0);
-                        close (1);
-                        close (2);
-                        execvp ((const char *)args[0], args);
-                    }
-#else
-                    close (0);
-                    close (1);
-                    close (2);
-                    execl (command, command, mountpoint, (char *)NULL);
-#endif
-                    exit(1);
+                    scripter_exec (comm, p, mountpoint);
                 default: /* parent */
                     break;
             }
@@ -2285,7 +2864,189 @@ static void source_run_script (char *command, char *mountpoint)
             } while (WIFEXITED(wstatus) == 0 && WIFSIGNALED(wstatus) == 0);
             break;
     }
+    free (r->mount);
     free (comm);
+    free (r);
+    return NULL;
+}
+
+
+/* read exactly len bytes off the event pipe, fail on error or EOF */
+static int scripter_read (int fd, void *buf, size_t len)
+{
+    char *p = buf;
+
+    while (len)
+    {
+        ssize_t n = read (fd, p, len);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+
+/* body of the persistent event helper. One record per event off the pipe and
+ * a single fork+exec each; SIG_IGN on SIGCHLD leaves reaping to the kernel.
+ * Exits when the server end of the pipe closes. Don't log from here, the
+ * inherited log state belongs to the server.
+ */
+static void scripter_loop (int fd)
+{
+    sighandler_child_reset ();
+    signal (SIGCHLD, SIG_IGN);
+    signal (SIGHUP, SIG_IGN);
+    signal (SIGINT, SIG_IGN);
+    for (;;)
+    {
+        unsigned short len [2];
+        char command [PIPE_BUF], mount [PIPE_BUF], *p, *comm;
+
+        if (scripter_read (fd, len, sizeof len) < 0)
+            break;
+        if (len[0] == 0 || len[1] == 0 || len[0] + len[1] + sizeof len > PIPE_BUF)
+            break;      /* framing lost, bail out */
+        if (scripter_read (fd, command, len[0]) < 0 || scripter_read (fd, mount, len[1]) < 0)
+            break;
+        command [len[0]-1] = '\0';
+        mount [len[1]-1] = '\0';
+        comm = p = command;
+#ifdef HAVE_STRSEP
+        strsep (&p, " \t");
+#endif
+        if (fork () == 0)
+            scripter_exec (comm, p, mount);
+    }
+    _exit (0);
+}
+
+
+/* hand an event to the helper. Records stay below PIPE_BUF so each write is
+ * atomic and needs no lock between workers. A failed write drops us back to
+ * in-process forking for the rest of the run.
+ */
+static int scripter_send (const char *command, const char *mountpoint)
+{
+    unsigned short len [2];
+    char buf [PIPE_BUF];
+    size_t total;
+    int fd = scripter_fd;
+
+    if (fd < 0)
+        return -1;
+    len[0] = strlen (command) + 1;
+    len[1] = strlen (mountpoint) + 1;
+    total = sizeof len + len[0] + len[1];
+    if (total > sizeof buf)
+        return -1;
+    memcpy (buf, len, sizeof len);
+    memcpy (buf + sizeof len, command, len[0]);
+    memcpy (buf + sizeof len + len[0], mountpoint, len[1]);
+    if (write (fd, buf, total) == (ssize_t)total)
+        return 0;
+    WARN1 ("event helper lost (%s), reverting to in-process forking", strerror (errno));
+    scripter_fd = -1;
+    close (fd);
+    return -1;
+}
+
+
+/* fork the persistent event helper. Called once at startup after the uid
+ * change but before the worker threads exist, so later events cost the
+ * server a pipe write instead of duplicating a large address space.
+ */
+void source_scripter_initialize (void)
+{
+    int fds [2];
+    pid_t pid;
+
+    if (pipe (fds) < 0)
+    {
+        WARN1 ("unable to create event helper pipe (%s)", strerror (errno));
+        return;
+    }
+    pid = fork ();
+    switch (pid)
+    {
+        case 0:
+            close (fds[1]);
+            fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+            scripter_loop (fds[0]);
+            break;  /* not reached */
+        case -1:
+            WARN1 ("unable to fork event helper (%s)", strerror (errno));
+            close (fds[0]);
+            close (fds[1]);
+            break;
+        default:
+            close (fds[0]);
+            fcntl (fds[1], F_SETFD, FD_CLOEXEC);
+            scripter_fd = fds[1];
+            scripter_pid = pid;
+            INFO1 ("event helper started, pid %ld", (long)pid);
+            break;
+    }
+}
+
+
+/* called from the connection loop when a SIGCHLD comes off the signalfd.
+ * Only the persistent helper is reaped here, auth and script children are
+ * waited on synchronously by the code that forked them. A helper that has
+ * gone away is replaced so events keep costing a pipe write, not a fork.
+ */
+void source_scripter_reap (void)
+{
+    int wstatus;
+
+    if (scripter_pid <= 0)
+        return;
+    if (waitpid (scripter_pid, &wstatus, WNOHANG) != scripter_pid)
+        return;
+    WARN2 ("event helper (pid %ld) gone, status %d, restarting", (long)scripter_pid, wstatus);
+    scripter_pid = -1;
+    if (scripter_fd >= 0)
+    {
+        close (scripter_fd);
+        scripter_fd = -1;
+    }
+    source_scripter_initialize ();
+}
+
+
+/* copies are taken as the mountinfo strings can be retired before the pool
+ * gets to the task; events go to the forked helper when it is up, else fall
+ * back to forking from a pool thread (or in place if the pool is down too)
+ */
+static void source_run_script (char *command, char *mountpoint)
+{
+    script_run_t *r;
+
+    if (scripter_fd >= 0)
+    {
+        char comm [PIPE_BUF];
+
+        snprintf (comm, sizeof comm, "%s", command);
+        comm [strcspn (comm, " \t")] = '\0';
+        if (access (comm, X_OK) != 0)
+        {
+            ERROR3 ("Unable to run command %s on %s (%s)", comm, mountpoint, strerror (errno));
+            return;
+        }
+        DEBUG2 ("Starting command %s on %s", comm, mountpoint);
+        if (scripter_send (command, mountpoint) == 0)
+            return;
+    }
+    r = calloc (1, sizeof (*r));
+    r->command = strdup (command);
+    r->mount = strdup (mountpoint);
+    if (thread_pool_run (THREAD_POOL_NORMAL, source_script_task, r) < 0)
+        source_script_task (r);
 }
 #endif
 
@@ -2833,6 +3594,17 @@ int source_format_init (source_t *source)
                 WARN1("No content-type for %s, Assuming content is mpeg.", source->mount);
             format->type = format_type;
         }
+        do
+        {
+            /* trusted feeds can be queued without any codec parsing */
+            mount_proxy *mountinfo = config_find_mount (config_get_config(), source->mount);
+            if (mountinfo && mountinfo->raw_passthrough)
+            {
+                INFO1 ("using raw passthrough on %s", source->mount);
+                format->type = FORMAT_TYPE_RAW;
+            }
+            config_release_config();
+        } while (0);
         format->mount = source->mount;
         if (format_get_plugin (format) < 0)
         {
@@ -2954,17 +3726,23 @@ int source_startup (client_t *client, const char *uri)
 /* check to see if the source client can be moved to a less busy worker thread.
  * we only move the source client, not the listeners, they will move later
  */
+/* with affinity set, the source and its listeners gather on one worker while the
+ * listener count is below the mark, saving cross-worker wakeups on small mounts */
+#define source_affinity_active(s)   ((s)->worker_affinity > 0 && (s)->listeners < (unsigned long)(s)->worker_affinity)
+
 static int source_change_worker (source_t *source, client_t *client)
 {
     worker_t *this_worker = client->worker, *worker;
     int ret = 0;
 
+    if (source_affinity_active (source) && is_worker_incoming (this_worker) == 0)
+        return 0;   /* stay put, listeners are gathering here */
     thread_rwlock_rlock (&workers_lock);
     if (this_worker->move_allocations)
     {
         int bypass = is_worker_incoming (this_worker) ? 1 : 0;
 
-        worker = worker_selected ();
+        worker = worker_preferred (this_worker);
         if (worker && worker != client->worker && (bypass || worker->count > 100))
         {
             long diff = bypass ? 2000000 : this_worker->count - worker->count;
@@ -3003,7 +3781,7 @@ static int source_change_worker (source_t *source, client_t *client)
 int listener_change_worker (client_t *client, source_t *source)
 {
     worker_t *this_worker = client->worker, *dest_worker = source->client->worker;
-    int ret = 0, spin = 0, locked = 0;
+    int ret = 0, spin = 0, locked = 0, affinity = source_affinity_active (source);
     long diff = 0;
 
     do
@@ -3014,7 +3792,11 @@ int listener_change_worker (client_t *client, source_t *source)
             break;
         locked = 1;
         if (this_worker == dest_worker)
-            dest_worker = worker_selected ();
+        {
+            if (affinity)
+                break;      // already alongside the source, do not spread out
+            dest_worker = worker_preferred_on_node (this_worker);
+        }
 
         if (dest_worker && this_worker != dest_worker)
         {
@@ -3035,7 +3817,7 @@ int listener_change_worker (client_t *client, source_t *source)
             {
                 this_worker->move_allocations--;
                 diff = this_worker->count - dest_count;
-                if (diff < adj)
+                if (affinity == 0 && diff < adj)
                     break;      // ignore the move this time
             }
             move = 1;
@@ -24,6 +24,7 @@
 typedef struct source_tag
 {
     char *mount;
+    struct source_tag *hash_next;   /* chain in the mount lookup hash */
     unsigned int flags;
     int listener_send_trigger;
     char wakeup;
@@ -45,12 +46,18 @@ typedef struct source_tag
 
     char *dumpfilename; /* Name of a file to dump incoming stream to */
     FILE *dumpfile;
+    struct dump_writer *dumper;
+
+    struct hls_output *hls; /* rolling in-memory segmenter, see hls.c */
 
     fbinfo fallback;
 
     int skip_duration;
     int incoming_adj;
     long limit_rate;
+    unsigned int notsent_lowat;
+    int pace_sends;
+    int worker_affinity;
     time_t wait_time;
 
     long termination_count;
@@ -60,6 +67,7 @@ typedef struct source_tag
     long incoming_rate;
     struct rate_calc *in_bitrate;
     struct rate_calc *out_bitrate;
+    bw_bucket_t bw_out;     /* per-mount outgoing token bucket */
 
     int yp_public;
 
@@ -80,6 +88,15 @@ typedef struct source_tag
     uint64_t shrink_pos;
     uint64_t shrink_time;
 
+    /* log2 bucketed listener lag (bytes), send pass latency (us) and queue
+     * buffer age (ms since ingest) counters, filled on the listener workers
+     * and published each stats interval */
+#define SOURCE_HIST_BUCKETS 16
+    spin_t hist_lock;
+    unsigned long lag_hist [SOURCE_HIST_BUCKETS];
+    unsigned long latency_hist [SOURCE_HIST_BUCKETS];
+    unsigned long age_hist [SOURCE_HIST_BUCKETS];
+
     unsigned buffer_count;
     unsigned timeout;  /* source timeout in seconds */
     uint64_t bytes_sent_at_update;
@@ -89,11 +106,33 @@ typedef struct source_tag
     int stats_interval;
     long stats;
 
+    /* values as last pushed to stats, so unchanged ones are skipped */
+    struct {
+        long outgoing_kbitrate;
+        unsigned long incoming_bitrate;
+        uint64_t read_bytes;
+        uint64_t sent_bytes;
+        unsigned int queue_size;
+    } last_stats;
+
     time_t last_read;
 
     refbuf_t *stream_data;
     refbuf_t *stream_data_tail;
 
+    /* retired queue blocks kept for reuse, only touched on the source thread */
+#define SOURCE_QCACHE_DEPTH 16
+    refbuf_t *qcache [SOURCE_QCACHE_DEPTH];
+    int qcache_count;
+
+    /* ring of the newest queued sync blocks with their stream positions, so
+     * that listener joins can binary search instead of walking the queue */
+#define SOURCE_SYNC_RING 256
+    refbuf_t *sync_block [SOURCE_SYNC_RING];
+    uint64_t sync_pos [SOURCE_SYNC_RING];
+    unsigned int sync_head;
+    unsigned int sync_count;
+
     util_dict *audio_info;
 
     cache_file_contents *intro_ipcache;
@@ -124,8 +163,17 @@ int source_compare_sources(void *arg, void *a, void *b);
 void source_free_source(source_t *source);
 void source_main(source_t *source);
 void source_recheck_mounts (int update_all);
+void source_stream_mem_limit (int64_t bytes);
+int64_t source_stream_mem_used (void);
+#ifndef _WIN32
+void source_scripter_initialize (void);
+void source_scripter_reap (void);
+#endif
 int  source_add_listener (const char *mount, mount_proxy *mountinfo, client_t *client);
 int  source_read (source_t *source);
+refbuf_t *source_qblock_new (source_t *source, unsigned int len);
+int  source_dump_write (source_t *source, const void *ptr, unsigned int len);
+void source_dump_stop (source_t *source);
 void source_setup_listener (source_t *source, client_t *client);
 void source_init (source_t *source);
 void source_shutdown (source_t *source, int with_fallback);
@@ -30,6 +30,7 @@
 #include "avl/avl.h"
 #include "httpp/httpp.h"
 #include "net/sock.h"
+#include "timing/timing.h"
 
 #include "connection.h"
 
@@ -79,17 +80,27 @@ typedef struct _stats_event_tag
     struct _stats_event_tag *next;
 } stats_event_t;
 
+/* cached serialized stats views, index 0 is the public set, 1 everything */
+#define FRAG_PUBLIC     0
+#define FRAG_ALL        1
+#define FRAG_CLASSES    2
+#define FRAG_STALE_ALL  ((1 << FRAG_CLASSES) - 1)
+
 typedef struct _stats_source_tag
 {
     char *source;
     int  flags;
+    int  frag_stale;
     time_t updated;
     avl_tree *stats_tree;
+    char *frag [FRAG_CLASSES];
+    unsigned int frag_len [FRAG_CLASSES];
 } stats_source_t;
 
 typedef struct _event_listener_tag
 {
     int mask;
+    int binary;             /* wants the varint delta encoding, not text lines */
     unsigned int content_len;
     char *source;
 
@@ -103,7 +114,7 @@ typedef struct _event_listener_tag
 
 typedef struct _stats_tag
 {
-    avl_tree *global_tree;
+    avl_rmap *global_map;
     avl_tree *source_tree;
 
     /* list of listeners for stats */
@@ -116,20 +127,248 @@ static volatile int _stats_running = 0;
 
 static stats_t _stats;
 
+/* updates to the global map serialise here, its readers take no lock. The
+ * serialized fragments below are guarded by the same mutex */
+static mutex_t global_write_lock;
+static char *global_frag [FRAG_CLASSES];
+static unsigned int global_frag_len [FRAG_CLASSES];
+static int global_frag_stale = FRAG_STALE_ALL;
+
+
+/* generation tracked streamlist so slaves can poll incrementally. A sorted
+ * snapshot of the visible mounts is kept alongside a bounded journal of the
+ * changes between refreshes, each batch of changes bumping the generation.
+ * A slave presenting a generation still covered by the journal gets just the
+ * adds and removes since then, anything older falls back to the full list
+ */
+#define STREAMLIST_JOURNAL_LEN  512
+
+struct streamlist_event
+{
+    uint64_t gen;
+    char op;                    /* 'A' add, 'R' remove */
+    char *mount;
+};
+
+static struct
+{
+    mutex_t lock;
+    uint64_t gen;               /* bumped when the visible list changes */
+    uint64_t gen_floor;         /* newest generation pushed out of the journal */
+    uint64_t appended;          /* events journalled since startup */
+    unsigned int count;         /* entries in the cached snapshot */
+    char **mounts;              /* sorted copy of the visible mounts */
+    struct streamlist_event journal [STREAMLIST_JOURNAL_LEN];
+} streamlist;
+
+
+/* shared pool for stats node names and mount strings. The same few dozen
+ * metric names repeat across every mount tree and each mount name is held
+ * in several places, so the trees store refcounted pointers into one pool
+ * and identical strings are pointer-equal. The entry header sits directly
+ * before the characters so releasing needs no lookup
+ */
+typedef struct
+{
+    unsigned int refs;
+    char *str;
+} intern_entry_t;
+
+static avl_tree *intern_pool;
+
 
 static int _compare_stats(void *a, void *b, void *arg);
 static int _compare_source_stats(void *a, void *b, void *arg);
+static int _compare_intern (void *arg, void *a, void *b);
+static int _free_intern (void *key);
+static char *stats_intern (const char *str);
+static void stats_intern_release (char *str);
 static int _free_stats(void *key);
 static int _free_source_stats(void *key);
 static int _free_source_stats_wrapper (void *key);
 static stats_node_t *_find_node(const avl_tree *tree, const char *name);
 static stats_source_t *_find_source(avl_tree *tree, const char *source);
 static void process_event (stats_event_t *event);
-static void _add_stats_to_stats_client (client_t *client, const char *fmt, va_list ap);
-static void stats_listener_send (int flags, const char *fmt, ...);
+static void _add_string_to_stats_client (client_t *client, const char *buf, unsigned int len);
+static void stats_listener_send (int flags, int op, const char *source, const char *name, const char *value);
 
 unsigned int throttle_sends;
 
+/* sharded counters for the global totals bumped from the client hot paths.
+ * threads land on separate cache lines so an update is a single relaxed
+ * increment, no mutex or tree lookup. the totals are folded back into the
+ * stats tree once a second from stats_global_calc
+ */
+#define COUNTER_SHARDS 16
+
+struct counter_shard
+{
+    uint64_t count;
+    char pad [64 - sizeof (uint64_t)];
+};
+
+static struct sharded_counter
+{
+    const char *name;
+    uint64_t reported;
+    struct counter_shard shard [COUNTER_SHARDS];
+} sharded_counters [] =
+{
+    { .name = "connections" },
+    { .name = "client_connections" },
+    { .name = "listener_connections" },
+    { .name = "file_connections" },
+    { .name = "source_client_connections" },
+    { .name = "source_relay_connections" },
+    { .name = "source_total_connections" },
+    { .name = "stream_kbytes_sent" },
+    { .name = "stream_kbytes_read" },
+};
+
+static __thread unsigned int counter_slot = COUNTER_SHARDS;
+static unsigned int counter_slot_seq;
+
+
+/* log2 bucketed histograms for latency style metrics. recording is a single
+ * relaxed increment on the owning bucket so it can sit on hot paths, the
+ * interval totals are folded into the stats tree once a second alongside the
+ * sharded counters with the bucket bounds holding the p50/p99 samples
+ */
+#define HIST_BUCKETS 16
+
+static struct stats_hist
+{
+    const char *name;
+    unsigned long unit;             /* span of bucket 0, doubling upward */
+    uint64_t bucket [HIST_BUCKETS];
+    uint64_t cum [HIST_BUCKETS];    /* since startup, for the metrics scrape */
+    uint64_t sum;
+} histograms [STATS_HIST_MAX] =
+{
+    [STATS_HIST_TTFB] = { .name = "client_ttfb_ms",      .unit = 1 },
+    [STATS_HIST_AUTH] = { .name = "auth_latency_ms",     .unit = 1 },
+    [STATS_HIST_LAG]  = { .name = "listener_lag_kbytes", .unit = 1 },
+};
+
+
+/* bounded lock-free ring carrying stat updates to the stats event
+ * listeners. producers claim a slot with an atomic sequence exchange so
+ * workers never queue on a mutex for the fan-out, the slave thread drains
+ * the batch from stats_global_calc. a full ring drops the oldest update
+ * rather than stalling the caller, the feed only carries updates so a
+ * stale one is the cheapest to lose.
+ * each entry holds a packed record (op tag then source, name and value as
+ * NUL terminated strings) which is serialized at drain time, as the text
+ * protocol for normal stats clients or as the varint delta encoding for
+ * binary subscribers
+ */
+#define EVENT_RING_SIZE 1024
+
+#define STATS_OP_EVENT      1   /* stat added or changed */
+#define STATS_OP_DELSTAT    2   /* single stat removed */
+#define STATS_OP_DELSOURCE  3   /* source dropped */
+#define STATS_OP_NEWSOURCE  4   /* source announced, name carries the type */
+#define STATS_OP_FLUSH      5   /* all stats under source are gone */
+#define STATS_OP_INFO       6   /* informational text, value only */
+
+struct event_ring_entry
+{
+    uint64_t seq;
+    refbuf_t *block;
+    int mask;
+};
+
+static struct event_ring_entry event_ring [EVENT_RING_SIZE];
+static uint64_t event_ring_head, event_ring_tail;
+static uint64_t event_ring_dropped;
+static int event_listener_count;
+
+
+/* detach the oldest published entry, NULL when drained. normally only the
+ * slave thread runs this, a producer finding the ring full takes the same
+ * path to make room which is why the head moves by compare exchange
+ */
+static refbuf_t *event_ring_pop (int *mask)
+{
+    for (;;)
+    {
+        uint64_t head = __atomic_load_n (&event_ring_head, __ATOMIC_RELAXED);
+        struct event_ring_entry *entry = &event_ring [head & (EVENT_RING_SIZE-1)];
+        uint64_t seq = __atomic_load_n (&entry->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == head + 1)
+        {
+            refbuf_t *block;
+
+            if (__atomic_compare_exchange_n (&event_ring_head, &head, head+1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED) == 0)
+                continue;
+            block = entry->block;
+            *mask = entry->mask;
+            __atomic_store_n (&entry->seq, head + EVENT_RING_SIZE, __ATOMIC_RELEASE);
+            return block;
+        }
+        if ((int64_t)(seq - (head+1)) < 0)
+            return NULL;        // empty, or the next entry is mid-publish
+    }
+}
+
+
+static void event_ring_push (refbuf_t *block, int mask)
+{
+    for (;;)
+    {
+        uint64_t tail = __atomic_load_n (&event_ring_tail, __ATOMIC_RELAXED);
+        struct event_ring_entry *entry = &event_ring [tail & (EVENT_RING_SIZE-1)];
+        uint64_t seq = __atomic_load_n (&entry->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - tail);
+
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n (&event_ring_tail, &tail, tail+1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED) == 0)
+                continue;
+            entry->block = block;
+            entry->mask = mask;
+            __atomic_store_n (&entry->seq, tail + 1, __ATOMIC_RELEASE);
+            return;
+        }
+        if (diff < 0)
+        {
+            int dropped_mask;
+            refbuf_t *dropped = event_ring_pop (&dropped_mask);
+
+            if (dropped)
+            {
+                refbuf_release (dropped);
+                __atomic_fetch_add (&event_ring_dropped, 1, __ATOMIC_RELAXED);
+            }
+        }
+        /* a raced claim or freed slot, retry with a fresh tail */
+    }
+}
+
+
+/* divert global counter updates away from the tree, 0 if not one of ours */
+static int counter_shard_add (const char *source, const char *name, uint64_t value)
+{
+    unsigned int i;
+
+    if (source)
+        return 0;
+    for (i = 0; i < sizeof (sharded_counters) / sizeof (sharded_counters [0]); i++)
+    {
+        if (strcmp (name, sharded_counters [i].name))
+            continue;
+        if (counter_slot >= COUNTER_SHARDS)
+            counter_slot = __atomic_fetch_add (&counter_slot_seq, 1, __ATOMIC_RELAXED) % COUNTER_SHARDS;
+        __atomic_fetch_add (&sharded_counters [i].shard [counter_slot].count, value, __ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
+}
+
+
 /* simple helper function for creating an event */
 static void build_event (stats_event_t *event, const char *source, const char *name, const char *value)
 {
@@ -147,15 +386,23 @@ static void build_event (stats_event_t *event, const char *source, const char *n
 
 void stats_initialize(void)
 {
+    unsigned int i;
+
     if (_stats_running)
         return;
 
+    for (i = 0; i < EVENT_RING_SIZE; i++)
+        event_ring [i].seq = i;
+
     /* set up global struct */
-    _stats.global_tree = avl_tree_new(_compare_stats, NULL);
+    intern_pool = avl_tree_new(_compare_intern, NULL);
+    _stats.global_map = avl_rmap_new (_compare_stats, NULL);
     _stats.source_tree = avl_tree_new(_compare_source_stats, NULL);
 
     _stats.event_listeners = NULL;
+    thread_mutex_create (&global_write_lock);
     thread_mutex_create (&_stats.listeners_lock);
+    thread_mutex_create (&streamlist.lock);
 
     _stats_running = 1;
 
@@ -191,8 +438,37 @@ void stats_shutdown(void)
 
     _stats_running = 0;
 
+    do
+    {
+        int mask;
+        refbuf_t *block;
+        while ((block = event_ring_pop (&mask)))
+            refbuf_release (block);
+    } while (0);
+
     avl_tree_free(_stats.source_tree, _free_source_stats_wrapper);
-    avl_tree_free(_stats.global_tree, _free_stats);
+    avl_rmap_free (_stats.global_map, _free_stats);
+    avl_tree_free(intern_pool, _free_intern);
+    intern_pool = NULL;
+    for (int i = 0; i < FRAG_CLASSES; i++)
+    {
+        free (global_frag [i]);
+        global_frag [i] = NULL;
+    }
+    global_frag_stale = FRAG_STALE_ALL;
+    for (unsigned int i = 0; i < streamlist.count; i++)
+        free (streamlist.mounts [i]);
+    free (streamlist.mounts);
+    streamlist.mounts = NULL;
+    streamlist.count = 0;
+    for (int i = 0; i < STREAMLIST_JOURNAL_LEN; i++)
+    {
+        free (streamlist.journal [i].mount);
+        streamlist.journal [i].mount = NULL;
+    }
+    streamlist.gen_floor = streamlist.gen;
+    thread_mutex_destroy (&streamlist.lock);
+    thread_mutex_destroy (&global_write_lock);
     thread_mutex_destroy (&_stats.listeners_lock);
 }
 
@@ -219,7 +495,7 @@ void stats_event(const char *source, const char *name, const char *value)
 {
     stats_event_t event;
 
-    if (value && xmlCheckUTF8 ((unsigned char *)value) == 0)
+    if (value && util_valid_utf8 (value) == 0)
     {
         WARN3 ("seen non-UTF8 data (%s), probably incorrect metadata (%s, %s)",
                 source?source:"global", name, value);
@@ -301,10 +577,11 @@ static char *_get_stats(const char *source, const char *name)
     char *value = NULL;
 
     if (source == NULL) {
-        avl_tree_rlock (_stats.global_tree);
-        stats = _find_node(_stats.global_tree, name);
-        if (stats) value = (char *)strdup(stats->value);
-        avl_tree_unlock (_stats.global_tree);
+        stats_node_t match = { (char *)name, NULL, 0, 0 };
+        int slot = avl_rmap_pin (_stats.global_map);
+        if (avl_rmap_get (_stats.global_map, &match, (void **)&stats) == 0)
+            value = (char *)strdup(stats->value);
+        avl_rmap_unpin (_stats.global_map, slot);
     } else {
         avl_tree_rlock (_stats.source_tree);
         src = _find_source(_stats.source_tree, source);
@@ -345,6 +622,8 @@ void stats_event_inc(const char *source, const char *name)
 {
     stats_event_t event;
     char buffer[VAL_BUFSIZE] = "1";
+    if (counter_shard_add (source, name, 1))
+        return;
     build_event (&event, source, name, buffer);
     /* DEBUG2("%s on %s", name, source==NULL?"global":source); */
     event.action = STATS_EVENT_INC;
@@ -358,6 +637,8 @@ void stats_event_add(const char *source, const char *name, unsigned long value)
 
     if (value == 0)
         return;
+    if (counter_shard_add (source, name, value))
+        return;
     build_event (&event, source, name, buffer);
     snprintf (buffer, VAL_BUFSIZE, "%ld", value);
     event.action = STATS_EVENT_ADD;
@@ -404,7 +685,8 @@ static stats_node_t *_find_node(const avl_tree *stats_tree, const char *name)
     
     while (node) {
         stats = (stats_node_t *)node->key;
-        cmp = strcmp(name, stats->name);
+        /* interned names share a pointer, skip the compare on a match */
+        cmp = (name == stats->name) ? 0 : strcmp(name, stats->name);
         if (cmp < 0) 
             node = node->left;
         else if (cmp > 0)
@@ -430,7 +712,7 @@ static stats_source_t *_find_source(avl_tree *source_tree, const char *source)
     node = source_tree->root->right;
     while (node) {
         stats = (stats_source_t *)node->key;
-        cmp = strcmp(source, stats->source);
+        cmp = (source == stats->source) ? 0 : strcmp(source, stats->source);
         if (cmp < 0)
             node = node->left;
         else if (cmp > 0)
@@ -444,25 +726,137 @@ static stats_source_t *_find_source(avl_tree *source_tree, const char *source)
 }
 
 
+struct stats_buf
+{
+    char *data;
+    unsigned int len, alloc;
+};
+
+static void sbuf_add (struct stats_buf *b, const char *s, unsigned int len)
+{
+    if (b->len + len + 1 > b->alloc)
+    {
+        if (b->alloc == 0)
+            b->alloc = 4096;
+        while (b->len + len + 1 > b->alloc)
+            b->alloc <<= 1;
+        b->data = realloc (b->data, b->alloc);
+    }
+    memcpy (b->data + b->len, s, len);
+    b->len += len;
+    b->data [b->len] = '\0';
+}
+
+static void sbuf_add_escaped (struct stats_buf *b, const char *s)
+{
+    const char *p = s;
+
+    while (*p)
+    {
+        const char *q = p;
+        while (*q && *q != '&' && *q != '<' && *q != '>' && *q != '"')
+            q++;
+        if (q > p)
+            sbuf_add (b, p, q - p);
+        if (*q == '\0')
+            break;
+        switch (*q)
+        {
+            case '&':  sbuf_add (b, "&amp;", 5);  break;
+            case '<':  sbuf_add (b, "&lt;", 4);   break;
+            case '>':  sbuf_add (b, "&gt;", 4);   break;
+            default:   sbuf_add (b, "&quot;", 6); break;
+        }
+        p = q + 1;
+    }
+}
+
+static void sbuf_add_stat (struct stats_buf *b, stats_node_t *stat)
+{
+    unsigned int name_len = strlen (stat->name);
+
+    sbuf_add (b, "<", 1);
+    sbuf_add (b, stat->name, name_len);
+    sbuf_add (b, ">", 1);
+    sbuf_add_escaped (b, stat->value);
+    sbuf_add (b, "</", 2);
+    sbuf_add (b, stat->name, name_len);
+    sbuf_add (b, ">", 1);
+}
+
+/* refresh the serialized view of this source, stats tree write lock held */
+static void source_frag_rebuild (stats_source_t *src, int cls)
+{
+    struct stats_buf b = { NULL, 0, 0 };
+    avl_node *anode = avl_get_first (src->stats_tree);
+
+    sbuf_add (&b, "<source mount=\"", 15);
+    sbuf_add_escaped (&b, src->source);
+    sbuf_add (&b, "\">", 2);
+    while (anode)
+    {
+        stats_node_t *stat = anode->key;
+        if (cls == FRAG_ALL || (stat->flags & STATS_HIDDEN) == 0)
+            sbuf_add_stat (&b, stat);
+        anode = avl_get_next (anode);
+    }
+    sbuf_add (&b, "</source>", 9);
+    free (src->frag [cls]);
+    src->frag [cls] = b.data;
+    src->frag_len [cls] = b.len;
+    src->frag_stale &= ~(1 << cls);
+}
+
+struct global_frag_args
+{
+    struct stats_buf *b;
+    int cls;
+};
+
+static int global_frag_stat (void *key, void *arg)
+{
+    struct global_frag_args *f = arg;
+    stats_node_t *stat = key;
+
+    if (f->cls == FRAG_ALL || (stat->flags & STATS_PUBLIC))
+        sbuf_add_stat (f->b, stat);
+    return 0;
+}
+
+/* refresh the serialized view of the global map, global_write_lock held */
+static void global_frag_rebuild (int cls)
+{
+    struct stats_buf b = { NULL, 0, 0 };
+    struct global_frag_args args = { &b, cls };
+
+    avl_rmap_iterate (_stats.global_map, global_frag_stat, &args);
+    if (b.data == NULL)
+        sbuf_add (&b, "", 0);
+    free (global_frag [cls]);
+    global_frag [cls] = b.data;
+    global_frag_len [cls] = b.len;
+    global_frag_stale &= ~(1 << cls);
+}
+
+
 /* helper to apply specialised changes to a stats node */
-static void modify_node_event (stats_node_t *node, stats_event_t *event)
+/* returns non-zero when the node value actually changed, so callers can skip
+ * re-sending values that are the same as last time */
+static int modify_node_event (stats_node_t *node, stats_event_t *event)
 {
     if (node == NULL || event == NULL)
-        return;
+        return 0;
     if (event->action & STATS_EVENT_HIDDEN)
     {
         node->flags = event->flags;
         event->action &= ~STATS_EVENT_HIDDEN;
         if (event->value == NULL)
-            return;
+            return 0;
     }
     if (event->action == STATS_EVENT_SET)
     {
-        if (node->flags & STATS_REGULAR)
-        {
-            if (node->value && strcmp (node->value, event->value) == 0)
-                return;  // no change, lets get out
-        }
+        if (node->value && strcmp (node->value, event->value) == 0)
+            return 0;  // no change, lets get out
     }
     else
     {
@@ -486,6 +880,8 @@ static void modify_node_event (stats_node_t *node, stats_event_t *event)
                 break;
         }
         snprintf (event->value, VAL_BUFSIZE, "%" PRId64, value);
+        if (node->value && strcmp (node->value, event->value) == 0)
+            return 0;  // adding zero or similar, nothing new to report
     }
     if (node->value)
         free (node->value);
@@ -495,45 +891,114 @@ static void modify_node_event (stats_node_t *node, stats_event_t *event)
         node->last_reported = 0;
     else
         DEBUG3 ("update \"%s\" %s (%s)", event->source?event->source:"global", node->name, node->value);
+    return 1;
+}
+
+
+/* the global map variant of modify_node_event. Published nodes are read
+ * without locks so the value cannot be swapped in place, a change builds a
+ * replacement node for the caller to swap in, the old one then retiring
+ * through the map's grace period. Returns NULL when nothing new to report */
+static stats_node_t *replace_node_event (stats_node_t *node, stats_event_t *event)
+{
+    stats_node_t *repl;
+    int flags = node->flags;
+
+    if (event->action & STATS_EVENT_HIDDEN)
+    {
+        flags = event->flags;
+        event->action &= ~STATS_EVENT_HIDDEN;
+        if (event->value == NULL)
+        {
+            node->flags = flags;    /* plain int store, benign for readers */
+            return NULL;
+        }
+    }
+    if (event->action != STATS_EVENT_SET)
+    {
+        int64_t value = 0;
+
+        switch (event->action)
+        {
+            case STATS_EVENT_INC:
+                value = atoll (node->value)+1;
+                break;
+            case STATS_EVENT_DEC:
+                value = atoll (node->value)-1;
+                break;
+            case STATS_EVENT_ADD:
+                value = atoll (node->value) + atoll (event->value);
+                break;
+            case STATS_EVENT_SUB:
+                value = atoll (node->value) - atoll (event->value);
+                break;
+            default:
+                break;
+        }
+        snprintf (event->value, VAL_BUFSIZE, "%" PRId64, value);
+    }
+    if (node->value && strcmp (node->value, event->value) == 0)
+    {
+        node->flags = flags;
+        return NULL;  // no change, lets get out
+    }
+    repl = (stats_node_t *)calloc (1, sizeof (stats_node_t));
+    repl->name = stats_intern (event->name);
+    repl->value = (char *)strdup (event->value);
+    repl->flags = flags;
+    if ((flags & STATS_REGULAR) == 0)
+        DEBUG2 ("update global %s (%s)", repl->name, repl->value);
+    return repl;
 }
 
 
 static void process_global_event (stats_event_t *event)
 {
-    stats_node_t *node = NULL;
+    stats_node_t match = { event->name, NULL, 0, 0 }, *node = NULL;
 
-    avl_tree_wlock (_stats.global_tree);
+    thread_mutex_lock (&global_write_lock);
     /* DEBUG3("global event %s %s %d", event->name, event->value, event->action); */
     if (event->action == STATS_EVENT_REMOVE)
     {
         /* we're deleting */
-        node = _find_node(_stats.global_tree, event->name);
-        if (node != NULL)
+        if (avl_rmap_get (_stats.global_map, &match, (void **)&node) == 0)
         {
-            stats_listener_send (node->flags, "DELETE global %s\n", event->name);
-            avl_delete(_stats.global_tree, (void *)node, _free_stats);
+            stats_listener_send (node->flags, STATS_OP_DELSTAT, NULL, event->name, NULL);
+            avl_rmap_delete (_stats.global_map, node, _free_stats);
+            global_frag_stale = FRAG_STALE_ALL;
         }
-        avl_tree_unlock (_stats.global_tree);
+        thread_mutex_unlock (&global_write_lock);
         return;
     }
-    node = _find_node(_stats.global_tree, event->name);
-    if (node)
+    int changed = 1;
+    if (avl_rmap_get (_stats.global_map, &match, (void **)&node) == 0)
     {
-        modify_node_event (node, event);
+        stats_node_t *repl = replace_node_event (node, event);
+        if (repl)
+        {
+            avl_rmap_replace (_stats.global_map, repl, _free_stats);
+            node = repl;
+        }
+        else
+            changed = 0;
     }
     else
     {
         /* add node */
         node = (stats_node_t *)calloc(1, sizeof(stats_node_t));
-        node->name = (char *)strdup(event->name);
+        node->name = stats_intern (event->name);
         node->value = (char *)strdup(event->value);
         node->flags = event->flags;
 
-        avl_insert(_stats.global_tree, (void *)node);
+        avl_rmap_insert (_stats.global_map, node);
+    }
+    if (changed)
+    {
+        global_frag_stale = FRAG_STALE_ALL;
+        if ((node->flags & STATS_REGULAR) == 0)
+            stats_listener_send (node->flags, STATS_OP_EVENT, NULL, node->name, node->value);
     }
-    if ((node->flags & STATS_REGULAR) == 0)
-        stats_listener_send (node->flags, "EVENT global %s %s\n", node->name, node->value);
-    avl_tree_unlock (_stats.global_tree);
+    thread_mutex_unlock (&global_write_lock);
 }
 
 
@@ -549,25 +1014,32 @@ static void process_source_stat (stats_source_t *src_stats, stats_event_t *event
             {
                 DEBUG3 ("new node on %s \"%s\" (%s)", src_stats->source, event->name, event->value);
                 node = (stats_node_t *)calloc (1,sizeof(stats_node_t));
-                node->name = (char *)strdup (event->name);
+                node->name = stats_intern (event->name);
                 node->value = (char *)strdup (event->value);
                 node->flags = event->flags;
                 if (src_stats->flags & STATS_HIDDEN)
                     node->flags |= STATS_HIDDEN;
-                stats_listener_send (node->flags, "EVENT %s %s %s\n", src_stats->source, event->name, event->value);
+                stats_listener_send (node->flags, STATS_OP_EVENT, src_stats->source, event->name, event->value);
                 avl_insert (src_stats->stats_tree, (void *)node);
+                src_stats->frag_stale = FRAG_STALE_ALL;
             }
             return;
         }
         if (event->action == STATS_EVENT_REMOVE)
         {
             DEBUG2 ("delete node %s from %s", event->name, src_stats->source);
-            stats_listener_send (node->flags, "DELETE %s %s\n", src_stats->source, event->name);
+            stats_listener_send (node->flags, STATS_OP_DELSTAT, src_stats->source, event->name, NULL);
             avl_delete (src_stats->stats_tree, (void *)node, _free_stats);
+            src_stats->frag_stale = FRAG_STALE_ALL;
             return;
         }
-        modify_node_event (node, event);
-        stats_listener_send (node->flags, "EVENT %s %s %s\n", src_stats->source, node->name, node->value);
+        if (event->action & STATS_EVENT_HIDDEN)
+            src_stats->frag_stale = FRAG_STALE_ALL;  // visibility changes alter the public view
+        if (modify_node_event (node, event))
+        {
+            src_stats->frag_stale = FRAG_STALE_ALL;
+            stats_listener_send (node->flags, STATS_OP_EVENT, src_stats->source, node->name, node->value);
+        }
         return;
     }
     if (event->action == STATS_EVENT_REMOVE && event->name == NULL)
@@ -587,6 +1059,7 @@ static void process_source_stat (stats_source_t *src_stats, stats_event_t *event
 
         if ((event->flags&STATS_HIDDEN) == (src_stats->flags&STATS_HIDDEN))
             return;
+        src_stats->frag_stale = FRAG_STALE_ALL;
         if (src_stats->flags & STATS_HIDDEN)
         {
             stats_node_t *ct = _find_node (src_stats->stats_tree, "server_type");
@@ -594,12 +1067,12 @@ static void process_source_stat (stats_source_t *src_stats, stats_event_t *event
             if (ct)
                 type = ct->value;
             src_stats->flags &= ~STATS_HIDDEN;
-            stats_listener_send (src_stats->flags, "NEW %s %s\n", type, src_stats->source);
+            stats_listener_send (src_stats->flags, STATS_OP_NEWSOURCE, src_stats->source, type, NULL);
             visible = 1;
         }
         else
         {
-            stats_listener_send (src_stats->flags, "DELETE %s\n", src_stats->source);
+            stats_listener_send (src_stats->flags, STATS_OP_DELSOURCE, src_stats->source, NULL, NULL);
             src_stats->flags |= STATS_HIDDEN;
         }
         while (node)
@@ -608,7 +1081,7 @@ static void process_source_stat (stats_source_t *src_stats, stats_event_t *event
             if (visible)
             {
                 stats->flags &= ~STATS_HIDDEN;
-                stats_listener_send (stats->flags, "EVENT %s %s %s\n", src_stats->source, stats->name, stats->value);
+                stats_listener_send (stats->flags, STATS_OP_EVENT, src_stats->source, stats->name, stats->value);
             }
             else
                 stats->flags |= STATS_HIDDEN;
@@ -635,7 +1108,7 @@ static void process_source_event (stats_event_t *event)
         if (snode == NULL)
             abort();
         DEBUG1 ("new source stat %s", event->source);
-        snode->source = (char *)strdup(event->source);
+        snode->source = stats_intern (event->source);
         snode->stats_tree = avl_tree_new(_compare_stats, NULL);
         snode->flags = STATS_SLAVE|STATS_GENERAL|STATS_HIDDEN;
 
@@ -764,28 +1237,210 @@ static void clear_stats_queue (client_t *client)
 }
 
 
-static void stats_listener_send (int mask, const char *fmt, ...)
+static void stats_listener_send (int mask, int op, const char *source, const char *name, const char *value)
 {
-    va_list ap;
-    event_listener_t *listener;
+    refbuf_t *block;
+    unsigned int slen, nlen, vlen;
+    char *p;
 
-    va_start(ap, fmt);
+    /* the common case of no stats clients costs a relaxed load, the record is
+     * only packed and queued when someone is listening */
+    if (__atomic_load_n (&event_listener_count, __ATOMIC_RELAXED) == 0)
+        return;
+    if (source == NULL) source = "";
+    if (name == NULL)   name = "";
+    if (value == NULL)  value = "";
+    slen = strlen (source);
+    nlen = strlen (name);
+    vlen = strlen (value);
+    block = refbuf_new (1 + slen + 1 + nlen + 1 + vlen + 1);
+    p = block->data;
+    *p++ = op;
+    memcpy (p, source, slen + 1);   p += slen + 1;
+    memcpy (p, name, nlen + 1);     p += nlen + 1;
+    memcpy (p, value, vlen + 1);
+    event_ring_push (block, mask);
+}
 
-    thread_mutex_lock (&_stats.listeners_lock);
-    listener = _stats.event_listeners;
 
-    while (listener)
+/* the text protocol lines as the stats clients have always seen them */
+static unsigned int stats_entry_text (int op, const char *source, const char *name,
+        const char *value, char *out, unsigned int remain)
+{
+    int len = 0;
+
+    switch (op)
+    {
+        case STATS_OP_EVENT:
+            len = snprintf (out, remain, "EVENT %s %s %s\n", source [0] ? source : "global", name, value);
+            break;
+        case STATS_OP_DELSTAT:
+            len = snprintf (out, remain, "DELETE %s %s\n", source [0] ? source : "global", name);
+            break;
+        case STATS_OP_DELSOURCE:
+            len = snprintf (out, remain, "DELETE %s\n", source);
+            break;
+        case STATS_OP_NEWSOURCE:
+            len = snprintf (out, remain, "NEW %s %s\n", name, source);
+            break;
+        case STATS_OP_FLUSH:
+            len = snprintf (out, remain, "FLUSH %s\n", source);
+            break;
+        case STATS_OP_INFO:
+            len = snprintf (out, remain, "INFO %s\n", value);
+            break;
+    }
+    return (len < 0 || len >= (int)remain) ? 0 : len;
+}
+
+
+static unsigned int bin_varint (unsigned char *out, uint64_t v)
+{
+    unsigned int n = 0;
+
+    while (v > 0x7f)
     {
-        int admuser = listener->mask & STATS_HIDDEN,
-            hidden = mask & STATS_HIDDEN,
-            flags = mask & ~STATS_HIDDEN;
+        out [n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    out [n++] = v;
+    return n;
+}
 
-        if (admuser || (hidden == 0 && (flags & listener->mask)))
-            _add_stats_to_stats_client (listener->client, fmt, ap);
-        listener = listener->next;
+
+/* binary delta record. one tag byte (low bits the op, 0x40 set when the
+ * value is numeric), then source and name as varint length prefixed
+ * strings, then the value as a zigzag varint or another prefixed string.
+ * counter updates, the bulk of the feed, come to a few bytes each
+ */
+static unsigned int stats_entry_bin (int op, const char *source, const char *name,
+        const char *value, unsigned char *out)
+{
+    unsigned int slen = strlen (source), nlen = strlen (name), vlen = strlen (value);
+    unsigned int len = 1;
+    char *end;
+    int64_t num = strtoll (value, &end, 10);
+
+    out [0] = op;
+    len += bin_varint (out + len, slen);
+    memcpy (out + len, source, slen);
+    len += slen;
+    len += bin_varint (out + len, nlen);
+    memcpy (out + len, name, nlen);
+    len += nlen;
+    if (vlen && *end == '\0' && end != value)
+    {
+        out [0] |= 0x40;
+        len += bin_varint (out + len, ((uint64_t)num << 1) ^ (num >> 63));
     }
-    thread_mutex_unlock (&_stats.listeners_lock);
-    va_end(ap);
+    else
+    {
+        len += bin_varint (out + len, vlen);
+        memcpy (out + len, value, vlen);
+        len += vlen;
+    }
+    return len;
+}
+
+
+static int stats_line_matches (int line_mask, int listener_mask)
+{
+    int admuser = listener_mask & STATS_HIDDEN,
+        hidden = line_mask & STATS_HIDDEN,
+        flags = line_mask & ~STATS_HIDDEN;
+
+    return admuser || (hidden == 0 && (flags & listener_mask));
+}
+
+
+/* drain the pending stat lines to the registered stats clients. one delta
+ * block is serialized per interval for each distinct listener mask, so the
+ * formatting and assembly cost no longer scales with the listener count,
+ * agents sharing a mask get the same assembled buffer
+ */
+#define EVENT_MASK_GROUPS   8
+
+static void stats_event_ring_flush (void)
+{
+    struct { refbuf_t *block; int mask; } pending [EVENT_RING_SIZE];
+    struct { refbuf_t *delta; int mask; int binary; } group [EVENT_MASK_GROUPS];
+    unsigned int count = 0, groups = 0, i, g;
+    uint64_t dropped;
+    event_listener_t *listener;
+
+    while (count < EVENT_RING_SIZE &&
+            (pending [count].block = event_ring_pop (&pending [count].mask)))
+        count++;
+    if (count)
+    {
+        thread_mutex_lock (&_stats.listeners_lock);
+        for (listener = _stats.event_listeners; listener; listener = listener->next)
+        {
+            unsigned int len = 0;
+            refbuf_t *delta = NULL;
+
+            for (g = 0; g < groups; g++)
+                if (group [g].mask == listener->mask && group [g].binary == listener->binary)
+                    break;
+            if (g < groups)
+                delta = group [g].delta;
+            else
+            {
+                /* first listener with this mask and encoding, serialize its
+                 * delta. the packed record length plus a little slack bounds
+                 * either output form */
+                for (i = 0; i < count; i++)
+                    if (stats_line_matches (pending [i].mask, listener->mask))
+                        len += pending [i].block->len + 16;
+                if (len)
+                {
+                    delta = refbuf_new (len);
+                    for (i = 0, len = 0; i < count; i++)
+                    {
+                        const char *source, *name, *value;
+
+                        if (stats_line_matches (pending [i].mask, listener->mask) == 0)
+                            continue;
+                        source = pending [i].block->data + 1;
+                        name = source + strlen (source) + 1;
+                        value = name + strlen (name) + 1;
+                        if (listener->binary)
+                            len += stats_entry_bin (pending [i].block->data [0], source, name,
+                                    value, (unsigned char *)delta->data + len);
+                        else
+                            len += stats_entry_text (pending [i].block->data [0], source, name,
+                                    value, delta->data + len, delta->len - len);
+                    }
+                    delta->len = len;
+                }
+                if (groups < EVENT_MASK_GROUPS)
+                {
+                    group [groups].mask = listener->mask;
+                    group [groups].binary = listener->binary;
+                    group [groups].delta = delta;
+                    groups++;
+                }
+                else if (delta)
+                {
+                    /* group table full, apply and drop rather than cache */
+                    _add_string_to_stats_client (listener->client, delta->data, delta->len);
+                    refbuf_release (delta);
+                    continue;
+                }
+            }
+            if (delta)
+                _add_string_to_stats_client (listener->client, delta->data, delta->len);
+        }
+        thread_mutex_unlock (&_stats.listeners_lock);
+        for (g = 0; g < groups; g++)
+            refbuf_release (group [g].delta);
+        for (i = 0; i < count; i++)
+            refbuf_release (pending [i].block);
+        stats_clients_wakeup ();
+    }
+    dropped = __atomic_exchange_n (&event_ring_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped)
+        INFO1 ("dropped %" PRIu64 " stat updates to the event listeners", dropped);
 }
 
 
@@ -797,6 +1452,7 @@ void stats_global (ice_config_t *config)
     stats_event (NULL, "location", config->location);
     stats_event (NULL, "admin", config->admin);
     global.max_rate = config->max_bandwidth;
+    bw_bucket_set (&global.bw_out, config->max_bandwidth, timing_get_time ());
     throttle_sends = 0;
 }
 
@@ -868,7 +1524,7 @@ static void _add_node_to_stats_client (client_t *client, refbuf_t *refbuf)
 }
 
 
-static void _add_stats_to_stats_client (client_t *client, const char *fmt, va_list ap)
+static void _add_string_to_stats_client (client_t *client, const char *buf, unsigned int len)
 {
     event_listener_t *listener = client->shared_data;
     refbuf_t *r = listener->recent_block;
@@ -882,53 +1538,136 @@ static void _add_stats_to_stats_client (client_t *client, const char *fmt, va_li
         client->connection.error = 1;
         return;
     }
-    do
+    /* lets see if we can append to an existing block */
+    if (r && (r->flags & STATS_BLOCK_CONNECTION) == 0 && r->len + len <= r->alloc_len)
     {
-        if (r && (r->flags & STATS_BLOCK_CONNECTION) == 0)
-        {
-            /* lets see if we can append to an existing block */
-            if (r->len < 4000)
-            {
-                int written = _append_to_bufferv (r, 4096, fmt, ap);
-                if (written > 0)
-                {
-                    listener->content_len += written;
-                    break;
-                }
-            }
-        }
-        r = refbuf_new (4096);
-        r->len = 0;
-        if (_append_to_bufferv (r, 4096, fmt, ap) < 0)
-        {
-            WARN1 ("stat details are too large \"%s\"", fmt);
-            refbuf_release (r);
-            return;
-        }
-        _add_node_to_stats_client (client, r);
-    } while (0);
+        memcpy (r->data + r->len, buf, len);
+        r->len += len;
+        listener->content_len += len;
+        return;
+    }
+    r = refbuf_new (len < 4096 ? 4096 : len);
+    memcpy (r->data, buf, len);
+    r->len = len;
+    _add_node_to_stats_client (client, r);
 }
 
 
-static xmlNodePtr _dump_stats_to_doc (xmlNodePtr root, const char *show_mount, int flags)
-{
-    avl_node *avlnode;
-    xmlNodePtr ret = NULL;
+/* grow-only serialization buffer for the json status output, kept per thread
+ * so frequent pollers reuse the allocation instead of rebuilding a DOM
+ */
+static __thread char *json_buf;
+static __thread unsigned int json_alloc;
 
-    /* general stats first */
-    avl_tree_rlock (_stats.global_tree);
-    avlnode = avl_get_first(_stats.global_tree);
-    while (avlnode)
+static int json_reserve (unsigned int len, unsigned int need)
+{
+    if (len + need <= json_alloc)
+        return 0;
+    do
     {
-        stats_node_t *stat = avlnode->key;
-        if (stat->flags & flags)
-            xmlNewTextChild (root, NULL, XMLSTR(stat->name), XMLSTR(stat->value));
-        avlnode = avl_get_next (avlnode);
+        unsigned int alloc = json_alloc ? json_alloc << 1 : 16384;
+        char *p = realloc (json_buf, alloc);
+        if (p == NULL)
+            return -1;
+        json_buf = p;
+        json_alloc = alloc;
+    } while (len + need > json_alloc);
+    return 0;
+}
+
+
+static unsigned int json_add (unsigned int len, const char *str, unsigned int slen)
+{
+    if (json_reserve (len, slen) < 0)
+        return len;
+    memcpy (json_buf + len, str, slen);
+    return len + slen;
+}
+
+
+/* append str as a json string, escaping the few characters that need it */
+static unsigned int json_add_string (unsigned int len, const char *str)
+{
+    len = json_add (len, "\"", 1);
+    while (*str)
+    {
+        const char *p = str;
+        char esc [8];
+
+        while (*p && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20)
+            p++;
+        len = json_add (len, str, p - str);
+        if (*p == '\0')
+            break;
+        if (*p == '"' || *p == '\\')
+            len = json_add (len, *p == '"' ? "\\\"" : "\\\\", 2);
+        else
+            len = json_add (len, esc, snprintf (esc, sizeof esc, "\\u%04x", *p & 0xFF));
+        str = p + 1;
     }
-    avl_tree_unlock (_stats.global_tree);
-    /* now per mount stats */
+    return json_add (len, "\"", 1);
+}
+
+
+/* numbers go through plain, anything else as an escaped string */
+static unsigned int json_add_value (unsigned int len, const char *value)
+{
+    char *end;
+
+    if (value == NULL || value [0] == '\0')
+        return json_add (len, "\"\"", 2);
+    strtoll (value, &end, 10);
+    if (*end == '\0' && end != value && (value [0] != '0' || value [1] == '\0'))
+        return json_add (len, value, strlen (value));
+    return json_add_string (len, value);
+}
+
+
+struct global_json_args
+{
+    unsigned int len;
+    int flags;
+    int first;
+};
+
+static int stats_json_global (void *key, void *arg)
+{
+    struct global_json_args *j = arg;
+    stats_node_t *stat = key;
+
+    if (stat->flags & j->flags)
+    {
+        if (j->first == 0)
+            j->len = json_add (j->len, ",", 1);
+        j->first = 0;
+        j->len = json_add_string (j->len, stat->name);
+        j->len = json_add (j->len, ":", 1);
+        j->len = json_add_value (j->len, stat->value);
+    }
+    return 0;
+}
+
+
+/* walk the stats trees straight into a json response, no xml doc and no
+ * transform, for the frequently polled status case
+ */
+int stats_send_json (client_t *client, int flags, const char *show_mount)
+{
+    unsigned int len = 0, hdr_len;
+    int first;
+    avl_node *avlnode;
+    refbuf_t *body;
+
+    len = json_add (len, "{\"icestats\":{", 13);
+    struct global_json_args jargs = { len, flags, 1 };
+    avl_rmap_iterate (_stats.global_map, stats_json_global, &jargs);
+    len = jargs.len;
+    first = jargs.first;
+
+    len = json_add (len, first ? "\"sources\":{" : ",\"sources\":{", first ? 11 : 12);
+    first = 1;
     avl_tree_rlock (_stats.source_tree);
-    avlnode = avl_get_first(_stats.source_tree);
+    avlnode = avl_get_first (_stats.source_tree);
     while (avlnode)
     {
         stats_source_t *source = (stats_source_t *)avlnode->key;
@@ -936,31 +1675,286 @@ static xmlNodePtr _dump_stats_to_doc (xmlNodePtr root, const char *show_mount, i
                 (show_mount == NULL || strcmp (show_mount, source->source) == 0))
         {
             avl_node *avlnode2;
-            xmlNodePtr xmlnode = xmlNewTextChild (root, NULL, XMLSTR("source"), NULL);
+            int sfirst = 1;
+
+            if (first == 0)
+                len = json_add (len, ",", 1);
+            first = 0;
+            len = json_add_string (len, source->source);
+            len = json_add (len, ":{", 2);
             avl_tree_rlock (source->stats_tree);
             avlnode2 = avl_get_first (source->stats_tree);
-
-            xmlSetProp (xmlnode, XMLSTR("mount"), XMLSTR(source->source));
-            if (ret == NULL)
-                ret = xmlnode;
             while (avlnode2)
             {
                 stats_node_t *stat = avlnode2->key;
                 if ((flags&STATS_HIDDEN) || (stat->flags&STATS_HIDDEN) == (flags&STATS_HIDDEN))
-                    xmlNewTextChild (xmlnode, NULL, XMLSTR(stat->name), XMLSTR(stat->value));
+                {
+                    if (sfirst == 0)
+                        len = json_add (len, ",", 1);
+                    sfirst = 0;
+                    len = json_add_string (len, stat->name);
+                    len = json_add (len, ":", 1);
+                    len = json_add_value (len, stat->value);
+                }
                 avlnode2 = avl_get_next (avlnode2);
             }
             avl_tree_unlock (source->stats_tree);
+            len = json_add (len, "}", 1);
         }
         avlnode = avl_get_next (avlnode);
     }
     avl_tree_unlock (_stats.source_tree);
-    return ret;
+    len = json_add (len, "}}}", 3);
+
+    if (json_buf == NULL || len + 1 > json_alloc)
+        return client_send_400 (client, "stats too large");
+
+    body = refbuf_new (len);
+    memcpy (body->data, json_buf, len);
+    body->flags |= WRITE_BLOCK_GENERIC;
+
+    client_set_queue (client, NULL);
+    client->refbuf = refbuf_new (256);
+    hdr_len = snprintf (client->refbuf->data, 256,
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: application/json\r\n"
+            "Content-Length: %u\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Access-Control-Allow-Origin: *\r\n\r\n", len);
+    client->refbuf->len = hdr_len;
+    client->refbuf->flags |= WRITE_BLOCK_GENERIC;
+    client->refbuf->next = body;
+    client->respcode = 200;
+    return fserve_setup_client (client);
+}
+
+
+/* append a metric name, mapping anything prometheus does not allow to _ */
+static unsigned int prom_add_name (unsigned int len, const char *str)
+{
+    for (; *str; str++)
+    {
+        char c = *str;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                (c >= '0' && c <= '9') || c == '_' || c == ':')
+            len = json_add (len, &c, 1);
+        else
+            len = json_add (len, "_", 1);
+    }
+    return len;
+}
+
+
+/* append a label value, escaping per the exposition format */
+static unsigned int prom_add_label (unsigned int len, const char *str)
+{
+    while (*str)
+    {
+        const char *p = str;
+        while (*p && *p != '"' && *p != '\\' && *p != '\n')
+            p++;
+        len = json_add (len, str, p - str);
+        if (*p == '\0')
+            break;
+        len = json_add (len, *p == '\n' ? "\\n" : (*p == '"' ? "\\\"" : "\\\\"), 2);
+        str = p + 1;
+    }
+    return len;
+}
+
+
+static int prom_numeric (const char *value)
+{
+    char *end;
+
+    if (value == NULL || value [0] == '\0')
+        return 0;
+    strtoll (value, &end, 10);
+    return (*end == '\0' && end != value);
+}
+
+
+static int stats_prom_global (void *key, void *arg)
+{
+    unsigned int *len = arg;
+    stats_node_t *stat = key;
+
+    if (prom_numeric (stat->value))
+    {
+        *len = json_add (*len, "icecast_", 8);
+        *len = prom_add_name (*len, stat->name);
+        *len = json_add (*len, " ", 1);
+        *len = json_add (*len, stat->value, strlen (stat->value));
+        *len = json_add (*len, "\n", 1);
+    }
+    return 0;
+}
+
+
+/* render the stats trees and histograms in prometheus text format. the per
+ * thread scratch buffer from the json path is reused, so a steady state
+ * scrape allocates nothing beyond the response blocks themselves
+ */
+int stats_send_prometheus (client_t *client)
+{
+    unsigned int len = 0, hdr_len;
+    avl_node *avlnode;
+    refbuf_t *body;
+    char line [100];
+    int id;
+
+    avl_rmap_iterate (_stats.global_map, stats_prom_global, &len);
+
+    avl_tree_rlock (_stats.source_tree);
+    avlnode = avl_get_first (_stats.source_tree);
+    while (avlnode)
+    {
+        stats_source_t *source = (stats_source_t *)avlnode->key;
+        avl_node *avlnode2;
+
+        avl_tree_rlock (source->stats_tree);
+        avlnode2 = avl_get_first (source->stats_tree);
+        while (avlnode2)
+        {
+            stats_node_t *stat = avlnode2->key;
+            if (prom_numeric (stat->value))
+            {
+                len = json_add (len, "icecast_source_", 15);
+                len = prom_add_name (len, stat->name);
+                len = json_add (len, "{mount=\"", 8);
+                len = prom_add_label (len, source->source);
+                len = json_add (len, "\"} ", 3);
+                len = json_add (len, stat->value, strlen (stat->value));
+                len = json_add (len, "\n", 1);
+            }
+            avlnode2 = avl_get_next (avlnode2);
+        }
+        avl_tree_unlock (source->stats_tree);
+        avlnode = avl_get_next (avlnode);
+    }
+    avl_tree_unlock (_stats.source_tree);
+
+    for (id = 0; id < STATS_HIST_MAX; id++)
+    {
+        struct stats_hist *h = &histograms [id];
+        uint64_t running = 0, sum = __atomic_load_n (&h->sum, __ATOMIC_RELAXED);
+
+        for (int i = 0; i < HIST_BUCKETS; i++)
+        {
+            running += __atomic_load_n (&h->cum [i], __ATOMIC_RELAXED);
+            len = json_add (len, "icecast_", 8);
+            len = json_add (len, h->name, strlen (h->name));
+            if (i < HIST_BUCKETS - 1)
+                len = json_add (len, line, snprintf (line, sizeof line,
+                            "_bucket{le=\"%lu\"} %" PRIu64 "\n",
+                            (h->unit << i) - 1, running));
+            else
+                len = json_add (len, line, snprintf (line, sizeof line,
+                            "_bucket{le=\"+Inf\"} %" PRIu64 "\n", running));
+        }
+        len = json_add (len, "icecast_", 8);
+        len = json_add (len, h->name, strlen (h->name));
+        len = json_add (len, line, snprintf (line, sizeof line,
+                    "_sum %" PRIu64 "\n", sum));
+        len = json_add (len, "icecast_", 8);
+        len = json_add (len, h->name, strlen (h->name));
+        len = json_add (len, line, snprintf (line, sizeof line,
+                    "_count %" PRIu64 "\n", running));
+    }
+
+    if (json_buf == NULL || len + 1 > json_alloc)
+        return client_send_400 (client, "stats too large");
+
+    body = refbuf_new (len);
+    memcpy (body->data, json_buf, len);
+    body->flags |= WRITE_BLOCK_GENERIC;
+
+    client_set_queue (client, NULL);
+    client->refbuf = refbuf_new (256);
+    hdr_len = snprintf (client->refbuf->data, 256,
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %u\r\n"
+            "Cache-Control: no-cache\r\n\r\n", len);
+    client->refbuf->len = hdr_len;
+    client->refbuf->flags |= WRITE_BLOCK_GENERIC;
+    client->refbuf->next = body;
+    client->respcode = 200;
+    return fserve_setup_client (client);
+}
+
+
+/* concatenate the cached fragments matching the filter, refreshing any that
+ * have gone stale since the last request */
+static void _dump_stats_to_buffer (struct stats_buf *b, const char *show_mount, int flags)
+{
+    avl_node *avlnode;
+    int cls = (flags & STATS_HIDDEN) ? FRAG_ALL : FRAG_PUBLIC;
+
+    sbuf_add (b, "<icestats>", 10);
+    /* general stats first */
+    if (flags & STATS_PUBLIC)
+    {
+        thread_mutex_lock (&global_write_lock);
+        if (global_frag [cls] == NULL || (global_frag_stale & (1 << cls)))
+            global_frag_rebuild (cls);
+        sbuf_add (b, global_frag [cls], global_frag_len [cls]);
+        thread_mutex_unlock (&global_write_lock);
+    }
+    /* now per mount stats */
+    avl_tree_rlock (_stats.source_tree);
+    avlnode = avl_get_first(_stats.source_tree);
+    while (avlnode)
+    {
+        stats_source_t *source = (stats_source_t *)avlnode->key;
+        if (((flags&STATS_HIDDEN) || (source->flags&STATS_HIDDEN) == (flags&STATS_HIDDEN)) &&
+                (show_mount == NULL || strcmp (show_mount, source->source) == 0))
+        {
+            avl_tree_wlock (source->stats_tree);
+            if (source->frag [cls] == NULL || (source->frag_stale & (1 << cls)))
+                source_frag_rebuild (source, cls);
+            sbuf_add (b, source->frag [cls], source->frag_len [cls]);
+            avl_tree_unlock (source->stats_tree);
+        }
+        avlnode = avl_get_next (avlnode);
+    }
+    avl_tree_unlock (_stats.source_tree);
+    sbuf_add (b, "</icestats>", 11);
+}
+
+
+struct listener_init_args
+{
+    refbuf_t *refbuf;
+    refbuf_t **full_p;
+    refbuf_t *last;
+    size_t size;
+    size_t len;
+    int mask;
+};
+
+static int listener_init_global (void *key, void *arg)
+{
+    struct listener_init_args *d = arg;
+    stats_node_t *stat = key;
+
+    if (stat->flags & d->mask)
+    {
+        while (_append_to_buffer (d->refbuf, d->size, "EVENT global %s %s\n", stat->name, stat->value) < 0)
+        {
+            *d->full_p = d->last = d->refbuf;
+            d->full_p = &d->refbuf->next;
+            d->len += d->refbuf->len;
+            d->refbuf = refbuf_new (d->size);
+            d->refbuf->len = 0;
+        }
+    }
+    return 0;
 }
 
 
 /* factoring out code for stats loops
- * this function copies all stats to queue, and registers 
+ * this function copies all stats to queue, and registers
  */
 static void _register_listener (client_t *client)
 {
@@ -980,6 +1974,7 @@ static void _register_listener (client_t *client)
     thread_mutex_lock (&_stats.listeners_lock);
     listener->next = _stats.event_listeners;
     _stats.event_listeners = listener;
+    __atomic_fetch_add (&event_listener_count, 1, __ATOMIC_RELAXED);
     thread_mutex_unlock (&_stats.listeners_lock);
 
     /* first we fill our initial queue with the headers */
@@ -989,26 +1984,12 @@ static void _register_listener (client_t *client)
     _append_to_buffer (refbuf, size, "HTTP/1.0 200 OK\r\nCapability: streamlist stats\r\n\r\n");
 
     /* now the global stats */
-    avl_tree_rlock (_stats.global_tree);
-    node = avl_get_first(_stats.global_tree);
-    while (node)
-    {
-        stats_node_t *stat = node->key;
-
-        if (stat->flags & listener->mask)
-        {
-            while (_append_to_buffer (refbuf, size, "EVENT global %s %s\n", stat->name, stat->value) < 0)
-            {
-                *full_p = last = refbuf;
-                full_p = &refbuf->next;
-                len += refbuf->len;
-                refbuf = refbuf_new (size);
-                refbuf->len = 0;
-            }
-        }
-        node = avl_get_next(node);
-    }
-    avl_tree_unlock (_stats.global_tree);
+    struct listener_init_args gdump = { refbuf, full_p, last, size, len, listener->mask };
+    avl_rmap_iterate (_stats.global_map, listener_init_global, &gdump);
+    refbuf = gdump.refbuf;
+    full_p = gdump.full_p;
+    last = gdump.last;
+    len = gdump.len;
     /* now the stats for each source */
     avl_tree_rlock (_stats.source_tree);
     node = avl_get_first(_stats.source_tree);
@@ -1112,6 +2093,158 @@ static void _register_listener (client_t *client)
 }
 
 
+struct bin_dump
+{
+    refbuf_t *head, **tailp, *cur;
+    size_t total;
+};
+
+static void bin_dump_emit (struct bin_dump *d, int op, const char *source,
+        const char *name, const char *value)
+{
+    unsigned char rec [8192];
+    unsigned int len;
+
+    if (source == NULL) source = "";
+    if (name == NULL)   name = "";
+    if (value == NULL)  value = "";
+    if (strlen (source) + strlen (name) + strlen (value) + 32 > sizeof rec)
+        return;     // mirrors the text dump dropping oversized lines
+    len = stats_entry_bin (op, source, name, value, rec);
+    if (d->cur && d->cur->len + len > d->cur->alloc_len)
+    {
+        *d->tailp = d->cur;
+        d->tailp = &d->cur->next;
+        d->total += d->cur->len;
+        d->cur = NULL;
+    }
+    if (d->cur == NULL)
+    {
+        d->cur = refbuf_new (8192);
+        d->cur->len = 0;
+    }
+    memcpy (d->cur->data + d->cur->len, rec, len);
+    d->cur->len += len;
+}
+
+
+struct bin_global_args
+{
+    struct bin_dump *d;
+    int mask;
+};
+
+static int bin_dump_global (void *key, void *arg)
+{
+    struct bin_global_args *b = arg;
+    stats_node_t *stat = key;
+
+    if (stat->flags & b->mask)
+        bin_dump_emit (b->d, STATS_OP_EVENT, NULL, stat->name, stat->value);
+    return 0;
+}
+
+
+/* binary form of the initial registration dump, same record encoding and the
+ * same ordering as the text one so a subscriber sees a full snapshot then
+ * deltas
+ */
+static void _register_listener_bin (client_t *client)
+{
+    event_listener_t *listener = client->shared_data;
+    avl_node *node;
+    worker_t *worker = client->worker;
+    stats_event_t stats_count;
+    struct bin_dump d = { .head = NULL };
+    refbuf_t *last;
+    char buffer[20];
+
+    build_event (&stats_count, NULL, "stats_connections", buffer);
+    stats_count.action = STATS_EVENT_INC;
+    process_event (&stats_count);
+
+    /* we register to receive future events, sources could come in after these initial stats */
+    thread_mutex_lock (&_stats.listeners_lock);
+    listener->next = _stats.event_listeners;
+    _stats.event_listeners = listener;
+    __atomic_fetch_add (&event_listener_count, 1, __ATOMIC_RELAXED);
+    thread_mutex_unlock (&_stats.listeners_lock);
+
+    d.tailp = &d.head;
+    d.cur = refbuf_new (8192);
+    d.cur->len = 0;
+    _append_to_buffer (d.cur, 8192, "HTTP/1.0 200 OK\r\nCapability: streamlist stats binary\r\n\r\n");
+
+    struct bin_global_args bargs = { &d, listener->mask };
+    avl_rmap_iterate (_stats.global_map, bin_dump_global, &bargs);
+
+    avl_tree_rlock (_stats.source_tree);
+    node = avl_get_first (_stats.source_tree);
+    while (node)
+    {
+        stats_source_t *snode = (stats_source_t *)node->key;
+
+        if (snode->flags & listener->mask)
+        {
+            stats_node_t *ct = _find_node (snode->stats_tree, "server_type");
+            bin_dump_emit (&d, STATS_OP_NEWSOURCE, snode->source, ct ? ct->value : "audio/mpeg", NULL);
+        }
+        node = avl_get_next (node);
+    }
+    bin_dump_emit (&d, STATS_OP_INFO, NULL, NULL, "full list end");
+    node = avl_get_first (_stats.source_tree);
+    while (node)
+    {
+        stats_source_t *snode = (stats_source_t *)node->key;
+
+        if (snode->flags & listener->mask)
+        {
+            stats_node_t *metadata_stat = NULL;
+            avl_node *node2;
+
+            avl_tree_rlock (snode->stats_tree);
+            node2 = avl_get_first (snode->stats_tree);
+            while (node2)
+            {
+                stats_node_t *stat = node2->key;
+                if (stat->flags & listener->mask)
+                {
+                    if (strcmp (stat->name, "metadata_updated") == 0)
+                        metadata_stat = stat;
+                    else
+                        bin_dump_emit (&d, STATS_OP_EVENT, snode->source, stat->name, stat->value);
+                }
+                node2 = avl_get_next (node2);
+            }
+            if (metadata_stat)
+                bin_dump_emit (&d, STATS_OP_EVENT, snode->source, metadata_stat->name, metadata_stat->value);
+            avl_tree_unlock (snode->stats_tree);
+        }
+        node = avl_get_next (node);
+    }
+    avl_tree_unlock (_stats.source_tree);
+
+    *d.tailp = last = d.cur;
+    d.tailp = &d.cur->next;
+    d.total += d.cur->len;
+
+    /* before we make the client active (for sending queued data), we need to prepend the stats
+     * we have just built onto any stats that may of come in */
+    thread_mutex_lock (&_stats.listeners_lock);
+    *d.tailp = client->refbuf;
+    client->refbuf = d.head;
+    listener->content_len += d.total;
+    while (last->next)
+        last = last->next;
+    listener->recent_block = last;
+    thread_mutex_unlock (&_stats.listeners_lock);
+
+    client->schedule_ms = 0;
+    client->flags |= CLIENT_ACTIVE;
+    worker_wakeup (worker);
+}
+
+
 static void stats_client_release (client_t *client)
 {
     event_listener_t *listener = client->shared_data, *match, **trail;
@@ -1130,9 +2263,12 @@ static void stats_client_release (client_t *client)
         match = *trail;
     }
     if (match)
+    {
         *trail = match->next;
+        __atomic_fetch_sub (&event_listener_count, 1, __ATOMIC_RELAXED);
+    }
     else
-        WARN0 ("odd, no stats client details in collection"); 
+        WARN0 ("odd, no stats client details in collection");
     thread_mutex_unlock (&_stats.listeners_lock);
 
     clear_stats_queue (client);
@@ -1155,7 +2291,11 @@ struct _client_functions stats_client_send_ops =
 void stats_add_listener (client_t *client, int mask)
 {
     event_listener_t *listener = calloc (1, sizeof (event_listener_t));
+    const char *encoding = httpp_get_query_param (client->parser, "encoding");
+
     listener->mask = mask;
+    if (encoding && strcmp (encoding, "bin") == 0)
+        listener->binary = 1;
 
     client->respcode = 200;
     client->ops = &stats_client_send_ops;
@@ -1163,7 +2303,10 @@ void stats_add_listener (client_t *client, int mask)
     client_set_queue (client, NULL);
     listener->client = client;
 
-    _register_listener (client);
+    if (listener->binary)
+        _register_listener_bin (client);
+    else
+        _register_listener (client);
 }
 
 
@@ -1188,13 +2331,23 @@ int stats_transform_xslt (client_t *client, const char *uri)
 xmlDocPtr stats_get_xml (int flags, const char *show_mount)
 {
     xmlDocPtr doc;
-    xmlNodePtr node;
-
-    doc = xmlNewDoc (XMLSTR("1.0"));
-    node = xmlNewDocNode (doc, NULL, XMLSTR("icestats"), NULL);
-    xmlDocSetRootElement(doc, node);
+    xmlNodePtr node = NULL;
+    struct stats_buf b = { NULL, 0, 0 };
 
-    node = _dump_stats_to_doc (node, show_mount, flags);
+    _dump_stats_to_buffer (&b, show_mount, flags);
+    doc = xmlParseMemory (b.data, b.len);
+    free (b.data);
+    if (doc == NULL)
+    {
+        WARN0 ("problem parsing cached stats fragments");
+        doc = xmlNewDoc (XMLSTR("1.0"));
+        xmlDocSetRootElement (doc, xmlNewDocNode (doc, NULL, XMLSTR("icestats"), NULL));
+        return doc;
+    }
+    if (show_mount)
+        for (node = xmlDocGetRootElement (doc)->children; node; node = node->next)
+            if (node->type == XML_ELEMENT_NODE && xmlStrcmp (node->name, XMLSTR("source")) == 0)
+                break;
 
     if (show_mount && node)
     {
@@ -1231,6 +2384,8 @@ static int _compare_stats(void *arg, void *a, void *b)
     stats_node_t *nodea = (stats_node_t *)a;
     stats_node_t *nodeb = (stats_node_t *)b;
 
+    if (nodea->name == nodeb->name)   /* interned, equal means same pointer */
+        return 0;
     return strcmp(nodea->name, nodeb->name);
 }
 
@@ -1239,27 +2394,83 @@ static int _compare_source_stats(void *arg, void *a, void *b)
     stats_source_t *nodea = (stats_source_t *)a;
     stats_source_t *nodeb = (stats_source_t *)b;
 
+    if (nodea->source == nodeb->source)
+        return 0;
     return strcmp(nodea->source, nodeb->source);
 }
 
+static int _compare_intern (void *arg, void *a, void *b)
+{
+    return strcmp (((intern_entry_t *)a)->str, ((intern_entry_t *)b)->str);
+}
+
+static int _free_intern (void *key)
+{
+    free (key);   /* the characters are part of the entry allocation */
+    return 1;
+}
+
+
+/* return a pooled copy of str, creating one on first use. The caller owns a
+ * reference which stats_intern_release drops
+ */
+static char *stats_intern (const char *str)
+{
+    intern_entry_t match, *entry;
+    void *result;
+
+    match.str = (char *)str;
+    avl_tree_wlock (intern_pool);
+    if (avl_get_by_key (intern_pool, &match, &result) == 0)
+        entry = result;
+    else
+    {
+        entry = malloc (sizeof (*entry) + strlen (str) + 1);
+        entry->refs = 0;
+        entry->str = (char *)(entry + 1);
+        strcpy (entry->str, str);
+        avl_insert (intern_pool, entry);
+    }
+    entry->refs++;
+    avl_tree_unlock (intern_pool);
+    return entry->str;
+}
+
+
+static void stats_intern_release (char *str)
+{
+    if (str)
+    {
+        intern_entry_t *entry = ((intern_entry_t *)str) - 1;
+
+        avl_tree_wlock (intern_pool);
+        if (--entry->refs == 0)
+            avl_delete (intern_pool, entry, _free_intern);
+        avl_tree_unlock (intern_pool);
+    }
+}
+
+
 static int _free_stats(void *key)
 {
     stats_node_t *node = (stats_node_t *)key;
     free(node->value);
-    free(node->name);
+    stats_intern_release (node->name);
     free(node);
-    
+
     return 1;
 }
 
 static int _free_source_stats(void *key)
 {
     stats_source_t *node = (stats_source_t *)key;
-    stats_listener_send (node->flags, "DELETE %s\n", node->source);
+    stats_listener_send (node->flags, STATS_OP_DELSOURCE, node->source, NULL, NULL);
     DEBUG1 ("delete source node %s", node->source);
     avl_tree_unlock (node->stats_tree);
     avl_tree_free(node->stats_tree, _free_stats);
-    free(node->source);
+    for (int i = 0; i < FRAG_CLASSES; i++)
+        free (node->frag [i]);
+    stats_intern_release (node->source);
     free(node);
 
     return 1;
@@ -1323,6 +2534,169 @@ refbuf_t *stats_get_streams (int prepend)
 }
 
 
+static void streamlist_journal_add (uint64_t gen, char op, const char *mount)
+{
+    struct streamlist_event *ev = &streamlist.journal [streamlist.appended % STREAMLIST_JOURNAL_LEN];
+
+    if (ev->mount)
+    {
+        streamlist.gen_floor = ev->gen;
+        free (ev->mount);
+    }
+    ev->gen = gen;
+    ev->op = op;
+    ev->mount = strdup (mount);
+    streamlist.appended++;
+}
+
+
+/* rebuild the streamlist snapshot, journalling any differences from the
+ * previous one. The streamlist lock is expected to be held
+ */
+static void streamlist_refresh (void)
+{
+    avl_node *node;
+    unsigned int count = 0, alloc = streamlist.count + 16, i = 0, j = 0;
+    char **mounts = malloc (sizeof (char*) * alloc);
+    uint64_t gen = streamlist.gen + 1;
+    int changed = 0;
+
+    avl_tree_rlock (_stats.source_tree);
+    node = avl_get_first (_stats.source_tree);
+    while (node)
+    {
+        stats_source_t *source = (stats_source_t *)node->key;
+
+        if ((source->flags & STATS_HIDDEN) == 0)
+        {
+            if (count == alloc)
+            {
+                alloc <<= 1;
+                mounts = realloc (mounts, sizeof (char*) * alloc);
+            }
+            mounts [count++] = strdup (source->source);
+        }
+        node = avl_get_next (node);
+    }
+    avl_tree_unlock (_stats.source_tree);
+
+    /* both lists are in strcmp order so walk them together for the changes */
+    while (i < streamlist.count || j < count)
+    {
+        int cmp;
+
+        if (i == streamlist.count)
+            cmp = 1;
+        else if (j == count)
+            cmp = -1;
+        else
+            cmp = strcmp (streamlist.mounts [i], mounts [j]);
+        if (cmp < 0)
+        {
+            streamlist_journal_add (gen, 'R', streamlist.mounts [i]);
+            changed = 1;
+            i++;
+        }
+        else if (cmp > 0)
+        {
+            streamlist_journal_add (gen, 'A', mounts [j]);
+            changed = 1;
+            j++;
+        }
+        else
+        {
+            i++;
+            j++;
+        }
+    }
+    if (changed)
+        streamlist.gen = gen;
+    for (i = 0; i < streamlist.count; i++)
+        free (streamlist.mounts [i]);
+    free (streamlist.mounts);
+    streamlist.mounts = mounts;
+    streamlist.count = count;
+}
+
+
+/* current streamlist generation, refreshing the snapshot beforehand */
+uint64_t stats_streamlist_gen (void)
+{
+    uint64_t gen;
+
+    thread_mutex_lock (&streamlist.lock);
+    streamlist_refresh ();
+    gen = streamlist.gen;
+    thread_mutex_unlock (&streamlist.lock);
+    return gen;
+}
+
+
+/* return the streamlist changes since the stated generation as binary frames,
+ * an op byte then a 2 byte network order length then the mount, terminated
+ * with a 'Z' frame. NULL is returned if the journal no longer covers the
+ * stated generation, meaning the caller has to send the full list instead
+ */
+refbuf_t *stats_get_streams_delta (uint64_t have, uint64_t *gen)
+{
+    refbuf_t *start, *cur;
+    unsigned int remaining = STREAMLIST_BLKSIZE;
+    char *buffer;
+    uint64_t seq;
+
+    thread_mutex_lock (&streamlist.lock);
+    streamlist_refresh ();
+    *gen = streamlist.gen;
+    if (have > streamlist.gen || have < streamlist.gen_floor)
+    {
+        thread_mutex_unlock (&streamlist.lock);
+        return NULL;
+    }
+    start = cur = refbuf_new (STREAMLIST_BLKSIZE);
+    buffer = cur->data;
+    seq = streamlist.appended > STREAMLIST_JOURNAL_LEN ?
+        streamlist.appended - STREAMLIST_JOURNAL_LEN : 0;
+    for (; seq < streamlist.appended; seq++)
+    {
+        struct streamlist_event *ev = &streamlist.journal [seq % STREAMLIST_JOURNAL_LEN];
+        unsigned int len;
+
+        if (ev->gen <= have)
+            continue;
+        len = strlen (ev->mount);
+        if (remaining < len + 3)
+        {
+            cur->len = STREAMLIST_BLKSIZE - remaining;
+            cur->next = refbuf_new (STREAMLIST_BLKSIZE);
+            remaining = STREAMLIST_BLKSIZE;
+            cur = cur->next;
+            buffer = cur->data;
+        }
+        *buffer++ = ev->op;
+        *buffer++ = (len >> 8) & 0xFF;
+        *buffer++ = len & 0xFF;
+        memcpy (buffer, ev->mount, len);
+        buffer += len;
+        remaining -= len + 3;
+    }
+    if (remaining < 3)
+    {
+        cur->len = STREAMLIST_BLKSIZE - remaining;
+        cur->next = refbuf_new (STREAMLIST_BLKSIZE);
+        remaining = STREAMLIST_BLKSIZE;
+        cur = cur->next;
+        buffer = cur->data;
+    }
+    *buffer++ = 'Z';
+    *buffer++ = 0;
+    *buffer = 0;
+    remaining -= 3;
+    cur->len = STREAMLIST_BLKSIZE - remaining;
+    thread_mutex_unlock (&streamlist.lock);
+    return start;
+}
+
+
 
 /* because we can have stats entries for inactive mountpoints (when there is a fallback)
  * then these need to be left on, while others need to be removed
@@ -1359,14 +2733,129 @@ void stats_purge (time_t mark)
 }
 
 
+/* fold the sharded counter totals into the stats tree, only ones that have
+ * moved since the last pass generate an event
+ */
+static void counter_shards_publish (void)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < sizeof (sharded_counters) / sizeof (sharded_counters [0]); i++)
+    {
+        struct sharded_counter *c = &sharded_counters [i];
+        uint64_t total = 0;
+        char buf [VAL_BUFSIZE];
+        stats_event_t event;
+
+        for (j = 0; j < COUNTER_SHARDS; j++)
+            total += __atomic_load_n (&c->shard [j].count, __ATOMIC_RELAXED);
+        if (total == c->reported)
+            continue;
+        c->reported = total;
+        snprintf (buf, sizeof buf, "%" PRIu64, total);
+        build_event (&event, NULL, c->name, buf);
+        event.flags |= STATS_COUNTERS;
+        process_event (&event);
+    }
+}
+
+
+/* drop a sample into the named histogram, cheap enough for the send paths */
+void stats_hist_record (int id, unsigned long value)
+{
+    struct stats_hist *h = &histograms [id];
+    unsigned long v = value / h->unit;
+    unsigned int b = 0;
+
+    while (v && b < HIST_BUCKETS - 1)
+    {
+        v >>= 1;
+        b++;
+    }
+    __atomic_fetch_add (&h->bucket [b], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&h->sum, value, __ATOMIC_RELAXED);
+}
+
+
+/* index of the bucket holding the sample at the given percentile */
+static int hist_percentile (uint64_t *counts, uint64_t total, unsigned int pct)
+{
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS - 1; i++)
+    {
+        seen += counts [i];
+        if (seen * 100 >= total * pct)
+            break;
+    }
+    return i;
+}
+
+
+/* fold the last intervals samples into the stats tree, giving the bucket
+ * spread and the upper bound of the buckets holding the p50/p99 samples */
+static void stats_histograms_publish (void)
+{
+    int id, i, r;
+    char buf [256], name [64];
+
+    for (id = 0; id < STATS_HIST_MAX; id++)
+    {
+        struct stats_hist *h = &histograms [id];
+        uint64_t counts [HIST_BUCKETS], total = 0;
+
+        for (i = 0; i < HIST_BUCKETS; i++)
+        {
+            counts [i] = __atomic_exchange_n (&h->bucket [i], 0, __ATOMIC_RELAXED);
+            __atomic_fetch_add (&h->cum [i], counts [i], __ATOMIC_RELAXED);
+            total += counts [i];
+        }
+        if (total == 0)
+            continue;
+        for (i = 0, r = 0; i < HIST_BUCKETS; i++)
+            r += snprintf (buf + r, sizeof buf - r, "%s%" PRIu64, i ? "/" : "", counts [i]);
+        snprintf (name, sizeof name, "%s_hist", h->name);
+        stats_event_flags (NULL, name, buf, STATS_COUNTERS);
+        snprintf (name, sizeof name, "%s_p50", h->name);
+        snprintf (buf, sizeof buf, "%lu", h->unit << hist_percentile (counts, total, 50));
+        stats_event_flags (NULL, name, buf, STATS_COUNTERS);
+        snprintf (name, sizeof name, "%s_p99", h->name);
+        snprintf (buf, sizeof buf, "%lu", h->unit << hist_percentile (counts, total, 99));
+        stats_event_flags (NULL, name, buf, STATS_COUNTERS);
+    }
+}
+
+
+/* re-send the regularly reported globals that have gone quiet for a while,
+ * global_write_lock held so last_reported stays writer-private */
+static int global_calc_regular (void *key, void *arg)
+{
+    stats_node_t *node = key;
+    time_t now = *(time_t *)arg;
+
+    if (node->flags & STATS_REGULAR)
+    {
+        if (node->last_reported + 9 < now)
+        {
+            stats_listener_send (node->flags, STATS_OP_EVENT, NULL, node->name, node->value);
+            DEBUG2 ("update global %s (%s)", node->name, node->value);
+            node->last_reported = now;
+        }
+    }
+    return 0;
+}
+
+
 void stats_global_calc (time_t now)
 {
     stats_event_t clients, listeners;
-    avl_node *anode;
     char buf1 [VAL_BUFSIZE];
     char buf2 [VAL_BUFSIZE];
     char buf3 [VAL_BUFSIZE];
 
+    counter_shards_publish ();
+    stats_histograms_publish ();
     global_lock();
     connection_stats ();
 
@@ -1384,28 +2873,38 @@ void stats_global_calc (time_t now)
     listeners.flags |= STATS_COUNTERS;
     process_event (&listeners);
 
-    avl_tree_wlock (_stats.global_tree);
-    anode = avl_get_first(_stats.global_tree);
-    while (anode)
+    thread_mutex_lock (&global_write_lock);
+    avl_rmap_iterate (_stats.global_map, global_calc_regular, &now);
+    thread_mutex_unlock (&global_write_lock);
+
+    build_event (&clients, NULL, "outgoing_kbitrate", buf3);
+    clients.flags = STATS_COUNTERS|STATS_HIDDEN;
+    process_event (&clients);
+
+    snprintf (buf1, sizeof(buf1), "%" PRId64, source_stream_mem_used ());
+    build_event (&clients, NULL, "stream_memory_used", buf1);
+    clients.flags = STATS_COUNTERS;
+    process_event (&clients);
+
+    do
     {
-        stats_node_t *node = (stats_node_t *)anode->key;
+        spin_info_t info;
+        int i;
 
-        if (node->flags & STATS_REGULAR)
+        for (i = 0; thread_spin_info (i, &info) == 0; i++)
         {
-            if (node->last_reported + 9 < now)
-            {
-                stats_listener_send (node->flags, "EVENT global %s %s\n", node->name, node->value);
-                DEBUG2 ("update global %s (%s)", node->name, node->value);
-                node->last_reported = now;
-            }
+            char metric [64];
+
+            snprintf (metric, sizeof metric, "lock_%s_spins", info.name);
+            stats_event_args (NULL, metric, "%llu", info.spins);
+            snprintf (metric, sizeof metric, "lock_%s_waits", info.name);
+            stats_event_args (NULL, metric, "%llu", info.waits);
+            snprintf (metric, sizeof metric, "lock_%s_hold_ms", info.name);
+            stats_event_args (NULL, metric, "%llu", info.hold_ms);
         }
-        anode = avl_get_next (anode);
-    }
-    avl_tree_unlock (_stats.global_tree);
+    } while (0);
 
-    build_event (&clients, NULL, "outgoing_kbitrate", buf3);
-    clients.flags = STATS_COUNTERS|STATS_HIDDEN;
-    process_event (&clients);
+    stats_event_ring_flush ();
 }
 
 
@@ -1423,7 +2922,7 @@ stats_handle_t stats_handle (const char *mount)
         if (src_stats == NULL)
             abort();
         DEBUG1 ("new source stat %s", mount);
-        src_stats->source = (char *)strdup (mount);
+        src_stats->source = stats_intern (mount);
         src_stats->stats_tree = avl_tree_new (_compare_stats, NULL);
         src_stats->flags = STATS_SLAVE|STATS_GENERAL|STATS_HIDDEN;
 
@@ -1472,7 +2971,7 @@ void stats_flush (stats_handle_t handle)
             DEBUG2 ("Removing %s from %s", stats->name, src_stats->source);
             avl_delete (t, (void*)stats, _free_stats);
         }
-        stats_listener_send (src_stats->flags, "FLUSH %s\n", src_stats->source);
+        stats_listener_send (src_stats->flags, STATS_OP_FLUSH, src_stats->source, NULL, NULL);
         avl_tree_unlock (src_stats->stats_tree);
     }
 }
@@ -1599,7 +3098,21 @@ void stats_set_conv (stats_handle_t handle, const char *name, const char *value,
 {
     if (charset)
     {
-        xmlCharEncodingHandlerPtr encoding = xmlFindCharEncodingHandler (charset);
+        xmlCharEncodingHandlerPtr encoding;
+
+        /* the usual icy case, already the target charset so no need for the
+         * buffer shuffle below, just verify the sequences */
+        if (value && (strcasecmp (charset, "UTF-8") == 0 || strcasecmp (charset, "UTF8") == 0))
+        {
+            if (util_valid_utf8 (value))
+            {
+                stats_set_entity_decode (handle, name, value);
+                return;
+            }
+            WARN2 ("seen non-UTF8 data, probably incorrect charcter set (%s, %s)", name, value);
+            return;
+        }
+        encoding = xmlFindCharEncodingHandler (charset);
 
         if (encoding)
         {
@@ -1617,7 +3130,7 @@ void stats_set_conv (stats_handle_t handle, const char *name, const char *value,
         WARN1 ("No charset found for \"%s\"", charset);
         return;
     }
-    if (value && xmlCheckUTF8 ((unsigned char *)value) == 0)
+    if (value && util_valid_utf8 (value) == 0)
     {
         WARN2 ("seen non-UTF8 data, probably incorrect charcter set (%s, %s)", name, value);
         return;
@@ -1640,7 +3153,7 @@ void stats_listener_to_xml (client_t *listener, xmlNodePtr parent)
     xmlNewChild (node, NULL, XMLSTR("IP"), XMLSTR(listener->connection.ip));
 
     header = httpp_getvar (listener->parser, "user-agent");
-    if (header && xmlCheckUTF8((unsigned char *)header))
+    if (header && util_valid_utf8 (header))
     {
         xmlChar *str = xmlEncodeEntitiesReentrant (parent->doc, XMLSTR(header));
         xmlNewChild (node, NULL, XMLSTR("UserAgent"), str);
@@ -1648,7 +3161,7 @@ void stats_listener_to_xml (client_t *listener, xmlNodePtr parent)
     }
 
     header = httpp_getvar (listener->parser, "referer");
-    if (header && xmlCheckUTF8((unsigned char *)header))
+    if (header && util_valid_utf8 (header))
     {
         xmlChar *str = xmlEncodeEntitiesReentrant (parent->doc, XMLSTR(header));
         xmlNewChild (node, NULL, XMLSTR("Referer"), str);
@@ -29,6 +29,12 @@
 #define STATS_REGULAR   01000
 #define STATS_ALL      ~0
 
+/* histogram ids for stats_hist_record */
+#define STATS_HIST_TTFB 0
+#define STATS_HIST_AUTH 1
+#define STATS_HIST_LAG  2
+#define STATS_HIST_MAX  3
+
 typedef uintptr_t stats_handle_t;
 
 void stats_initialize(void);
@@ -37,6 +43,8 @@ void stats_shutdown(void);
 void stats_global(ice_config_t *config);
 void stats_get_streamlist (char *buffer, size_t remaining);
 refbuf_t *stats_get_streams (int prepend);
+refbuf_t *stats_get_streams_delta (uint64_t have, uint64_t *gen);
+uint64_t stats_streamlist_gen (void);
 void stats_purge (time_t mark);
 void stats_clients_wakeup (void);
 
@@ -50,6 +58,7 @@ void stats_event_sub(const char *source, const char *name, unsigned long value);
 void stats_event_dec(const char *source, const char *name);
 void stats_event_flags (const char *source, const char *name, const char *value, int flags);
 void stats_event_time (const char *mount, const char *name, int flags);
+void stats_hist_record (int id, unsigned long value);
 
 void *stats_connection(void *arg);
 void stats_add_listener (client_t *client, int hidden_level);
@@ -58,6 +67,8 @@ void stats_global_calc (time_t now);
 int  stats_transform_xslt(client_t *client, const char *uri);
 void stats_sendxml(client_t *client);
 xmlDocPtr stats_get_xml(int flags, const char *show_mount);
+int  stats_send_json (client_t *client, int flags, const char *show_mount);
+int  stats_send_prometheus (client_t *client);
 char *stats_get_value(const char *source, const char *name);
 
 stats_handle_t stats_handle (const char *mount);
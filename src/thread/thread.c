@@ -153,6 +153,7 @@ static void _mutex_unlock_c(mutex_t *mutex, const char *file, int line);
 static void *_start_routine(void *arg);
 static void _catch_signals(void);
 static void _block_signals(void);
+static void _pool_initialize(void);
 
 #define _mutex_lock(x)      _mutex_lock_c((x),__FILE__,__LINE__)
 #define _mutex_unlock(x)    _mutex_unlock_c((x),__FILE__,__LINE__)
@@ -204,6 +205,8 @@ void thread_initialize(void)
 
     _catch_signals();
 
+    _pool_initialize();
+
     lock_problem_abort = 0;
     dbg = getenv ("ICE_LOCK_ABORT");
     if (dbg)
@@ -221,6 +224,7 @@ void thread_use_log_id (int log_id)
 
 void thread_shutdown(void)
 {
+    thread_pool_shutdown();
     if (_initialized == 1) {
         thread_mutex_destroy(&_library_mutex);
         thread_mutex_destroy(&_threadtree_mutex);
@@ -919,6 +923,300 @@ static int _free_thread(void *key)
 }
 
 
+/* shared worker pool for blocking side-work. Callers hand over short-lived
+ * jobs (yp submissions, script runs, auth lookups) instead of spawning a
+ * detached thread each time; a few workers absorb the bursts and retire
+ * once the queues have been quiet for a while.
+ */
+
+#define POOL_MAX_THREADS        8
+#define POOL_IDLE_SECS          30
+
+typedef struct pool_task
+{
+    struct pool_task *next;
+    void *(*fn)(void *arg);
+    void *arg;
+} pool_task_t;
+
+static struct
+{
+    mutex_t lock;
+    cond_t wakeup;
+    pool_task_t *head [THREAD_POOL_LOW+1], **tail [THREAD_POOL_LOW+1];
+    int queued;
+    int threads;
+    int idle;
+    int running;
+} pool;
+
+
+static void _pool_initialize (void)
+{
+    int i;
+
+    thread_mutex_create (&pool.lock);
+    thread_cond_create (&pool.wakeup);
+    for (i = THREAD_POOL_HIGH; i <= THREAD_POOL_LOW; i++)
+        pool.tail [i] = &pool.head [i];
+    pool.running = 1;
+}
+
+
+static void *pool_thread (void *arg)
+{
+    thread_mutex_lock (&pool.lock);
+    while (1)
+    {
+        int i;
+        pool_task_t *task = NULL;
+        struct timespec deadline;
+
+        for (i = THREAD_POOL_HIGH; i <= THREAD_POOL_LOW; i++)
+        {
+            if (pool.head [i])
+            {
+                task = pool.head [i];
+                pool.head [i] = task->next;
+                if (pool.head [i] == NULL)
+                    pool.tail [i] = &pool.head [i];
+                pool.queued--;
+                break;
+            }
+        }
+        if (task)
+        {
+            thread_mutex_unlock (&pool.lock);
+            task->fn (task->arg);
+            free (task);
+            thread_mutex_lock (&pool.lock);
+            continue;
+        }
+        if (pool.running == 0)
+            break;
+        thread_get_timespec (&deadline);
+        deadline.tv_sec += POOL_IDLE_SECS;
+        pool.idle++;
+        thread_cond_timedwait (&pool.wakeup, &pool.lock, &deadline);
+        pool.idle--;
+        if (pool.queued == 0 && pool.running && pool.threads > 1)
+            break;      /* idled out, let the pool shrink back */
+    }
+    pool.threads--;
+    thread_mutex_unlock (&pool.lock);
+    return NULL;
+}
+
+
+/* queue fn(arg) to run on a pool worker. returns 0 with the job accepted,
+ * -1 if it cannot run, in which case the caller still owns arg
+ */
+int thread_pool_run (int priority, void *(*fn)(void *arg), void *arg)
+{
+    pool_task_t *task;
+
+    if (priority < THREAD_POOL_HIGH || priority > THREAD_POOL_LOW)
+        priority = THREAD_POOL_NORMAL;
+    task = calloc (1, sizeof (*task));
+    if (task == NULL)
+        return -1;
+    task->fn = fn;
+    task->arg = arg;
+
+    thread_mutex_lock (&pool.lock);
+    if (pool.running == 0)
+    {
+        thread_mutex_unlock (&pool.lock);
+        free (task);
+        return -1;
+    }
+    if (pool.idle == 0 && pool.threads < POOL_MAX_THREADS)
+    {
+        /* everyone is busy, grow. The new worker blocks on the pool lock
+         * until the job is queued below */
+        if (thread_create ("pool", pool_thread, NULL, THREAD_DETACHED))
+            pool.threads++;
+        else if (pool.threads == 0)
+        {
+            thread_mutex_unlock (&pool.lock);
+            free (task);
+            return -1;
+        }
+    }
+    *pool.tail [priority] = task;
+    pool.tail [priority] = &task->next;
+    pool.queued++;
+    if (pool.idle)
+        thread_cond_signal (&pool.wakeup);
+    thread_mutex_unlock (&pool.lock);
+    return 0;
+}
+
+
+void thread_pool_shutdown (void)
+{
+    int i;
+
+    thread_mutex_lock (&pool.lock);
+    pool.running = 0;
+    for (i = pool.threads; i; i--)
+        thread_cond_signal (&pool.wakeup);
+    /* workers may still be draining, the pool lock and cond stay valid */
+    thread_mutex_unlock (&pool.lock);
+}
+
+
+#ifdef THREAD_ADAPTIVE_SPIN
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define SPIN_TRIES 200
+
+static struct
+{
+    spin_t *spin;
+    char name [28];
+} spin_registry [32];
+static volatile int spin_registry_lock;
+
+
+static void spin_futex_wait (volatile int *addr, int val)
+{
+    syscall (SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void spin_futex_wake (volatile int *addr)
+{
+    syscall (SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static unsigned long long spin_now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+void thread_spin_create (spin_t *spin)
+{
+    memset (spin, 0, sizeof *spin);
+}
+
+void thread_spin_destroy (spin_t *spin)
+{
+    thread_spin_unregister (spin);
+}
+
+void thread_spin_lock (spin_t *spin)
+{
+    int expect = 0;
+
+    if (__atomic_compare_exchange_n (&spin->lock, &expect, 1, 0,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) == 0)
+    {
+        int tries = SPIN_TRIES;
+
+        for (;;)
+        {
+            expect = 0;
+            if (spin->lock == 0 &&
+                    __atomic_compare_exchange_n (&spin->lock, &expect, 1, 0,
+                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            {
+                __atomic_fetch_add (&spin->spins, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            if (--tries == 0)
+            {
+                /* holder is likely off-cpu, sleep until the unlock kicks us */
+                __atomic_fetch_add (&spin->waits, 1, __ATOMIC_RELAXED);
+                while (__atomic_exchange_n (&spin->lock, 2, __ATOMIC_ACQUIRE) != 0)
+                    spin_futex_wait (&spin->lock, 2);
+                break;
+            }
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause ();
+#elif defined(__aarch64__)
+            __asm__ __volatile__ ("yield");
+#endif
+        }
+    }
+    if (spin->timed)
+        spin->held_since = spin_now_ns ();
+}
+
+void thread_spin_unlock (spin_t *spin)
+{
+    if (spin->timed && spin->held_since)
+        __atomic_fetch_add (&spin->hold_ns, spin_now_ns () - spin->held_since,
+                __ATOMIC_RELAXED);
+    if (__atomic_exchange_n (&spin->lock, 0, __ATOMIC_RELEASE) == 2)
+        spin_futex_wake (&spin->lock);
+}
+
+void thread_spin_register (spin_t *spin, const char *name)
+{
+    int i;
+
+    while (__atomic_exchange_n (&spin_registry_lock, 1, __ATOMIC_ACQUIRE))
+        ;
+    for (i = 0; i < (int)(sizeof (spin_registry) / sizeof (spin_registry [0])); i++)
+    {
+        if (spin_registry [i].spin == NULL)
+        {
+            snprintf (spin_registry [i].name, sizeof (spin_registry [i].name), "%s", name);
+            spin_registry [i].spin = spin;
+            spin->timed = 1;
+            break;
+        }
+    }
+    __atomic_store_n (&spin_registry_lock, 0, __ATOMIC_RELEASE);
+}
+
+void thread_spin_unregister (spin_t *spin)
+{
+    int i;
+
+    while (__atomic_exchange_n (&spin_registry_lock, 1, __ATOMIC_ACQUIRE))
+        ;
+    for (i = 0; i < (int)(sizeof (spin_registry) / sizeof (spin_registry [0])); i++)
+    {
+        if (spin_registry [i].spin == spin)
+        {
+            spin_registry [i].spin = NULL;
+            break;
+        }
+    }
+    __atomic_store_n (&spin_registry_lock, 0, __ATOMIC_RELEASE);
+}
+
+/* walk the registered locks, idx from 0 up; returns -1 past the end. The
+ * counters are sampled without the registry lock, this is diagnostics */
+int thread_spin_info (int idx, spin_info_t *info)
+{
+    int i, n = 0;
+
+    for (i = 0; i < (int)(sizeof (spin_registry) / sizeof (spin_registry [0])); i++)
+    {
+        spin_t *spin = spin_registry [i].spin;
+
+        if (spin == NULL)
+            continue;
+        if (n++ == idx)
+        {
+            snprintf (info->name, sizeof (info->name), "%s", spin_registry [i].name);
+            info->spins = __atomic_load_n (&spin->spins, __ATOMIC_RELAXED);
+            info->waits = __atomic_load_n (&spin->waits, __ATOMIC_RELAXED);
+            info->hold_ms = __atomic_load_n (&spin->hold_ns, __ATOMIC_RELAXED) / 1000000;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+#else
+
 #ifdef HAVE_PTHREAD_SPIN_LOCK
 void thread_spin_create (spin_t *spin)
 {
@@ -945,6 +1243,21 @@ void thread_spin_unlock (spin_t *spin)
 }
 #endif
 
+void thread_spin_register (spin_t *spin, const char *name)
+{
+}
+
+void thread_spin_unregister (spin_t *spin)
+{
+}
+
+int thread_spin_info (int idx, spin_info_t *info)
+{
+    return -1;
+}
+
+#endif
+
 
 #ifdef HAVE_CLOCK_GETTIME
 void thread_get_timespec (struct timespec *now)
@@ -98,7 +98,28 @@ typedef struct {
     pthread_rwlock_t sys_rwlock;
 } rwlock_t;
 
-#ifdef HAVE_PTHREAD_SPIN_LOCK
+#if defined(__linux__) && defined(__GNUC__)
+/* adaptive spinlock. These guard short critical sections so a brief spin
+ * normally settles it, but a preempted holder drops waiters into a futex
+ * sleep instead of burning their timeslice. Contended acquires are counted,
+ * registered locks also accumulate hold time */
+#define THREAD_ADAPTIVE_SPIN 1
+
+typedef struct
+{
+    volatile int lock;              /* 0 free, 1 held, 2 held with waiters */
+    unsigned int timed;             /* set on registered locks */
+    unsigned long long spins;       /* contended acquires settled by spinning */
+    unsigned long long waits;       /* acquires that slept in the kernel */
+    unsigned long long hold_ns;
+    unsigned long long held_since;
+} spin_t;
+
+void thread_spin_create (spin_t *spin);
+void thread_spin_destroy (spin_t *spin);
+void thread_spin_lock (spin_t *spin);
+void thread_spin_unlock (spin_t *spin);
+#elif defined(HAVE_PTHREAD_SPIN_LOCK)
 typedef struct
 {
     pthread_spinlock_t lock;
@@ -116,6 +137,30 @@ typedef mutex_t spin_t;
 #define thread_spin_unlock(x)    thread_mutex_unlock(x)
 #endif
 
+/* shared pool for blocking side-work (yp, scripts, auth bursts); higher
+ * priority classes are taken first, extra threads appear for bursts and
+ * retire when idle */
+#define THREAD_POOL_HIGH        0
+#define THREAD_POOL_NORMAL      1
+#define THREAD_POOL_LOW         2
+
+int  thread_pool_run (int priority, void *(*fn)(void *arg), void *arg);
+void thread_pool_shutdown (void);
+
+/* contention visibility for the locks worth naming; no-ops unless the
+ * adaptive implementation is in use */
+typedef struct
+{
+    char name [28];
+    unsigned long long spins;
+    unsigned long long waits;
+    unsigned long long hold_ms;
+} spin_info_t;
+
+void thread_spin_register (spin_t *spin, const char *name);
+void thread_spin_unregister (spin_t *spin);
+int  thread_spin_info (int idx, spin_info_t *info);
+
 typedef int (*thread_mx_create_func)(void**m, int create);
 typedef int (*thread_mx_lock_func)(void**m, int create);
 
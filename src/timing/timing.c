@@ -65,6 +65,39 @@ uint64_t timing_get_time(void)
 }
 
 
+static uint64_t cached_time_ms;
+
+/* Refresh the published coarse clock, one per worker loop pass. The kernel
+ * coarse wall clock is tick resolution which is plenty for scheduling and
+ * logging stamps; pacing math keeps the precise read above. The coarse
+ * monotonic clock is no use here as consumers derive wall seconds from it.
+ */
+uint64_t timing_refresh_time(void)
+{
+    uint64_t v;
+#if defined(CLOCK_REALTIME_COARSE) && defined(HAVE_GETTIMEOFDAY)
+    struct timespec ts;
+
+    clock_gettime (CLOCK_REALTIME_COARSE, &ts);
+    v = (uint64_t)(ts.tv_sec) * 1000 + (uint64_t)(ts.tv_nsec) / 1000000;
+#else
+    v = timing_get_time();
+#endif
+    __atomic_store_n (&cached_time_ms, v, __ATOMIC_RELAXED);
+    return v;
+}
+
+
+/* cheap read of the published clock, falls back to a real query before the
+ * first worker pass publishes anything */
+uint64_t timing_cached_time(void)
+{
+    uint64_t v = __atomic_load_n (&cached_time_ms, __ATOMIC_RELAXED);
+
+    return v ? v : timing_get_time();
+}
+
+
 void timing_sleep(uint64_t sleeptime)
 {
 #ifdef WIN32
@@ -25,6 +25,8 @@
 #ifndef _WIN32
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #ifdef HAVE_POLL
 #include <sys/poll.h>
@@ -39,6 +41,16 @@
 #include <fnmatch.h>
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#if defined(__GNUC__) && !defined(_WIN32)
+#include <immintrin.h>
+#define B64_SIMD 1
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "net/sock.h"
 #include "thread/thread.h"
 
@@ -53,22 +65,22 @@
 
 #include "logging.h"
 
-struct rate_calc_node
-{
-    int64_t index;
-    uint64_t value;
-    struct rate_calc_node *next;
-};
+/* fixed ring of sample buckets with a running sum, each bucket covers
+ * width sid units so updates are O(1) and allocation free */
+#define RATE_BUCKETS 32
 
 struct rate_calc
 {
-    int64_t total;
-    uint64_t cycle_till;
-    struct rate_calc_node *current;
+    int64_t total;          /* running sum over the ring */
     spin_t lock;
-    unsigned int samples;
-    unsigned int ssec;
-    unsigned int blocks;
+    unsigned int samples;   /* window size in sid units */
+    unsigned int ssec;      /* sid units per second */
+    unsigned int width;     /* sid units per bucket */
+    unsigned int count;     /* buckets holding data */
+    unsigned int head;      /* ring slot of the newest bucket */
+    uint64_t head_bucket;   /* sid/width of the newest bucket */
+    uint64_t last_sid;      /* newest sid seen */
+    int64_t vals [RATE_BUCKETS];
 };
 
 
@@ -177,6 +189,10 @@ int util_check_valid_extension(const char *uri) {
                 */
                 ret = XSLT_CONTENT;
             }
+            if (strncmp(p2, "m3u8", strlen("m3u8")) == 0) {
+                /* rolling playlist request, handled by the hls subsystem */
+                ret = M3U8_CONTENT;
+            }
             if (strncmp(p2, "htm", strlen("htm")) == 0) {
                 /* Build the full path for the request, concatenating the webroot from the config.
                 ** Here would be also a good time to prevent accesses like '../../../../etc/passwd' or somesuch.
@@ -297,9 +313,16 @@ static char safechars[256] = {
       0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
 };
 
+#ifdef __SSE2__
+/* per byte mask for lo <= v <= hi, unsigned */
+#define BYTES_IN_RANGE(v, lo, hi) \
+    _mm_cmpeq_epi8 (_mm_subs_epu8 (_mm_sub_epi8 ((v), _mm_set1_epi8 (lo)), \
+                _mm_set1_epi8 ((hi) - (lo))), _mm_setzero_si128 ())
+#endif
+
 char *util_url_escape (const char *src)
 {
-    int len, i, j=0;
+    int len, i=0, j=0;
     char *dst;
     unsigned char *source;
 
@@ -307,10 +330,39 @@ char *util_url_escape (const char *src)
         return strdup ("");
     len = strlen(src);
     /* Efficiency not a big concern here, keep the code simple/conservative */
-    dst = calloc(1, len*3 + 1); 
+    dst = calloc(1, len*3 + 1);
     source = (unsigned char *)src;
 
-    for(i=0; i < len; i++) {
+#ifdef __SSE2__
+    /* classify 16 bytes at a time, safe runs copy over in bulk and the mask
+     * walks the bytes needing the %XX form */
+    while (i + 16 <= len)
+    {
+        __m128i v = _mm_loadu_si128 ((const __m128i *)(source + i));
+        __m128i safe = _mm_or_si128 (BYTES_IN_RANGE (v, '0', '9'),
+                _mm_or_si128 (BYTES_IN_RANGE (v, 'A', 'Z'), BYTES_IN_RANGE (v, 'a', 'z')));
+        unsigned unsafe = ~_mm_movemask_epi8 (safe) & 0xffff;
+        int pos = 0;
+
+        while (unsafe)
+        {
+            int b = __builtin_ctz (unsafe);
+
+            memcpy (dst + j, source + i + pos, b - pos);
+            j += b - pos;
+            dst[j] = '%';
+            dst[j+1] = hexchars[ (source[i+b] >> 4) & 0xf ];
+            dst[j+2] = hexchars[ source[i+b] & 0xf ];
+            j += 3;
+            pos = b + 1;
+            unsafe &= unsafe - 1;
+        }
+        memcpy (dst + j, source + i + pos, 16 - pos);
+        j += 16 - pos;
+        i += 16;
+    }
+#endif
+    for(; i < len; i++) {
         if(safechars[source[i]]) {
             dst[j++] = source[i];
         }
@@ -345,8 +397,50 @@ char *util_url_unescape (const char *src)
     decoded = calloc(1, len + 1);
 
     dst = decoded;
+    i = 0;
 
-    for(i=0; i < len; i++)
+#ifdef __SSE2__
+    while (i + 16 <= len)
+    {
+        __m128i v16 = _mm_loadu_si128 ((const __m128i *)(src + i));
+        unsigned hits = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v16, _mm_set1_epi8 ('%')));
+        int pos = 0, b = 16;
+
+        while (hits)
+        {
+            b = __builtin_ctz (hits);
+            if (b > 13)     /* %XX would straddle the load, resume there */
+                break;
+            memcpy (dst, src + i + pos, b - pos);
+            dst += b - pos;
+            v = unescape_code (src + i + b + 1);
+            if (v >= 0 && isprint(v))
+            {
+                *dst++ = (char)v;
+                pos = b + 3;
+            }
+            else
+            {
+                *dst++ = src[i+b];
+                pos = b + 1;
+            }
+            hits &= 0xffffu << pos;
+        }
+        if (hits)
+        {
+            memcpy (dst, src + i + pos, b - pos);
+            dst += b - pos;
+            i += b;
+        }
+        else
+        {
+            memcpy (dst, src + i + pos, 16 - pos);
+            dst += 16 - pos;
+            i += 16;
+        }
+    }
+#endif
+    for(; i < len; i++)
     {
         if (src[i] == '%' && i+2 < len)
         {
@@ -442,6 +536,138 @@ char *util_bin_to_hex(unsigned char *data, int len)
     return hex;
 }
 
+
+/* fast non-cryptographic 64 bit hash (murmur64a style) for cache keys and
+ * table placement. Values are not stable across platforms or builds, so they
+ * must never hit the wire or disk, and an outside party should not be given
+ * a reason to care about engineering collisions in them.
+ */
+uint64_t util_hash64 (const void *data, size_t len, uint64_t seed)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const unsigned char *p = data, *end = p + (len & ~(size_t)7);
+    uint64_t h = seed ^ (len * m), k;
+
+    while (p != end)
+    {
+        memcpy (&k, p, 8);
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+        h ^= k;
+        h *= m;
+        p += 8;
+    }
+    if (len & 7)
+    {
+        k = 0;
+        memcpy (&k, p, len & 7);
+        h ^= k;
+        h *= m;
+    }
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
+    return h;
+}
+
+#ifdef B64_SIMD
+static int b64_have_ssse3 (void)
+{
+    static int detected = -1;
+
+    if (detected < 0)
+        detected = __builtin_cpu_supports ("ssse3") ? 1 : 0;
+    return detected;
+}
+
+
+/* lookup-shuffle kernels, pshufb splits each 3 input bytes over 4 sextets
+ * (and joins them again on decode) so the bulk of a long userpass goes 12
+ * bytes a step. The callers finish off with their byte loops, which also
+ * cover padding and anything the validity check rejects */
+__attribute__((target("ssse3")))
+static void b64_encode_ssse3 (const char **data_p, int *len_p, char **out_p)
+{
+    const char *data = *data_p;
+    char *out = *out_p;
+    int len = *len_p;
+    const __m128i shuf = _mm_setr_epi8 (1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10);
+    const __m128i shift_lut = _mm_setr_epi8 (71, -4,-4,-4,-4,-4,-4,-4,-4,-4,-4, -19, -16, 65, 0, 0);
+
+    while (len >= 16)   /* 12 used, full load must stay within the string */
+    {
+        __m128i in = _mm_loadu_si128 ((const __m128i *)data);
+        __m128i t0, indices, result;
+
+        in = _mm_shuffle_epi8 (in, shuf);
+        t0 = _mm_mulhi_epu16 (_mm_and_si128 (in, _mm_set1_epi32 (0x0fc0fc00)),
+                _mm_set1_epi32 (0x04000040));
+        indices = _mm_or_si128 (t0,
+                _mm_mullo_epi16 (_mm_and_si128 (in, _mm_set1_epi32 (0x003f03f0)),
+                    _mm_set1_epi32 (0x01000010)));
+
+        /* sextant to ASCII, 0-25 forced to slot 13, 52 up resolve via the
+         * saturated subtract, the rest land on the -4 run */
+        result = _mm_subs_epu8 (indices, _mm_set1_epi8 (51));
+        result = _mm_or_si128 (result,
+                _mm_and_si128 (_mm_cmpgt_epi8 (_mm_set1_epi8 (26), indices), _mm_set1_epi8 (13)));
+        result = _mm_add_epi8 (indices, _mm_shuffle_epi8 (shift_lut, result));
+        _mm_storeu_si128 ((__m128i *)out, result);
+        data += 12;
+        out += 16;
+        len -= 12;
+    }
+    *data_p = data;
+    *out_p = out;
+    *len_p = len;
+}
+
+
+__attribute__((target("ssse3")))
+static void b64_decode_ssse3 (const unsigned char **input_p, int *len_p, char **out_p)
+{
+    const unsigned char *input = *input_p;
+    char *out = *out_p;
+    int len = *len_p;
+    const __m128i lut_lo = _mm_setr_epi8 (0x15,0x11,0x11,0x11,0x11,0x11,0x11,0x11,
+                                          0x11,0x11,0x13,0x1A,0x1B,0x1B,0x1B,0x1A);
+    const __m128i lut_hi = _mm_setr_epi8 (0x10,0x10,0x01,0x02,0x04,0x08,0x04,0x08,
+                                          0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10);
+    const __m128i lut_roll = _mm_setr_epi8 (0, 16, 19, 4, -65, -65, -71, -71, 0,0,0,0,0,0,0,0);
+    const __m128i nibble = _mm_set1_epi8 (0x0f);
+
+    while (len >= 16)
+    {
+        __m128i in = _mm_loadu_si128 ((const __m128i *)input);
+        __m128i hi_nib = _mm_and_si128 (_mm_srli_epi32 (in, 4), nibble);
+        __m128i lo = _mm_shuffle_epi8 (lut_lo, _mm_and_si128 (in, nibble));
+        __m128i hi = _mm_shuffle_epi8 (lut_hi, hi_nib);
+        __m128i packed;
+
+        /* any byte outside the alphabet (or '=' padding) drops the whole
+         * block back to the caller loop */
+        if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_and_si128 (lo, hi),
+                        _mm_setzero_si128 ())) != 0xFFFF)
+            break;
+        in = _mm_add_epi8 (in, _mm_shuffle_epi8 (lut_roll,
+                    _mm_add_epi8 (_mm_cmpeq_epi8 (in, _mm_set1_epi8 (0x2f)), hi_nib)));
+
+        packed = _mm_maddubs_epi16 (in, _mm_set1_epi32 (0x01400140));
+        packed = _mm_madd_epi16 (packed, _mm_set1_epi32 (0x00011000));
+        packed = _mm_shuffle_epi8 (packed, _mm_setr_epi8 (2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1));
+        _mm_storeu_si128 ((__m128i *)out, packed);
+        input += 16;
+        out += 12;
+        len -= 16;
+    }
+    *input_p = input;
+    *out_p = out;
+    *len_p = len;
+}
+#endif
+
+
 /* This isn't efficient, but it doesn't need to be */
 char *util_base64_encode(const char *data)
 {
@@ -450,6 +676,10 @@ char *util_base64_encode(const char *data)
     char *result = out;
     int chunk;
 
+#ifdef B64_SIMD
+    if (len >= 16 && b64_have_ssse3 ())
+        b64_encode_ssse3 (&data, &len, &out);
+#endif
     while(len > 0) {
         chunk = (len >3)?3:len;
         *out++ = base64table[(*data & 0xFC)>>2];
@@ -484,6 +714,10 @@ char *util_base64_decode(const char *data)
     char *result = out;
     signed char vals[4];
 
+#ifdef B64_SIMD
+    if (len >= 16 && b64_have_ssse3 ())
+        b64_decode_ssse3 (&input, &len, &out);
+#endif
     while(len > 0) {
         if(len < 4)
         {
@@ -705,6 +939,73 @@ struct tm *gmtime_r(const time_t *timep, struct tm *result)
 #endif
 
 
+/* structural UTF-8 check on a nul terminated string, 1 for valid else 0.
+ * metadata is mostly ASCII so runs of 7bit bytes are skipped in bulk, the
+ * byte checks only deal with whatever multibyte sequences remain
+ */
+int util_valid_utf8 (const char *string)
+{
+    const unsigned char *p = (const unsigned char *)string;
+
+    for (;;)
+    {
+        int follow;
+
+        while (((uintptr_t)p & 15) && *p && *p < 0x80)
+            p++;
+#ifdef __SSE2__
+        if (((uintptr_t)p & 15) == 0)
+        {
+            /* aligned loads cannot cross a page so reading a little past the
+             * terminator is fine, the movemask settles where to stop */
+            const __m128i zero = _mm_setzero_si128();
+
+            for (;;)
+            {
+                __m128i v = _mm_load_si128 ((const __m128i *)p);
+                int stop = _mm_movemask_epi8 (v) |
+                           _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, zero));
+
+                if (stop)
+                {
+                    p += __builtin_ctz (stop);
+                    break;
+                }
+                p += 16;
+            }
+        }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+        if (((uintptr_t)p & 15) == 0)
+        {
+            for (;;)
+            {
+                uint8x16_t v = vld1q_u8 (p);
+
+                if (vminvq_u8 (v) == 0 || vmaxvq_u8 (v) > 0x7F)
+                    break;      // terminator or high byte, locate it below
+                p += 16;
+            }
+        }
+#endif
+        while (*p && *p < 0x80)
+            p++;
+        if (*p == 0)
+            return 1;
+        if ((*p & 0xE0) == 0xC0)
+            follow = 1;
+        else if ((*p & 0xF0) == 0xE0)
+            follow = 2;
+        else if ((*p & 0xF8) == 0xF0)
+            follow = 3;
+        else
+            return 0;   // stray continuation or invalid lead byte
+        for (p++; follow; follow--, p++)
+            if ((*p & 0xC0) != 0x80)
+                return 0;
+    }
+}
+
+
 /* helper function for converting a passed string in one character set to another
  * we use libxml2 for this
  */
@@ -759,150 +1060,92 @@ struct rate_calc *rate_setup (unsigned int samples, unsigned int ssec)
     thread_spin_create (&calc->lock);
     calc->samples = samples;
     calc->ssec = ssec;
+    calc->width = (samples + RATE_BUCKETS - 1) / RATE_BUCKETS;
     return calc;
 }
 
-static void rate_purge_entries (struct rate_calc *calc, uint64_t cutoff)
-{
-    struct rate_calc_node *node = calc->current->next, *to_free = NULL;
-    int count = calc->blocks;
-
-    while (count && node->index <= cutoff)
-    {
-        struct rate_calc_node *to_go = node;
-        if (node == NULL || node->next == NULL)
-            abort();
-        count--;
-        if (count)
-        {
-            node = node->next;
-            calc->current->next = node;
-            calc->total -= to_go->value;
-        }
-        else
-        {
-             calc->current = NULL;
-             calc->total = 0;
-        }
-        to_go->next = to_free;
-        to_free = to_go;
-    }
-    calc->blocks = count;
-    thread_spin_unlock (&calc->lock);
-    while (to_free)
-    {
-        struct rate_calc_node *to_go = to_free;
-        to_free = to_go->next;
-        free (to_go);
-    }
-}
-
 /* add a value to sampled data, t is used to determine which sample
- * block the sample goes into.
+ * bucket the sample goes into.
  */
 void rate_add_sum (struct rate_calc *calc, long value, uint64_t sid, uint64_t *sum)
 {
-    uint64_t cutoff;
+    uint64_t b;
 
+    if (sum && value)
+        *sum += value;
     thread_spin_lock (&calc->lock);
-    cutoff = sid - calc->samples;
-    if (calc->cycle_till)
+    b = sid / calc->width;
+    if (calc->count == 0)
     {
-        do {
-            if (calc->current)
-            {
-                struct rate_calc_node *next = calc->current->next;
-                if (next->index < calc->cycle_till)
-                {
-                    cutoff = next->index + 1;
-                    break;
-                }
-            }
-            calc->cycle_till = 0;
-        } while (0);
+        calc->head_bucket = b;
+        calc->head = 0;
+        calc->vals [0] = value;
+        calc->count = 1;
+        calc->total = value;
     }
-    if (value == 0 && calc->current && calc->current->value == 0)
+    else if (b <= calc->head_bucket)
     {
-        calc->current->index = sid; /* update the timestamp if 0 already present */
-        rate_purge_entries (calc, cutoff);
-        return;
+        /* same bucket, or a late sample, folds into the newest */
+        calc->vals [calc->head] += value;
+        calc->total += value;
     }
-    if (sum)
-        *sum += value;
-    while (1)
+    else
     {
-        struct rate_calc_node *next = NULL, *node;
-        int to_insert = 1;
-        if (calc->current)
+        uint64_t steps = b - calc->head_bucket;
+
+        if (steps >= RATE_BUCKETS)
         {
-            if (sid == calc->current->index)
-            {
-                if (value)
-                {
-                    calc->current->value += value;
-                    calc->total += value;
-                }
-                thread_spin_unlock (&calc->lock);
-                return;
-            }
-            next = calc->current->next;
-            if (cutoff > next->index)
-                to_insert = 0;
+            /* idle longer than the whole window, start over */
+            memset (calc->vals, 0, sizeof calc->vals);
+            calc->head = 0;
+            calc->count = 1;
+            calc->total = 0;
         }
-        if (to_insert)
+        else
         {
-            thread_spin_unlock (&calc->lock);
-            node = calloc (1, sizeof (*node));
-
-            node->index = sid;
-            thread_spin_lock (&calc->lock);
-            if ((calc->current && calc->current->next != next) ||
-                    (calc->current == NULL && next != NULL))
+            while (steps--)
             {
-                thread_spin_unlock (&calc->lock);
-                free (node);
-                thread_spin_lock (&calc->lock);
-                continue;
+                calc->head = (calc->head + 1) % RATE_BUCKETS;
+                if (calc->count == RATE_BUCKETS)
+                    calc->total -= calc->vals [calc->head];
+                else
+                    calc->count++;
+                calc->vals [calc->head] = 0;
             }
-            node->next = next ? next : node;
-            if (calc->current)  calc->current->next = node;
-            calc->current = node;
-            calc->blocks++;
-        }
-        else
-        {
-            calc->current = next;
-            calc->total -= next->value;
-            next->index = sid;
         }
-        calc->current->value = value;
-        break;
+        calc->head_bucket = b;
+        calc->vals [calc->head] += value;
+        calc->total += value;
     }
-    calc->total += value;
-    rate_purge_entries (calc, cutoff);
+    if (sid > calc->last_sid)
+        calc->last_sid = sid;
+    thread_spin_unlock (&calc->lock);
 }
 
 
-/* return the average sample value over all the blocks except the 
- * current one, as that may be incomplete. t to reduce the duration
+/* return the average sample value over the range covered by the ring,
+ * t to reduce the duration
  */
 long rate_avg_shorten (struct rate_calc *calc, unsigned int t)
 {
-    long total = 0, ssec = 1;
-    float range = 1.0;
+    int64_t total;
+    float range;
+    unsigned int ssec = 1;
 
     if (calc == NULL)
-        return total;
+        return 0;
     thread_spin_lock (&calc->lock);
-    if (calc && calc->blocks > 1)
+    if (calc->count < 2)
     {
-        range = (float)(calc->current->index - calc->current->next->index);
-        if (range < 1)
-            range = 1;
-        total = calc->total;
-        if (t < calc->ssec)
-            ssec = calc->ssec - t;
+        thread_spin_unlock (&calc->lock);
+        return 0;
     }
+    total = calc->total;
+    range = (float)(calc->last_sid - (calc->head_bucket - (calc->count - 1)) * calc->width);
+    if (range < 1)
+        range = 1;
+    if (t < calc->ssec)
+        ssec = calc->ssec - t;
     thread_spin_unlock (&calc->lock);
     return (long)(total / range * ssec);
 }
@@ -912,42 +1155,124 @@ long rate_avg (struct rate_calc *calc)
     return rate_avg_shorten (calc, 0);
 }
 
-/* reduce the samples used to calculate average */
-void rate_reduce (struct rate_calc *calc, unsigned int range)
+
+/* rate over just the newest pair of buckets, quick to react for the
+ * throttle checks where the windowed average smooths for too long
+ */
+long rate_avg_inst (struct rate_calc *calc)
 {
+    long ret = 0;
+
     if (calc == NULL)
-        return;
+        return 0;
     thread_spin_lock (&calc->lock);
-    if (range && calc->blocks > 1)
+    if (calc->count >= 2)
     {
-        calc->cycle_till = calc->current->index;
-        rate_purge_entries (calc, calc->current->index - range);
+        unsigned int prev = (calc->head + RATE_BUCKETS - 1) % RATE_BUCKETS;
+        int64_t total = calc->vals [calc->head] + calc->vals [prev];
+        float span = (float)(calc->last_sid - (calc->head_bucket - 1) * calc->width);
+
+        if (span < 1)
+            span = 1;
+        ret = (long)(total / span * calc->ssec);
     }
-    else
-        thread_spin_unlock (&calc->lock);
+    thread_spin_unlock (&calc->lock);
+    return ret;
 }
 
 
-void rate_free (struct rate_calc *calc)
+/* reduce the samples used to calculate average */
+void rate_reduce (struct rate_calc *calc, unsigned int range)
 {
     if (calc == NULL)
         return;
-    if (calc->current)
+    thread_spin_lock (&calc->lock);
+    if (range && calc->count > 1)
     {
-        struct rate_calc_node *node = calc->current->next;
-        calc->current->next = NULL;
-        while (node)
+        unsigned int allowed = range / calc->width + 1;
+
+        while (calc->count > allowed)
         {
-            struct rate_calc_node *to_go = node;
-            node = node->next;
-            free (to_go);
+            unsigned int tail = (calc->head + RATE_BUCKETS - (calc->count - 1)) % RATE_BUCKETS;
+
+            calc->total -= calc->vals [tail];
+            calc->vals [tail] = 0;
+            calc->count--;
         }
     }
+    thread_spin_unlock (&calc->lock);
+}
+
+
+void rate_free (struct rate_calc *calc)
+{
+    if (calc == NULL)
+        return;
     thread_spin_destroy (&calc->lock);
     free (calc);
 }
 
 
+/* Token bucket for shaping outgoing bandwidth. Senders debit bytes after a
+ * write pass and the bucket is allowed to run into debt; the time that debt
+ * represents is what bw_bucket_owed reports, so overdrawn senders sit out
+ * exactly the overshoot rather than oscillating around a sampled average.
+ * All accesses are atomic, there is no lock to contend on the send path.
+ */
+
+static void bw_bucket_refill (bw_bucket_t *b, uint64_t milli)
+{
+    uint64_t stamp = __atomic_load_n (&b->stamp_ms, __ATOMIC_RELAXED);
+
+    if (milli <= stamp)
+        return;
+    if (__atomic_compare_exchange_n (&b->stamp_ms, &stamp, milli, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        int64_t t = __atomic_add_fetch (&b->tokens, (int64_t)(milli - stamp) * b->rate / 1000, __ATOMIC_RELAXED);
+        if (t > b->burst)   /* clamp, the race with concurrent spends is benign */
+            __atomic_fetch_sub (&b->tokens, t - b->burst, __ATOMIC_RELAXED);
+    }
+}
+
+
+/* (re)apply a limit in bits per second, 0 disables the bucket */
+void bw_bucket_set (bw_bucket_t *b, int64_t bits_per_sec, uint64_t milli)
+{
+    int64_t rate = bits_per_sec / 8;
+
+    if (rate == b->rate)
+        return;
+    b->burst = rate / 4;            /* 250ms of headroom */
+    __atomic_store_n (&b->tokens, b->burst, __ATOMIC_RELAXED);
+    __atomic_store_n (&b->stamp_ms, milli, __ATOMIC_RELAXED);
+    b->rate = rate;
+}
+
+
+/* milliseconds a sender should back off for, 0 when within the limit */
+long bw_bucket_owed (bw_bucket_t *b, uint64_t milli)
+{
+    int64_t t;
+
+    if (b->rate == 0)
+        return 0;
+    bw_bucket_refill (b, milli);
+    t = __atomic_load_n (&b->tokens, __ATOMIC_RELAXED);
+    if (t >= 0)
+        return 0;
+    return (long)(-t * 1000 / b->rate) + 1;
+}
+
+
+void bw_bucket_spend (bw_bucket_t *b, long bytes, uint64_t milli)
+{
+    if (b->rate == 0 || bytes <= 0)
+        return;
+    bw_bucket_refill (b, milli);
+    __atomic_fetch_sub (&b->tokens, bytes, __ATOMIC_RELAXED);
+}
+
+
 int get_line(FILE *file, char *buf, size_t siz)
 {
     if(fgets(buf, (int)siz, file)) {
@@ -963,6 +1288,578 @@ int get_line(FILE *file, char *buf, size_t siz)
 }
 
 
+/* binary radix trie over IP prefixes. Nodes store the prefix bits they cover,
+ * branching on the first bit past the prefix, so lookups cost at most one
+ * node per differing bit and a /8 costs the same as a host entry.
+ */
+struct iptrie_node
+{
+    struct iptrie_node *kid[2];
+    time_t timeout;         // 0 for permanent, else expiry time
+    unsigned char plen;     // prefix length in bits
+    unsigned char terminal; // an inserted entry ends at this node
+    unsigned char key[16];
+};
+
+static int iptrie_bit (const unsigned char *key, int pos)
+{
+    return (key [pos >> 3] >> (7 - (pos & 7))) & 1;
+}
+
+static int iptrie_common_bits (const unsigned char *a, const unsigned char *b, int max)
+{
+    int pos = 0;
+    while (pos + 8 <= max && a[pos>>3] == b[pos>>3])
+        pos += 8;
+    while (pos < max && iptrie_bit (a, pos) == iptrie_bit (b, pos))
+        pos++;
+    return pos;
+}
+
+
+/* turn "1.2.3.4", "10.0.0.0/8" or "2001:db8::/32" into key bits. v4-mapped
+ * v6 addresses fold into the v4 trie so both spellings match each other.
+ */
+static int iptrie_parse (const char *entry, unsigned char *key, int *plen, int *maxbits)
+{
+    char buf [60], *slash;
+    struct in_addr v4;
+    struct in6_addr v6;
+    int prefix = -1;
+
+    if (entry == NULL || snprintf (buf, sizeof buf, "%s", entry) >= (int)sizeof buf)
+        return -1;
+    slash = strchr (buf, '/');
+    if (slash)
+    {
+        *slash = '\0';
+        prefix = atoi (slash+1);
+        if (prefix < 0)
+            return -1;
+    }
+    if (inet_pton (AF_INET, buf, &v4) == 1)
+    {
+        memcpy (key, &v4, 4);
+        *maxbits = 32;
+    }
+    else if (inet_pton (AF_INET6, buf, &v6) == 1)
+    {
+        if (IN6_IS_ADDR_V4MAPPED (&v6))
+        {
+            memcpy (key, &v6.s6_addr[12], 4);
+            *maxbits = 32;
+            if (prefix > 96)
+                prefix -= 96;
+        }
+        else
+        {
+            memcpy (key, &v6, 16);
+            *maxbits = 128;
+        }
+    }
+    else
+        return -1;
+    *plen = (prefix < 0 || prefix > *maxbits) ? *maxbits : prefix;
+    return 0;
+}
+
+
+static struct iptrie_node *iptrie_node_new (const unsigned char *key, int plen)
+{
+    struct iptrie_node *node = calloc (1, sizeof (*node));
+    if (node)
+    {
+        memcpy (node->key, key, sizeof (node->key));
+        node->plen = plen;
+    }
+    return node;
+}
+
+
+/* returns 1 for a new entry, 0 for refreshing an existing one, -1 on failure */
+static int iptrie_node_insert (struct iptrie_node **pp, const unsigned char *key, int plen, time_t timeout)
+{
+    struct iptrie_node *node = *pp, *split;
+    int common;
+
+    if (node == NULL)
+    {
+        if ((node = iptrie_node_new (key, plen)) == NULL)
+            return -1;
+        node->terminal = 1;
+        node->timeout = timeout;
+        *pp = node;
+        return 1;
+    }
+    common = iptrie_common_bits (node->key, key, plen < node->plen ? plen : node->plen);
+    if (common == node->plen)
+    {
+        if (plen == node->plen)
+        {
+            int fresh = node->terminal ? 0 : 1;
+            node->terminal = 1;
+            node->timeout = timeout;
+            return fresh;
+        }
+        return iptrie_node_insert (&node->kid [iptrie_bit (key, node->plen)], key, plen, timeout);
+    }
+    /* prefixes diverge inside this node, split it at the common point */
+    if ((split = iptrie_node_new (key, common)) == NULL)
+        return -1;
+    split->kid [iptrie_bit (node->key, common)] = node;
+    *pp = split;
+    if (common == plen)
+    {
+        split->terminal = 1;
+        split->timeout = timeout;
+        return 1;
+    }
+    return iptrie_node_insert (&split->kid [iptrie_bit (key, common)], key, plen, timeout);
+}
+
+
+int iptrie_insert (iptrie_t *trie, const char *entry, time_t timeout)
+{
+    unsigned char key [16] = { 0 };
+    int plen, maxbits, ret;
+
+    if (iptrie_parse (entry, key, &plen, &maxbits) < 0)
+        return -1;
+    ret = iptrie_node_insert (maxbits == 32 ? &trie->v4 : &trie->v6, key, plen, timeout);
+    if (ret > 0)
+        trie->count++;
+    return ret < 0 ? -1 : 0;
+}
+
+
+int iptrie_remove (iptrie_t *trie, const char *entry)
+{
+    unsigned char key [16] = { 0 };
+    int plen, maxbits;
+    struct iptrie_node *node;
+
+    if (iptrie_parse (entry, key, &plen, &maxbits) < 0)
+        return -1;
+    node = maxbits == 32 ? trie->v4 : trie->v6;
+    while (node)
+    {
+        if (node->plen > plen || iptrie_common_bits (node->key, key, node->plen) < node->plen)
+            return -1;
+        if (node->plen == plen)
+        {
+            if (node->terminal == 0)
+                return -1;
+            node->terminal = 0; // node stays, may be holding up children
+            trie->count--;
+            return 0;
+        }
+        node = node->kid [iptrie_bit (key, node->plen)];
+    }
+    return -1;
+}
+
+
+/* longest-prefix match for ip, honouring entry timeouts. Timed entries close
+ * to expiry are extended on a hit, as the old ban list did, so an active
+ * offender stays banned. return 1 on match else 0.
+ */
+int iptrie_lookup (iptrie_t *trie, const char *ip, time_t now)
+{
+    unsigned char key [16] = { 0 };
+    int plen, maxbits;
+    struct iptrie_node *node, *best = NULL;
+
+    if (trie->count == 0 || iptrie_parse (ip, key, &plen, &maxbits) < 0)
+        return 0;
+    node = maxbits == 32 ? trie->v4 : trie->v6;
+    while (node)
+    {
+        if (iptrie_common_bits (node->key, key, node->plen) < node->plen)
+            break;
+        if (node->terminal)
+            best = node;
+        if (node->plen >= maxbits)
+            break;
+        node = node->kid [iptrie_bit (key, node->plen)];
+    }
+    if (best == NULL)
+        return 0;
+    if (best->timeout)
+    {
+        if (best->timeout <= now)
+        {
+            best->terminal = 0; // lapsed, drops fully on the next file reload
+            trie->count--;
+            return 0;
+        }
+        if (now + 300 > best->timeout)
+            best->timeout = now + 300;
+    }
+    return 1;
+}
+
+
+static void iptrie_node_free (struct iptrie_node *node)
+{
+    if (node == NULL)
+        return;
+    iptrie_node_free (node->kid[0]);
+    iptrie_node_free (node->kid[1]);
+    free (node);
+}
+
+
+void iptrie_clear (iptrie_t *trie)
+{
+    iptrie_node_free (trie->v4);
+    iptrie_node_free (trie->v6);
+    trie->v4 = trie->v6 = NULL;
+    trie->count = 0;
+}
+
+
+#ifdef HAVE_FNMATCH_H
+
+/* compiled form of a wildcard pattern list. Instead of running fnmatch per
+ * entry on every lookup the set is folded into structures matched in one
+ * pass over the string:
+ *   - patterns with a literal head ("Mozilla*", "curl?*") sit in a prefix
+ *     trie, fnmatch only runs on the tail of entries whose head matched
+ *   - "*lit*" and "*lit" entries go into an aho-corasick automaton
+ *   - anything odd ("[Bb]ot*", "*a*b*") stays on a residual fnmatch list
+ * Rebuilt whenever the backing file reloads.
+ */
+
+struct ptrie_tail
+{
+    char *pattern;              /* tail from the first wildcard onward */
+    struct ptrie_tail *next;
+};
+
+struct ptrie_node
+{
+    struct ptrie_node *sibling, *child;
+    struct ptrie_tail *tails;
+    unsigned char ch;
+    unsigned char prefix_any;   /* a "head*" pattern ends here */
+};
+
+struct ac_node
+{
+    struct ac_node *sibling, *child, *fail;
+    unsigned char ch;
+    unsigned char out_any;      /* "*lit*" ends here */
+    unsigned char out_suffix;   /* "*lit" ends here */
+};
+
+struct pattern_set
+{
+    struct ptrie_node *trie;
+    struct ac_node *ac;
+    struct cache_list_node *residual;
+    unsigned int states;        /* ac node count, for the fail link pass */
+};
+
+
+static struct ptrie_node *ptrie_child (struct ptrie_node *n, unsigned char ch)
+{
+    n = n ? n->child : NULL;
+    while (n && n->ch != ch)
+        n = n->sibling;
+    return n;
+}
+
+
+static void ptrie_add (struct pattern_set *set, const char *head, unsigned int len, const char *tail)
+{
+    struct ptrie_node *node = set->trie;
+    unsigned int i;
+
+    for (i = 0; i < len; i++)
+    {
+        struct ptrie_node *next = ptrie_child (node, (unsigned char)head [i]);
+        if (next == NULL)
+        {
+            next = calloc (1, sizeof (*next));
+            if (next == NULL) return;
+            next->ch = (unsigned char)head [i];
+            next->sibling = node->child;
+            node->child = next;
+        }
+        node = next;
+    }
+    if (tail [0] == '*' && tail [1] == '\0')
+        node->prefix_any = 1;
+    else
+    {
+        struct ptrie_tail *t = calloc (1, sizeof (*t));
+        if (t == NULL) return;
+        t->pattern = strdup (tail);
+        t->next = node->tails;
+        node->tails = t;
+    }
+}
+
+
+static struct ac_node *ac_child (struct ac_node *n, unsigned char ch)
+{
+    n = n->child;
+    while (n && n->ch != ch)
+        n = n->sibling;
+    return n;
+}
+
+
+static void ac_add (struct pattern_set *set, const char *lit, unsigned int len, int suffix)
+{
+    struct ac_node *node = set->ac;
+    unsigned int i;
+
+    for (i = 0; i < len; i++)
+    {
+        struct ac_node *next = ac_child (node, (unsigned char)lit [i]);
+        if (next == NULL)
+        {
+            next = calloc (1, sizeof (*next));
+            if (next == NULL) return;
+            next->ch = (unsigned char)lit [i];
+            next->sibling = node->child;
+            node->child = next;
+            set->states++;
+        }
+        node = next;
+    }
+    if (suffix)
+        node->out_suffix = 1;
+    else
+        node->out_any = 1;
+}
+
+
+/* classic BFS fail link construction, output flags are folded along the
+ * links so the scan only has to test the current state
+ */
+static void ac_build_links (struct pattern_set *set)
+{
+    struct ac_node *root = set->ac, **queue, *n;
+    unsigned int head = 0, count = 0;
+
+    queue = calloc (set->states, sizeof (*queue));
+    if (queue == NULL) return;
+    for (n = root->child; n; n = n->sibling)
+    {
+        n->fail = root;
+        queue [count++] = n;
+    }
+    while (head < count)
+    {
+        struct ac_node *u = queue [head++], *v;
+        for (v = u->child; v; v = v->sibling)
+        {
+            struct ac_node *f = u->fail;
+            while (f != root && ac_child (f, v->ch) == NULL)
+                f = f->fail;
+            v->fail = ac_child (f, v->ch);
+            if (v->fail == NULL || v->fail == v)
+                v->fail = root;
+            v->out_any |= v->fail->out_any;
+            v->out_suffix |= v->fail->out_suffix;
+            queue [count++] = v;
+        }
+    }
+    free (queue);
+}
+
+
+static void ptrie_free (struct ptrie_node *n)
+{
+    while (n)
+    {
+        struct ptrie_node *sibling = n->sibling;
+        while (n->tails)
+        {
+            struct ptrie_tail *t = n->tails;
+            n->tails = t->next;
+            free (t->pattern);
+            free (t);
+        }
+        ptrie_free (n->child);
+        free (n);
+        n = sibling;
+    }
+}
+
+
+static void ac_free (struct ac_node *n)
+{
+    while (n)
+    {
+        struct ac_node *sibling = n->sibling;
+        ac_free (n->child);
+        free (n);
+        n = sibling;
+    }
+}
+
+
+static void pattern_set_free (struct pattern_set *set)
+{
+    if (set == NULL)
+        return;
+    if (set->trie)
+    {
+        ptrie_free (set->trie->child);
+        free (set->trie);
+    }
+    if (set->ac)
+    {
+        ac_free (set->ac->child);
+        free (set->ac);
+    }
+    while (set->residual)
+    {
+        struct cache_list_node *entry = set->residual;
+        set->residual = entry->next;
+        free (entry->content);
+        free (entry);
+    }
+    free (set);
+}
+
+
+/* (re)build the compiled matcher from the wildcard entries on cache->extra.
+ * run this after the list has been (re)populated, under the same lock that
+ * guards the reload
+ */
+void cached_pattern_compile (cache_file_contents *cache)
+{
+    struct pattern_set *set;
+    struct cache_list_node *entry;
+    unsigned int trie = 0, substr = 0, residual = 0;
+
+    pattern_set_free (cache->matcher);
+    cache->matcher = NULL;
+    if (cache->extra == NULL)
+        return;
+    set = calloc (1, sizeof (*set));
+    if (set == NULL)
+        return;
+    set->trie = calloc (1, sizeof (struct ptrie_node));
+    set->ac = calloc (1, sizeof (struct ac_node));
+    if (set->trie == NULL || set->ac == NULL)
+    {
+        pattern_set_free (set);
+        return;
+    }
+    for (entry = cache->extra; entry; entry = entry->next)
+    {
+        const char *p = entry->content;
+        unsigned int head = strcspn (p, "*?[");
+
+        if (head > 0)
+        {
+            ptrie_add (set, p, head, p + head);
+            trie++;
+            continue;
+        }
+        if (p [0] == '*')
+        {
+            unsigned int body = strcspn (p + 1, "*?[");
+            if (body > 0 && p [1 + body] == '\0')
+            {
+                ac_add (set, p + 1, body, 1);       /* "*lit" */
+                substr++;
+                continue;
+            }
+            if (body > 0 && p [1 + body] == '*' && p [2 + body] == '\0')
+            {
+                ac_add (set, p + 1, body, 0);       /* "*lit*" */
+                substr++;
+                continue;
+            }
+        }
+        /* starts with ?/[ or has multiple wildcard sections, keep as-is */
+        {
+            struct cache_list_node *node = calloc (1, sizeof (*node));
+            if (node)
+            {
+                node->content = strdup (p);
+                node->next = set->residual;
+                set->residual = node;
+                residual++;
+            }
+        }
+    }
+    ac_build_links (set);
+    cache->matcher = set;
+    DEBUG4 ("compiled %u anchored, %u substring, %u residual patterns (%s)",
+            trie, substr, residual, cache->filename ? cache->filename : "dynamic");
+}
+
+
+/* single pass match of line against the compiled set.
+ * return 1 for match, 0 for no match
+ */
+int cached_pattern_match (cache_file_contents *cache, const char *line)
+{
+    struct pattern_set *set = cache->matcher;
+    struct cache_list_node *entry;
+    const char *p;
+    struct ptrie_node *tn;
+    struct ac_node *root, *st;
+
+    if (set == NULL)
+        return 0;
+    tn = set->trie;
+    for (p = line; tn; p++)
+    {
+        if (tn->prefix_any)
+            return 1;
+        if (tn->tails)
+        {
+            struct ptrie_tail *t = tn->tails;
+            for (; t; t = t->next)
+                if (fnmatch (t->pattern, p, FNM_NOESCAPE) == 0)
+                    return 1;
+        }
+        if (*p == '\0')
+            break;
+        tn = ptrie_child (tn, (unsigned char)*p);
+    }
+    root = st = set->ac;
+    for (p = line; *p; p++)
+    {
+        unsigned char c = (unsigned char)*p;
+        struct ac_node *next;
+
+        while ((next = ac_child (st, c)) == NULL && st != root)
+            st = st->fail;
+        st = next ? next : root;
+        if (st->out_any)
+            return 1;
+        if (st->out_suffix && p [1] == '\0')
+            return 1;
+    }
+    for (entry = set->residual; entry; entry = entry->next)
+        if (fnmatch (entry->content, line, FNM_NOESCAPE) == 0)
+            return 1;
+    return 0;
+}
+
+#else
+
+void cached_pattern_compile (cache_file_contents *cache)
+{
+}
+
+int cached_pattern_match (cache_file_contents *cache, const char *line)
+{
+    return 0;
+}
+
+#endif
+
+
 int cached_pattern_compare (const char *value, const char *pattern)
 {
 #ifdef HAVE_FNMATCH_H
@@ -1030,6 +1927,7 @@ void cached_prune (cache_file_contents *cache)
         avl_tree_free (cache->contents, cached_treenode_free);
         cache->contents = NULL;
     }
+    iptrie_clear (&cache->iptrie);
     while (cache->extra)
     {
         struct cache_list_node *entry = cache->extra;
@@ -1037,6 +1935,10 @@ void cached_prune (cache_file_contents *cache)
         free (entry->content);
         free (entry);
     }
+#ifdef HAVE_FNMATCH_H
+    pattern_set_free (cache->matcher);
+    cache->matcher = NULL;
+#endif
 }
 
 
@@ -1092,6 +1994,7 @@ void cached_file_recheck (cache_file_contents *cache, time_t now)
             cache->add( cache, line, 0);
         }
         fclose (file);
+        cached_pattern_compile (cache);
         INFO2 ("%d entries read from file \"%s\"", count, cache->filename);
 
     } while (0);
@@ -1106,7 +2009,16 @@ int cached_pattern_search (cache_file_contents *cache, const char *line, time_t
     do
     {
         cached_file_recheck (cache, now);
-        if (cache->extra)
+        if (cache->matcher)
+        {
+            if (cached_pattern_match (cache, line))
+            {
+                DEBUG1 ("%s matched pattern", line);
+                return 1;
+            }
+            ret = 0;
+        }
+        else if (cache->extra)
         {
             struct cache_list_node *entry = cache->extra;
             while (entry)
@@ -1120,6 +2032,12 @@ int cached_pattern_search (cache_file_contents *cache, const char *line, time_t
             }
             ret = 0;
         }
+        if (cache->iptrie.count)
+        {
+            if (iptrie_lookup (&cache->iptrie, line, now))
+                return 1;
+            ret = 0;
+        }
         if (cache->contents)
         {
             void *result;
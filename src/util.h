@@ -17,6 +17,7 @@
 
 #define XSLT_CONTENT 1
 #define HTML_CONTENT 2
+#define M3U8_CONTENT 3
 
 #define READ_ENTIRE_HEADER 1
 #define READ_LINE 0
@@ -33,6 +34,7 @@ char *util_normalise_uri(const char *uri);
 char *util_base64_encode(const char *data);
 char *util_base64_decode(const char *input);
 char *util_bin_to_hex(unsigned char *data, int len);
+uint64_t util_hash64 (const void *data, size_t len, uint64_t seed);
 
 char *util_url_unescape(const char *src);
 char *util_url_escape(const char *src);
@@ -64,6 +66,21 @@ struct cache_list_node
     struct cache_list_node *next;
 };
 
+/* binary radix trie over IP prefixes, keeps IPv4 and IPv6 separate. Entries
+ * may carry a timeout for timed bans, 0 means permanent.
+ */
+struct iptrie_node;
+typedef struct iptrie
+{
+    struct iptrie_node *v4, *v6;
+    long count;
+} iptrie_t;
+
+int  iptrie_insert (iptrie_t *trie, const char *entry, time_t timeout);
+int  iptrie_remove (iptrie_t *trie, const char *entry);
+int  iptrie_lookup (iptrie_t *trie, const char *ip, time_t now);
+void iptrie_clear (iptrie_t *trie);
+
 struct _cache_contents;
 typedef void (*cachefile_add_func)(struct _cache_contents *, const void *ip, time_t now);
 typedef int  (*cachefile_compare_func)(void *, void *, void *);
@@ -73,6 +90,8 @@ typedef struct _cache_contents
     time_t                  file_recheck;
     time_t                  file_mtime;
     void                    *extra;
+    void                    *matcher;   /* compiled wildcard set, see cached_pattern_compile */
+    iptrie_t                iptrie;
     avl_tree                *contents;
     // callback routines key insert and comparison
     cachefile_compare_func  compare;
@@ -98,12 +117,27 @@ struct tm *localtime_r (const time_t *timep, struct tm *result);
 struct tm *gmtime_r(const time_t *timep, struct tm *result);
 #endif
 char *util_conv_string (const char *string, const char *in_charset, const char *out_charset);
+int util_valid_utf8 (const char *string);
+
+/* atomic token bucket for bandwidth shaping, see util.c for the model */
+typedef struct bw_bucket
+{
+    int64_t rate;               /* bytes per second, 0 for no limit */
+    int64_t burst;              /* bucket depth in bytes */
+    volatile int64_t tokens;    /* bytes in hand, may go negative */
+    volatile uint64_t stamp_ms; /* time of the last refill */
+} bw_bucket_t;
+
+void bw_bucket_set (bw_bucket_t *b, int64_t bits_per_sec, uint64_t milli);
+long bw_bucket_owed (bw_bucket_t *b, uint64_t milli);
+void bw_bucket_spend (bw_bucket_t *b, long bytes, uint64_t milli);
 
 struct rate_calc *rate_setup (unsigned int samples, unsigned int ssec);
 void rate_add_sum (struct rate_calc *calc, long value, uint64_t t, uint64_t *sum);
 #define rate_add(A,B,C)   rate_add_sum((A),(B),(C), NULL);
 long rate_avg (struct rate_calc *calc);
 long rate_avg_shorten (struct rate_calc *calc, unsigned int t);
+long rate_avg_inst (struct rate_calc *calc);
 void rate_free (struct rate_calc *calc);
 void rate_reduce (struct rate_calc *calc, unsigned int range);
 
@@ -117,6 +151,8 @@ int cached_pattern_compare (const char *value, const char *pattern);
 
 void cached_file_clear (cache_file_contents *cache);
 int cached_pattern_search (cache_file_contents *cache, const char *line, time_t now);
+void cached_pattern_compile (cache_file_contents *cache);
+int cached_pattern_match (cache_file_contents *cache, const char *line);
 void cached_file_recheck (cache_file_contents *cache, time_t now);
 void cached_prune (cache_file_contents *cache);
 
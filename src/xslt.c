@@ -78,7 +78,8 @@ typedef struct
 
 static int xslt_client (client_t *client);
 static int xslt_cached (const char *fn, stylesheet_cache_t *new_sheet, time_t now);
-static int xslt_send_sheet (client_t *client, xmlDocPtr doc, int idx);
+static int xslt_send_sheet (client_t *client, xmlDocPtr doc, int idx, const char *key);
+static char *xslt_render_key (client_t *client, const char *fn);
 
 
 struct _client_functions xslt_ops =
@@ -104,6 +105,24 @@ static spin_t update_lock;
 int    xsl_updating;
 
 
+/* Short-lived cache of rendered pages, keyed on stylesheet and query args.
+ * Status style pages are identical within the second across pollers so repeat
+ * hits can skip the transform entirely. */
+#define RENDERCACHESIZE 10
+
+typedef struct {
+    char            *key;
+    char            *mediatype;
+    char            *disposition;
+    char            *content;
+    unsigned int    len;
+    time_t          rendered;
+} rendered_cache_t;
+
+static rendered_cache_t rendered[RENDERCACHESIZE];
+static spin_t render_lock;
+
+
 
 #ifndef HAVE_XSLTSAVERESULTTOSTRING
 int xsltSaveResultToString(xmlChar **doc_txt_ptr, int * doc_txt_len, xmlDocPtr result, xsltStylesheetPtr style) {
@@ -193,8 +212,10 @@ int xslt_SaveResultToBuf (refbuf_t **bptr, int *len, xmlDocPtr result, xsltStyle
 void xslt_initialize(void)
 {
     memset (&cache[0], 0, sizeof cache);
+    memset (&rendered[0], 0, sizeof rendered);
     thread_rwlock_create (&xslt_lock);
     thread_spin_create (&update_lock);
+    thread_spin_create (&render_lock);
     xsl_updating = 0;
 #ifdef MY_ALLOC
     xmlMemSetup(xmlMemFree, xmlMemMalloc, xmlMemRealloc, xmlMemoryStrdup);
@@ -214,9 +235,16 @@ void xslt_shutdown(void) {
         if(cache[i].stylesheet)
             xsltFreeStylesheet(cache[i].stylesheet);
     }
+    for(i=0; i < RENDERCACHESIZE; i++) {
+        free(rendered[i].key);
+        free(rendered[i].mediatype);
+        free(rendered[i].disposition);
+        free(rendered[i].content);
+    }
 
     thread_rwlock_destroy (&xslt_lock);
     thread_spin_destroy (&update_lock);
+    thread_spin_destroy (&render_lock);
     xmlCleanupParser();
     xsltCleanupGlobals();
 }
@@ -253,9 +281,11 @@ void *xslt_update (void *arg)
             x->cache.disposition = filename;
         }
         // we now have a sheet, find and update.
+        char *key = xslt_render_key (client, fn);
         thread_rwlock_wlock (&xslt_lock);
         i = xslt_cached (fn, &x->cache, time(NULL));
-        xslt_send_sheet (client, x->doc, i);
+        xslt_send_sheet (client, x->doc, i, key);
+        free (key);
     }
     else
     {
@@ -396,30 +426,134 @@ static int xslt_req_sheet (client_t *client, xmlDocPtr doc, const char *fn, int
 }
 
 
+static char *xslt_render_key (client_t *client, const char *fn)
+{
+    const char *args = httpp_getvar (client->parser, HTTPP_VAR_QUERYARGS);
+    unsigned int len = strlen (fn) + (args ? strlen (args) : 0) + 1;
+    char *key = malloc (len);
+
+    snprintf (key, len, "%s%s", fn, args ? args : "");
+    return key;
+}
+
+
+/* serve a just-rendered copy of this page if one exists, returns 1 with *ret
+ * filled in on a hit. Content is copied out as send queues cannot share. */
+static int xslt_render_hit (client_t *client, const char *key, int *ret)
+{
+    time_t now = client->worker->current_time.tv_sec;
+    refbuf_t *refbuf, *content;
+    int i, bytes;
+
+    thread_spin_lock (&render_lock);
+    for (i = 0; i < RENDERCACHESIZE; i++)
+        if (rendered[i].key && strcmp (rendered[i].key, key) == 0)
+            break;
+    if (i == RENDERCACHESIZE || rendered[i].rendered != now)
+    {
+        thread_spin_unlock (&render_lock);
+        return 0;
+    }
+    DEBUG1 ("rendered cache hit for %s", key);
+    content = refbuf_new (rendered[i].len);
+    memcpy (content->data, rendered[i].content, rendered[i].len);
+    refbuf = refbuf_new (1000);
+    bytes = snprintf (refbuf->data, 1000,
+            "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %u\r\n%s"
+            "Expires: Thu, 19 Nov 1981 08:52:00 GMT\r\n"
+            "Cache-Control: no-store, no-cache, must-revalidate\r\n"
+            "Pragma: no-cache\r\n%s\r\n",
+            rendered[i].mediatype, rendered[i].len,
+            rendered[i].disposition ? rendered[i].disposition : "", client_keepalive_header (client));
+    thread_spin_unlock (&render_lock);
+
+    if (bytes < 1000)
+        client_add_cors (client, refbuf->data+bytes, 1000-bytes);
+    client->shared_data = NULL;
+    client->respcode = 200;
+    client_set_queue (client, NULL);
+    client->refbuf = refbuf;
+    refbuf->len = strlen (refbuf->data);
+    refbuf->next = content;
+    *ret = fserve_setup_client (client);
+    return 1;
+}
+
+
+/* take a flattened copy of the transform output for repeat hits within the
+ * second. The oldest entry makes way when the table is full. */
+static void xslt_render_store (client_t *client, const char *key, const char *mediatype,
+        const char *disposition, refbuf_t *content, int len)
+{
+    rendered_cache_t fresh, stale;
+    refbuf_t *r;
+    char *p;
+    int i, oldest = 0;
+
+    fresh.key = strdup (key);
+    fresh.mediatype = strdup (mediatype);
+    fresh.disposition = disposition ? strdup (disposition) : NULL;
+    fresh.content = p = malloc (len);
+    fresh.len = len;
+    fresh.rendered = client->worker->current_time.tv_sec;
+    for (r = content; r; r = r->next)
+    {
+        memcpy (p, r->data, r->len);
+        p += r->len;
+    }
+    thread_spin_lock (&render_lock);
+    for (i = 0; i < RENDERCACHESIZE; i++)
+    {
+        if (rendered[i].key == NULL || strcmp (rendered[i].key, key) == 0)
+        {
+            oldest = i;
+            break;
+        }
+        if (rendered[i].rendered < rendered[oldest].rendered)
+            oldest = i;
+    }
+    stale = rendered [oldest];
+    rendered [oldest] = fresh;
+    thread_spin_unlock (&render_lock);
+    free (stale.key);
+    free (stale.mediatype);
+    free (stale.disposition);
+    free (stale.content);
+}
+
+
 int xslt_transform (xmlDocPtr doc, const char *xslfilename, client_t *client)
 {
     int     i, ret;
-    xsl_req *x;
+    xsl_req *x = client->shared_data;
+    char    *key = xslt_render_key (client, xslfilename);
 
-    thread_rwlock_rlock (&xslt_lock);
-    i = xslt_cached (xslfilename, NULL, client->worker->current_time.tv_sec);
-    i = xslt_req_sheet (client, doc, xslfilename, i);
-    x = client->shared_data;
-    switch (i)
+    if (xslt_render_hit (client, key, &ret))
+        xmlFreeDoc (doc);
+    else
     {
-        case -1:
-            thread_rwlock_unlock (&xslt_lock);
-            xmlFreeDoc (doc);
-            client->shared_data = NULL;
-            ret = client_send_404 (client, "Could not parse XSLT file");
-            break;
-        case CACHESIZE:   // delayed
-            thread_rwlock_unlock (&xslt_lock);
-            return 0;
-        default:  // found it and ok to use
-            ret = xslt_send_sheet (client, doc, i);
-            break;
+        thread_rwlock_rlock (&xslt_lock);
+        i = xslt_cached (xslfilename, NULL, client->worker->current_time.tv_sec);
+        i = xslt_req_sheet (client, doc, xslfilename, i);
+        x = client->shared_data;
+        switch (i)
+        {
+            case -1:
+                thread_rwlock_unlock (&xslt_lock);
+                xmlFreeDoc (doc);
+                client->shared_data = NULL;
+                ret = client_send_404 (client, "Could not parse XSLT file");
+                break;
+            case CACHESIZE:   // delayed
+                thread_rwlock_unlock (&xslt_lock);
+                free (key);
+                return 0;
+            default:  // found it and ok to use
+                ret = xslt_send_sheet (client, doc, i, key);
+                break;
+        }
     }
+    free (key);
     if (x)
     {
         free (x->cache.filename);
@@ -431,7 +565,7 @@ int xslt_transform (xmlDocPtr doc, const char *xslfilename, client_t *client)
 
 
 // requires xslt_lock before being called, released on return
-static int xslt_send_sheet (client_t *client, xmlDocPtr doc, int idx)
+static int xslt_send_sheet (client_t *client, xmlDocPtr doc, int idx, const char *key)
 {
     xmlDocPtr           res;
     xsltStylesheetPtr   cur = cache [idx].stylesheet;
@@ -439,17 +573,27 @@ static int xslt_send_sheet (client_t *client, xmlDocPtr doc, int idx)
     refbuf_t            *content = NULL;
     int len;
 
-    if (client->parser->queryvars)
+    if (client->parser->queries || (client->parser->queryvars && client->parser->queryvars->length))
     {
+        http_parser_t *parser = client->parser;
         // annoying but we need to surround the args with ' when passing them in
-        int j, arg_count = client->parser->queryvars->length * 2;
-        avl_node *node = avl_get_first (client->parser->queryvars);
+        int j, q = 0, arg_count = (parser->queries + (parser->queryvars ? parser->queryvars->length : 0)) * 2;
+        avl_node *node = parser->queryvars ? avl_get_first (parser->queryvars) : NULL;
 
         params = calloc (arg_count+1, sizeof (char *));
-        for (j = 0; node && j < arg_count; node = avl_get_next (node))
+        for (j = 0; (q < parser->queries || node) && j < arg_count; )
         {
-            http_var_t *param = (http_var_t *)node->key;
-            char *tmp = util_url_escape (param->value);
+            http_var_t *param;
+            char *tmp;
+
+            if (q < parser->queries)
+                param = &parser->query [q++];
+            else
+            {
+                param = (http_var_t *)node->key;
+                node = avl_get_next (node);
+            }
+            tmp = util_url_escape (param->value);
             params[j++] = param->name;
             // use alloca for now, should really url esc into a supplied buffer
             params[j] = (char*)alloca (strlen (tmp) + 3);
@@ -491,6 +635,7 @@ static int xslt_send_sheet (client_t *client, xmlDocPtr doc, int idx)
                 else
                     mediatype = "text/xml";
         }
+        xslt_render_store (client, key, mediatype, cache[idx].disposition, content, len);
         int bytes = snprintf (refbuf->data, 1000,
                 "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %d\r\n%s"
                 "Expires: Thu, 19 Nov 1981 08:52:00 GMT\r\n"
@@ -45,11 +45,11 @@ struct yp_server
     unsigned    url_timeout;
     unsigned    touch_interval;
     int         remove;
+    int         stuck;      /* connect failure seen this run, back off */
+    int         inflight;
 
-    CURL *curl;
     struct ypdata_tag *mounts, *pending_mounts;
     struct yp_server *next;
-    char curl_error[CURL_ERROR_SIZE];
 };
 
 
@@ -75,6 +75,8 @@ typedef struct ypdata_tag
     char *subtype;
 
     struct yp_server *server;
+    CURL        *handle;        /* per-transfer easy handle while in flight */
+    const char  *cmd;
     time_t      next_update;
     unsigned    touch_interval;
     char        *error_msg;
@@ -101,6 +103,7 @@ int yp_initialised;
 
 static volatile struct yp_server *active_yps = NULL, *pending_yps = NULL;
 static volatile int yp_update = 0;
+static CURLM *yp_multi;
 static time_t now;
 static volatile thread_type *yp_thread;
 static volatile unsigned client_limit = 0;
@@ -213,8 +216,6 @@ static void destroy_yp_server (struct yp_server *server)
     if (server == NULL)
         return;
     DEBUG1 ("Removing YP server entry for %s", server->url);
-    if (server->curl)
-        curl_easy_cleanup (server->curl);
     if (server->mounts) WARN0 ("active ypdata not freed up");
     if (server->pending_mounts) WARN0 ("pending ypdata not freed up");
     free (server->url);
@@ -253,7 +254,8 @@ static int directory_recheck (client_t *client)
                 {
                     client->counter = (uint64_t)-1;
                     client->flags &= ~CLIENT_ACTIVE;
-                    thread_create ("YP Thread", yp_update_thread, NULL, THREAD_DETACHED);
+                    if (thread_pool_run (THREAD_POOL_LOW, yp_update_thread, NULL) < 0)
+                        thread_create ("YP Thread", yp_update_thread, NULL, THREAD_DETACHED);
                     break;
                 }
             }
@@ -325,24 +327,8 @@ void yp_recheck_config (ice_config_t *config)
             server->url = strdup (config->yp_url[i]);
             server->url_timeout = config->yp_url_timeout[i];
             server->touch_interval = config->yp_touch_interval[i];
-            server->curl = curl_easy_init();
-            if (server->curl == NULL)
-            {
-                destroy_yp_server (server);
-                break;
-            }
             if (server->touch_interval < 30)
                 server->touch_interval = 30;
-            curl_easy_setopt (server->curl, CURLOPT_USERAGENT, server->server_id);
-            curl_easy_setopt (server->curl, CURLOPT_URL, server->url);
-            curl_easy_setopt (server->curl, CURLOPT_HEADERFUNCTION, response_header);
-            curl_easy_setopt (server->curl, CURLOPT_WRITEFUNCTION, handle_returned_data);
-            curl_easy_setopt (server->curl, CURLOPT_WRITEDATA, server->curl);
-            curl_easy_setopt (server->curl, CURLOPT_TIMEOUT, server->url_timeout);
-            curl_easy_setopt (server->curl, CURLOPT_NOSIGNAL, 1L);
-            curl_easy_setopt (server->curl, CURLOPT_FOLLOWLOCATION, 1L);
-            curl_easy_setopt (server->curl, CURLOPT_MAXREDIRS, 3L);
-            curl_easy_setopt (server->curl, CURLOPT_ERRORBUFFER, &(server->curl_error[0]));
             server->next = (struct yp_server *)pending_yps;
             pending_yps = server;
             INFO3 ("Adding new YP server \"%s\" (timeout %ds, default interval %ds)",
@@ -372,37 +358,75 @@ void yp_initialize (ice_config_t *config)
 
 
 
-/* handler for curl, checks if successful handling occurred
- * return 0 for ok, -1 for this entry failed, -2 for server fail.
- * On failure case, update and process are modified
+/* queue a request on the shared multi handle. The post body is copied by
+ * curl so the caller can release it straight away; the outcome is handled
+ * in yp_complete once the multi stack reports the transfer done.
+ * return 0 with the transfer in flight, -1 otherwise
  */
-static int send_to_yp (const char *cmd, ypdata_t *yp, char *post)
+static int yp_submit (const char *cmd, ypdata_t *yp, char *post)
 {
-    int curlcode;
     struct yp_server *server = yp->server;
+    CURL *handle = curl_easy_init ();
 
     // DEBUG2 ("send YP (%s):%s", cmd, post);
+    if (handle == NULL)
+        return -1;
     yp->cmd_ok = 0;
-    curl_easy_setopt (server->curl, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt (server->curl, CURLOPT_WRITEHEADER, yp);
-    curlcode = curl_easy_perform (server->curl);
-    if (curlcode)
+    curl_easy_setopt (handle, CURLOPT_USERAGENT, server->server_id);
+    curl_easy_setopt (handle, CURLOPT_URL, server->url);
+    curl_easy_setopt (handle, CURLOPT_HEADERFUNCTION, response_header);
+    curl_easy_setopt (handle, CURLOPT_WRITEFUNCTION, handle_returned_data);
+    curl_easy_setopt (handle, CURLOPT_WRITEDATA, handle);
+    curl_easy_setopt (handle, CURLOPT_TIMEOUT, (long)server->url_timeout);
+    curl_easy_setopt (handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt (handle, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt (handle, CURLOPT_MAXREDIRS, 3L);
+    curl_easy_setopt (handle, CURLOPT_COPYPOSTFIELDS, post);
+    curl_easy_setopt (handle, CURLOPT_WRITEHEADER, yp);
+    curl_easy_setopt (handle, CURLOPT_PRIVATE, yp);
+    if (curl_multi_add_handle (yp_multi, handle) != CURLM_OK)
+    {
+        curl_easy_cleanup (handle);
+        return -1;
+    }
+    yp->handle = handle;
+    yp->cmd = cmd;
+    server->inflight++;
+    return 0;
+}
+
+
+/* post-transfer handling, the scheduling previously done inline after
+ * curl_easy_perform. Runs on the yp update thread from yp_drain
+ */
+static void yp_complete (ypdata_t *yp, CURLcode code)
+{
+    struct yp_server *server = yp->server;
+    const char *cmd = yp->cmd;
+
+    server->inflight--;
+    curl_multi_remove_handle (yp_multi, yp->handle);
+    curl_easy_cleanup (yp->handle);
+    yp->handle = NULL;
+
+    if (code)
     {
         yp->process = do_yp_add;
         yp_schedule (yp, 1200);
-        ERROR3 ("connection to %s failed on %s with \"%s\"", server->url, yp->mount, server->curl_error);
-        return -2;
+        ERROR3 ("connection to %s failed on %s with \"%s\"", server->url, yp->mount, curl_easy_strerror (code));
+        server->stuck = 1;
+        return;
     }
     if (yp->cmd_ok == 0)
     {
         if (yp->error_msg == NULL)
             yp->error_msg = strdup ("no response from server");
-        if (yp->process == do_yp_add)
+        if (strcmp (cmd, "add") == 0)
         {
             ERROR4 ("YP %s on %s failed for %s: %s", cmd, server->url, yp->mount, yp->error_msg);
             yp_schedule (yp, 7200);
         }
-        if (yp->process == do_yp_touch)
+        if (strcmp (cmd, "touch") == 0)
         {
             /* At this point the touch request failed, either because they rejected our session
              * or the server isn't accessible. This means we have to wait before doing another
@@ -421,10 +445,50 @@ static int send_to_yp (const char *cmd, ypdata_t *yp, char *post)
         yp->sid = NULL;
         free (yp->error_msg);
         yp->error_msg = NULL;
-        return -1;
+        return;
     }
     DEBUG3 ("YP %s at %s for %s succeeded", cmd, server->url, yp->mount);
-    return 0;
+    if (strcmp (cmd, "add") == 0)
+    {
+        yp->process = do_yp_touch;
+        /* force first touch in 5 secs */
+        yp_schedule (yp, 5);
+    }
+    else if (strcmp (cmd, "touch") == 0)
+        yp_schedule (yp, yp->touch_interval);
+    else
+        yp->process = do_yp_add;
+}
+
+
+/* run the multi stack until every in-flight submission has completed,
+ * dispatching yp_complete as the transfers finish
+ */
+static void yp_drain (void)
+{
+    int running;
+
+    do
+    {
+        CURLMsg *msg;
+        int queued;
+
+        if (curl_multi_perform (yp_multi, &running) != CURLM_OK)
+            break;
+        while ((msg = curl_multi_info_read (yp_multi, &queued)))
+        {
+            if (msg->msg == CURLMSG_DONE)
+            {
+                char *yp = NULL;
+                curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE, &yp);
+                if (yp)
+                    yp_complete ((ypdata_t *)yp, msg->data.result);
+            }
+        }
+        if (running)
+            if (curl_multi_wait (yp_multi, NULL, 0, 1000, NULL) != CURLM_OK)
+                break;
+    } while (running);
 }
 
 
@@ -440,12 +504,11 @@ static int do_yp_remove (ypdata_t *yp, char *s, unsigned len)
             return ret+1;
 
         INFO1 ("clearing up YP entry for %s", yp->mount);
-        ret = send_to_yp ("remove", yp, s);
+        ret = yp_submit ("remove", yp, s);
         free (yp->sid);
         yp->sid = NULL;
     }
     yp->remove = 1;
-    yp->process = do_yp_add;
     yp_update = 1;
 
     return ret;
@@ -538,14 +601,7 @@ static int do_yp_add (ypdata_t *yp, char *s, unsigned len)
                     yp->server_type, yp->subtype, yp->bitrate, yp->audio_info);
     if (ret >= (signed)len)
         return ret+1;
-    ret = send_to_yp ("add", yp, s);
-    if (ret == 0)
-    {
-        yp->process = do_yp_touch;
-        /* force first touch in 5 secs */
-        yp_schedule (yp, 5);
-    }
-    return ret;
+    return yp_submit ("add", yp, s);
 }
 
 
@@ -587,12 +643,7 @@ static int do_yp_touch (ypdata_t *yp, char *s, unsigned len)
     if (ret >= (signed)len)
         return ret+1; /* space required for above text and nul*/
 
-    ret = send_to_yp ("touch", yp, s);
-    if (ret == 0)
-    {
-        yp_schedule (yp, yp->touch_interval);
-    }
-    return ret;
+    return yp_submit ("touch", yp, s);
 }
 
 
@@ -631,43 +682,45 @@ static int process_ypdata (struct yp_server *server, ypdata_t *yp)
 }
 
 
-static void yp_process_server (struct yp_server *server)
+/* queue a batch of due submissions for this server onto the multi stack.
+ * returns the number put in flight, the update thread drains them and
+ * comes back for the next batch until nothing is due
+ */
+static int yp_process_server (struct yp_server *server)
 {
     ypdata_t *yp;
-    int error = 0, within_limit = 20;
+    int submitted = 0, within_limit = 20;
 
     /* DEBUG1("processing yp server %s", server->url); */
     yp = server->mounts;
-    now = time(NULL);
     while (yp)
     {
         /* if one of the streams shows that the server cannot be contacted then mark the
          * other entries for an update later. Assume YP server is stuck and skip it for now
          */
-        if (error == -2)
+        if (server->stuck)
         {
             static unsigned disperse = 0;
-            disperse++;
-            DEBUG2 ("skiping %s on %s", yp->mount, server->url);
-            yp->process = do_yp_add;
-            yp_schedule (yp, 30 + (disperse%60));
+            if (yp->handle == NULL && now >= yp->next_update)
+            {
+                disperse++;
+                DEBUG2 ("skiping %s on %s", yp->mount, server->url);
+                yp->process = do_yp_add;
+                yp_schedule (yp, 30 + (disperse%60));
+            }
         }
-        else if (within_limit)
+        else if (within_limit && yp->handle == NULL && now >= yp->next_update)
         {
             within_limit--;
-            if (now >= yp->next_update)
-            {
-                error = process_ypdata (server, yp);
-                if (error == -2)
-                    WARN1 ("error detected, backing off on %s", server->url);
-                now = time(NULL);
-            }
+            if (process_ypdata (server, yp) == 0 && yp->handle)
+                submitted++;
         }
         if (yp->remove == 0 && (uint64_t)yp->next_update < ypclient.counter)
             ypclient.counter = (uint64_t)yp->next_update;
 
         yp = yp->next;
     }
+    return submitted;
 }
 
 
@@ -843,15 +896,36 @@ static void *yp_update_thread(void *arg)
     yp_thread = thread_self();
     /* DEBUG0("YP thread started"); */
 
-    /* do the YP communication */
+    /* do the YP communication. Batches of due submissions from each server
+     * run concurrently on the multi stack, repeating until nothing is due,
+     * so a full touch cycle takes a few round trips rather than a blocking
+     * transfer per mount */
     thread_rwlock_rlock (&yp_lock);
+    if (yp_multi == NULL)
+        yp_multi = curl_multi_init ();
     server = (struct yp_server *)active_yps;
     while (server)
     {
-        /* DEBUG1 ("trying %s", server->url); */
-        yp_process_server (server);
+        server->stuck = 0;
         server = server->next;
     }
+    while (1)
+    {
+        int submitted = 0;
+
+        now = time (NULL);
+        ypclient.counter = (uint64_t)-1;
+        server = (struct yp_server *)active_yps;
+        while (server)
+        {
+            /* DEBUG1 ("trying %s", server->url); */
+            submitted += yp_process_server (server);
+            server = server->next;
+        }
+        if (submitted == 0)
+            break;
+        yp_drain ();
+    }
     thread_rwlock_unlock (&yp_lock);
 
     /* update the local YP structure */
@@ -1150,7 +1224,8 @@ static void yp_queue_change (yp_change_t *change)
     if (yp_pending_thread == 0)
     {
         yp_pending_thread = 1;
-        thread_create ("YP change", yp_pending_update, NULL, THREAD_DETACHED);
+        if (thread_pool_run (THREAD_POOL_LOW, yp_pending_update, NULL) < 0)
+            thread_create ("YP change", yp_pending_update, NULL, THREAD_DETACHED);
     }
     thread_mutex_unlock (&yp_pending_lock);
 }
@@ -1226,6 +1301,11 @@ void yp_shutdown (void)
     free ((char*)server_version);
     server_version = NULL;
     active_yps = NULL;
+    if (yp_multi)
+    {
+        curl_multi_cleanup (yp_multi);
+        yp_multi = NULL;
+    }
     yp_initialised = 0;
     INFO0 ("YP cleanup complete");
 }